@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/memfd.h"
 #include "qom/object_interfaces.h"
 #include "qapi/error.h"
 #include "sysemu/hostmem.h"
@@ -21,6 +22,7 @@
 static void
 sgx_epc_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
 {
+    ERRP_GUARD();
     uint32_t ram_flags;
     char *name;
     int fd;
@@ -30,11 +32,27 @@ sgx_epc_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
         return;
     }
 
-    fd = qemu_open_old("/dev/sgx_vepc", O_RDWR);
-    if (fd < 0) {
-        error_setg_errno(errp, errno,
-                         "failed to open /dev/sgx_vepc to alloc SGX EPC");
-        return;
+    if (MEMORY_BACKEND_EPC(backend)->emulated) {
+        /*
+         * The EPC is only protected by TCG, which keeps software outside
+         * of enclaves from accessing it.  RAM_PROTECTED keeps everybody
+         * else (vhost, VFIO) away.
+         */
+        fd = qemu_memfd_create(TYPE_MEMORY_BACKEND_EPC, backend->size,
+                               false, 0, 0, errp);
+        if (fd < 0) {
+            return;
+        }
+    } else {
+        fd = qemu_open_old("/dev/sgx_vepc", O_RDWR);
+        if (fd < 0) {
+            error_setg_errno(errp, errno,
+                             "failed to open /dev/sgx_vepc to alloc SGX EPC");
+            error_append_hint(errp, "The host does not provide SGX EPC to "
+                              "guests; with TCG, emulated=on backs the EPC "
+                              "with ordinary memory instead.\n");
+            return;
+        }
     }
 
     name = object_get_canonical_path(OBJECT(backend));
@@ -54,11 +72,32 @@ static void sgx_epc_backend_instance_init(Object *obj)
     m->dump = false;
 }
 
+static bool sgx_epc_backend_get_emulated(Object *obj, Error **errp)
+{
+    return MEMORY_BACKEND_EPC(obj)->emulated;
+}
+
+static void sgx_epc_backend_set_emulated(Object *obj, bool value, Error **errp)
+{
+    if (host_memory_backend_mr_inited(MEMORY_BACKEND(obj))) {
+        error_setg(errp, "cannot change property value");
+        return;
+    }
+
+    MEMORY_BACKEND_EPC(obj)->emulated = value;
+}
+
 static void sgx_epc_backend_class_init(ObjectClass *oc, void *data)
 {
     HostMemoryBackendClass *bc = MEMORY_BACKEND_CLASS(oc);
 
     bc->alloc = sgx_epc_backend_memory_alloc;
+
+    object_class_property_add_bool(oc, "emulated",
+                                   sgx_epc_backend_get_emulated,
+                                   sgx_epc_backend_set_emulated);
+    object_class_property_set_description(oc, "emulated",
+                                          "Back EPC with memory for TCG");
 }
 
 static const TypeInfo sgx_epc_backed_info = {
@@ -71,12 +110,11 @@ static const TypeInfo sgx_epc_backed_info = {
 
 static void register_types(void)
 {
-    int fd = qemu_open_old("/dev/sgx_vepc", O_RDWR);
-    if (fd >= 0) {
-        close(fd);
-
-        type_register_static(&sgx_epc_backed_info);
-    }
+    /*
+     * Emulated EPC does not need any support from the host, so the type is
+     * always available; without /dev/sgx_vepc, only emulated=on works.
+     */
+    type_register_static(&sgx_epc_backed_info);
 }
 
 type_init(register_types);
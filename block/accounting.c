@@ -26,15 +26,27 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
+#include "qemu/units.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
-void block_acct_init(BlockAcctStats *stats)
+const uint64_t block_acct_size_class_max[BLOCK_ACCT_SIZE_CLASSES - 1] = {
+    4 * KiB, 16 * KiB, 64 * KiB, 256 * KiB,
+};
+
+const unsigned
+block_acct_queue_depth_class_max[BLOCK_ACCT_QUEUE_DEPTH_CLASSES - 1] = {
+    1, 4, 16, 64,
+};
+
+void block_acct_init(BlockAcctStats *stats, const unsigned int *in_flight)
 {
     qemu_mutex_init(&stats->lock);
+    stats->in_flight = in_flight;
     if (qtest_enabled()) {
         clock_type = QEMU_CLOCK_VIRTUAL;
     }
@@ -50,9 +62,14 @@ void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        g_free(stats->latency_buckets[i]);
+    }
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -92,6 +109,9 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->bytes = bytes;
     cookie->start_time_ns = qemu_clock_get_ns(clock_type);
     cookie->type = type;
+    /* The request itself is usually not submitted yet */
+    cookie->queue_depth = stats->in_flight ?
+                          qatomic_read(stats->in_flight) + 1 : 1;
 }
 
 /* block_latency_histogram_compare_func:
@@ -182,6 +202,98 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+/* Return the bucket in which @latency_ns is accounted */
+int block_acct_latency_bucket(uint64_t latency_ns)
+{
+    int msb, shift;
+
+    if (latency_ns < BLOCK_ACCT_LAT_SUB_BUCKETS) {
+        return latency_ns;
+    }
+    msb = 63 - clz64(latency_ns);
+    if (msb >= BLOCK_ACCT_LAT_MAX_BITS) {
+        return BLOCK_ACCT_LAT_BUCKETS - 1;
+    }
+    shift = msb - BLOCK_ACCT_LAT_SUB_BITS;
+    return ((shift + 1) << BLOCK_ACCT_LAT_SUB_BITS) +
+           ((latency_ns >> shift) & (BLOCK_ACCT_LAT_SUB_BUCKETS - 1));
+}
+
+/* Return the highest latency that is accounted in @bucket */
+uint64_t block_acct_latency_bucket_max(int bucket)
+{
+    int shift = (bucket >> BLOCK_ACCT_LAT_SUB_BITS) - 1;
+    uint64_t sub = bucket & (BLOCK_ACCT_LAT_SUB_BUCKETS - 1);
+
+    if (bucket < BLOCK_ACCT_LAT_SUB_BUCKETS) {
+        return bucket;
+    }
+    return ((BLOCK_ACCT_LAT_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/*
+ * Return an upper bound for the latency that @fraction of the @count
+ * requests in @buckets do not exceed.
+ */
+uint64_t block_acct_latency_percentile(const uint64_t *buckets, uint64_t count,
+                                       double fraction)
+{
+    uint64_t rank = fraction * count;
+    uint64_t sum = 0;
+    int i;
+
+    /* Round up, the request of rank @rank must be included */
+    if (rank < fraction * count || rank == 0) {
+        rank++;
+    }
+
+    for (i = 0; i < BLOCK_ACCT_LAT_BUCKETS; i++) {
+        sum += buckets[i];
+        if (sum >= rank) {
+            break;
+        }
+    }
+    return block_acct_latency_bucket_max(MIN(i, BLOCK_ACCT_LAT_BUCKETS - 1));
+}
+
+static void block_acct_latency_account(BlockAcctStats *stats,
+                                       BlockAcctCookie *cookie,
+                                       int64_t latency_ns)
+{
+    BlockAcctLatencyBuckets *lat;
+    int bucket, size_class, qd_class;
+
+    lat = qatomic_read(&stats->latency_buckets[cookie->type]);
+    if (!lat) {
+        BlockAcctLatencyBuckets *old;
+
+        lat = g_new0(BlockAcctLatencyBuckets, 1);
+        old = qatomic_cmpxchg(&stats->latency_buckets[cookie->type], NULL,
+                              lat);
+        if (old) {
+            g_free(lat);
+            lat = old;
+        }
+    }
+
+    for (size_class = 0; size_class < BLOCK_ACCT_SIZE_CLASSES - 1;
+         size_class++) {
+        if (cookie->bytes <= block_acct_size_class_max[size_class]) {
+            break;
+        }
+    }
+    for (qd_class = 0; qd_class < BLOCK_ACCT_QUEUE_DEPTH_CLASSES - 1;
+         qd_class++) {
+        if (cookie->queue_depth <= block_acct_queue_depth_class_max[qd_class]) {
+            break;
+        }
+    }
+
+    bucket = block_acct_latency_bucket(MAX(latency_ns, 0));
+    stat64_add(&lat->by_size[size_class][bucket], 1);
+    stat64_add(&lat->by_queue_depth[qd_class][bucket], 1);
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -199,6 +311,10 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         return;
     }
 
+    if (!failed || stats->account_failed) {
+        block_acct_latency_account(stats, cookie, latency_ns);
+    }
+
     WITH_QEMU_LOCK_GUARD(&stats->lock) {
         if (failed) {
             stats->failed_ops[cookie->type]++;
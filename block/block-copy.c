@@ -22,9 +22,11 @@
 #include "qemu/coroutine.h"
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
+#include "qemu/stats64.h"
 
-#define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
+#define BLOCK_COPY_MAX_COPY_RANGE (64 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+#define BLOCK_COPY_MAX_ADAPTIVE_BUFFER (8 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
@@ -38,6 +40,19 @@ typedef enum {
     COPY_RANGE_FULL
 } BlockCopyMethod;
 
+typedef enum {
+    BLOCK_COPY_STAT_READ,
+    BLOCK_COPY_STAT_WRITE,
+    BLOCK_COPY_STAT_OFFLOAD,
+    BLOCK_COPY_STAT__MAX
+} BlockCopyStatType;
+
+typedef struct BlockCopyOpStats {
+    Stat64 bytes;
+    Stat64 ops;
+    Stat64 total_ns;
+} BlockCopyOpStats;
+
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
@@ -48,12 +63,20 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    bool staged;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
     /* Coroutine where async block-copy is running */
     Coroutine *co;
 
     /* Fields whose state changes throughout the execution */
+    /*
+     * Maximum task size for COPY_READ_WRITE, adapted to the dirty areas found
+     * (see block_copy_adapt_chunk()); 0 until the first task is created.
+     * Protected by lock in BlockCopyState, like task creation.
+     */
+    int64_t adaptive_chunk;
+    int64_t last_task_end;
     bool finished; /* atomic */
     QemuCoSleep sleep; /* TODO: protect API with a lock */
     bool cancelled; /* atomic */
@@ -98,19 +121,56 @@ typedef struct BlockCopyTask {
      * Protected by lock in BlockCopyState.
      */
     CoQueue wait_queue; /* coroutines blocked on this task */
+    /*
+     * Set for tasks of staged calls once the old data has been read into
+     * @staged_buf. The data is then written to target in the background;
+     * other staged calls need not wait for that any more.
+     */
+    bool captured;
     /*
      * Only protect the case of parallel read while updating @bytes
      * value in block_copy_task_shrink().
      */
     int64_t bytes;
     QLIST_ENTRY(BlockCopyTask) list;
+
+    /*
+     * Only for tasks of staged calls: the data to write to target, taken
+     * from BlockCopyState.staging. Such tasks outlive their call state.
+     */
+    bool staged;
+    void *staged_buf;
 } BlockCopyTask;
 
+static coroutine_fn int block_copy_task_stage(BlockCopyTask *task);
+
 static int64_t task_end(BlockCopyTask *task)
 {
     return task->offset + task->bytes;
 }
 
+/*
+ * Only tasks that read the data into a buffer take memory from
+ * BlockCopyState.mem. Copy offloading and zero writes don't need a buffer, so
+ * they are limited only by the number of workers; should copy_range fail,
+ * the fallback in block_copy_do_copy() allocates its buffers piecewise.
+ */
+static int64_t task_mem(BlockCopyTask *task)
+{
+    switch (task->method) {
+    case COPY_WRITE_ZEROES:
+    case COPY_RANGE_FULL:
+        return 0;
+    default:
+        return task->bytes;
+    }
+}
+
+static SharedResource *task_shres(BlockCopyTask *task)
+{
+    return task->staged ? task->s->staging : task->s->mem;
+}
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -157,16 +217,36 @@ typedef struct BlockCopyState {
     BdrvDirtyBitmap *copy_bitmap;
     ProgressMeter *progress;
     SharedResource *mem;
+    /* Bounds staged data not yet written to target, see block_copy_staged() */
+    SharedResource *staging;
+    /* Node that is kept in flight while staged data is written */
+    BlockDriverState *staging_bs;
     RateLimit rate_limit;
+
+    /*
+     * First error of a background write of staged data. The old data is lost
+     * then, so it fails all following unstaged calls. Protected by lock.
+     */
+    int staging_ret;
+
+    /* Successful requests by type. Updated atomically, without lock. */
+    BlockCopyOpStats stats[BLOCK_COPY_STAT__MAX];
 } BlockCopyState;
 
-/* Called with lock held */
+/*
+ * Called with lock held. With @skip_captured, tasks whose data is already
+ * staged in memory don't count as conflicting.
+ */
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
-                                            int64_t offset, int64_t bytes)
+                                            int64_t offset, int64_t bytes,
+                                            bool skip_captured)
 {
     BlockCopyTask *t;
 
     QLIST_FOREACH(t, &s->tasks, list) {
+        if (skip_captured && t->captured) {
+            continue;
+        }
         if (offset + bytes > t->offset && offset < t->offset + t->bytes) {
             return t;
         }
@@ -183,9 +263,10 @@ static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
  * Return value of 0 proves that lock was NOT released.
  */
 static bool coroutine_fn block_copy_wait_one(BlockCopyState *s, int64_t offset,
-                                             int64_t bytes)
+                                             int64_t bytes, bool skip_captured)
 {
-    BlockCopyTask *task = find_conflicting_task(s, offset, bytes);
+    BlockCopyTask *task = find_conflicting_task(s, offset, bytes,
+                                                skip_captured);
 
     if (!task) {
         return false;
@@ -197,12 +278,17 @@ static bool coroutine_fn block_copy_wait_one(BlockCopyState *s, int64_t offset,
 }
 
 /* Called with lock held */
-static int64_t block_copy_chunk_size(BlockCopyState *s)
+static int64_t block_copy_chunk_size(BlockCopyState *s,
+                                     BlockCopyCallState *call_state)
 {
     switch (s->method) {
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
+        if (call_state->adaptive_chunk) {
+            return call_state->adaptive_chunk;
+        }
+        /* fallthrough */
     case COPY_RANGE_SMALL:
         return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
                    s->max_transfer);
@@ -215,6 +301,48 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     }
 }
 
+/*
+ * Adapt the maximum size of buffered copy requests of @call_state to the
+ * dirty areas it finds: A run of dirty clusters that is longer than the
+ * current chunk size and follows directly on the previous task is likely a
+ * sequential stretch of data, so the chunk size is doubled (up to
+ * BLOCK_COPY_MAX_ADAPTIVE_BUFFER) to copy it with fewer, larger requests.
+ * When the dirty areas become scattered and small, the chunk size is halved
+ * again, down to BLOCK_COPY_MAX_BUFFER, so that memory is not tied up by a
+ * few large tasks while many small ones could run in parallel.
+ *
+ * Called with lock held.
+ */
+static void block_copy_adapt_chunk(BlockCopyState *s,
+                                   BlockCopyCallState *call_state,
+                                   int64_t offset, int64_t bytes,
+                                   int64_t max_chunk)
+{
+    int64_t min_size = MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
+                           s->max_transfer);
+    int64_t max_size = MIN(MAX(s->cluster_size,
+                               BLOCK_COPY_MAX_ADAPTIVE_BUFFER),
+                           s->max_transfer);
+    int64_t chunk = call_state->adaptive_chunk ?: min_size;
+    bool sequential = offset == call_state->last_task_end;
+
+    call_state->last_task_end = offset + bytes;
+    if (s->method != COPY_READ_WRITE) {
+        return;
+    }
+
+    if (sequential && bytes >= max_chunk) {
+        chunk = MIN(chunk * 2, max_size);
+    } else if (bytes < chunk / 4) {
+        chunk = MAX(chunk / 2, min_size);
+    }
+
+    if (chunk != call_state->adaptive_chunk) {
+        trace_block_copy_chunk_size(s, call_state, chunk);
+        call_state->adaptive_chunk = chunk;
+    }
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
  * the beginning of it.
@@ -224,10 +352,12 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
                        int64_t offset, int64_t bytes)
 {
     BlockCopyTask *task;
+    BlockCopyMethod method;
     int64_t max_chunk;
 
     QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s, call_state),
+                             call_state->max_chunk);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -238,8 +368,16 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
     bytes = QEMU_ALIGN_UP(bytes, s->cluster_size);
 
+    block_copy_adapt_chunk(s, call_state, offset, bytes, max_chunk);
+
     /* region is dirty, so no existent tasks possible in it */
-    assert(!find_conflicting_task(s, offset, bytes));
+    assert(!find_conflicting_task(s, offset, bytes, false));
+
+    method = s->method;
+    if (call_state->staged && method != COPY_READ_WRITE_CLUSTER) {
+        /* copy_range would read source only after the guest has written it */
+        method = COPY_READ_WRITE;
+    }
 
     bdrv_reset_dirty_bitmap(s->copy_bitmap, offset, bytes);
     s->in_flight_bytes += bytes;
@@ -251,7 +389,8 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
         .call_state = call_state,
         .offset = offset,
         .bytes = bytes,
-        .method = s->method,
+        .method = method,
+        .staged = call_state->staged,
     };
     qemu_co_queue_init(&task->wait_queue);
     QLIST_INSERT_HEAD(&s->tasks, task, list);
@@ -309,6 +448,9 @@ void block_copy_state_free(BlockCopyState *s)
     ratelimit_destroy(&s->rate_limit);
     bdrv_release_dirty_bitmap(s->copy_bitmap);
     shres_destroy(s->mem);
+    if (s->staging) {
+        shres_destroy(s->staging);
+    }
     g_free(s);
 }
 
@@ -449,6 +591,24 @@ void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
     s->progress = pm;
 }
 
+/* Maximum size of a task of block_copy_staged() */
+static int64_t block_copy_staged_chunk(BlockCopyState *s)
+{
+    return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER), s->max_transfer);
+}
+
+/* Only set before any copy request, no need for locking. */
+void block_copy_set_staging(BlockCopyState *s, BlockDriverState *bs,
+                            uint64_t size)
+{
+    assert(!s->staging);
+    if (size) {
+        /* Make sure that a single task always fits */
+        s->staging = shres_create(MAX(size, block_copy_staged_chunk(s)));
+        s->staging_bs = bs;
+    }
+}
+
 /*
  * Takes ownership of @task
  *
@@ -461,6 +621,10 @@ void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
 static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
                                             BlockCopyTask *task)
 {
+    if (task->staged) {
+        return block_copy_task_stage(task);
+    }
+
     if (!pool) {
         int ret = task->task.func(&task->task);
 
@@ -470,7 +634,7 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
-        co_put_to_shres(task->s->mem, task->bytes);
+        co_put_to_shres(task_shres(task), task_mem(task));
         block_copy_task_end(task, -ECANCELED);
         g_free(task);
         return -ECANCELED;
@@ -481,6 +645,118 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+/* Record a successful request of @type that was started at @start_ns */
+static void coroutine_fn block_copy_account(BlockCopyState *s,
+                                            BlockCopyStatType type,
+                                            int64_t bytes, int64_t start_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    stat64_add(&s->stats[type].bytes, bytes);
+    stat64_add(&s->stats[type].ops, 1);
+    stat64_add(&s->stats[type].total_ns, now - start_ns);
+}
+
+static int coroutine_fn block_copy_read(BlockCopyState *s, int64_t offset,
+                                        int64_t bytes, void *buf)
+{
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    ret = bdrv_co_pread(s->source, offset, bytes, buf, 0);
+    if (ret < 0) {
+        trace_block_copy_read_fail(s, offset, ret);
+        return ret;
+    }
+
+    block_copy_account(s, BLOCK_COPY_STAT_READ, bytes, start_ns);
+    return ret;
+}
+
+static int coroutine_fn block_copy_write(BlockCopyState *s, int64_t offset,
+                                         int64_t bytes, void *buf)
+{
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    ret = bdrv_co_pwrite(s->target, offset, bytes, buf, s->write_flags);
+    if (ret < 0) {
+        trace_block_copy_write_fail(s, offset, ret);
+        return ret;
+    }
+
+    block_copy_account(s, BLOCK_COPY_STAT_WRITE, bytes, start_ns);
+    return ret;
+}
+
+static int coroutine_fn block_copy_write_zeroes(BlockCopyState *s,
+                                                int64_t offset, int64_t bytes)
+{
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(s->target, offset, bytes, s->write_flags &
+                                ~BDRV_REQ_WRITE_COMPRESSED);
+    if (ret < 0) {
+        trace_block_copy_write_zeroes_fail(s, offset, ret);
+        return ret;
+    }
+
+    block_copy_account(s, BLOCK_COPY_STAT_WRITE, bytes, start_ns);
+    return ret;
+}
+
+/*
+ * Returns true if a copy_range failure with @ret means that copy offloading
+ * does not work for the source and target, so that the data must be copied
+ * through a buffer instead. Other errors (e.g. -EIO or -ENOSPC) are real
+ * I/O errors and fail the request like a failed read or write would.
+ */
+static bool block_copy_range_unsupported(int ret)
+{
+    return ret == -ENOTSUP || ret == -EXDEV || ret == -EINVAL;
+}
+
+/*
+ * Copy @bytes at @offset through bounce buffers of at most
+ * BLOCK_COPY_MAX_BUFFER bytes, taking the memory for each piece from s->mem.
+ */
+static int coroutine_fn block_copy_do_bounce_copy(BlockCopyState *s,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  bool *error_is_read)
+{
+    int64_t chunk = MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
+                        s->max_transfer);
+    void *bounce_buffer = qemu_blockalign(s->source->bs, MIN(chunk, bytes));
+    int ret = 0;
+
+    while (bytes) {
+        int64_t n = MIN(chunk, bytes);
+
+        co_get_from_shres(s->mem, n);
+        ret = block_copy_read(s, offset, n, bounce_buffer);
+        if (ret < 0) {
+            *error_is_read = true;
+        } else {
+            ret = block_copy_write(s, offset, n, bounce_buffer);
+            if (ret < 0) {
+                *error_is_read = false;
+            }
+        }
+        co_put_to_shres(s->mem, n);
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        bytes -= n;
+    }
+
+    qemu_vfree(bounce_buffer);
+    return ret;
+}
+
 /*
  * block_copy_do_copy
  *
@@ -490,8 +766,8 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
  * No sync here: nor bitmap neighter intersecting requests handling, only copy.
  *
  * @method is an in-out argument, so that copy_range can be either extended to
- * a full-size buffer or disabled if the copy_range attempt fails.  The output
- * value of @method should be used for subsequent tasks.
+ * a full-size buffer or disabled if copy_range turns out to be unsupported.
+ * The output value of @method should be used for subsequent tasks.
  * Returns 0 on success.
  */
 static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
@@ -501,6 +777,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
 {
     int ret;
     int64_t nbytes = MIN(offset + bytes, s->len) - offset;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     void *bounce_buffer = NULL;
 
     assert(offset >= 0 && bytes > 0 && INT64_MAX - offset >= bytes);
@@ -513,10 +790,8 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
 
     switch (*method) {
     case COPY_WRITE_ZEROES:
-        ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes, s->write_flags &
-                                    ~BDRV_REQ_WRITE_COMPRESSED);
+        ret = block_copy_write_zeroes(s, offset, nbytes);
         if (ret < 0) {
-            trace_block_copy_write_zeroes_fail(s, offset, ret);
             *error_is_read = false;
         }
         return ret;
@@ -528,38 +803,47 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         if (ret >= 0) {
             /* Successful copy-range, increase chunk size.  */
             *method = COPY_RANGE_FULL;
+            block_copy_account(s, BLOCK_COPY_STAT_OFFLOAD, nbytes, start_ns);
             return 0;
         }
 
         trace_block_copy_copy_range_fail(s, offset, ret);
+        if (!block_copy_range_unsupported(ret)) {
+            /* Can't tell which side failed; the target is more likely */
+            *error_is_read = false;
+            return ret;
+        }
+        if (*method == COPY_RANGE_FULL) {
+            *method = COPY_READ_WRITE;
+            /*
+             * No memory was reserved for this task, so fall back to
+             * buffered copying in BLOCK_COPY_MAX_BUFFER pieces.
+             */
+            return block_copy_do_bounce_copy(s, offset, nbytes,
+                                             error_is_read);
+        }
+
         *method = COPY_READ_WRITE;
         /* Fall through to read+write with allocated buffer */
 
     case COPY_READ_WRITE_CLUSTER:
     case COPY_READ_WRITE:
         /*
-         * In case of failed copy_range request above, we may proceed with
-         * buffered request larger than BLOCK_COPY_MAX_BUFFER.
-         * Still, further requests will be properly limited, so don't care too
-         * much. Moreover the most likely case (copy_range is unsupported for
-         * the configuration, so the very first copy_range request fails)
-         * is handled by setting large copy_size only after first successful
-         * copy_range.
+         * In case of failed COPY_RANGE_SMALL request above, we proceed with
+         * buffered request up to BLOCK_COPY_MAX_BUFFER, for which memory
+         * has been reserved.
          */
 
         bounce_buffer = qemu_blockalign(s->source->bs, nbytes);
 
-        ret = bdrv_co_pread(s->source, offset, nbytes, bounce_buffer, 0);
+        ret = block_copy_read(s, offset, nbytes, bounce_buffer);
         if (ret < 0) {
-            trace_block_copy_read_fail(s, offset, ret);
             *error_is_read = true;
             goto out;
         }
 
-        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                             s->write_flags);
+        ret = block_copy_write(s, offset, nbytes, bounce_buffer);
         if (ret < 0) {
-            trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
             goto out;
         }
@@ -599,12 +883,97 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             progress_work_done(s->progress, t->bytes);
         }
     }
-    co_put_to_shres(s->mem, t->bytes);
+    co_put_to_shres(s->mem, task_mem(t));
     block_copy_task_end(t, ret);
 
     return ret;
 }
 
+static void coroutine_fn block_copy_staged_write_entry(void *opaque)
+{
+    BlockCopyTask *t = opaque;
+    BlockCopyState *s = t->s;
+    BlockDriverState *bs = s->staging_bs;
+    int64_t nbytes = MIN(task_end(t), s->len) - t->offset;
+    int ret;
+
+    if (t->method == COPY_WRITE_ZEROES) {
+        ret = block_copy_write_zeroes(s, t->offset, nbytes);
+    } else {
+        ret = block_copy_write(s, t->offset, nbytes, t->staged_buf);
+    }
+    trace_block_copy_staged_write(s, t->offset, t->bytes, ret);
+
+    qemu_vfree(t->staged_buf);
+    co_put_to_shres(s->staging, task_mem(t));
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (ret < 0) {
+            if (!s->staging_ret) {
+                s->staging_ret = ret;
+            }
+        } else if (s->progress) {
+            progress_work_done(s->progress, t->bytes);
+        }
+    }
+
+    /*
+     * Source has been overwritten by now, so even on failure don't set the
+     * dirty bits back: copying the area again would give wrong data.
+     */
+    block_copy_task_end(t, 0);
+    g_free(t);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Read the old data of staged task @t into memory from the staging area,
+ * then leave writing it to target to a background coroutine. Takes ownership
+ * of @t, which is ended and freed once the write is done.
+ *
+ * Returns 0 when the data is staged and -errno if it couldn't be read.
+ */
+static coroutine_fn int block_copy_task_stage(BlockCopyTask *t)
+{
+    BlockCopyState *s = t->s;
+    int64_t nbytes = MIN(task_end(t), s->len) - t->offset;
+    Coroutine *co;
+    int ret;
+
+    if (t->method != COPY_WRITE_ZEROES) {
+        t->staged_buf = qemu_blockalign(s->source->bs, nbytes);
+        ret = block_copy_read(s, t->offset, nbytes, t->staged_buf);
+        if (ret < 0) {
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                if (!t->call_state->ret) {
+                    t->call_state->ret = ret;
+                    t->call_state->error_is_read = true;
+                }
+            }
+            qemu_vfree(t->staged_buf);
+            co_put_to_shres(s->staging, task_mem(t));
+            block_copy_task_end(t, ret);
+            g_free(t);
+            return ret;
+        }
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        t->captured = true;
+        qemu_co_queue_restart_all(&t->wait_queue);
+    }
+    /* The call may return before the data is written */
+    t->call_state = NULL;
+
+    /* Draining the node (or target, through it) waits for the write */
+    bdrv_inc_in_flight(s->staging_bs);
+    co = qemu_coroutine_create(block_copy_staged_write_entry, t);
+    aio_co_enter(bdrv_get_aio_context(s->target->bs), co);
+
+    return 0;
+}
+
 static int block_copy_block_status(BlockCopyState *s, int64_t offset,
                                    int64_t bytes, int64_t *pnum)
 {
@@ -793,12 +1162,12 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         trace_block_copy_process(s, task->offset);
 
-        co_get_from_shres(s->mem, task->bytes);
+        co_get_from_shres(task_shres(task), task_mem(task));
 
         offset = task_end(task);
         bytes = end - offset;
 
-        if (!aio && bytes) {
+        if (!aio && bytes && !call_state->staged) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
 
@@ -862,7 +1231,8 @@ static int coroutine_fn block_copy_common(BlockCopyCallState *call_state)
                  * wait to complete
                  */
                 ret = block_copy_wait_one(s, call_state->offset,
-                                          call_state->bytes);
+                                          call_state->bytes,
+                                          call_state->staged);
                 if (ret == 0) {
                     /*
                      * No pending tasks, but check again the bitmap in this
@@ -893,6 +1263,18 @@ static int coroutine_fn block_copy_common(BlockCopyCallState *call_state)
          */
     } while (ret > 0 && !qatomic_read(&call_state->cancelled));
 
+    if (!call_state->staged) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (ret >= 0 && s->staging_ret < 0) {
+                ret = s->staging_ret;
+            }
+            if (!call_state->ret && s->staging_ret < 0) {
+                call_state->ret = s->staging_ret;
+                call_state->error_is_read = false;
+            }
+        }
+    }
+
     qatomic_store_release(&call_state->finished, true);
 
     if (call_state->cb) {
@@ -920,6 +1302,24 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t start, int64_t bytes,
     return block_copy_common(&call_state);
 }
 
+int coroutine_fn block_copy_staged(BlockCopyState *s, int64_t start,
+                                   int64_t bytes)
+{
+    BlockCopyCallState call_state = {
+        .s = s,
+        .offset = start,
+        .bytes = bytes,
+        .ignore_ratelimit = true,
+        .max_workers = 1,
+        .max_chunk = block_copy_staged_chunk(s),
+        .staged = true,
+    };
+
+    assert(s->staging);
+
+    return block_copy_common(&call_state);
+}
+
 static void coroutine_fn block_copy_async_co_entry(void *opaque)
 {
     block_copy_common(opaque);
@@ -1013,6 +1413,34 @@ int64_t block_copy_cluster_size(BlockCopyState *s)
     return s->cluster_size;
 }
 
+static BlockCopyOpInfo *block_copy_op_info(BlockCopyOpStats *stats)
+{
+    BlockCopyOpInfo *info = g_new0(BlockCopyOpInfo, 1);
+
+    info->bytes = stat64_get(&stats->bytes);
+    info->ops = stat64_get(&stats->ops);
+    info->latency_ns = info->ops ?
+                       stat64_get(&stats->total_ns) / info->ops : 0;
+
+    return info;
+}
+
+BlockCopyStats *block_copy_get_stats(BlockCopyState *s)
+{
+    BlockCopyStats *stats = g_new0(BlockCopyStats, 1);
+
+    /*
+     * This is called outside of coroutine context, so s->lock can't be taken.
+     * Each counter is read atomically; they are only informational, so it is
+     * fine if they are not consistent with each other.
+     */
+    stats->read = block_copy_op_info(&s->stats[BLOCK_COPY_STAT_READ]);
+    stats->write = block_copy_op_info(&s->stats[BLOCK_COPY_STAT_WRITE]);
+    stats->offload = block_copy_op_info(&s->stats[BLOCK_COPY_STAT_OFFLOAD]);
+
+    return stats;
+}
+
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 {
     qatomic_set(&s->skip_unallocated, skip);
@@ -17,6 +17,7 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
+#include "block/aio_task.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
@@ -31,6 +32,8 @@ enum {
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
+typedef struct CommitTask CommitTask;
+
 typedef struct CommitBlockJob {
     BlockJob common;
     BlockDriverState *commit_top_bs;
@@ -42,8 +45,19 @@ typedef struct CommitBlockJob {
     bool base_read_only;
     bool chain_frozen;
     char *backing_file_str;
+    int max_workers;
+    QSIMPLEQ_HEAD(, CommitTask) retry_list;
 } CommitBlockJob;
 
+struct CommitTask {
+    AioTask task;
+    CommitBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+    bool zero;                      /* The range reads as zeroes */
+    QSIMPLEQ_ENTRY(CommitTask) next;
+};
+
 static int commit_prepare(Job *job)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
@@ -112,14 +126,94 @@ static void commit_clean(Job *job)
     blk_unref(s->top);
 }
 
+static int coroutine_fn commit_task_entry(AioTask *task)
+{
+    CommitTask *t = container_of(task, CommitTask, task);
+    CommitBlockJob *s = t->s;
+    bool error_in_source = true;
+    int ret;
+
+    if (t->zero) {
+        ret = blk_co_pwrite_zeroes(s->base, t->offset, t->bytes,
+                                   BDRV_REQ_MAY_UNMAP);
+        error_in_source = false;
+    } else {
+        QEMU_AUTO_VFREE void *buf = blk_blockalign(s->top, t->bytes);
+
+        ret = blk_co_pread(s->top, t->offset, t->bytes, buf, 0);
+        if (ret >= 0) {
+            ret = blk_co_pwrite(s->base, t->offset, t->bytes, buf, 0);
+            if (ret < 0) {
+                error_in_source = false;
+            }
+        }
+    }
+    if (ret < 0) {
+        BlockErrorAction action =
+            block_job_error_action(&s->common, s->on_error,
+                                   error_in_source, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            return ret;
+        } else {
+            /* The task is freed on return, commit_run() resubmits a copy */
+            CommitTask *retry = g_new(CommitTask, 1);
+
+            *retry = *t;
+            QSIMPLEQ_INSERT_TAIL(&s->retry_list, retry, next);
+            return 0;
+        }
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+/*
+ * Find out how much of [@offset, @offset + @bytes) has the same status, and
+ * return it in *@pnum.  Returns 1 if the range is allocated above the base
+ * and has to be copied, in which case *@zero is set if it reads as zeroes.
+ */
+static int coroutine_fn commit_block_status(CommitBlockJob *s, int64_t offset,
+                                            int64_t bytes, int64_t *pnum,
+                                            bool *zero)
+{
+    int64_t n;
+    int ret;
+
+    *zero = false;
+
+    /* Copy if allocated above the base */
+    ret = bdrv_is_allocated_above(blk_bs(s->top), s->base_overlay, true,
+                                  offset, bytes, pnum);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    /* Writing zeroes is cheaper than copying them */
+    ret = bdrv_block_status_above(blk_bs(s->top), NULL, offset, *pnum, &n,
+                                  NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    if (n > 0) {
+        *pnum = n;
+        *zero = ret & BDRV_BLOCK_ZERO;
+    }
+    return 1;
+}
+
 static int coroutine_fn commit_run(Job *job, Error **errp)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
-    int64_t offset;
+    AioTaskPool *pool;
+    CommitTask *t;
+    int64_t offset = 0;
     uint64_t delay_ns = 0;
     int ret = 0;
-    int64_t n = 0; /* bytes */
-    QEMU_AUTO_VFREE void *buf = NULL;
+    int64_t n = 0; /* bytes from offset with the same status */
+    bool copy = false;
+    bool zero = false;
     int64_t len, base_len;
 
     len = blk_getlength(s->top);
@@ -140,57 +234,90 @@ static int coroutine_fn commit_run(Job *job, Error **errp)
         }
     }
 
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
-
-    for (offset = 0; offset < len; offset += n) {
-        bool copy;
-        bool error_in_source = true;
+    pool = aio_task_pool_new(s->max_workers);
+    while (aio_task_pool_status(pool) == 0) {
+        /*
+         * Wait for a free worker before the pause point, so that no new
+         * request is started after a failed one has stopped the job.
+         */
+        aio_task_pool_wait_slot(pool);
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Requests that are still
+         * in flight are completed by the drain.
          */
         job_sleep_ns(&s->common.job, delay_ns);
         if (job_is_cancelled(&s->common.job)) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(blk_bs(s->top), s->base_overlay, true,
-                                      offset, COMMIT_BUFFER_SIZE, &n);
-        copy = (ret > 0);
-        trace_commit_one_iteration(s, offset, n, ret);
-        if (copy) {
-            assert(n < SIZE_MAX);
-
-            ret = blk_co_pread(s->top, offset, n, buf, 0);
-            if (ret >= 0) {
-                ret = blk_co_pwrite(s->base, offset, n, buf, 0);
+        delay_ns = 0;
+
+        t = QSIMPLEQ_FIRST(&s->retry_list);
+        if (t) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry_list, next);
+        } else if (offset < len) {
+            if (n == 0) {
+                /* Query as much as possible at once, copy in chunks */
+                ret = commit_block_status(s, offset, len - offset, &n, &zero);
+                trace_commit_one_iteration(s, offset, n, ret);
                 if (ret < 0) {
-                    error_in_source = false;
+                    BlockErrorAction action =
+                        block_job_error_action(&s->common, s->on_error,
+                                               true, -ret);
+                    if (action == BLOCK_ERROR_ACTION_REPORT) {
+                        break;
+                    }
+                    n = 0;
+                    continue;
                 }
+                copy = (ret > 0);
             }
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error,
-                                       error_in_source, -ret);
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                return ret;
-            } else {
+
+            if (!copy) {
+                /* Publish progress */
+                job_progress_update(&s->common.job, n);
+                offset += n;
                 n = 0;
                 continue;
             }
-        }
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
 
-        if (copy) {
-            delay_ns = block_job_ratelimit_get_delay(&s->common, n);
+            t = g_new(CommitTask, 1);
+            *t = (CommitTask) {
+                .task.func = commit_task_entry,
+                .s = s,
+                .offset = offset,
+                .bytes = MIN(n, COMMIT_BUFFER_SIZE),
+                .zero = zero,
+            };
+            offset += t->bytes;
+            n -= t->bytes;
+        } else if (!aio_task_pool_empty(pool)) {
+            /* Requests in flight may still fail and have to be retried */
+            aio_task_pool_wait_one(pool);
+            continue;
         } else {
-            delay_ns = 0;
+            break;
         }
+
+        if (!t->zero) {
+            delay_ns = block_job_ratelimit_get_delay(&s->common, t->bytes);
+        }
+        aio_task_pool_start_task(pool, &t->task);
     }
 
-    return 0;
+    aio_task_pool_wait_all(pool);
+    if (ret >= 0) {
+        ret = aio_task_pool_status(pool);
+    }
+    aio_task_pool_free(pool);
+
+    /* Drop the requests that were to be retried if the job was cancelled */
+    while ((t = QSIMPLEQ_FIRST(&s->retry_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry_list, next);
+        g_free(t);
+    }
+
+    return ret < 0 ? ret : 0;
 }
 
 static const BlockJobDriver commit_job_driver = {
@@ -242,7 +369,8 @@ static BlockDriver bdrv_commit_top = {
 void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top,
                   int creation_flags, int64_t speed,
-                  BlockdevOnError on_error, const char *backing_file_str,
+                  BlockdevOnError on_error, int max_workers,
+                  const char *backing_file_str,
                   const char *filter_node_name, Error **errp)
 {
     CommitBlockJob *s;
@@ -254,6 +382,10 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     int ret;
 
     assert(top != bs);
+    if (max_workers < 1) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
     if (bdrv_skip_filters(top) == bdrv_skip_filters(base)) {
         error_setg(errp, "Invalid files for merge: top and base are the same");
         return;
@@ -388,6 +520,8 @@ void commit_start(const char *job_id, BlockDriverState *bs,
 
     s->backing_file_str = g_strdup(backing_file_str);
     s->on_error = on_error;
+    s->max_workers = max_workers;
+    QSIMPLEQ_INIT(&s->retry_list);
 
     trace_commit_start(bs, base, top, s);
     job_start(&s->common.job);
@@ -31,14 +31,35 @@
 #include "block/block_int.h"
 #include "block/qdict.h"
 #include "block/block-copy.h"
+#include "qemu/option.h"
 
 #include "block/copy-before-write.h"
 
 typedef struct BDRVCopyBeforeWriteState {
     BlockCopyState *bcs;
     BdrvChild *target;
+    /*
+     * Don't let guest writes wait for the target: only copy old data to a
+     * bounded staging area in memory, block-copy writes it to target later.
+     */
+    bool staging;
 } BDRVCopyBeforeWriteState;
 
+#define CBW_OPT_STAGING_SIZE "staging-size"
+static QemuOptsList runtime_opts = {
+    .name = "copy-before-write",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = CBW_OPT_STAGING_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "memory for old data not yet copied to target, "
+                "default 0 (no staging)",
+        },
+        { /* end of list */ }
+    },
+};
+
 static coroutine_fn int cbw_co_preadv(
         BlockDriverState *bs, int64_t offset, int64_t bytes,
         QEMUIOVector *qiov, BdrvRequestFlags flags)
@@ -60,6 +81,10 @@ static coroutine_fn int cbw_do_copy_before_write(BlockDriverState *bs,
     off = QEMU_ALIGN_DOWN(offset, cluster_size);
     end = QEMU_ALIGN_UP(offset + bytes, cluster_size);
 
+    if (s->staging) {
+        return block_copy_staged(s->bcs, off, end - off);
+    }
+
     return block_copy(s->bcs, off, end - off, true);
 }
 
@@ -150,6 +175,16 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVCopyBeforeWriteState *s = bs->opaque;
     BdrvDirtyBitmap *copy_bitmap;
+    QemuOpts *opts;
+    uint64_t staging_size;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    staging_size = qemu_opt_get_size(opts, CBW_OPT_STAGING_SIZE, 0);
+    qemu_opts_del(opts);
 
     bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
                                BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
@@ -164,6 +199,15 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    if (staging_size && bdrv_chain_contains(s->target->bs, bs->file->bs)) {
+        /*
+         * Fleecing readers of target would see the new data through the
+         * backing chain until the staged old data is written.
+         */
+        error_setg(errp, "staging-size is not supported for image fleecing");
+        return -EINVAL;
+    }
+
     bs->total_sectors = bs->file->bs->total_sectors;
     bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
             (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
@@ -177,6 +221,9 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    block_copy_set_staging(s->bcs, bs, staging_size);
+    s->staging = staging_size > 0;
+
     copy_bitmap = block_copy_dirty_bitmap(s->bcs);
     bdrv_set_dirty_bitmap(copy_bitmap, 0, bdrv_dirty_bitmap_size(copy_bitmap));
 
@@ -214,6 +261,7 @@ BlockDriver bdrv_cbw_filter = {
 BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   BlockDriverState *target,
                                   const char *filter_node_name,
+                                  uint64_t staging_size,
                                   BlockCopyState **bcs,
                                   Error **errp)
 {
@@ -231,6 +279,9 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
     }
     qdict_put_str(opts, "file", bdrv_get_node_name(source));
     qdict_put_str(opts, "target", bdrv_get_node_name(target));
+    if (staging_size) {
+        qdict_put_int(opts, CBW_OPT_STAGING_SIZE, staging_size);
+    }
 
     top = bdrv_insert_node(source, opts, BDRV_O_RDWR, errp);
     if (!top) {
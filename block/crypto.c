@@ -22,6 +22,8 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -31,13 +33,30 @@
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "crypto.h"
 
+/* Maximum number of threads encrypting or decrypting for one node */
+#define BLOCK_CRYPTO_MAX_THREADS 4
+/*
+ * Buffers smaller than this are processed in the request coroutine, for
+ * them the thread pool overhead is larger than the gain. Larger ones are
+ * split into parts of at least this size.
+ */
+#define BLOCK_CRYPTO_THREAD_MIN_BYTES (64 * KiB)
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    /*
+     * Each thread needs a cipher of its own, the QCryptoBlock has one more
+     * for the request coroutines
+     */
+    int nb_threads;
+    CoQueue thread_task_queue;
 };
 
 
@@ -265,6 +284,8 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     unsigned int cflags = 0;
     QDict *cryptoopts = NULL;
 
+    qemu_co_queue_init(&crypto->thread_task_queue);
+
     bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
                                BDRV_CHILD_IMAGE, false, errp);
     if (!bs->file) {
@@ -294,7 +315,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       BLOCK_CRYPTO_MAX_THREADS + 1,
                                        errp);
 
     if (!crypto->block) {
@@ -396,6 +417,94 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/* Common prototype of qcrypto_block_encrypt() and qcrypto_block_decrypt() */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoTask {
+    AioTask task;
+    BlockDriverState *bs;
+    BlockCryptoEncDecFunc func;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+} BlockCryptoTask;
+
+static int block_crypto_thread_func(void *opaque)
+{
+    BlockCryptoTask *t = opaque;
+    BlockCrypto *crypto = t->bs->opaque;
+
+    return t->func(crypto->block, t->offset, t->buf, t->len, NULL) < 0 ?
+           -EIO : 0;
+}
+
+static coroutine_fn int block_crypto_task_entry(AioTask *task)
+{
+    BlockCryptoTask *t = container_of(task, BlockCryptoTask, task);
+    BlockCrypto *crypto = t->bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(t->bs));
+    int ret;
+
+    while (crypto->nb_threads >= BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, NULL);
+    }
+    crypto->nb_threads++;
+
+    ret = thread_pool_submit_co(pool, block_crypto_thread_func, t);
+
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+
+    return ret;
+}
+
+/*
+ * Encrypts or decrypts @len bytes of @buf in place. Large buffers are split
+ * into parts that are processed in parallel by the thread pool.
+ */
+static coroutine_fn int
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset, uint8_t *buf,
+                       size_t len, BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    AioTaskPool *aio;
+    size_t chunk, done;
+    int ret;
+
+    if (len < BLOCK_CRYPTO_THREAD_MIN_BYTES) {
+        return func(crypto->block, offset, buf, len, NULL) < 0 ? -EIO : 0;
+    }
+
+    chunk = QEMU_ALIGN_UP(DIV_ROUND_UP(len, BLOCK_CRYPTO_MAX_THREADS),
+                          sector_size);
+    chunk = MAX(chunk, BLOCK_CRYPTO_THREAD_MIN_BYTES);
+
+    aio = aio_task_pool_new(BLOCK_CRYPTO_MAX_THREADS);
+    for (done = 0; done < len && aio_task_pool_status(aio) == 0;
+         done += chunk)
+    {
+        BlockCryptoTask *t = g_new(BlockCryptoTask, 1);
+
+        *t = (BlockCryptoTask) {
+            .task.func = block_crypto_task_entry,
+            .bs = bs,
+            .func = func,
+            .offset = offset + done,
+            .buf = buf + done,
+            .len = MIN(chunk, len - done),
+        };
+        aio_task_pool_start_task(aio, &t->task);
+    }
+
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    aio_task_pool_free(aio);
+
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, BdrvRequestFlags flags)
@@ -439,9 +548,9 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                     cur_bytes, qcrypto_block_decrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -495,9 +604,9 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                     cur_bytes, qcrypto_block_encrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
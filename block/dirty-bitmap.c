@@ -31,6 +31,7 @@
 struct BdrvDirtyBitmap {
     BlockDriverState *bs;
     HBitmap *bitmap;            /* Dirty bitmap implementation */
+    HBitmap *meta;              /* Tracks changes to bitmap, if not NULL */
     bool busy;                  /* Bitmap is busy, it can't be used via QMP */
     BdrvDirtyBitmap *successor; /* Anonymous child, if any. */
     char *name;                 /* Optional non-empty unique ID */
@@ -258,6 +259,10 @@ static void bdrv_release_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
     assert(!bdrv_dirty_bitmap_busy(bitmap));
     assert(!bdrv_dirty_bitmap_has_successor(bitmap));
     QLIST_REMOVE(bitmap, list);
+    if (bitmap->meta) {
+        hbitmap_set_meta(bitmap->bitmap, NULL);
+        hbitmap_free(bitmap->meta);
+    }
     hbitmap_free(bitmap->bitmap);
     g_free(bitmap->name);
     g_free(bitmap);
@@ -573,6 +578,43 @@ bool bdrv_dirty_bitmap_get(BdrvDirtyBitmap *bitmap, int64_t offset)
     return ret;
 }
 
+/**
+ * Start tracking which parts of @bitmap change, in chunks of @chunk_size
+ * bytes, unless that is already being done.  Nothing is known about the
+ * past, so all of the bitmap counts as changed when tracking starts.
+ * The owner of a persistent bitmap uses this to find out what to write back.
+ */
+void bdrv_dirty_bitmap_create_meta(BdrvDirtyBitmap *bitmap,
+                                   uint64_t chunk_size)
+{
+    assert(is_power_of_2(chunk_size));
+
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    if (bitmap->meta &&
+        (1ULL << hbitmap_granularity(bitmap->meta)) != chunk_size) {
+        hbitmap_set_meta(bitmap->bitmap, NULL);
+        hbitmap_free(bitmap->meta);
+        bitmap->meta = NULL;
+    }
+    if (!bitmap->meta) {
+        bitmap->meta = hbitmap_alloc(bitmap->size, ctz64(chunk_size));
+        hbitmap_set(bitmap->meta, 0, bitmap->size);
+        hbitmap_set_meta(bitmap->bitmap, bitmap->meta);
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+void bdrv_dirty_bitmap_release_meta(BdrvDirtyBitmap *bitmap)
+{
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    if (bitmap->meta) {
+        hbitmap_set_meta(bitmap->bitmap, NULL);
+        hbitmap_free(bitmap->meta);
+        bitmap->meta = NULL;
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
 /**
  * Chooses a default granularity based on the existing cluster size,
  * but clamped between [4K, 64K]. Defaults to 64K in the case that there
@@ -654,6 +696,22 @@ void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/*
+ * Make @new the implementation of @bitmap instead of @old.  Changes are
+ * tracked on @new from now on, and all of the bitmap counts as changed.
+ * Called within bdrv_dirty_bitmap_lock..unlock.
+ */
+static void bdrv_dirty_bitmap_replace_locked(BdrvDirtyBitmap *bitmap,
+                                             HBitmap *old, HBitmap *new)
+{
+    bitmap->bitmap = new;
+    if (bitmap->meta) {
+        hbitmap_set_meta(old, NULL);
+        hbitmap_set_meta(new, bitmap->meta);
+        hbitmap_set(bitmap->meta, 0, bitmap->size);
+    }
+}
+
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
 {
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
@@ -662,8 +720,9 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        bdrv_dirty_bitmap_replace_locked(bitmap, backup,
+                                         hbitmap_alloc(bitmap->size,
+                                             hbitmap_granularity(backup)));
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -673,7 +732,7 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup)
 {
     HBitmap *tmp = bitmap->bitmap;
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
-    bitmap->bitmap = backup;
+    bdrv_dirty_bitmap_replace_locked(bitmap, tmp, backup);
     hbitmap_free(tmp);
 }
 
@@ -766,6 +825,31 @@ int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap)
     return hbitmap_count(bitmap->bitmap);
 }
 
+/*
+ * Return the start of the first chunk in [@offset, @offset + @bytes) that
+ * changed since bdrv_dirty_bitmap_create_meta() or the last
+ * bdrv_dirty_bitmap_reset_changed() for it, or -1 if there is none.
+ * Without change tracking, everything counts as changed.
+ * Called within bdrv_dirty_bitmap_lock..unlock.
+ */
+int64_t bdrv_dirty_bitmap_next_changed(BdrvDirtyBitmap *bitmap,
+                                       int64_t offset, int64_t bytes)
+{
+    if (!bitmap->meta) {
+        return offset;
+    }
+    return hbitmap_next_dirty(bitmap->meta, offset, bytes);
+}
+
+/* Called within bdrv_dirty_bitmap_lock..unlock.  */
+void bdrv_dirty_bitmap_reset_changed(BdrvDirtyBitmap *bitmap,
+                                     int64_t offset, int64_t bytes)
+{
+    if (bitmap->meta) {
+        hbitmap_reset(bitmap->meta, offset, bytes);
+    }
+}
+
 bool bdrv_dirty_bitmap_readonly(const BdrvDirtyBitmap *bitmap)
 {
     return bitmap->readonly;
@@ -942,7 +1026,9 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 
     if (backup) {
         *backup = dest->bitmap;
-        dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        bdrv_dirty_bitmap_replace_locked(dest, *backup,
+                                         hbitmap_alloc(dest->size,
+                                             hbitmap_granularity(*backup)));
         ret = hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         ret = hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
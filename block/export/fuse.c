@@ -26,6 +26,8 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/units.h"
 #include "sysemu/block-backend.h"
 
 #include <fuse.h>
@@ -42,6 +44,16 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/*
+ * Read buffers of up to this size are kept for reuse instead of being freed
+ * after each request.  The kernel never sends reads larger than its
+ * max_pages limit, which is at most 1 MB.
+ */
+#define FUSE_READ_BUF_SIZE (1 * MiB)
+#define FUSE_MAX_FREE_READ_BUFS 16
+
+/* Number of asynchronous (read) requests the kernel may have outstanding */
+#define FUSE_MAX_BACKGROUND 64
 
 typedef struct FuseExport {
     BlockExport common;
@@ -59,6 +71,10 @@ typedef struct FuseExport {
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
+
+    /* Unused FUSE_READ_BUF_SIZE read buffers */
+    void *free_read_bufs[FUSE_MAX_FREE_READ_BUFS];
+    unsigned nb_free_read_bufs;
 } FuseExport;
 
 static GHashTable *exports;
@@ -293,6 +309,10 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
+    while (exp->nb_free_read_bufs > 0) {
+        qemu_vfree(exp->free_read_bufs[--exp->nb_free_read_bufs]);
+    }
+
     free(exp->fuse_buf.mem);
     g_free(exp->mountpoint);
 }
@@ -335,6 +355,13 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /*
+     * Reads are processed in coroutines, so let the kernel keep more of
+     * them in flight than its default of 12.
+     */
+    conn->max_background = FUSE_MAX_BACKGROUND;
+    conn->congestion_threshold = FUSE_MAX_BACKGROUND * 3 / 4;
 }
 
 /**
@@ -505,16 +532,85 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+static void *fuse_read_buf_get(FuseExport *exp, size_t size)
+{
+    if (size <= FUSE_READ_BUF_SIZE) {
+        if (exp->nb_free_read_bufs > 0) {
+            return exp->free_read_bufs[--exp->nb_free_read_bufs];
+        }
+        size = FUSE_READ_BUF_SIZE;
+    }
+
+    return qemu_try_blockalign(blk_bs(exp->common.blk), size);
+}
+
+static void fuse_read_buf_put(FuseExport *exp, void *buf, size_t size)
+{
+    if (size <= FUSE_READ_BUF_SIZE &&
+        exp->nb_free_read_bufs < FUSE_MAX_FREE_READ_BUFS)
+    {
+        exp->free_read_bufs[exp->nb_free_read_bufs++] = buf;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
+typedef struct FuseReadCo {
+    FuseExport *exp;
+    fuse_req_t req;
+    size_t size;
+    off_t offset;
+} FuseReadCo;
+
+static void coroutine_fn fuse_co_read(void *opaque)
+{
+    FuseReadCo *rd = opaque;
+    FuseExport *exp = rd->exp;
+    fuse_req_t req = rd->req;
+    size_t size = rd->size;
+    off_t offset = rd->offset;
+    void *buf;
+    int ret;
+
+    g_free(rd);
+
+    buf = fuse_read_buf_get(exp, size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        goto out;
+    }
+
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
+    if (ret >= 0) {
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+        bufv.buf[0].mem = buf;
+        fuse_reply_data(req, &bufv, 0);
+    } else {
+        fuse_reply_err(req, -ret);
+    }
+
+    fuse_read_buf_put(exp, buf, size);
+
+out:
+    blk_exp_unref(&exp->common);
+}
+
 /**
  * Handle client reads from the exported image.
+ *
+ * The read itself runs in a coroutine, so that the FUSE event loop can go on
+ * receiving further requests while it is in flight.  The kernel submits reads
+ * asynchronously, so this allows a client to have several reads processed in
+ * parallel.
  */
 static void fuse_read(fuse_req_t req, fuse_ino_t inode,
                       size_t size, off_t offset, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    FuseReadCo *rd;
+    Coroutine *co;
     int64_t length;
-    void *buf;
-    int ret;
 
     /* Limited by max_read, should not happen */
     if (size > FUSE_MAX_BOUNCE_BYTES) {
@@ -536,20 +632,19 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
-    buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
-    if (!buf) {
-        fuse_reply_err(req, ENOMEM);
-        return;
-    }
+    rd = g_new(FuseReadCo, 1);
+    *rd = (FuseReadCo) {
+        .exp = exp,
+        .req = req,
+        .size = size,
+        .offset = offset,
+    };
 
-    ret = blk_pread(exp->common.blk, offset, buf, size);
-    if (ret >= 0) {
-        fuse_reply_buf(req, buf, size);
-    } else {
-        fuse_reply_err(req, -ret);
-    }
+    /* Released by fuse_co_read() */
+    blk_exp_ref(&exp->common);
 
-    qemu_vfree(buf);
+    co = qemu_coroutine_create(fuse_co_read, rd);
+    aio_co_enter(exp->common.ctx, co);
 }
 
 /**
@@ -10,6 +10,7 @@
  * later.  See the COPYING file in the top-level directory.
  */
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "block/block.h"
 #include "subprojects/libvhost-user/libvhost-user.h" /* only for the type definitions */
 #include "standard-headers/linux/virtio_blk.h"
@@ -44,6 +45,7 @@ typedef struct VuBlkReq {
     struct virtio_blk_outhdr out;
     VuServer *server;
     struct VuVirtq *vq;
+    int vq_idx;
 } VuBlkReq;
 
 /* vhost user block device */
@@ -54,15 +56,47 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+
+    uint16_t num_queues;
+    QEMUBH *notify_bh;                  /* bh for guest notification */
+    unsigned long *batch_notify_vqs;
 } VuBlkExport;
 
+/*
+ * Completions are pushed to the used ring immediately, but the guest is only
+ * notified once per virtqueue and event loop iteration.  With several
+ * virtqueues and deep queues this saves most of the eventfd writes (and thus
+ * guest interrupts) that would otherwise be sent for every single request.
+ */
+static void vu_blk_notify_bh(void *opaque)
+{
+    VuBlkExport *vexp = opaque;
+    VuDev *vu_dev = &vexp->vu_server.vu_dev;
+    unsigned long i;
+
+    for (i = find_first_bit(vexp->batch_notify_vqs, vexp->num_queues);
+         i < vexp->num_queues;
+         i = find_next_bit(vexp->batch_notify_vqs, vexp->num_queues, i + 1))
+    {
+        clear_bit(i, vexp->batch_notify_vqs);
+
+        /* The client may have gone away while requests were in flight */
+        if (vexp->vu_server.sioc && i < vu_dev->max_queues) {
+            vu_queue_notify(vu_dev, vu_get_queue(vu_dev, i));
+        }
+    }
+}
+
 static void vu_blk_req_complete(VuBlkReq *req)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuServer *server = req->server;
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
 
     /* IO size with 1 extra status byte */
-    vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
-    vu_queue_notify(vu_dev, req->vq);
+    vu_queue_push(&server->vu_dev, req->vq, &req->elem, req->size + 1);
+
+    set_bit(req->vq_idx, vexp->batch_notify_vqs);
+    qemu_bh_schedule(vexp->notify_bh);
 
     free(req);
 }
@@ -295,8 +329,12 @@ err:
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 {
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
     VuVirtq *vq = vu_get_queue(vu_dev, idx);
 
+    /* Submit all requests that are available in one go */
+    blk_io_plug(vexp->export.blk);
+
     while (1) {
         VuBlkReq *req;
 
@@ -307,11 +345,14 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        req->vq_idx = idx;
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
         qemu_coroutine_enter(co);
     }
+
+    blk_io_unplug(vexp->export.blk);
 }
 
 static void vu_blk_queue_set_started(VuDev *vu_dev, int idx, bool started)
@@ -424,6 +465,7 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     VuBlkExport *vexp = opaque;
 
     vexp->export.ctx = ctx;
+    vexp->notify_bh = aio_bh_new(ctx, vu_blk_notify_bh, vexp);
     vhost_user_server_attach_aio_context(&vexp->vu_server, ctx);
 }
 
@@ -432,6 +474,12 @@ static void blk_aio_detach(void *opaque)
     VuBlkExport *vexp = opaque;
 
     vhost_user_server_detach_aio_context(&vexp->vu_server);
+
+    /* Don't lose notifications for requests that completed last */
+    qemu_bh_delete(vexp->notify_bh);
+    vexp->notify_bh = NULL;
+    vu_blk_notify_bh(vexp);
+
     vexp->export.ctx = NULL;
 }
 
@@ -503,6 +551,10 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
 
+    vexp->num_queues = num_queues;
+    vexp->batch_notify_vqs = bitmap_new(num_queues);
+    vexp->notify_bh = aio_bh_new(exp->ctx, vu_blk_notify_bh, vexp);
+
     blk_add_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                  vexp);
 
@@ -510,6 +562,8 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        qemu_bh_delete(vexp->notify_bh);
+        g_free(vexp->batch_notify_vqs);
         return -EADDRNOTAVAIL;
     }
 
@@ -522,6 +576,10 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    if (vexp->notify_bh) {
+        qemu_bh_delete(vexp->notify_bh);
+    }
+    g_free(vexp->batch_notify_vqs);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
@@ -159,6 +159,7 @@ typedef struct BDRVRawState {
     bool use_linux_io_uring:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
+    bool has_clone_range; /* accessed atomically from the thread pool */
     bool needs_alignment;
     bool force_alignment;
     bool drop_cache;
@@ -757,6 +758,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         } else {
             s->discard_zeroes = true;
             s->has_fallocate = true;
+            qatomic_set(&s->has_clone_range, true);
         }
     } else {
         if (!(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))) {
@@ -1786,24 +1788,88 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+/*
+ * Try to share the extents of the source with the destination instead of
+ * copying any data. This works on file systems with reflink support and
+ * completes the whole request at once, independently of its size.
+ */
+static int handle_aiocb_clone_range(RawPosixAIOData *aiocb)
+{
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd         = aiocb->aio_fildes,
+        .src_offset     = aiocb->aio_offset,
+        .src_length     = aiocb->aio_nbytes,
+        .dest_offset    = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    if (!qatomic_read(&s->has_clone_range)) {
+        return -ENOTSUP;
+    }
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret < 0 && errno == EINTR);
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret < 0 ? -errno : 0);
+    if (ret == 0) {
+        return 0;
+    }
+
+    switch (errno) {
+    case ENOTTY:
+    case EOPNOTSUPP:
+        /* Not supported by the file system, don't try again */
+        qatomic_set(&s->has_clone_range, false);
+        return -ENOTSUP;
+    case EXDEV:
+        /*
+         * This destination is on another file system; others may still be
+         * on the same one, so keep trying for them.
+         */
+        return -ENOTSUP;
+    case EINVAL:
+        /*
+         * Most likely the request is not aligned to the file system block
+         * size; copy_file_range() can still handle it.
+         */
+        return -ENOTSUP;
+    default:
+        return -errno;
+    }
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
     uint64_t bytes = aiocb->aio_nbytes;
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
+    ssize_t ret;
+
+    /* Only try copy_file_range() if cloning is not possible */
+    ret = handle_aiocb_clone_range(aiocb);
+    if (ret != -ENOTSUP) {
+        return ret;
+    }
 
     while (bytes) {
-        ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
-                                      aiocb->copy_range.aio_fd2, &out_off,
-                                      bytes, 0);
+        ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                              aiocb->copy_range.aio_fd2, &out_off, bytes, 0);
         trace_file_copy_file_range(aiocb->bs, aiocb->aio_fildes, in_off,
                                    aiocb->copy_range.aio_fd2, out_off, bytes,
                                    0, ret);
         if (ret == 0) {
             /* No progress (e.g. when beyond EOF), let the caller fall back to
              * buffer I/O. */
-            return -ENOSPC;
+            return -EINVAL;
         }
         if (ret < 0) {
             switch (errno) {
@@ -2452,6 +2518,16 @@ static int64_t raw_get_allocated_file_size(BlockDriverState *bs)
     return (int64_t)st.st_blocks * 512;
 }
 
+static int raw_fstat(BlockDriverState *bs, struct stat *st)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (fstat(s->fd, st) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
 static int coroutine_fn
 raw_co_create(BlockdevCreateOptions *options, Error **errp)
 {
@@ -3303,6 +3379,7 @@ BlockDriver bdrv_file = {
     .bdrv_get_info = raw_get_info,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_fstat = raw_fstat,
     .bdrv_get_specific_stats = raw_get_specific_stats,
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
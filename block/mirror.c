@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/coroutine.h"
 #include "qemu/range.h"
 #include "trace.h"
@@ -28,6 +29,25 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * The number of background operations in flight starts at MAX_IN_FLIGHT and
+ * is adapted to the measured throughput between these limits, see
+ * mirror_adapt().
+ */
+#define MIRROR_MIN_IN_FLIGHT 4
+#define MIRROR_MAX_IN_FLIGHT 64
+#define MIRROR_ADAPT_STEP 4
+#define MIRROR_ADAPT_WINDOW_NS (200 * SCALE_MS)
+#define MIRROR_ADAPT_TOLERANCE 0.05
+
+/*
+ * The dirty bitmap is split into up to MIRROR_MAX_REGIONS regions of at least
+ * MIRROR_MIN_REGION_SIZE bytes that are visited in turn, see
+ * mirror_next_dirty().
+ */
+#define MIRROR_MAX_REGIONS 16
+#define MIRROR_MIN_REGION_SIZE (1 * GiB)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -65,7 +85,6 @@ typedef struct MirrorBlockJob {
     int64_t bdev_length;
     unsigned long *cow_bitmap;
     BdrvDirtyBitmap *dirty_bitmap;
-    BdrvDirtyBitmapIter *dbi;
     uint8_t *buf;
     QSIMPLEQ_HEAD(, MirrorBuffer) buf_free;
     int buf_free_count;
@@ -75,6 +94,27 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int64_t bytes_in_flight;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+
+    /* Current limit for s->in_flight, see mirror_adapt() */
+    int max_in_flight;
+    int adapt_direction;
+    bool adapt_window_saturated;
+    int64_t adapt_window_start;
+    uint64_t adapt_window_bytes;
+    double adapt_last_throughput;
+
+    /* Statistics about the achieved parallelism */
+    int peak_in_flight;
+    int64_t in_flight_since_ns;
+    int64_t busy_ns;
+    uint64_t in_flight_integral; /* sum of s->in_flight * ns */
+
+    /* Regions of the dirty bitmap and where to continue looking in each */
+    int64_t region_size;
+    int nb_regions;
+    int next_region;
+    int64_t *region_cursor;
+
     int ret;
     bool unmap;
     int target_cluster_size;
@@ -183,6 +223,69 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/* Adds @delta to s->in_flight and updates the parallelism statistics */
+static void mirror_update_in_flight(MirrorBlockJob *s, int delta)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (s->in_flight > 0) {
+        int64_t elapsed = now - s->in_flight_since_ns;
+
+        s->busy_ns += elapsed;
+        s->in_flight_integral += (uint64_t)s->in_flight * elapsed;
+    }
+    s->in_flight_since_ns = now;
+
+    s->in_flight += delta;
+    s->peak_in_flight = MAX(s->peak_in_flight, s->in_flight);
+}
+
+/*
+ * Adjust s->max_in_flight to the throughput achieved by background
+ * operations.  This is a simple hill climber: Every MIRROR_ADAPT_WINDOW_NS,
+ * the limit is moved one step further in the current direction as long as
+ * that improves the throughput, and the direction is reversed when it gets
+ * worse.  Only windows in which the limit was actually reached are taken into
+ * account; otherwise the job is limited by something else (the rate limit,
+ * the buffer size or simply a lack of dirty data).
+ */
+static void mirror_adapt(MirrorBlockJob *s, uint64_t bytes)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->adapt_window_start;
+    double throughput, last = s->adapt_last_throughput;
+    int new_max;
+
+    s->adapt_window_bytes += bytes;
+    if (elapsed < MIRROR_ADAPT_WINDOW_NS) {
+        return;
+    }
+
+    throughput = (double)s->adapt_window_bytes * NANOSECONDS_PER_SECOND /
+                 elapsed;
+    s->adapt_window_start = now;
+    s->adapt_window_bytes = 0;
+
+    if (!s->adapt_window_saturated) {
+        return;
+    }
+    s->adapt_window_saturated = false;
+    s->adapt_last_throughput = throughput;
+
+    if (throughput < last * (1.0 - MIRROR_ADAPT_TOLERANCE)) {
+        /* The last step made things worse, go back */
+        s->adapt_direction = -s->adapt_direction;
+    } else if (throughput < last * (1.0 + MIRROR_ADAPT_TOLERANCE)) {
+        /* No significant change, stay where we are */
+        return;
+    }
+
+    new_max = s->max_in_flight + s->adapt_direction * MIRROR_ADAPT_STEP;
+    new_max = MAX(MIRROR_MIN_IN_FLIGHT, MIN(new_max, MIRROR_MAX_IN_FLIGHT));
+    trace_mirror_adapt(s, throughput, s->max_in_flight, new_max);
+    s->max_in_flight = new_max;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -192,7 +295,7 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->offset, op->bytes, ret);
 
-    s->in_flight--;
+    mirror_update_in_flight(s, -1);
     s->bytes_in_flight -= op->bytes;
     iov = op->qiov.iov;
     for (i = 0; i < op->qiov.niov; i++) {
@@ -213,6 +316,7 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        mirror_adapt(s, op->bytes);
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -330,6 +434,17 @@ mirror_wait_for_free_in_flight_slot(MirrorBlockJob *s)
     mirror_wait_for_any_operation(s, false);
 }
 
+/* Waits until fewer than s->max_in_flight background operations are running */
+static void coroutine_fn mirror_wait_for_in_flight_limit(MirrorBlockJob *s,
+                                                         int64_t offset)
+{
+    while (s->in_flight >= s->max_in_flight) {
+        s->adapt_window_saturated = true;
+        trace_mirror_yield_in_flight(s, offset, s->in_flight);
+        mirror_wait_for_free_in_flight_slot(s);
+    }
+}
+
 /* Perform a mirror copy operation.
  *
  * *op->bytes_handled is set to the number of bytes copied after and
@@ -387,7 +502,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     }
 
     /* Copy the dirty cluster.  */
-    s->in_flight++;
+    mirror_update_in_flight(s, 1);
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
@@ -402,7 +517,7 @@ static void coroutine_fn mirror_co_zero(void *opaque)
     MirrorOp *op = opaque;
     int ret;
 
-    op->s->in_flight++;
+    mirror_update_in_flight(op->s, 1);
     op->s->bytes_in_flight += op->bytes;
     *op->bytes_handled = op->bytes;
     op->is_in_flight = true;
@@ -417,7 +532,7 @@ static void coroutine_fn mirror_co_discard(void *opaque)
     MirrorOp *op = opaque;
     int ret;
 
-    op->s->in_flight++;
+    mirror_update_in_flight(op->s, 1);
     op->s->bytes_in_flight += op->bytes;
     *op->bytes_handled = op->bytes;
     op->is_in_flight = true;
@@ -472,55 +587,117 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+static void mirror_init_regions(MirrorBlockJob *s)
+{
+    int i;
+
+    s->region_size = MAX(DIV_ROUND_UP(s->bdev_length, MIRROR_MAX_REGIONS),
+                         MIRROR_MIN_REGION_SIZE);
+    s->region_size = QEMU_ALIGN_UP(s->region_size, s->granularity);
+    s->nb_regions = DIV_ROUND_UP(s->bdev_length, s->region_size);
+    s->next_region = 0;
+
+    s->region_cursor = g_new(int64_t, s->nb_regions);
+    for (i = 0; i < s->nb_regions; i++) {
+        s->region_cursor[i] = i * s->region_size;
+    }
+}
+
+/*
+ * Returns the offset of the next dirty chunk to mirror.
+ *
+ * Instead of walking the whole bitmap from start to end, the regions of the
+ * device are visited in turn, each continuing where it left off.  This spreads
+ * the operations in flight over the device and means that a dirty area that is
+ * blocked by an operation in flight (typically because the guest keeps
+ * writing to it) does not hold up copying the rest of the device: Regions
+ * whose next dirty chunk is still in flight are skipped, and only if all of
+ * them are blocked the first such chunk is returned, so that the caller can
+ * wait for it.
+ *
+ * Called with the dirty bitmap lock held.  The bitmap must not be clean.
+ */
+static int64_t mirror_next_dirty(MirrorBlockJob *s)
+{
+    int64_t blocked_offset = -1;
+    int blocked_region = 0;
+    int i;
+
+    for (i = 0; i < s->nb_regions; i++) {
+        int region = (s->next_region + i) % s->nb_regions;
+        int64_t start = region * s->region_size;
+        int64_t end = MIN(start + s->region_size, s->bdev_length);
+        int64_t cursor = s->region_cursor[region];
+        int64_t offset;
+
+        offset = bdrv_dirty_bitmap_next_dirty(s->dirty_bitmap, cursor,
+                                              end - cursor);
+        if (offset < 0 && cursor > start) {
+            trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
+            offset = bdrv_dirty_bitmap_next_dirty(s->dirty_bitmap, start,
+                                                  cursor - start);
+        }
+        if (offset < 0) {
+            continue;
+        }
+
+        if (!test_bit(offset / s->granularity, s->in_flight_bitmap)) {
+            s->next_region = (region + 1) % s->nb_regions;
+            return offset;
+        }
+        if (blocked_offset < 0) {
+            blocked_offset = offset;
+            blocked_region = region;
+        }
+    }
+
+    assert(blocked_offset >= 0);
+    trace_mirror_regions_blocked(s, blocked_offset);
+    s->next_region = (blocked_region + 1) % s->nb_regions;
+    return blocked_offset;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
     MirrorOp *pseudo_op;
-    int64_t offset;
+    int64_t offset, end, max_bytes;
+    int64_t chunk, end_chunk;
     uint64_t delay_ns = 0, ret = 0;
-    /* At least the first dirty chunk is mirrored in one iteration. */
-    int nb_chunks = 1;
+    int nb_chunks, region;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
     int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    offset = bdrv_dirty_iter_next(s->dbi);
-    if (offset < 0) {
-        bdrv_set_dirty_iter(s->dbi, 0);
-        offset = bdrv_dirty_iter_next(s->dbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
-        assert(offset >= 0);
-    }
+    offset = mirror_next_dirty(s);
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
     mirror_wait_on_conflicts(NULL, s, offset, 1);
 
     job_pause_point(&s->common.job);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+    /*
+     * Coalesce the dirty chunks following the first dirty one into a single
+     * extent of up to s->buf_size bytes, stopping at the first clean chunk or
+     * at the first chunk with an operation in flight.  At least the first
+     * dirty chunk is mirrored in one iteration.
+     */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
-
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
-        }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
-    }
+    max_bytes = MIN(s->buf_size,
+                    QEMU_ALIGN_UP(s->bdev_length - offset, s->granularity));
+    end = bdrv_dirty_bitmap_next_zero(s->dirty_bitmap, offset, max_bytes);
+    if (end < 0) {
+        end = offset + max_bytes;
+    }
+    chunk = offset / s->granularity;
+    end_chunk = MAX(DIV_ROUND_UP(end, s->granularity), chunk + 1);
+    end_chunk = find_next_bit(s->in_flight_bitmap, end_chunk, chunk + 1);
+    nb_chunks = end_chunk - chunk;
+
+    region = offset / s->region_size;
+    s->region_cursor[region] = MIN(end_chunk * s->granularity,
+                                   MIN((region + 1) * s->region_size,
+                                       s->bdev_length));
 
     /* Clear dirty bits before querying the block status, because
      * calling bdrv_block_status_above could yield - if some blocks are
@@ -578,10 +755,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
-            trace_mirror_yield_in_flight(s, offset, s->in_flight);
-            mirror_wait_for_free_in_flight_slot(s);
-        }
+        mirror_wait_for_in_flight_limit(s, offset);
 
         if (s->ret < 0) {
             ret = 0;
@@ -831,7 +1005,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -979,8 +1153,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
     }
 
-    assert(!s->dbi);
-    s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
+    mirror_init_regions(s);
     for (;;) {
         uint64_t delay_ns = 0;
         int64_t cnt, delta;
@@ -1017,8 +1190,11 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
+                if (s->in_flight >= s->max_in_flight) {
+                    s->adapt_window_saturated = true;
+                }
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
                 continue;
@@ -1103,10 +1279,14 @@ immediate_exit:
     }
 
     assert(s->in_flight == 0);
+    trace_mirror_parallelism(s, s->peak_in_flight,
+                             s->busy_ns ? s->in_flight_integral * 100 /
+                                          s->busy_ns : 0,
+                             s->max_in_flight);
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
-    bdrv_dirty_iter_free(s->dbi);
+    g_free(s->region_cursor);
 
     if (need_drain) {
         s->in_drain = true;
@@ -1202,6 +1382,30 @@ static bool commit_active_cancel(Job *job, bool force)
     return force || !job_is_ready(job);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+    int64_t busy_ns = s->busy_ns;
+    uint64_t integral = s->in_flight_integral;
+
+    /* Include the time since the last change of s->in_flight */
+    if (s->in_flight > 0) {
+        int64_t elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                          s->in_flight_since_ns;
+
+        busy_ns += elapsed;
+        integral += (uint64_t)s->in_flight * elapsed;
+    }
+
+    info->has_mirror_stats = true;
+    info->mirror_stats = g_new(MirrorStats, 1);
+    *info->mirror_stats = (MirrorStats) {
+        .peak_in_flight = s->peak_in_flight,
+        .avg_in_flight  = busy_ns ? (double)integral / busy_ns : 0,
+        .max_in_flight  = s->max_in_flight,
+    };
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1216,6 +1420,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1232,6 +1437,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .cancel                 = commit_active_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1748,6 +1954,8 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->adapt_direction = 1;
     if (auto_complete) {
         s->should_complete = true;
     }
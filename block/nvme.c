@@ -1036,18 +1036,35 @@ static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
 {
     BDRVNVMeState *s = bs->opaque;
     uint64_t *pagelist = req->prp_list_page;
-    int i, j, r;
+    int i, j, n, r;
     int entries = 0;
     Error *local_err = NULL, **errp = NULL;
 
     assert(qiov->size);
     assert(QEMU_IS_ALIGNED(qiov->size, s->page_size));
     assert(qiov->size / s->page_size <= s->page_size / sizeof(uint64_t));
-    for (i = 0; i < qiov->niov; ++i) {
+    for (i = 0; i < qiov->niov; i += n) {
         bool retry = true;
         uint64_t iova;
-        size_t len = QEMU_ALIGN_UP(qiov->iov[i].iov_len,
-                                   qemu_real_host_page_size);
+        size_t iov_len = qiov->iov[i].iov_len;
+        size_t len;
+
+        /*
+         * Map runs of host-contiguous elements with a single call, which
+         * saves lookups and IOMMU mappings for guest requests that were
+         * split at page boundaries.  nvme_qiov_aligned() made sure that all
+         * elements are aligned to the host page size.
+         */
+        for (n = 1; i + n < qiov->niov; n++) {
+            struct iovec *prev = &qiov->iov[i + n - 1];
+
+            if (qiov->iov[i + n].iov_base !=
+                (uint8_t *)prev->iov_base + prev->iov_len) {
+                break;
+            }
+            iov_len += qiov->iov[i + n].iov_len;
+        }
+        len = QEMU_ALIGN_UP(iov_len, qemu_real_host_page_size);
 try_map:
         r = qemu_vfio_dma_map(s->vfio,
                               qiov->iov[i].iov_base,
@@ -1094,11 +1111,11 @@ try_map:
             goto fail;
         }
 
-        for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
+        for (j = 0; j < iov_len / s->page_size; j++) {
             pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
         }
         trace_nvme_cmd_map_qiov_iov(s, i, qiov->iov[i].iov_base,
-                                    qiov->iov[i].iov_len / s->page_size);
+                                    iov_len / s->page_size);
     }
 
     s->dma_map_count += qiov->size;
@@ -1584,9 +1601,6 @@ static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
 
     ret = qemu_vfio_dma_map(s->vfio, host, size, false, NULL, &local_err);
     if (ret) {
-        /* FIXME: we may run out of IOVA addresses after repeated
-         * bdrv_register_buf/bdrv_unregister_buf, because nvme_vfio_dma_unmap
-         * doesn't reclaim addresses for fixed mappings. */
         error_reportf_err(local_err, "nvme_register_buf failed: ");
     }
 }
@@ -32,10 +32,17 @@
 #include "qemu/units.h"
 #include "block/block_int.h"
 
+/*
+ * In async mode, reserve enough space for the appends of this long at the
+ * rate observed since the previous reservation.
+ */
+#define PREALLOCATE_AHEAD_NS (2 * NANOSECONDS_PER_SECOND)
 
 typedef struct PreallocateOpts {
     int64_t prealloc_size;
     int64_t prealloc_align;
+    bool prealloc_async;
+    int64_t prealloc_size_max;
 } PreallocateOpts;
 
 typedef struct BDRVPreallocateState {
@@ -74,10 +81,28 @@ typedef struct BDRVPreallocateState {
      * be invalid (< 0) when we don't have both exclusive BLK_PERM_RESIZE and
      * BLK_PERM_WRITE permissions on file child.
      */
+
+    /*
+     * Set while a preallocation request is in flight, either issued by a
+     * write or, in async mode, in the background for [@file_end,
+     * @reserve_end).  Writes beyond @file_end wait for it in @reserve_queue
+     * instead of preallocating themselves.
+     */
+    bool reserving;
+    int64_t reserve_end;
+    CoQueue reserve_queue;
+    /* Set if a background request failed for another reason than a conflict */
+    int reserve_error;
+
+    /* @data_end and time of the previous reservation, to estimate the rate */
+    int64_t rate_data_end;
+    int64_t rate_ns;
 } BDRVPreallocateState;
 
 #define PREALLOCATE_OPT_PREALLOC_ALIGN "prealloc-align"
 #define PREALLOCATE_OPT_PREALLOC_SIZE "prealloc-size"
+#define PREALLOCATE_OPT_PREALLOC_ASYNC "prealloc-async"
+#define PREALLOCATE_OPT_PREALLOC_SIZE_MAX "prealloc-size-max"
 static QemuOptsList runtime_opts = {
     .name = "preallocate",
     .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
@@ -93,6 +118,18 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "how much to preallocate, default 128M",
         },
+        {
+            .name = PREALLOCATE_OPT_PREALLOC_ASYNC,
+            .type = QEMU_OPT_BOOL,
+            .help = "preallocate in the background ahead of the writes, "
+                "default off",
+        },
+        {
+            .name = PREALLOCATE_OPT_PREALLOC_SIZE_MAX,
+            .type = QEMU_OPT_SIZE,
+            .help = "in async mode, the most to preallocate at once, "
+                "default 1G",
+        },
         { /* end of list */ }
     },
 };
@@ -110,9 +147,20 @@ static bool preallocate_absorb_opts(PreallocateOpts *dest, QDict *options,
         qemu_opt_get_size(opts, PREALLOCATE_OPT_PREALLOC_ALIGN, 1 * MiB);
     dest->prealloc_size =
         qemu_opt_get_size(opts, PREALLOCATE_OPT_PREALLOC_SIZE, 128 * MiB);
+    dest->prealloc_async =
+        qemu_opt_get_bool(opts, PREALLOCATE_OPT_PREALLOC_ASYNC, false);
+    dest->prealloc_size_max =
+        qemu_opt_get_size(opts, PREALLOCATE_OPT_PREALLOC_SIZE_MAX,
+                          MAX(1 * GiB, dest->prealloc_size));
 
     qemu_opts_del(opts);
 
+    if (dest->prealloc_size_max < dest->prealloc_size) {
+        error_setg(errp, "prealloc-size-max parameter of preallocate filter "
+                   "is smaller than prealloc-size");
+        return false;
+    }
+
     if (!QEMU_IS_ALIGNED(dest->prealloc_align, BDRV_SECTOR_SIZE)) {
         error_setg(errp, "prealloc-align parameter of preallocate filter "
                    "is not aligned to %llu", BDRV_SECTOR_SIZE);
@@ -140,6 +188,7 @@ static int preallocate_open(BlockDriverState *bs, QDict *options, int flags,
      * For this to work, mark them invalid.
      */
     s->file_end = s->zero_start = s->data_end = -EINVAL;
+    qemu_co_queue_init(&s->reserve_queue);
 
     bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
                                BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
@@ -167,6 +216,9 @@ static void preallocate_close(BlockDriverState *bs)
     int ret;
     BDRVPreallocateState *s = bs->opaque;
 
+    /* Background requests are waited for when draining before close */
+    assert(!s->reserving);
+
     if (s->data_end < 0) {
         return;
     }
@@ -215,6 +267,7 @@ static void preallocate_reopen_commit(BDRVReopenState *state)
     BDRVPreallocateState *s = state->bs->opaque;
 
     s->opts = *(PreallocateOpts *)state->opaque;
+    s->reserve_error = 0;
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -261,6 +314,79 @@ static bool has_prealloc_perms(BlockDriverState *bs)
     return false;
 }
 
+static void coroutine_fn preallocate_reserve_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVPreallocateState *s = bs->opaque;
+    int64_t start = s->file_end;
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(
+            bs->file, start, s->reserve_end - start,
+            BDRV_REQ_NO_FALLBACK | BDRV_REQ_SERIALISING | BDRV_REQ_NO_WAIT);
+    if (ret >= 0) {
+        /* Truncate and permission changes wait for us */
+        assert(s->file_end == start);
+        s->file_end = s->reserve_end;
+    } else if (ret != -EBUSY) {
+        /*
+         * The file may have been partially extended, like in handle_write().
+         * Don't try again, writes will preallocate for themselves.
+         */
+        s->file_end = ret;
+        s->reserve_error = ret;
+    }
+
+    s->reserving = false;
+    qemu_co_queue_restart_all(&s->reserve_queue);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * In async mode, start preallocating the next extent in the background when
+ * less than half of the current one is left beyond @data_end.  The extent is
+ * sized for PREALLOCATE_AHEAD_NS of appends at the observed rate, within
+ * [prealloc-size, prealloc-size-max].
+ */
+static void preallocate_reserve_ahead(BlockDriverState *bs)
+{
+    BDRVPreallocateState *s = bs->opaque;
+    int64_t now, size;
+    Coroutine *co;
+
+    if (!s->opts.prealloc_async || s->reserving || s->reserve_error ||
+        s->data_end < 0 || s->file_end < 0)
+    {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    size = s->opts.prealloc_size;
+    if (s->rate_ns && now > s->rate_ns && s->data_end > s->rate_data_end) {
+        double ahead = (double)(s->data_end - s->rate_data_end) *
+                       PREALLOCATE_AHEAD_NS / (now - s->rate_ns);
+
+        size = MIN(MAX(ahead, s->opts.prealloc_size),
+                   s->opts.prealloc_size_max);
+    }
+
+    if (s->file_end - s->data_end >= size / 2) {
+        return;
+    }
+
+    s->rate_ns = now;
+    s->rate_data_end = s->data_end;
+    s->reserve_end = QEMU_ALIGN_UP(s->data_end + size, s->opts.prealloc_align);
+    if (s->reserve_end <= s->file_end) {
+        return;
+    }
+
+    s->reserving = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(preallocate_reserve_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
 /*
  * Call on each write. Returns true if @want_merge_zero is true and the region
  * [offset, offset + bytes) is zeroed (as a result of this call or earlier
@@ -277,6 +403,11 @@ static bool coroutine_fn handle_write(BlockDriverState *bs, int64_t offset,
     int64_t prealloc_start, prealloc_end;
     int ret;
 
+    /* The background request may cover this write, or conflict with ours */
+    while (s->reserving && end > s->file_end) {
+        qemu_co_queue_wait(&s->reserve_queue, NULL);
+    }
+
     if (!has_prealloc_perms(bs)) {
         /* We don't have state neither should try to recover it */
         return false;
@@ -315,6 +446,7 @@ static bool coroutine_fn handle_write(BlockDriverState *bs, int64_t offset,
 
     if (end <= s->file_end) {
         /* No preallocation needed. */
+        preallocate_reserve_ahead(bs);
         return want_merge_zero && offset >= s->zero_start;
     }
 
@@ -324,15 +456,19 @@ static bool coroutine_fn handle_write(BlockDriverState *bs, int64_t offset,
     prealloc_end = QEMU_ALIGN_UP(end + s->opts.prealloc_size,
                                  s->opts.prealloc_align);
 
+    s->reserving = true;
     ret = bdrv_co_pwrite_zeroes(
             bs->file, prealloc_start, prealloc_end - prealloc_start,
             BDRV_REQ_NO_FALLBACK | BDRV_REQ_SERIALISING | BDRV_REQ_NO_WAIT);
+    s->reserving = false;
+    qemu_co_queue_restart_all(&s->reserve_queue);
     if (ret < 0) {
         s->file_end = ret;
         return false;
     }
 
     s->file_end = prealloc_end;
+    preallocate_reserve_ahead(bs);
     return want_merge_zero;
 }
 
@@ -370,6 +506,10 @@ preallocate_co_truncate(BlockDriverState *bs, int64_t offset,
     BDRVPreallocateState *s = bs->opaque;
     int ret;
 
+    while (s->reserving) {
+        qemu_co_queue_wait(&s->reserve_queue, NULL);
+    }
+
     if (s->data_end >= 0 && offset > s->data_end) {
         if (s->file_end < 0) {
             s->file_end = bdrv_getlength(bs->file->bs);
@@ -457,6 +597,9 @@ static int preallocate_check_perm(BlockDriverState *bs,
     BDRVPreallocateState *s = bs->opaque;
 
     if (s->data_end >= 0 && !can_write_resize(perm)) {
+        /* The background request needs the permissions, too */
+        BDRV_POLL_WHILE(bs, s->reserving);
+
         /*
          * Lose permissions.
          * We should truncate in check_perm, as in set_perm bs->file->perm will
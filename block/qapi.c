@@ -424,6 +424,96 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+/* Fill in @info from @buckets and return the number of requests */
+static uint64_t bdrv_latency_percentiles(const uint64_t *buckets,
+                                         BlockLatencyPercentiles *info)
+{
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_LAT_BUCKETS; i++) {
+        count += buckets[i];
+    }
+    info->count = count;
+    if (count) {
+        info->p50 = block_acct_latency_percentile(buckets, count, 0.5);
+        info->p99 = block_acct_latency_percentile(buckets, count, 0.99);
+        info->p999 = block_acct_latency_percentile(buckets, count, 0.999);
+    }
+    return count;
+}
+
+static void bdrv_latency_stats(BlockAcctLatencyBuckets *lat, bool *not_null,
+                               BlockLatencyStats **info)
+{
+    g_autofree uint64_t *buckets = NULL;
+    g_autofree uint64_t *all = NULL;
+    BlockLatencySizeClassList **size_tail;
+    BlockLatencyQueueDepthClassList **qd_tail;
+    BlockLatencyStats *s;
+    int i, j;
+
+    *not_null = false;
+    if (!lat) {
+        return;
+    }
+
+    buckets = g_new(uint64_t, BLOCK_ACCT_LAT_BUCKETS);
+    all = g_new0(uint64_t, BLOCK_ACCT_LAT_BUCKETS);
+    s = g_new0(BlockLatencyStats, 1);
+    s->all = g_new0(BlockLatencyPercentiles, 1);
+
+    size_tail = &s->by_size;
+    for (i = 0; i < BLOCK_ACCT_SIZE_CLASSES; i++) {
+        BlockLatencySizeClass *c = g_new0(BlockLatencySizeClass, 1);
+
+        for (j = 0; j < BLOCK_ACCT_LAT_BUCKETS; j++) {
+            buckets[j] = stat64_get(&lat->by_size[i][j]);
+            all[j] += buckets[j];
+        }
+        if (!bdrv_latency_percentiles(buckets,
+                                      qapi_BlockLatencySizeClass_base(c))) {
+            qapi_free_BlockLatencySizeClass(c);
+            continue;
+        }
+        c->min_bytes = i ? block_acct_size_class_max[i - 1] + 1 : 0;
+        c->has_max_bytes = i < BLOCK_ACCT_SIZE_CLASSES - 1;
+        if (c->has_max_bytes) {
+            c->max_bytes = block_acct_size_class_max[i];
+        }
+        QAPI_LIST_APPEND(size_tail, c);
+    }
+
+    qd_tail = &s->by_queue_depth;
+    for (i = 0; i < BLOCK_ACCT_QUEUE_DEPTH_CLASSES; i++) {
+        BlockLatencyQueueDepthClass *c;
+
+        c = g_new0(BlockLatencyQueueDepthClass, 1);
+        for (j = 0; j < BLOCK_ACCT_LAT_BUCKETS; j++) {
+            buckets[j] = stat64_get(&lat->by_queue_depth[i][j]);
+        }
+        if (!bdrv_latency_percentiles(
+                buckets, qapi_BlockLatencyQueueDepthClass_base(c))) {
+            qapi_free_BlockLatencyQueueDepthClass(c);
+            continue;
+        }
+        c->min_queue_depth =
+            i ? block_acct_queue_depth_class_max[i - 1] + 1 : 1;
+        c->has_max_queue_depth = i < BLOCK_ACCT_QUEUE_DEPTH_CLASSES - 1;
+        if (c->has_max_queue_depth) {
+            c->max_queue_depth = block_acct_queue_depth_class_max[i];
+        }
+        QAPI_LIST_APPEND(qd_tail, c);
+    }
+
+    if (!bdrv_latency_percentiles(all, s->all)) {
+        qapi_free_BlockLatencyStats(s);
+        return;
+    }
+    *not_null = true;
+    *info = s;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -502,6 +592,19 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    bdrv_latency_stats(qatomic_read(&stats->latency_buckets[BLOCK_ACCT_READ]),
+                       &ds->has_rd_latency_percentiles,
+                       &ds->rd_latency_percentiles);
+    bdrv_latency_stats(qatomic_read(&stats->latency_buckets[BLOCK_ACCT_WRITE]),
+                       &ds->has_wr_latency_percentiles,
+                       &ds->wr_latency_percentiles);
+    bdrv_latency_stats(qatomic_read(&stats->latency_buckets[BLOCK_ACCT_FLUSH]),
+                       &ds->has_flush_latency_percentiles,
+                       &ds->flush_latency_percentiles);
+    bdrv_latency_stats(qatomic_read(&stats->latency_buckets[BLOCK_ACCT_UNMAP]),
+                       &ds->has_unmap_latency_percentiles,
+                       &ds->unmap_latency_percentiles);
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
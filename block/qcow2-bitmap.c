@@ -30,6 +30,7 @@
 #include "qemu/cutils.h"
 
 #include "qcow2.h"
+#include "trace.h"
 
 /* NOTICE: BME here means Bitmaps Extension and used as a namespace for
  * _internal_ constants. Please do not use this _internal_ abbreviation for
@@ -82,6 +83,20 @@ typedef struct Qcow2BitmapTable {
     QSIMPLEQ_ENTRY(Qcow2BitmapTable) entry;
 } Qcow2BitmapTable;
 
+/*
+ * What we know about the image's copy of a persistent bitmap that we loaded
+ * or stored ourselves: its bitmap table.  The BdrvDirtyBitmap tracks which
+ * of its parts changed since they were last written, in chunks of one
+ * bitmap data cluster.  This lets us rewrite only the clusters that changed
+ * when storing the bitmap again, as long as nobody else touched the image in
+ * between.
+ */
+typedef struct Qcow2StoredBitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint64_t *table;            /* in CPU endianness */
+} Qcow2StoredBitmap;
+
 typedef struct Qcow2Bitmap {
     Qcow2BitmapTable table;
     uint32_t flags;
@@ -89,6 +104,10 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    /* Image state to remember once the bitmap directory is updated */
+    Qcow2StoredBitmap *stored;
+    /* Stored into the existing bitmap table, which must not be freed */
+    bool in_place;
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -278,6 +297,126 @@ static int free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
     return 0;
 }
 
+/*
+ * Stored bitmap state
+ */
+
+static void stored_bitmap_free(gpointer opaque)
+{
+    Qcow2StoredBitmap *st = opaque;
+
+    if (st == NULL) {
+        return;
+    }
+
+    g_free(st->table);
+    g_free(st);
+}
+
+/* Takes ownership of @table */
+static Qcow2StoredBitmap *stored_bitmap_new(uint64_t table_offset,
+                                            uint32_t table_size,
+                                            uint64_t *table)
+{
+    Qcow2StoredBitmap *st = g_new(Qcow2StoredBitmap, 1);
+
+    *st = (Qcow2StoredBitmap) {
+        .table_offset = table_offset,
+        .table_size = table_size,
+        .table = table,
+    };
+
+    return st;
+}
+
+static Qcow2StoredBitmap *stored_bitmap_dup(const Qcow2StoredBitmap *st)
+{
+    Qcow2StoredBitmap *copy = g_memdup(st, sizeof(*st));
+
+    copy->table = g_memdup(st->table, st->table_size * sizeof(st->table[0]));
+
+    return copy;
+}
+
+static void stored_bitmap_remember(BlockDriverState *bs, const char *name,
+                                   Qcow2StoredBitmap *st)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->stored_bitmaps) {
+        s->stored_bitmaps = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free, stored_bitmap_free);
+    }
+
+    g_hash_table_replace(s->stored_bitmaps, g_strdup(name), st);
+}
+
+static Qcow2StoredBitmap *stored_bitmap_find(BlockDriverState *bs,
+                                             const char *name)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->stored_bitmaps ? g_hash_table_lookup(s->stored_bitmaps, name)
+                             : NULL;
+}
+
+static void stored_bitmap_forget(BlockDriverState *bs, const char *name)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->stored_bitmaps) {
+        g_hash_table_remove(s->stored_bitmaps, name);
+    }
+}
+
+/*
+ * Forget about the image's copies of all bitmaps, so that the next store
+ * writes them out completely. Must be called whenever we lose control over
+ * the image.
+ */
+void qcow2_forget_stored_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->stored_bitmaps) {
+        g_hash_table_destroy(s->stored_bitmaps);
+        s->stored_bitmaps = NULL;
+    }
+}
+
+/* Whether @st can be updated in place to store @bitmap */
+static bool stored_bitmap_fits(BlockDriverState *bs, Qcow2StoredBitmap *st,
+                               BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+
+    return st && st->table_size ==
+        size_to_clusters(s,
+            bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+}
+
+/*
+ * Make sure that changes to @bitmap are tracked per bitmap data cluster.
+ * With @clean, also forget about the changes so far; this must be done right
+ * after the image's copy of the bitmap was loaded, or before it is written
+ * completely.
+ */
+static void bitmap_track_changes(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                                 bool clean)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    bdrv_dirty_bitmap_create_meta(bitmap,
+        bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap));
+    if (clean) {
+        bdrv_dirty_bitmap_lock(bitmap);
+        bdrv_dirty_bitmap_reset_changed(bitmap, 0,
+                                        bdrv_dirty_bitmap_size(bitmap));
+        bdrv_dirty_bitmap_unlock(bitmap);
+    }
+}
+
 /* load_bitmap_data
  * @bitmap_table entries must satisfy specification constraints.
  * @bitmap must be cleared */
@@ -362,6 +501,15 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * Only remember the image's copy if we are going to mark it IN_USE,
+     * otherwise somebody else may change it behind our back.
+     */
+    if (can_write(bs)) {
+        bm->stored = stored_bitmap_new(bm->table.offset, bm->table.size,
+                                       bitmap_table);
+    }
+
     ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
@@ -369,11 +517,20 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
-    g_free(bitmap_table);
+    if (bm->stored) {
+        bitmap_track_changes(bs, bitmap, true);
+    } else {
+        g_free(bitmap_table);
+    }
     return bitmap;
 
 fail:
-    g_free(bitmap_table);
+    if (bm->stored) {
+        stored_bitmap_free(bm->stored);
+        bm->stored = NULL;
+    } else {
+        g_free(bitmap_table);
+    }
     if (bitmap != NULL) {
         bdrv_release_dirty_bitmap(bitmap);
     }
@@ -504,6 +661,7 @@ static void bitmap_free(Qcow2Bitmap *bm)
         return;
     }
 
+    stored_bitmap_free(bm->stored);
     g_free(bm->name);
     g_free(bm);
 }
@@ -1031,6 +1189,13 @@ bool qcow2_load_dirty_bitmaps(BlockDriverState *bs, bool *header_updated,
         }
     }
 
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->stored) {
+            stored_bitmap_remember(bs, bm->name, bm->stored);
+            bm->stored = NULL;
+        }
+    }
+
     if (!can_write(bs)) {
         g_slist_foreach(created_dirty_bitmaps, set_readonly_helper,
                         (gpointer)true);
@@ -1264,6 +1429,111 @@ out:
     return ret;
 }
 
+/*
+ * The background flush of persistent bitmaps runs in a coroutine concurrently
+ * to guest I/O and only takes s->lock for metadata updates.  Stores outside
+ * of coroutines happen on drained nodes and don't need it.
+ */
+static void bitmap_lock_metadata(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_lock(&s->lock);
+    }
+}
+
+static void bitmap_unlock_metadata(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+}
+
+/*
+ * Serialize the part of @bitmap between @offset and @end into @buf, padding
+ * it with zeroes up to the cluster size, and mark it as unchanged.  Returns
+ * false without touching @buf if the part is all zeroes.
+ */
+static bool serialize_bitmap_cluster(BlockDriverState *bs,
+                                     BdrvDirtyBitmap *bitmap,
+                                     uint64_t offset, uint64_t end,
+                                     uint8_t *buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t write_size =
+        bdrv_dirty_bitmap_serialization_size(bitmap, offset, end - offset);
+
+    assert(write_size <= s->cluster_size);
+
+    bdrv_dirty_bitmap_lock(bitmap);
+    bdrv_dirty_bitmap_reset_changed(bitmap, offset, end - offset);
+    if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, end - offset) < 0) {
+        bdrv_dirty_bitmap_unlock(bitmap);
+        return false;
+    }
+    bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
+    bdrv_dirty_bitmap_unlock(bitmap);
+
+    if (write_size < s->cluster_size) {
+        memset(buf + write_size, 0, s->cluster_size - write_size);
+    }
+    return true;
+}
+
+static int write_bitmap_cluster(BlockDriverState *bs, int64_t off,
+                                const uint8_t *buf, const char *bm_name,
+                                Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    bitmap_lock_metadata(bs);
+    ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+    bitmap_unlock_metadata(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        return ret;
+    }
+
+    ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm_name);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int write_bitmap_table(BlockDriverState *bs, int64_t tb_offset,
+                              const uint64_t *tb, uint32_t tb_size,
+                              const char *bm_name, Error **errp)
+{
+    g_autofree uint64_t *be_tb = NULL;
+    int ret;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                        tb_size * sizeof(tb[0]), false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        return ret;
+    }
+
+    be_tb = g_memdup(tb, tb_size * sizeof(tb[0]));
+    bitmap_table_to_be(be_tb, tb_size);
+    ret = bdrv_pwrite(bs->file, tb_offset, be_tb, tb_size * sizeof(tb[0]));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm_name);
+        return ret;
+    }
+
+    return 0;
+}
+
 /* store_bitmap_data()
  * Store bitmap to image, filling bitmap table accordingly.
  */
@@ -1300,12 +1570,15 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
     assert(DIV_ROUND_UP(bm_size, limit) == tb_size);
 
+    /* Every cluster written from here on is what the image contains */
+    bitmap_track_changes(bs, bitmap, true);
+
     offset = 0;
     while ((offset = bdrv_dirty_bitmap_next_dirty(bitmap, offset, INT64_MAX))
            >= 0)
     {
         uint64_t cluster = offset / limit;
-        uint64_t end, write_size;
+        uint64_t end;
         int64_t off;
 
         /*
@@ -1315,9 +1588,11 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
          */
         offset = QEMU_ALIGN_DOWN(offset, limit);
         end = MIN(bm_size, offset + limit);
-        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
-                                                          end - offset);
-        assert(write_size <= s->cluster_size);
+
+        if (!serialize_bitmap_cluster(bs, bitmap, offset, end, buf)) {
+            offset = end;
+            continue;
+        }
 
         off = qcow2_alloc_clusters(bs, s->cluster_size);
         if (off < 0) {
@@ -1328,21 +1603,8 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
         }
         tb[cluster] = off;
 
-        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
-        if (write_size < s->cluster_size) {
-            memset(buf + write_size, 0, s->cluster_size - write_size);
-        }
-
-        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
-        if (ret < 0) {
-            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
-            goto fail;
-        }
-
-        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+        ret = write_bitmap_cluster(bs, off, buf, bm_name, errp);
         if (ret < 0) {
-            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
-                             bm_name);
             goto fail;
         }
 
@@ -1364,7 +1626,7 @@ fail:
 
 /* store_bitmap()
  * Store bm->dirty_bitmap to qcow2.
- * Set bm->table_offset and bm->table_size accordingly.
+ * Set bm->table_offset, bm->table_size and bm->stored accordingly.
  */
 static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 {
@@ -1394,26 +1656,18 @@ static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
         goto fail;
     }
 
-    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
-                                        tb_size * sizeof(tb[0]), false);
-    if (ret < 0) {
-        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
-        goto fail;
-    }
-
-    bitmap_table_to_be(tb, tb_size);
-    ret = bdrv_pwrite(bs->file, tb_offset, tb, tb_size * sizeof(tb[0]));
+    ret = write_bitmap_table(bs, tb_offset, tb, tb_size, bm_name, errp);
     if (ret < 0) {
-        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
-                         bm_name);
         goto fail;
     }
 
-    g_free(tb);
-
     bm->table.offset = tb_offset;
     bm->table.size = tb_size;
 
+    stored_bitmap_free(bm->stored);
+    bm->stored = stored_bitmap_new(tb_offset, tb_size, tb);
+
+    trace_qcow2_bitmap_store(bs, bm_name, tb_size, tb_size, false);
     return 0;
 
 fail:
@@ -1429,6 +1683,144 @@ fail:
     return ret;
 }
 
+/*
+ * Update the image's copy of bitmap @name, described by @old, in place: only
+ * the data clusters that changed since they were last written are rewritten,
+ * clusters that became all zeroes are dropped, and the bitmap table is only
+ * written if entries were added or dropped. This is safe because the bitmap
+ * is marked IN_USE in the image until the bitmap directory is updated, so
+ * nobody trusts its data in the meantime.
+ *
+ * In a coroutine this runs concurrently to guest I/O and other bitmap
+ * operations, so the bitmap is looked up again after every request.
+ *
+ * On success, *@new describes the updated copy. On failure, the copy is in
+ * an unknown state and @old must not be used any more.
+ */
+static int store_bitmap_in_place(BlockDriverState *bs, const char *name,
+                                 const Qcow2StoredBitmap *old,
+                                 Qcow2StoredBitmap **new, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2StoredBitmap *st = stored_bitmap_dup(old);
+    uint8_t *buf = g_malloc(s->cluster_size);
+    BdrvDirtyBitmap *bitmap;
+    bool table_changed = false;
+    uint64_t i, written = 0;
+    int ret;
+
+    for (i = 0; i < st->table_size; i++) {
+        uint64_t bm_size, limit, offset, end, data_offset;
+        int64_t changed, off;
+
+        bitmap = bdrv_find_dirty_bitmap(bs, name);
+        if (!bitmap || !stored_bitmap_fits(bs, st, bitmap)) {
+            error_setg(errp, "Bitmap '%s' was replaced while being stored",
+                       name);
+            ret = -EAGAIN;
+            goto fail;
+        }
+
+        bm_size = bdrv_dirty_bitmap_size(bitmap);
+        limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size,
+                                                         bitmap);
+        assert(DIV_ROUND_UP(bm_size, limit) == st->table_size);
+
+        /*
+         * A bitmap object that replaced the one we loaded (e.g. when a
+         * backup job abdicated) starts out with everything changed
+         */
+        bitmap_track_changes(bs, bitmap, false);
+
+        bdrv_dirty_bitmap_lock(bitmap);
+        changed = bdrv_dirty_bitmap_next_changed(bitmap, i * limit,
+                                                 bm_size - i * limit);
+        bdrv_dirty_bitmap_unlock(bitmap);
+        if (changed < 0) {
+            break;
+        }
+
+        i = changed / limit;
+        offset = i * limit;
+        end = MIN(bm_size, offset + limit);
+        data_offset = st->table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (!serialize_bitmap_cluster(bs, bitmap, offset, end, buf)) {
+            if (st->table[i]) {
+                st->table[i] = 0;
+                table_changed = true;
+            }
+            continue;
+        }
+
+        if (data_offset) {
+            off = data_offset;
+        } else {
+            bitmap_lock_metadata(bs);
+            off = qcow2_alloc_clusters(bs, s->cluster_size);
+            bitmap_unlock_metadata(bs);
+            if (off < 0) {
+                error_setg_errno(errp, -off,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 name);
+                ret = off;
+                goto fail;
+            }
+            st->table[i] = off;
+            table_changed = true;
+        }
+
+        ret = write_bitmap_cluster(bs, off, buf, name, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        written++;
+    }
+
+    if (table_changed) {
+        bitmap_lock_metadata(bs);
+        ret = write_bitmap_table(bs, st->table_offset, st->table,
+                                 st->table_size, name, errp);
+        if (ret < 0) {
+            bitmap_unlock_metadata(bs);
+            goto fail;
+        }
+
+        /* Free dropped clusters now that the table doesn't use them */
+        for (i = 0; i < st->table_size; i++) {
+            uint64_t old_offset = old->table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (old_offset && !st->table[i]) {
+                qcow2_free_clusters(bs, old_offset, s->cluster_size,
+                                    QCOW2_DISCARD_ALWAYS);
+            }
+        }
+        bitmap_unlock_metadata(bs);
+    }
+
+    trace_qcow2_bitmap_store(bs, name, written, st->table_size, true);
+    g_free(buf);
+    *new = st;
+    return 0;
+
+fail:
+    /*
+     * Clusters allocated here may already be referenced by the image's table
+     * if writing it failed halfway, and the next store frees everything that
+     * table references.  Leaking them is safe, freeing them is not.
+     *
+     * We don't know which of the clusters made it to the image, so the next
+     * store has to consider all of the bitmap changed.
+     */
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (bitmap) {
+        bdrv_dirty_bitmap_release_meta(bitmap);
+    }
+    stored_bitmap_free(st);
+    g_free(buf);
+    return ret;
+}
+
 static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
                                         const char *name)
 {
@@ -1460,6 +1852,8 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
         return 0;
     }
 
+    /* A background flush may be writing the clusters we are going to free */
+    qemu_co_mutex_lock(&s->bitmap_flush_lock);
     qemu_co_mutex_lock(&s->lock);
 
     bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
@@ -1477,6 +1871,7 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
     }
 
     QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+    stored_bitmap_forget(bs, name);
 
     ret = update_ext_header_and_dir(bs, bm_list);
     if (ret < 0) {
@@ -1488,6 +1883,7 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
 
 out:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_co_mutex_unlock(&s->bitmap_flush_lock);
 
     bitmap_free(bm);
     bitmap_list_free(bm_list);
@@ -1594,15 +1990,26 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             bm->name = g_strdup(name);
             QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
         } else {
+            Qcow2StoredBitmap *st = stored_bitmap_find(bs, name);
+
             if (!(bm->flags & BME_FLAG_IN_USE)) {
                 error_setg(errp, "Bitmap '%s' already exists in the image",
                            name);
                 goto fail;
             }
-            tb = g_memdup(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+
+            if (stored_bitmap_fits(bs, st, bitmap) &&
+                st->table_offset == bm->table.offset &&
+                st->table_size == bm->table.size)
+            {
+                /* We know what is in the image, only write what changed */
+                bm->in_place = true;
+            } else {
+                tb = g_memdup(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1626,7 +2033,13 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             continue;
         }
 
-        ret = store_bitmap(bs, bm, errp);
+        if (bm->in_place) {
+            ret = store_bitmap_in_place(bs, bm->name,
+                                        stored_bitmap_find(bs, bm->name),
+                                        &bm->stored, errp);
+        } else {
+            ret = store_bitmap(bs, bm, errp);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1645,6 +2058,13 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
         g_free(tb);
     }
 
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->stored) {
+            stored_bitmap_remember(bs, bm->name, bm->stored);
+            bm->stored = NULL;
+        }
+    }
+
 success:
     if (release_stored) {
         QSIMPLEQ_FOREACH(bm, bm_list, entry) {
@@ -1654,6 +2074,8 @@ success:
 
             bdrv_release_dirty_bitmap(bm->dirty_bitmap);
         }
+        /* We are losing control over the image */
+        qcow2_forget_stored_bitmaps(bs);
     }
 
     bitmap_list_free(bm_list);
@@ -1661,6 +2083,12 @@ success:
 
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->in_place) {
+            /* May have been partially rewritten */
+            stored_bitmap_forget(bs, bm->name);
+            continue;
+        }
+
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
             bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
         {
@@ -1678,6 +2106,64 @@ fail:
     return false;
 }
 
+/*
+ * Write the clusters of persistent bitmaps that changed since they were
+ * loaded or last stored, so that storing the bitmaps when the image is
+ * closed or inactivated has less to do. The bitmaps stay IN_USE in the
+ * image, so this is only an optimization and not a consistency point.
+ *
+ * Only bitmaps whose image copy we know are considered. Their change
+ * tracking tells which clusters to write, so the cost depends on how much
+ * changed and not on the size of the bitmaps. The bitmaps are not marked
+ * busy, and s->lock is only taken for metadata updates, so neither QMP
+ * bitmap commands nor guest I/O have to wait for the flush.
+ *
+ * Called without s->lock held.
+ */
+int coroutine_fn qcow2_co_flush_persistent_dirty_bitmaps(BlockDriverState *bs,
+                                                         Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree gpointer *keys = NULL;
+    g_auto(GStrv) names = NULL;
+    int i, ret = 0;
+
+    if (!s->stored_bitmaps || !can_write(bs)) {
+        return 0;
+    }
+
+    /* Keeps qcow2_co_remove_persistent_dirty_bitmap() from freeing clusters */
+    qemu_co_mutex_lock(&s->bitmap_flush_lock);
+
+    /* The table entries may be replaced while we yield */
+    keys = g_hash_table_get_keys_as_array(s->stored_bitmaps, NULL);
+    names = g_strdupv((char **)keys);
+
+    for (i = 0; names[i] && ret == 0; i++) {
+        BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, names[i]);
+        Qcow2StoredBitmap *st = stored_bitmap_find(bs, names[i]);
+        Qcow2StoredBitmap *new_st;
+
+        if (!st || !bitmap || !bdrv_dirty_bitmap_get_persistence(bitmap) ||
+            bdrv_dirty_bitmap_check(bitmap, BDRV_BITMAP_RO |
+                                    BDRV_BITMAP_INCONSISTENT, NULL) ||
+            !stored_bitmap_fits(bs, st, bitmap))
+        {
+            continue;
+        }
+
+        ret = store_bitmap_in_place(bs, names[i], st, &new_st, errp);
+        if (ret < 0) {
+            stored_bitmap_forget(bs, names[i]);
+        } else {
+            stored_bitmap_remember(bs, names[i], new_st);
+        }
+    }
+
+    qemu_co_mutex_unlock(&s->bitmap_flush_lock);
+    return ret;
+}
+
 int qcow2_reopen_bitmaps_ro(BlockDriverState *bs, Error **errp)
 {
     BdrvDirtyBitmap *bitmap;
@@ -91,6 +91,25 @@ static inline bool can_clean_entry(Qcow2Cache *c, int i)
         t->lru_counter <= c->cache_clean_lru_counter;
 }
 
+/* Returns the number of tables the cache can hold */
+int qcow2_cache_get_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+/* Returns the number of entries that don't hold any table */
+int qcow2_cache_get_free_entries(Qcow2Cache *c)
+{
+    int i, n = 0;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset == 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
 void qcow2_cache_clean_unused(Qcow2Cache *c)
 {
     int i = 0;
@@ -211,10 +211,128 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
     int start_of_slice = l2_entry_size(s) *
         (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
+    if (s->l2_hot_used) {
+        uint64_t l1_index = offset_to_l1_index(s, offset);
+
+        if (l1_index < s->l2_hot_used_size &&
+            !test_bit(l1_index, s->l2_hot_used)) {
+            set_bit(l1_index, s->l2_hot_used);
+            s->l2_hot_changed = true;
+        }
+    }
+
     return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
                            (void **)l2_slice);
 }
 
+/*
+ * Loads the next batch of L2 tables referenced by the active L1 table into
+ * the L2 cache, starting the search at L1 index *@l1_index. If @filter is
+ * non-NULL, only the tables whose L1 index is set in this bitmap of
+ * @filter_size bits are considered.
+ *
+ * A batch consists of L2 tables that are contiguous in the image file and
+ * is read with a single request of at most QCOW2_L2_WARMUP_BATCH bytes.
+ * Slices that are already cached are left alone. Only free cache entries
+ * are used, so that the warm-up never evicts tables that the guest uses:
+ * *@slices_left is limited to the number of free entries and decremented
+ * for each slice that is added to the cache, and no more slices are loaded
+ * once it reaches 0.
+ *
+ * On return, *@l1_index points to the L1 entry after the batch.
+ *
+ * Returns 1 if there may be more tables to load, 0 if the end of the L1
+ * table has been reached or the cache is full and a negative errno value
+ * on failure.
+ *
+ * Called with s->lock held.
+ */
+int coroutine_fn qcow2_co_warm_l2_cache(BlockDriverState *bs,
+                                        const unsigned long *filter,
+                                        uint64_t filter_size,
+                                        uint64_t *l1_index, int *slices_left)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int slice_size = s->l2_slice_size * l2_entry_size(s);
+    int slices_per_table = s->cluster_size / slice_size;
+    uint64_t max_tables = MAX(QCOW2_L2_WARMUP_BATCH / s->cluster_size, 1);
+    uint64_t i, first, nb_tables, l2_offset = 0, pos;
+    uint8_t *buf;
+    int ret;
+
+    *slices_left = MIN(*slices_left,
+                       qcow2_cache_get_free_entries(s->l2_table_cache));
+    if (*slices_left <= 0) {
+        return 0;
+    }
+
+    for (i = *l1_index; i < s->l1_size; i++) {
+        l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+        if (l2_offset && !offset_into_cluster(s, l2_offset) &&
+            (!filter || (i < filter_size && test_bit(i, filter)))) {
+            break;
+        }
+    }
+    if (i >= s->l1_size) {
+        *l1_index = s->l1_size;
+        return 0;
+    }
+
+    first = i;
+    nb_tables = 1;
+    while (nb_tables < max_tables &&
+           nb_tables * slices_per_table < *slices_left &&
+           first + nb_tables < s->l1_size)
+    {
+        i = first + nb_tables;
+        if ((s->l1_table[i] & L1E_OFFSET_MASK) !=
+            l2_offset + nb_tables * s->cluster_size ||
+            (filter && (i >= filter_size || !test_bit(i, filter)))) {
+            break;
+        }
+        nb_tables++;
+    }
+    *l1_index = first + nb_tables;
+
+    trace_qcow2_warm_l2_cache(bs, first, nb_tables);
+
+    buf = qemu_try_blockalign(bs->file->bs, nb_tables * s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    ret = bdrv_co_pread(bs->file, l2_offset, nb_tables * s->cluster_size,
+                        buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (pos = 0; pos < nb_tables * s->cluster_size && *slices_left > 0;
+         pos += slice_size)
+    {
+        void *slice;
+
+        if (qcow2_cache_is_table_offset(s->l2_table_cache, l2_offset + pos)) {
+            continue;
+        }
+
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset + pos,
+                                    &slice);
+        if (ret < 0) {
+            goto out;
+        }
+        memcpy(slice, buf + pos, slice_size);
+        qcow2_cache_put(s->l2_table_cache, &slice);
+        (*slices_left)--;
+    }
+
+    ret = *l1_index < s->l1_size;
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
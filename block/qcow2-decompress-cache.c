@@ -0,0 +1,286 @@
+/*
+ * Cache of decompressed clusters for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Compressed clusters are never rewritten in place, so as long as an image
+ * is only opened read-only (which is the case for the base images this cache
+ * is meant for) the decompressed content of a compressed cluster depends on
+ * nothing but its host offset. That allows sharing a single cache between
+ * all qcow2 nodes that have the same image file open, no matter which guest
+ * offsets or which BlockBackends they serve.
+ *
+ * The image file is identified by its device and inode number rather than
+ * by its name, so that different paths to the same file share a cache. Its
+ * size and modification and status change times are part of the key as
+ * well: a file that was replaced or modified gets a new cache instead of
+ * the stale clusters of its earlier contents. The key is recomputed when a
+ * node is reopened or its cache is invalidated.
+ *
+ * Entries are evicted in LRU order once the cache is full. The cache is
+ * accessed from the AioContexts of all of its users, so lookups and updates
+ * are protected by a mutex; the registry of shared caches is only touched
+ * when opening and closing nodes and is protected by the BQL.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DecompressCacheEntry {
+    uint64_t coffset;
+    void *data;
+    QTAILQ_ENTRY(Qcow2DecompressCacheEntry) next;
+} Qcow2DecompressCacheEntry;
+
+typedef struct Qcow2DecompressCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+} Qcow2DecompressCacheKey;
+
+struct Qcow2DecompressCache {
+    Qcow2DecompressCacheKey key;
+    bool shared;        /* registered in shared_caches under @key */
+    int cluster_size;
+    unsigned refcnt;
+    uint64_t max_entries;
+
+    QemuMutex lock;
+    GHashTable *entries; /* host offset => Qcow2DecompressCacheEntry */
+    /* Most recently used entries first */
+    QTAILQ_HEAD(, Qcow2DecompressCacheEntry) lru;
+    uint64_t nb_entries;
+};
+
+/* Caches shared between all nodes, indexed by Qcow2DecompressCacheKey */
+static GHashTable *shared_caches;
+
+static guint cache_key_hash(gconstpointer p)
+{
+    const Qcow2DecompressCacheKey *key = p;
+
+    return key->dev ^ (key->ino << 16) ^ (key->ino >> 16) ^ key->size ^
+           key->mtime ^ key->ctime;
+}
+
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(Qcow2DecompressCacheKey));
+}
+
+/*
+ * Computes the key that identifies the image file of @bs from its current
+ * state. Returns -ENOTSUP if the file cannot be identified.
+ */
+static int cache_get_key(BlockDriverState *bs, Qcow2DecompressCacheKey *key)
+{
+    BlockDriverState *file_bs = bs->file->bs;
+    struct stat st;
+    int ret;
+
+    if (!file_bs->drv || !file_bs->drv->bdrv_fstat) {
+        return -ENOTSUP;
+    }
+    ret = file_bs->drv->bdrv_fstat(file_bs, &st);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return -ENOTSUP;
+    }
+
+    /* Zero the padding, too; keys are compared with memcmp() */
+    memset(key, 0, sizeof(*key));
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime = st.st_mtime;
+    key->ctime = st.st_ctime;
+    return 0;
+}
+
+static void entry_free(Qcow2DecompressCacheEntry *e)
+{
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+static void cache_evict(Qcow2DecompressCache *c, uint64_t max_entries)
+{
+    while (c->nb_entries > max_entries) {
+        Qcow2DecompressCacheEntry *e = QTAILQ_LAST(&c->lru);
+
+        QTAILQ_REMOVE(&c->lru, e, next);
+        g_hash_table_remove(c->entries, &e->coffset);
+        c->nb_entries--;
+        entry_free(e);
+    }
+}
+
+static uint64_t size_to_entries(uint64_t size, int cluster_size)
+{
+    return MAX(size / cluster_size, 1);
+}
+
+/*
+ * Returns a reference to the decompressed cluster cache for the image file
+ * of @bs, creating it if there is none yet. The cache will keep at least
+ * @size bytes of decompressed data (it grows if a new user asks for more
+ * than the current users did).
+ *
+ * Caches can only be shared if the image file is a regular file whose
+ * device and inode number the protocol driver can tell; otherwise a cache
+ * private to @bs is returned.
+ */
+Qcow2DecompressCache *qcow2_decompress_cache_get(BlockDriverState *bs,
+                                                 uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCacheKey key;
+    bool has_key = cache_get_key(bs, &key) == 0;
+    Qcow2DecompressCache *c = NULL;
+    uint64_t max_entries = size_to_entries(size, s->cluster_size);
+
+    if (!shared_caches) {
+        shared_caches = g_hash_table_new(cache_key_hash, cache_key_equal);
+    }
+
+    if (has_key) {
+        c = g_hash_table_lookup(shared_caches, &key);
+    }
+
+    if (c && c->cluster_size == s->cluster_size) {
+        c->refcnt++;
+        qemu_mutex_lock(&c->lock);
+        c->max_entries = MAX(c->max_entries, max_entries);
+        qemu_mutex_unlock(&c->lock);
+        return c;
+    }
+
+    c = g_new0(Qcow2DecompressCache, 1);
+    c->cluster_size = s->cluster_size;
+    c->refcnt = 1;
+    c->max_entries = max_entries;
+    qemu_mutex_init(&c->lock);
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&c->lru);
+
+    if (has_key && !g_hash_table_contains(shared_caches, &key)) {
+        c->key = key;
+        c->shared = true;
+        g_hash_table_insert(shared_caches, &c->key, c);
+    }
+
+    return c;
+}
+
+/* Drops a reference obtained with qcow2_decompress_cache_get() */
+void qcow2_decompress_cache_put(Qcow2DecompressCache *c)
+{
+    if (!c || --c->refcnt > 0) {
+        return;
+    }
+
+    if (c->shared) {
+        g_hash_table_remove(shared_caches, &c->key);
+    }
+
+    cache_evict(c, 0);
+    g_hash_table_destroy(c->entries);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+/*
+ * Copies @bytes bytes starting at @offset_in_cluster of the decompressed
+ * cluster stored at host offset @coffset into @qiov.
+ *
+ * Returns true on a cache hit, false if the cluster is not cached.
+ */
+bool qcow2_decompress_cache_read(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    Qcow2DecompressCacheEntry *e;
+
+    assert(offset_in_cluster + bytes <= c->cluster_size);
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, &coffset);
+    if (e) {
+        QTAILQ_REMOVE(&c->lru, e, next);
+        QTAILQ_INSERT_HEAD(&c->lru, e, next);
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            (uint8_t *)e->data + offset_in_cluster, bytes);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    trace_qcow2_decompress_cache_read(c, coffset, !!e);
+    return e;
+}
+
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset)
+{
+    bool ret;
+
+    qemu_mutex_lock(&c->lock);
+    ret = g_hash_table_contains(c->entries, &coffset);
+    qemu_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+/*
+ * Adds the decompressed cluster @data stored at host offset @coffset to the
+ * cache. @data must have been allocated with qemu_blockalign() and be one
+ * cluster in size; the cache takes ownership of it.
+ */
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c, uint64_t coffset,
+                                   void *data)
+{
+    Qcow2DecompressCacheEntry *e;
+
+    qemu_mutex_lock(&c->lock);
+    if (g_hash_table_contains(c->entries, &coffset)) {
+        /* Somebody else was faster */
+        qemu_mutex_unlock(&c->lock);
+        qemu_vfree(data);
+        return;
+    }
+
+    cache_evict(c, c->max_entries - 1);
+
+    e = g_new(Qcow2DecompressCacheEntry, 1);
+    *e = (Qcow2DecompressCacheEntry) {
+        .coffset = coffset,
+        .data = data,
+    };
+    g_hash_table_insert(c->entries, &e->coffset, e);
+    QTAILQ_INSERT_HEAD(&c->lru, e, next);
+    c->nb_entries++;
+    qemu_mutex_unlock(&c->lock);
+}
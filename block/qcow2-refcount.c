@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qcow2.h"
+#include "block/aio_task.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
@@ -887,14 +888,15 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             void *table;
 
             table = qcow2_cache_is_table_offset(s->refcount_block_cache,
-                                                offset);
+                                                cluster_offset);
             if (table != NULL) {
                 qcow2_cache_put(s->refcount_block_cache, &refcount_block);
                 old_table_index = -1;
                 qcow2_cache_discard(s->refcount_block_cache, table);
             }
 
-            table = qcow2_cache_is_table_offset(s->l2_table_cache, offset);
+            table = qcow2_cache_is_table_offset(s->l2_table_cache,
+                                                cluster_offset);
             if (table != NULL) {
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
@@ -1238,160 +1240,329 @@ int coroutine_fn qcow2_flush_caches(BlockDriverState *bs)
 
 
 
-/* update the refcounts of snapshots and the copied flag */
-int qcow2_update_snapshot_refcount(BlockDriverState *bs,
-    int64_t l1_table_offset, int l1_size, int addend)
+/*
+ * update_snapshot_refcount_l1() and check_refcounts_l1() read this many L2
+ * tables concurrently, within a limit of L2_READ_BATCH_BYTES of buffers.
+ * This bounds the L2 buffers only; the in-memory refcount table that check
+ * builds still has an entry for every host cluster.
+ */
+#define L2_READ_BATCH_TABLES 64
+#define L2_READ_BATCH_BYTES (16 * MiB)
+
+typedef struct L2ReadTask {
+    AioTask task;
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t bytes;
+    void *buf;
+    int *ret;
+} L2ReadTask;
+
+static int coroutine_fn l2_read_task_entry(AioTask *task)
+{
+    L2ReadTask *t = container_of(task, L2ReadTask, task);
+
+    *t->ret = bdrv_co_pread(t->bs->file, t->offset, t->bytes, t->buf, 0);
+    return *t->ret;
+}
+
+/*
+ * Reads the @nb_tables L2 tables at @l2_offsets into consecutive buffers
+ * of @l2_tables, and stores the result of each read in @ret.  The reads are
+ * issued concurrently when running in coroutine context.
+ */
+static void read_l2_tables(BlockDriverState *bs,
+                           const uint64_t *l2_offsets, int nb_tables,
+                           uint64_t *l2_tables, int *ret)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_slice, l2_offset, entry, l1_size2, refcount;
-    bool l1_allocated = false;
-    int64_t old_entry, old_l2_offset;
-    unsigned slice, slice_size2, n_slices;
-    int i, j, l1_modified = 0;
-    int ret;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    size_t l2_entries = l2_size_bytes / sizeof(uint64_t);
+    AioTaskPool *pool;
+    int i;
 
-    assert(addend >= -1 && addend <= 1);
+    if (!qemu_in_coroutine()) {
+        for (i = 0; i < nb_tables; i++) {
+            ret[i] = bdrv_pread(bs->file, l2_offsets[i],
+                                l2_tables + i * l2_entries, l2_size_bytes);
+        }
+        return;
+    }
 
-    l2_slice = NULL;
-    l1_table = NULL;
-    l1_size2 = l1_size * L1E_SIZE;
-    slice_size2 = s->l2_slice_size * l2_entry_size(s);
-    n_slices = s->cluster_size / slice_size2;
+    pool = aio_task_pool_new(nb_tables);
+    for (i = 0; i < nb_tables; i++) {
+        L2ReadTask *t = g_new(L2ReadTask, 1);
 
-    s->cache_discards = true;
+        *t = (L2ReadTask) {
+            .task.func = l2_read_task_entry,
+            .bs = bs,
+            .offset = l2_offsets[i],
+            .bytes = l2_size_bytes,
+            .buf = l2_tables + i * l2_entries,
+            .ret = &ret[i],
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+}
 
-    /* WARNING: qcow2_snapshot_goto relies on this function not using the
-     * l1_table_offset when it is the current s->l1_table_offset! Be careful
-     * when changing this! */
-    if (l1_table_offset != s->l1_table_offset) {
-        l1_table = g_try_malloc0(l1_size2);
-        if (l1_size2 && l1_table == NULL) {
-            ret = -ENOMEM;
-            goto fail;
+/* Returns true if a slice of the L2 table at @l2_offset is in the L2 cache */
+static bool l2_table_is_cached(BlockDriverState *bs, uint64_t l2_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    unsigned slice;
+
+    for (slice = 0; slice < s->cluster_size / slice_size2; slice++) {
+        if (qcow2_cache_is_table_offset(s->l2_table_cache,
+                                        l2_offset + slice * slice_size2)) {
+            return true;
         }
-        l1_allocated = true;
+    }
+    return false;
+}
 
-        ret = bdrv_pread(bs->file, l1_table_offset, l1_table, l1_size2);
+/*
+ * Adds @addend to the refcounts of the clusters referenced by slice @slice of
+ * the L2 table at @l2_offset and updates their copied flags.  The entries are
+ * taken from @l2_copy if it is not NULL, or else from the L2 cache; changed
+ * entries are always written through the L2 cache.
+ *
+ * The refcounts of runs of adjacent clusters are updated with a single
+ * update_refcount() call, which loads each refcount block only once.
+ */
+static int update_snapshot_refcount_l2_slice(BlockDriverState *bs,
+                                             uint64_t l2_offset,
+                                             unsigned slice,
+                                             const uint64_t *l2_copy,
+                                             int addend)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_offset = l2_offset +
+                            slice * s->l2_slice_size * l2_entry_size(s);
+    uint64_t *l2_slice = NULL;
+    uint64_t entry, old_entry, offset, refcount;
+    uint64_t run_start = 0, run_end = 0;
+    int j, ret;
+
+    if (!l2_copy) {
+        ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                              (void **) &l2_slice);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
+        l2_copy = l2_slice;
+    }
 
-        for (i = 0; i < l1_size; i++) {
-            be64_to_cpus(&l1_table[i]);
+    /* Check the entries and update the refcounts */
+    for (j = 0; j < s->l2_slice_size; j++) {
+        entry = get_l2_entry(s, l2_copy, j) & ~QCOW_OFLAG_COPIED;
+        offset = entry & L2E_OFFSET_MASK;
+
+        switch (qcow2_get_cluster_type(bs, entry)) {
+        case QCOW2_CLUSTER_COMPRESSED:
+            if (addend != 0) {
+                uint64_t coffset;
+                int csize;
+
+                qcow2_parse_compressed_l2_entry(bs, entry, &coffset, &csize);
+                ret = update_refcount(bs, coffset, csize, abs(addend),
+                                      addend < 0, QCOW2_DISCARD_SNAPSHOT);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+            break;
+
+        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_CLUSTER_ZERO_ALLOC:
+            if (offset_into_cluster(s, offset)) {
+                /* Here l2_index means table (not slice) index */
+                int l2_index = slice * s->l2_slice_size + j;
+                qcow2_signal_corruption(bs, true, -1, -1, "Cluster "
+                                        "allocation offset %#" PRIx64
+                                        " unaligned (L2 offset: %#"
+                                        PRIx64 ", L2 index: %#x)",
+                                        offset, l2_offset, l2_index);
+                ret = -EIO;
+                goto fail;
+            }
+            assert(offset >> s->cluster_bits);
+
+            if (addend != 0 && offset != run_end) {
+                ret = update_refcount(bs, run_start, run_end - run_start,
+                                      abs(addend), addend < 0,
+                                      QCOW2_DISCARD_SNAPSHOT);
+                if (ret < 0) {
+                    goto fail;
+                }
+                run_start = offset;
+            }
+            run_end = offset + s->cluster_size;
+            break;
+
+        default:
+            break;
         }
-    } else {
-        assert(l1_size == s->l1_size);
-        l1_table = s->l1_table;
-        l1_allocated = false;
     }
 
-    for (i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
+    if (addend != 0) {
+        ret = update_refcount(bs, run_start, run_end - run_start,
+                              abs(addend), addend < 0, QCOW2_DISCARD_SNAPSHOT);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
 
-            if (offset_into_cluster(s, l2_offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
-                                        PRIx64 " unaligned (L1 index: %#x)",
-                                        l2_offset, i);
-                ret = -EIO;
+    /* Update the copied flags */
+    for (j = 0; j < s->l2_slice_size; j++) {
+        entry = get_l2_entry(s, l2_copy, j);
+        old_entry = entry;
+        entry &= ~QCOW_OFLAG_COPIED;
+        offset = entry & L2E_OFFSET_MASK;
+
+        switch (qcow2_get_cluster_type(bs, entry)) {
+        case QCOW2_CLUSTER_COMPRESSED:
+            /* compressed clusters are never modified */
+            refcount = 2;
+            break;
+
+        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_CLUSTER_ZERO_ALLOC:
+            ret = qcow2_get_refcount(bs, offset >> s->cluster_bits,
+                                     &refcount);
+            if (ret < 0) {
                 goto fail;
             }
+            break;
 
-            for (slice = 0; slice < n_slices; slice++) {
-                ret = qcow2_cache_get(bs, s->l2_table_cache,
-                                      l2_offset + slice * slice_size2,
+        case QCOW2_CLUSTER_ZERO_PLAIN:
+        case QCOW2_CLUSTER_UNALLOCATED:
+            refcount = 0;
+            break;
+
+        default:
+            abort();
+        }
+
+        if (refcount == 1) {
+            entry |= QCOW_OFLAG_COPIED;
+        }
+        if (entry != old_entry) {
+            if (!l2_slice) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
                                       (void **) &l2_slice);
                 if (ret < 0) {
                     goto fail;
                 }
+            }
+            if (addend > 0) {
+                qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                           s->refcount_block_cache);
+            }
+            set_l2_entry(s, l2_slice, j, entry);
+            qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        }
+    }
 
-                for (j = 0; j < s->l2_slice_size; j++) {
-                    uint64_t cluster_index;
-                    uint64_t offset;
+    ret = 0;
+fail:
+    if (l2_slice) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+    return ret;
+}
 
-                    entry = get_l2_entry(s, l2_slice, j);
-                    old_entry = entry;
-                    entry &= ~QCOW_OFLAG_COPIED;
-                    offset = entry & L2E_OFFSET_MASK;
-
-                    switch (qcow2_get_cluster_type(bs, entry)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        if (addend != 0) {
-                            uint64_t coffset;
-                            int csize;
-
-                            qcow2_parse_compressed_l2_entry(bs, entry,
-                                                            &coffset, &csize);
-                            ret = update_refcount(
-                                bs, coffset, csize,
-                                abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
+/*
+ * Adds @addend to the refcounts of the L2 tables referenced by the entries
+ * [@start, @end) of @l1_table and of the clusters they reference, and updates
+ * the copied flags.  Sets *@l1_modified if an entry of @l1_table changed.
+ *
+ * The L2 tables that are not in the L2 cache are read in batches, and are
+ * only loaded into the cache if one of their entries must be changed.
+ */
+static int update_snapshot_refcount_l1(BlockDriverState *bs,
+                                       uint64_t *l1_table, int start, int end,
+                                       int addend, bool *l1_modified)
+{
+    BDRVQcow2State *s = bs->opaque;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    size_t l2_entries = l2_size_bytes / sizeof(uint64_t);
+    unsigned slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    unsigned slice, n_slices = s->cluster_size / slice_size2;
+    g_autofree uint64_t *l2_tables = NULL;
+    uint64_t l2_offsets[L2_READ_BATCH_TABLES];
+    int l2_ret[L2_READ_BATCH_TABLES];
+    uint64_t l2_offset, old_l2_offset, refcount;
+    int batch_tables;
+    int i, j, next, ret;
+
+    batch_tables = MAX(1, MIN(L2_READ_BATCH_TABLES,
+                              L2_READ_BATCH_BYTES / l2_size_bytes));
+    l2_tables = g_try_malloc(batch_tables * l2_size_bytes);
+    if (l2_tables == NULL) {
+        return -ENOMEM;
+    }
 
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO_ALLOC:
-                        if (offset_into_cluster(s, offset)) {
-                            /* Here l2_index means table (not slice) index */
-                            int l2_index = slice * s->l2_slice_size + j;
-                            qcow2_signal_corruption(
-                                bs, true, -1, -1, "Cluster "
-                                "allocation offset %#" PRIx64
-                                " unaligned (L2 offset: %#"
-                                PRIx64 ", L2 index: %#x)",
-                                offset, l2_offset, l2_index);
-                            ret = -EIO;
-                            goto fail;
-                        }
+    for (i = start; i < end; i = next) {
+        int nb_tables = 0;
 
-                        cluster_index = offset >> s->cluster_bits;
-                        assert(cluster_index);
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(
-                                bs, cluster_index, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
+        /*
+         * Read the next batch of L2 tables.  An L2 table referenced twice
+         * must be read again after its entries have been updated.
+         */
+        for (next = i; next < end && nb_tables < batch_tables; next++) {
+            l2_offset = l1_table[next] & L1E_OFFSET_MASK;
+            if (!l2_offset || offset_into_cluster(s, l2_offset) ||
+                l2_table_is_cached(bs, l2_offset)) {
+                continue;
+            }
+            for (j = 0; j < nb_tables; j++) {
+                if (l2_offsets[j] == l2_offset) {
+                    break;
+                }
+            }
+            if (j < nb_tables) {
+                break;
+            }
+            l2_offsets[nb_tables++] = l2_offset;
+        }
+        read_l2_tables(bs, l2_offsets, nb_tables, l2_tables, l2_ret);
 
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
+        for (j = 0; i < next; i++) {
+            const uint64_t *l2_table = NULL;
 
-                    case QCOW2_CLUSTER_ZERO_PLAIN:
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+            if (!l1_table[i]) {
+                continue;
+            }
+            old_l2_offset = l1_table[i];
+            l2_offset = old_l2_offset & L1E_OFFSET_MASK;
 
-                    default:
-                        abort();
-                    }
+            if (offset_into_cluster(s, l2_offset)) {
+                qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
+                                        PRIx64 " unaligned (L1 index: %#x)",
+                                        l2_offset, i);
+                return -EIO;
+            }
 
-                    if (refcount == 1) {
-                        entry |= QCOW_OFLAG_COPIED;
-                    }
-                    if (entry != old_entry) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                                       s->refcount_block_cache);
-                        }
-                        set_l2_entry(s, l2_slice, j, entry);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache,
-                                                     l2_slice);
-                    }
+            if (j < nb_tables && l2_offsets[j] == l2_offset) {
+                if (l2_ret[j] < 0) {
+                    return l2_ret[j];
                 }
+                l2_table = l2_tables + j * l2_entries;
+                j++;
+            }
 
-                qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = update_snapshot_refcount_l2_slice(
+                    bs, l2_offset, slice,
+                    l2_table ? l2_table + slice * slice_size2 / sizeof(uint64_t)
+                             : NULL,
+                    addend);
+                if (ret < 0) {
+                    return ret;
+                }
             }
 
             if (addend != 0) {
@@ -1400,29 +1571,78 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                                                     abs(addend), addend < 0,
                                                     QCOW2_DISCARD_SNAPSHOT);
                 if (ret < 0) {
-                    goto fail;
+                    return ret;
                 }
             }
             ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                      &refcount);
             if (ret < 0) {
-                goto fail;
+                return ret;
             } else if (refcount == 1) {
                 l2_offset |= QCOW_OFLAG_COPIED;
             }
             if (l2_offset != old_l2_offset) {
                 l1_table[i] = l2_offset;
-                l1_modified = 1;
+                *l1_modified = true;
             }
         }
     }
 
-    ret = bdrv_flush(bs);
-fail:
-    if (l2_slice) {
-        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return 0;
+}
+
+/* update the refcounts of snapshots and the copied flag */
+int qcow2_update_snapshot_refcount(BlockDriverState *bs,
+    int64_t l1_table_offset, int l1_size, int addend)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l1_table, l1_size2;
+    bool l1_allocated = false;
+    bool l1_modified = false;
+    int i;
+    int ret;
+
+    assert(addend >= -1 && addend <= 1);
+
+    l1_table = NULL;
+    l1_size2 = l1_size * L1E_SIZE;
+
+    s->cache_discards = true;
+
+    /* WARNING: qcow2_snapshot_goto relies on this function not using the
+     * l1_table_offset when it is the current s->l1_table_offset! Be careful
+     * when changing this! */
+    if (l1_table_offset != s->l1_table_offset) {
+        l1_table = g_try_malloc0(l1_size2);
+        if (l1_size2 && l1_table == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        l1_allocated = true;
+
+        ret = bdrv_pread(bs->file, l1_table_offset, l1_table, l1_size2);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (i = 0; i < l1_size; i++) {
+            be64_to_cpus(&l1_table[i]);
+        }
+    } else {
+        assert(l1_size == s->l1_size);
+        l1_table = s->l1_table;
+        l1_allocated = false;
+    }
+
+    ret = update_snapshot_refcount_l1(bs, l1_table, 0, l1_size, addend,
+                                      &l1_modified);
+    if (ret < 0) {
+        goto fail;
     }
 
+    /* Not bdrv_flush(), this may run with s->lock held */
+    ret = qcow2_flush_caches(bs);
+fail:
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
@@ -1444,6 +1664,64 @@ fail:
     return ret;
 }
 
+/*
+ * Drops the references that the entries [@start, @end) of @l1_table, the L1
+ * table of a deleted snapshot in host byte order, hold on their L2 tables and
+ * the clusters these reference.  Used for deleting snapshots in the
+ * background, see qcow2_snapshot_delete().
+ */
+int qcow2_release_snapshot_l1_range(BlockDriverState *bs, uint64_t *l1_table,
+                                    int start, int end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    bool l1_modified = false;
+    int ret;
+
+    s->cache_discards = true;
+    ret = update_snapshot_refcount_l1(bs, l1_table, start, end, -1,
+                                      &l1_modified);
+    if (ret == 0) {
+        ret = qcow2_flush_caches(bs);
+    }
+    s->cache_discards = false;
+    qcow2_process_discards(bs, ret);
+
+    return ret;
+}
+
+/*
+ * Updates the copied flags of the entries [@start, @end) of the active L1
+ * table and of the L2 tables they reference, without changing refcounts.
+ * Used once the background deletion of snapshots is done, see
+ * qcow2_release_deleted_snapshots().
+ */
+int qcow2_update_copied_flags_l1_range(BlockDriverState *bs, int start,
+                                       int end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint64_t *old_l1_table = NULL;
+    bool l1_modified = false;
+    int i, ret;
+
+    old_l1_table = g_memdup2(s->l1_table + start, (end - start) * L1E_SIZE);
+
+    s->cache_discards = true;
+    ret = update_snapshot_refcount_l1(bs, s->l1_table, start, end, 0,
+                                      &l1_modified);
+    if (ret == 0) {
+        ret = qcow2_flush_caches(bs);
+    }
+    s->cache_discards = false;
+    qcow2_process_discards(bs, ret);
+
+    for (i = start; ret == 0 && l1_modified && i < end; i++) {
+        if (s->l1_table[i] != old_l1_table[i - start]) {
+            ret = qcow2_write_l1_entry(bs, i);
+        }
+    }
+    return ret;
+}
+
 
 
 
@@ -1649,8 +1927,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, which was read from @l2_offset. While
+ * doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1658,24 +1936,15 @@ fail:
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
+                              uint64_t *l2_table,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size_bytes);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1863,9 +2132,15 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    size_t l2_entries = l2_size_bytes / sizeof(uint64_t);
     g_autofree uint64_t *l1_table = NULL;
+    g_autofree uint64_t *l2_tables = NULL;
+    uint64_t l2_offsets[L2_READ_BATCH_TABLES];
+    int l2_ret[L2_READ_BATCH_TABLES];
+    int batch_tables;
     uint64_t l2_offset;
-    int i, ret;
+    int i, j, next, ret;
 
     if (!l1_size) {
         return 0;
@@ -1896,41 +2171,84 @@ static int check_refcounts_l1(BlockDriverState *bs,
         be64_to_cpus(&l1_table[i]);
     }
 
+    batch_tables = MAX(1, MIN(L2_READ_BATCH_TABLES,
+                              L2_READ_BATCH_BYTES / l2_size_bytes));
+    l2_tables = g_try_malloc(batch_tables * l2_size_bytes);
+    if (l2_tables == NULL) {
+        res->check_errors++;
+        return -ENOMEM;
+    }
+
     /* Do the actual checks */
-    for (i = 0; i < l1_size; i++) {
-        if (!l1_table[i]) {
-            continue;
+    for (i = 0; i < l1_size; i = next) {
+        int nb_tables = 0;
+
+        /*
+         * Read the next batch of L2 tables.  When repairing, an L2 table
+         * referenced twice must be read again after it has been checked.
+         */
+        for (next = i; next < l1_size && nb_tables < batch_tables; next++) {
+            if (!l1_table[next]) {
+                continue;
+            }
+            l2_offset = l1_table[next] & L1E_OFFSET_MASK;
+            if (fix & BDRV_FIX_ERRORS) {
+                for (j = 0; j < nb_tables; j++) {
+                    if (l2_offsets[j] == l2_offset) {
+                        break;
+                    }
+                }
+                if (j < nb_tables) {
+                    break;
+                }
+            }
+            l2_offsets[nb_tables++] = l2_offset;
         }
+        read_l2_tables(bs, l2_offsets, nb_tables, l2_tables, l2_ret);
 
-        if (l1_table[i] & L1E_RESERVED_MASK) {
-            fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
-                    "%" PRIx64 "\n", l1_table[i]);
-            res->corruptions++;
-        }
+        for (j = 0; i < next; i++) {
+            if (!l1_table[i]) {
+                continue;
+            }
 
-        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+            if (l1_table[i] & L1E_RESERVED_MASK) {
+                fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
+                        "%" PRIx64 "\n", l1_table[i]);
+                res->corruptions++;
+            }
 
-        /* Mark L2 table as used */
-        ret = qcow2_inc_refcounts_imrt(bs, res,
-                                       refcount_table, refcount_table_size,
-                                       l2_offset, s->cluster_size);
-        if (ret < 0) {
-            return ret;
-        }
+            l2_offset = l1_table[i] & L1E_OFFSET_MASK;
 
-        /* L2 tables are cluster aligned */
-        if (offset_into_cluster(s, l2_offset)) {
-            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                "cluster aligned; L1 entry corrupted\n", l2_offset);
-            res->corruptions++;
-        }
+            /* Mark L2 table as used */
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           l2_offset, s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
 
-        /* Process and check L2 entries */
-        ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
-        if (ret < 0) {
-            return ret;
+            /* L2 tables are cluster aligned */
+            if (offset_into_cluster(s, l2_offset)) {
+                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                    "cluster aligned; L1 entry corrupted\n", l2_offset);
+                res->corruptions++;
+            }
+
+            if (l2_ret[j] < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                return l2_ret[j];
+            }
+
+            /* Process and check L2 entries */
+            ret = check_refcounts_l2(bs, res, refcount_table,
+                                     refcount_table_size, l2_offset,
+                                     l2_tables + j * l2_entries, flags,
+                                     fix, active);
+            if (ret < 0) {
+                return ret;
+            }
+            j++;
         }
     }
 
@@ -903,6 +903,109 @@ fail:
     return ret;
 }
 
+static int qcow2_queue_deleted_snapshot(BlockDriverState *bs,
+                                        uint64_t l1_table_offset, int l1_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DeletedSnapshot *ds;
+    uint64_t *l1_table;
+    int i, ret;
+
+    l1_table = g_try_malloc0(l1_size * L1E_SIZE);
+    if (l1_size && l1_table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, l1_table_offset, l1_table, l1_size * L1E_SIZE);
+    if (ret < 0) {
+        g_free(l1_table);
+        return ret;
+    }
+    for (i = 0; i < l1_size; i++) {
+        be64_to_cpus(&l1_table[i]);
+    }
+
+    ds = g_new(Qcow2DeletedSnapshot, 1);
+    *ds = (Qcow2DeletedSnapshot) {
+        .l1_table_offset    = l1_table_offset,
+        .l1_size            = l1_size,
+        .l1_table           = l1_table,
+    };
+    QSIMPLEQ_INSERT_TAIL(&s->deleted_snapshots, ds, next);
+    return 0;
+}
+
+/*
+ * Releases the clusters of the snapshots that qcow2_snapshot_delete() left
+ * to the background and then updates the copied flags of the active L1
+ * table, going through at most @max_entries L1 entries unless it is
+ * negative.  It must not run concurrently with other metadata updates, so
+ * in coroutine context the caller must hold s->lock.
+ *
+ * Errors are only reported: like a failing qcow2_snapshot_delete(), they
+ * leak the remaining clusters of the snapshot.
+ */
+void qcow2_release_deleted_snapshots(BlockDriverState *bs, int max_entries)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DeletedSnapshot *ds;
+    int end, ret = 0;
+
+    while ((ds = QSIMPLEQ_FIRST(&s->deleted_snapshots)) && max_entries) {
+        end = ds->l1_size;
+        if (max_entries > 0) {
+            end = MIN(end, ds->l1_index + max_entries);
+            max_entries -= end - ds->l1_index;
+        }
+
+        ret = qcow2_release_snapshot_l1_range(bs, ds->l1_table, ds->l1_index,
+                                              end);
+        if (ret < 0) {
+            warn_report("Failed to free the clusters of a deleted snapshot "
+                        "of node '%s': %s", bdrv_get_device_or_node_name(bs),
+                        strerror(-ret));
+        } else if (end < ds->l1_size) {
+            ds->l1_index = end;
+            continue;
+        } else {
+            qcow2_free_clusters(bs, ds->l1_table_offset,
+                                ds->l1_size * L1E_SIZE,
+                                QCOW2_DISCARD_SNAPSHOT);
+        }
+
+        QSIMPLEQ_REMOVE_HEAD(&s->deleted_snapshots, next);
+        g_free(ds->l1_table);
+        g_free(ds);
+
+        /* must update the copied flag on the current cluster offsets */
+        s->copied_flags_pending = true;
+        s->copied_flags_index = 0;
+    }
+
+    while (QSIMPLEQ_EMPTY(&s->deleted_snapshots) && s->copied_flags_pending &&
+           max_entries) {
+        end = s->l1_size;
+        if (max_entries > 0) {
+            end = MIN(end, s->copied_flags_index + max_entries);
+            max_entries -= end - s->copied_flags_index;
+        }
+
+        if (s->copied_flags_index < end) {
+            ret = qcow2_update_copied_flags_l1_range(bs, s->copied_flags_index,
+                                                     end);
+            if (ret < 0) {
+                warn_report("Failed to update snapshot status in disk of "
+                            "node '%s': %s", bdrv_get_device_or_node_name(bs),
+                            strerror(-ret));
+            } else if (end < s->l1_size) {
+                s->copied_flags_index = end;
+                continue;
+            }
+        }
+        s->copied_flags_pending = false;
+    }
+}
+
 int qcow2_snapshot_delete(BlockDriverState *bs,
                           const char *snapshot_id,
                           const char *name,
@@ -951,6 +1054,17 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
     g_free(sn.id_str);
     g_free(sn.name);
 
+    if (s->background_snapshot_delete) {
+        /* The clusters are released by qcow2_release_deleted_snapshots() */
+        ret = qcow2_queue_deleted_snapshot(bs, sn.l1_table_offset,
+                                           sn.l1_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to read the L1 table");
+            return ret;
+        }
+        return 0;
+    }
+
     /*
      * Now decrease the refcounts of clusters referenced by the snapshot and
      * free the L1 table.
@@ -71,6 +71,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_HOT_L2_TABLES 0x4c32484f
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -427,6 +428,28 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_HOT_L2_TABLES:
+        {
+            uint64_t nbits = (uint64_t)ext.len * BITS_PER_BYTE;
+
+            /* Only a hint, so just ignore it if it doesn't make sense */
+            if (nbits > QCOW_MAX_L1_SIZE / L1E_SIZE) {
+                break;
+            }
+
+            g_free(s->l2_hot_hint);
+            s->l2_hot_hint = bitmap_new(nbits);
+            s->l2_hot_hint_size = nbits;
+            ret = bdrv_pread(bs->file, offset, s->l2_hot_hint, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: hot_l2_tables_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+            bitmap_from_le(s->l2_hot_hint, s->l2_hot_hint, nbits);
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -611,6 +634,9 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    /* Clusters of snapshots that are being deleted would look leaked */
+    qcow2_release_deleted_snapshots(bs, -1);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -697,6 +723,12 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DECOMPRESS_CACHE_SIZE,
+    QCOW2_OPT_DECOMPRESS_READAHEAD,
+    QCOW2_OPT_L2_WARMUP,
+    QCOW2_OPT_L2_HOT_LIST,
+    QCOW2_OPT_BITMAP_FLUSH_INTERVAL,
+    QCOW2_OPT_BACKGROUND_SNAPSHOT_DELETE,
     NULL
 };
 
@@ -808,6 +840,42 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_DECOMPRESS_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache shared "
+                    "by all read-only users of the image file",
+        },
+        {
+            .name = QCOW2_OPT_DECOMPRESS_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of compressed clusters to decompress into the "
+                    "decompressed cluster cache ahead of a read",
+        },
+        {
+            .name = QCOW2_OPT_L2_WARMUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Load L2 tables into the L2 cache in the background "
+                    "while the image is idle",
+        },
+        {
+            .name = QCOW2_OPT_L2_HOT_LIST,
+            .type = QEMU_OPT_BOOL,
+            .help = "Record which L2 tables are used and store the list in "
+                    "the image for the next warm-up",
+        },
+        {
+            .name = QCOW2_OPT_BITMAP_FLUSH_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Write changed parts of persistent bitmaps to the image "
+                    "after this time (in seconds)",
+        },
+        {
+            .name = QCOW2_OPT_BACKGROUND_SNAPSHOT_DELETE,
+            .type = QEMU_OPT_BOOL,
+            .help = "Free the clusters of deleted internal snapshots in the "
+                    "background",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -858,15 +926,261 @@ static void cache_clean_timer_del(BlockDriverState *bs)
     }
 }
 
+static void l2_warmup_timer_schedule(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->l2_warmup_timer && !s->l2_warmup_done && !s->background_paused) {
+        timer_mod(s->l2_warmup_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  QCOW2_L2_WARMUP_INTERVAL_MS);
+    }
+}
+
+static void coroutine_fn l2_warmup_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->l2_warmup_hot_pass) {
+        ret = qcow2_co_warm_l2_cache(bs, s->l2_hot_hint, s->l2_hot_hint_size,
+                                     &s->l2_warmup_index,
+                                     &s->l2_warmup_slices_left);
+        if (ret == 0) {
+            /* Continue with all the other tables */
+            s->l2_warmup_hot_pass = false;
+            s->l2_warmup_index = 0;
+            ret = 1;
+        }
+    } else {
+        ret = qcow2_co_warm_l2_cache(bs, NULL, 0, &s->l2_warmup_index,
+                                     &s->l2_warmup_slices_left);
+    }
+    if (s->l2_warmup_slices_left <= 0) {
+        ret = 0;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret > 0) {
+        l2_warmup_timer_schedule(bs);
+    } else {
+        trace_qcow2_l2_warmup_done(bs, ret);
+        s->l2_warmup_done = true;
+    }
+
+    bdrv_dec_in_flight(bs);
+}
+
+static void l2_warmup_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Coroutine *co;
+
+    /*
+     * The warm-up has the lowest priority: Only go ahead if there are no
+     * other requests, and don't touch images that we don't own yet.
+     */
+    if (qatomic_read(&bs->in_flight) || (bs->open_flags & BDRV_O_INACTIVE)) {
+        l2_warmup_timer_schedule(bs);
+        return;
+    }
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(l2_warmup_entry, bs);
+    qemu_coroutine_enter(co);
+}
+
+static void l2_warmup_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->l2_warmup && !s->l2_warmup_done) {
+        s->l2_warmup_timer =
+            aio_timer_new_with_attrs(context, QEMU_CLOCK_VIRTUAL,
+                                     SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                     l2_warmup_timer_cb, bs);
+        l2_warmup_timer_schedule(bs);
+    }
+}
+
+static void l2_warmup_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->l2_warmup_timer) {
+        timer_free(s->l2_warmup_timer);
+        s->l2_warmup_timer = NULL;
+    }
+}
+
+static void bitmap_flush_timer_schedule(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->bitmap_flush_timer && !s->background_paused) {
+        timer_mod(s->bitmap_flush_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->bitmap_flush_interval * 1000);
+    }
+}
+
+static void coroutine_fn bitmap_flush_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Error *local_err = NULL;
+
+    if (qcow2_co_flush_persistent_dirty_bitmaps(bs, &local_err) < 0) {
+        /* Not fatal, the bitmaps are stored completely on close */
+        warn_reportf_err(local_err, "Failed to flush persistent bitmaps of "
+                         "node '%s': ", bdrv_get_device_or_node_name(bs));
+    }
+
+    bitmap_flush_timer_schedule(bs);
+    bdrv_dec_in_flight(bs);
+}
+
+static void bitmap_flush_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Coroutine *co;
+
+    if (bs->open_flags & BDRV_O_INACTIVE) {
+        bitmap_flush_timer_schedule(bs);
+        return;
+    }
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(bitmap_flush_entry, bs);
+    qemu_coroutine_enter(co);
+}
+
+static void bitmap_flush_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->bitmap_flush_interval > 0) {
+        s->bitmap_flush_timer =
+            aio_timer_new_with_attrs(context, QEMU_CLOCK_VIRTUAL,
+                                     SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                     bitmap_flush_timer_cb, bs);
+        bitmap_flush_timer_schedule(bs);
+    }
+}
+
+static void bitmap_flush_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->bitmap_flush_timer) {
+        timer_free(s->bitmap_flush_timer);
+        s->bitmap_flush_timer = NULL;
+    }
+}
+
+static void snapshot_release_timer_schedule(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->snapshot_release_timer && !s->background_paused &&
+        (!QSIMPLEQ_EMPTY(&s->deleted_snapshots) || s->copied_flags_pending)) {
+        timer_mod(s->snapshot_release_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  QCOW2_SNAPSHOT_RELEASE_INTERVAL_MS);
+    }
+}
+
+static void coroutine_fn snapshot_release_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    /* Guest requests can run between the batches */
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_release_deleted_snapshots(bs, QCOW2_SNAPSHOT_RELEASE_BATCH);
+    qemu_co_mutex_unlock(&s->lock);
+
+    snapshot_release_timer_schedule(bs);
+    bdrv_dec_in_flight(bs);
+}
+
+static void snapshot_release_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Coroutine *co;
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(snapshot_release_entry, bs);
+    qemu_coroutine_enter(co);
+}
+
+static void snapshot_release_timer_init(BlockDriverState *bs,
+                                        AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->background_snapshot_delete) {
+        /* Unlike the warm-up, this must make progress while the VM is paused */
+        s->snapshot_release_timer =
+            aio_timer_new_with_attrs(context, QEMU_CLOCK_REALTIME,
+                                     SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                     snapshot_release_timer_cb, bs);
+        snapshot_release_timer_schedule(bs);
+    }
+}
+
+static void snapshot_release_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->snapshot_release_timer) {
+        timer_free(s->snapshot_release_timer);
+        s->snapshot_release_timer = NULL;
+    }
+}
+
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    l2_warmup_timer_del(bs);
+    bitmap_flush_timer_del(bs);
+    snapshot_release_timer_del(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     cache_clean_timer_init(bs, new_context);
+    l2_warmup_timer_init(bs, new_context);
+    bitmap_flush_timer_init(bs, new_context);
+    snapshot_release_timer_init(bs, new_context);
+}
+
+static void coroutine_fn qcow2_co_drain_begin(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    /*
+     * Don't start new warm-up batches, bitmap flushes or batches of releasing
+     * deleted snapshots while drained
+     */
+    if (s->background_paused++ == 0) {
+        if (s->l2_warmup_timer) {
+            timer_del(s->l2_warmup_timer);
+        }
+        if (s->bitmap_flush_timer) {
+            timer_del(s->bitmap_flush_timer);
+        }
+        if (s->snapshot_release_timer) {
+            timer_del(s->snapshot_release_timer);
+        }
+    }
+}
+
+static void coroutine_fn qcow2_co_drain_end(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    assert(s->background_paused > 0);
+    if (--s->background_paused == 0) {
+        l2_warmup_timer_schedule(bs);
+        bitmap_flush_timer_schedule(bs);
+        snapshot_release_timer_schedule(bs);
+    }
 }
 
 static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
@@ -969,6 +1283,12 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t decompress_cache_size;
+    uint64_t decompress_readahead;
+    bool l2_warmup;
+    bool l2_hot_track;
+    uint64_t bitmap_flush_interval;
+    bool background_snapshot_delete;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1070,6 +1390,45 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * The decompressed cluster cache is shared with other users of the same
+     * image file, which is only safe as long as nobody can modify it.
+     */
+    r->decompress_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_DECOMPRESS_CACHE_SIZE, 0);
+    r->decompress_readahead =
+        qemu_opt_get_number(opts, QCOW2_OPT_DECOMPRESS_READAHEAD, 0);
+    if (r->decompress_readahead > QCOW2_MAX_DECOMPRESS_READAHEAD) {
+        error_setg(errp, QCOW2_OPT_DECOMPRESS_READAHEAD " may not exceed %d",
+                   QCOW2_MAX_DECOMPRESS_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->decompress_readahead && !r->decompress_cache_size) {
+        error_setg(errp, QCOW2_OPT_DECOMPRESS_READAHEAD " requires "
+                   QCOW2_OPT_DECOMPRESS_CACHE_SIZE " to be set");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (flags & BDRV_O_RDWR) {
+        r->decompress_cache_size = 0;
+        r->decompress_readahead = 0;
+    }
+
+    r->l2_warmup = qemu_opt_get_bool(opts, QCOW2_OPT_L2_WARMUP, false);
+    r->l2_hot_track = qemu_opt_get_bool(opts, QCOW2_OPT_L2_HOT_LIST, false);
+
+    r->bitmap_flush_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_BITMAP_FLUSH_INTERVAL, 0);
+    if (r->bitmap_flush_interval > UINT_MAX) {
+        error_setg(errp, "Bitmap flush interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->background_snapshot_delete =
+        qemu_opt_get_bool(opts, QCOW2_OPT_BACKGROUND_SNAPSHOT_DELETE, false);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1225,6 +1584,56 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    if (s->bitmap_flush_interval != r->bitmap_flush_interval) {
+        bitmap_flush_timer_del(bs);
+        s->bitmap_flush_interval = r->bitmap_flush_interval;
+        bitmap_flush_timer_init(bs, bdrv_get_aio_context(bs));
+    }
+
+    if (s->background_snapshot_delete != r->background_snapshot_delete) {
+        snapshot_release_timer_del(bs);
+        s->background_snapshot_delete = r->background_snapshot_delete;
+        if (!s->background_snapshot_delete) {
+            /* Nothing would release the snapshots that are still queued */
+            qcow2_release_deleted_snapshots(bs, -1);
+        }
+        snapshot_release_timer_init(bs, bdrv_get_aio_context(bs));
+    }
+
+    /*
+     * Look the cache up again even if its size didn't change: the image file
+     * may have been replaced or modified since it was opened, and then the
+     * cached clusters must not be used any more.
+     */
+    qcow2_decompress_cache_put(s->decompress_cache);
+    s->decompress_cache = NULL;
+    s->decompress_cache_size = r->decompress_cache_size;
+    if (s->decompress_cache_size) {
+        s->decompress_cache =
+            qcow2_decompress_cache_get(bs, s->decompress_cache_size);
+    }
+    s->decompress_readahead = r->decompress_readahead;
+
+    /* The L2 cache has been recreated, so warm it up again */
+    l2_warmup_timer_del(bs);
+    s->l2_warmup = r->l2_warmup;
+    s->l2_warmup_done = false;
+    s->l2_warmup_hot_pass = true;
+    s->l2_warmup_index = 0;
+    s->l2_warmup_slices_left = qcow2_cache_get_size(s->l2_table_cache);
+    l2_warmup_timer_init(bs, bdrv_get_aio_context(bs));
+
+    if (r->l2_hot_track && !s->l2_hot_used) {
+        s->l2_hot_used = bitmap_new(s->l1_size);
+        s->l2_hot_used_size = s->l1_size;
+        s->l2_hot_changed = false;
+    } else if (!r->l2_hot_track) {
+        g_free(s->l2_hot_used);
+        s->l2_hot_used = NULL;
+        s->l2_hot_used_size = 0;
+    }
+    s->l2_hot_track = r->l2_hot_track;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1589,6 +1998,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    QSIMPLEQ_INIT(&s->deleted_snapshots);
+
     /* Parse driver-specific options */
     ret = qcow2_update_options(bs, options, flags, errp);
     if (ret < 0) {
@@ -1856,6 +2267,17 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_decompress_cache_put(s->decompress_cache);
+    s->decompress_cache = NULL;
+    s->decompress_cache_size = 0;
+    l2_warmup_timer_del(bs);
+    bitmap_flush_timer_del(bs);
+    snapshot_release_timer_del(bs);
+    qcow2_forget_stored_bitmaps(bs);
+    g_free(s->l2_hot_used);
+    s->l2_hot_used = NULL;
+    g_free(s->l2_hot_hint);
+    s->l2_hot_hint = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -1899,6 +2321,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->bitmap_flush_lock);
 
     if (qemu_in_coroutine()) {
         /* From bdrv_co_create.  */
@@ -1941,6 +2364,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_deleted_snapshots(state->bs, -1);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
@@ -2684,6 +3109,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_deleted_snapshots(bs, -1);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2691,6 +3118,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           "inactivation of node '%s': ",
                           bdrv_get_device_or_node_name(bs));
     }
+    /* Somebody else may modify the image from now on */
+    qcow2_forget_stored_bitmaps(bs);
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -2706,6 +3135,17 @@ static int qcow2_inactivate(BlockDriverState *bs)
                      strerror(-ret));
     }
 
+    if (s->l2_hot_track && s->l2_hot_changed && !bdrv_is_read_only(bs)) {
+        /* Not fatal, the list is only used as a hint */
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            warn_report("Failed to store the list of used L2 tables: %s",
+                        strerror(-ret));
+        } else {
+            s->l2_hot_changed = false;
+        }
+    }
+
     if (result == 0) {
         qcow2_mark_clean(bs);
     }
@@ -2716,6 +3156,11 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    if (!(s->flags & BDRV_O_INACTIVE)) {
+        /* This needs the active L1 table, so do it before freeing it */
+        qcow2_release_deleted_snapshots(bs, -1);
+    }
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2725,8 +3170,19 @@ static void qcow2_close(BlockDriverState *bs)
     }
 
     cache_clean_timer_del(bs);
+    l2_warmup_timer_del(bs);
+    bitmap_flush_timer_del(bs);
+    snapshot_release_timer_del(bs);
+    qcow2_forget_stored_bitmaps(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_decompress_cache_put(s->decompress_cache);
+    s->decompress_cache = NULL;
+    s->decompress_cache_size = 0;
+    g_free(s->l2_hot_used);
+    s->l2_hot_used = NULL;
+    g_free(s->l2_hot_hint);
+    s->l2_hot_hint = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -3034,6 +3490,37 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /*
+     * Hot L2 tables extension. This is only a hint, so it is dropped rather
+     * than failing the update if there is not enough space left in the
+     * header cluster.
+     */
+    if (s->l2_hot_track ? s->l2_hot_used : s->l2_hot_hint) {
+        unsigned long *hot = s->l2_hot_track ? s->l2_hot_used : s->l2_hot_hint;
+        uint64_t nbits = MIN(s->l2_hot_track ? s->l2_hot_used_size
+                                             : s->l2_hot_hint_size,
+                             s->l1_size);
+        size_t len = DIV_ROUND_UP(nbits, BITS_PER_BYTE);
+        size_t needed = sizeof(QCowExtension) + ROUND_UP(len, 8) +
+                        sizeof(QCowExtension) +
+                        (s->image_backing_file ?
+                         strlen(s->image_backing_file) : 0);
+
+        if (nbits && needed <= buflen) {
+            g_autofree unsigned long *le = bitmap_new(nbits);
+
+            bitmap_to_le(le, hot, nbits);
+            ret = header_ext_add(buf, QCOW2_EXT_MAGIC_HOT_L2_TABLES, le, len,
+                                 buflen);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            buf += ret;
+            buflen -= ret;
+        }
+    }
+
     /* End of header extensions */
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_END, NULL, 0, buflen);
     if (ret < 0) {
@@ -4229,6 +4716,8 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
             goto fail;
         }
 
+        qcow2_release_deleted_snapshots(bs, -1);
+
         ret = qcow2_cluster_discard(bs, ROUND_UP(offset, s->cluster_size),
                                     old_length - ROUND_UP(offset,
                                                           s->cluster_size),
@@ -4692,6 +5181,153 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Reads the compressed cluster described by @coffset and @csize and
+ * decompresses it into @out_buf, which must be one cluster in size.
+ */
+static int coroutine_fn
+qcow2_co_read_compressed_cluster(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, void *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    g_free(buf);
+    return ret;
+}
+
+typedef struct Qcow2DecompressReadahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    unsigned nb_clusters;
+} Qcow2DecompressReadahead;
+
+static void coroutine_fn qcow2_co_decompress_readahead_entry(void *opaque)
+{
+    Qcow2DecompressReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = ra->offset;
+    uint64_t end = MIN(ra->offset + (uint64_t)ra->nb_clusters * s->cluster_size,
+                       bs->total_sectors * BDRV_SECTOR_SIZE);
+    void *out_buf = NULL;
+    int ret;
+
+    while (offset < end) {
+        unsigned int bytes = s->cluster_size;
+        QCow2SubclusterType type;
+        uint64_t l2_entry, coffset;
+        int csize;
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            break;
+        }
+
+        offset += s->cluster_size;
+        if (type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            continue;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (qcow2_decompress_cache_contains(s->decompress_cache, coffset)) {
+            continue;
+        }
+
+        if (!out_buf) {
+            out_buf = qemu_try_blockalign(bs, s->cluster_size);
+            if (!out_buf) {
+                break;
+            }
+        }
+
+        ret = qcow2_co_read_compressed_cluster(bs, coffset, csize, out_buf);
+        if (ret < 0) {
+            break;
+        }
+
+        qcow2_decompress_cache_insert(s->decompress_cache, coffset, out_buf);
+        out_buf = NULL;
+    }
+
+    qemu_vfree(out_buf);
+    s->decompress_readahead_busy = false;
+    bdrv_dec_in_flight(bs);
+    g_free(ra);
+}
+
+/*
+ * Starts decompressing clusters into the decompressed cluster cache in the
+ * background after a read of the compressed cluster containing @offset.
+ *
+ * A cache miss (!@hit) starts a window after that cluster.  Cache hits only
+ * start the next window, following the last one, once sequential reads have
+ * reached the second half of the last window; other hits don't read ahead.
+ * Only one readahead per node runs at a time; requests made while it is
+ * busy are dropped.
+ */
+static void qcow2_decompress_readahead(BlockDriverState *bs, uint64_t offset,
+                                       bool hit)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t window = (uint64_t)s->decompress_readahead * s->cluster_size;
+    uint64_t cluster = start_of_cluster(s, offset);
+    Qcow2DecompressReadahead *ra;
+    Coroutine *co;
+    uint64_t start;
+
+    if (!s->decompress_readahead || s->decompress_readahead_busy) {
+        return;
+    }
+
+    if (!hit) {
+        start = cluster + s->cluster_size;
+    } else if (cluster < s->decompress_readahead_end &&
+               s->decompress_readahead_end - cluster <=
+               (uint64_t)DIV_ROUND_UP(s->decompress_readahead, 2) *
+               s->cluster_size) {
+        start = s->decompress_readahead_end;
+    } else {
+        return;
+    }
+    s->decompress_readahead_end = start + window;
+
+    ra = g_new(Qcow2DecompressReadahead, 1);
+    *ra = (Qcow2DecompressReadahead) {
+        .bs = bs,
+        .offset = start,
+        .nb_clusters = s->decompress_readahead,
+    };
+
+    trace_qcow2_decompress_readahead(bs, ra->offset, ra->nb_clusters);
+
+    s->decompress_readahead_busy = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_co_decompress_readahead_entry, ra);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t l2_entry,
@@ -4703,34 +5339,37 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     int ret = 0, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
+    uint8_t *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    if (s->decompress_cache &&
+        qcow2_decompress_cache_read(s->decompress_cache, coffset,
+                                    offset_in_cluster, bytes,
+                                    qiov, qiov_offset))
+    {
+        qcow2_decompress_readahead(bs, offset, true);
+        return 0;
     }
 
     out_buf = qemu_blockalign(bs, s->cluster_size);
 
-    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    ret = qcow2_co_read_compressed_cluster(bs, coffset, csize, out_buf);
     if (ret < 0) {
         goto fail;
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
+    if (s->decompress_cache) {
+        qcow2_decompress_cache_insert(s->decompress_cache, coffset, out_buf);
+        out_buf = NULL;
+        qcow2_decompress_readahead(bs, offset, false);
+    }
+
 fail:
     qemu_vfree(out_buf);
-    g_free(buf);
 
     return ret;
 }
@@ -4895,6 +5534,9 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    /* make_completely_empty() would leave the queued snapshots dangling */
+    qcow2_release_deleted_snapshots(bs, -1);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5518,6 +6160,9 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     Qcow2AmendHelperCBInfo helper_cb_info;
     bool encryption_update = false;
 
+    /* Some of the changes rewrite all metadata */
+    qcow2_release_deleted_snapshots(bs, -1);
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -5963,6 +6608,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_probe         = qcow2_probe,
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
+    .bdrv_co_drain_begin  = qcow2_co_drain_begin,
+    .bdrv_co_drain_end    = qcow2_co_drain_end,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_reopen_commit   = qcow2_reopen_commit,
     .bdrv_reopen_commit_post = qcow2_reopen_commit_post,
@@ -149,6 +149,12 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DECOMPRESS_CACHE_SIZE "decompress-cache-size"
+#define QCOW2_OPT_DECOMPRESS_READAHEAD "decompress-readahead"
+#define QCOW2_OPT_L2_WARMUP "l2-warmup"
+#define QCOW2_OPT_L2_HOT_LIST "l2-hot-list"
+#define QCOW2_OPT_BITMAP_FLUSH_INTERVAL "bitmap-flush-interval"
+#define QCOW2_OPT_BACKGROUND_SNAPSHOT_DELETE "background-snapshot-delete"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -227,9 +233,20 @@ typedef struct QCowSnapshot {
     void *unknown_extra_data;
 } QCowSnapshot;
 
+/* A deleted snapshot whose clusters are still being released */
+typedef struct Qcow2DeletedSnapshot {
+    uint64_t l1_table_offset;
+    int l1_size;
+    uint64_t *l1_table;         /* In host byte order */
+    int l1_index;               /* First entry that is not released yet */
+    QSIMPLEQ_ENTRY(Qcow2DeletedSnapshot) next;
+} Qcow2DeletedSnapshot;
+
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -323,6 +340,18 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+#define QCOW2_MAX_DECOMPRESS_READAHEAD 64
+
+/* Maximum size of a single read of the background L2 cache warm-up */
+#define QCOW2_L2_WARMUP_BATCH (1 * MiB)
+/* Interval between two batches of the background L2 cache warm-up */
+#define QCOW2_L2_WARMUP_INTERVAL_MS 10
+
+/* Number of L1 entries of a deleted snapshot released in one batch */
+#define QCOW2_SNAPSHOT_RELEASE_BATCH 64
+/* Interval between two batches of releasing deleted snapshots */
+#define QCOW2_SNAPSHOT_RELEASE_INTERVAL_MS 10
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -347,6 +376,35 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Decompressed clusters, only used for read-only images */
+    Qcow2DecompressCache *decompress_cache;
+    uint64_t decompress_cache_size;
+    /* Number of compressed clusters to decompress ahead of a read */
+    unsigned decompress_readahead;
+    bool decompress_readahead_busy;
+    uint64_t decompress_readahead_end; /* End of the last readahead window */
+
+    /* Background warm-up of the L2 cache after open */
+    QEMUTimer *l2_warmup_timer;
+    bool l2_warmup;
+    bool l2_warmup_done;
+    bool l2_warmup_hot_pass; /* Loading the tables from l2_hot_hint first */
+    int background_paused; /* No background work while drained */
+    uint64_t l2_warmup_index;
+    int l2_warmup_slices_left;
+
+    /*
+     * Bitmaps of L1 indices: the L2 tables used since the image was opened
+     * (if l2_hot_track is set), and the ones that were used the last time
+     * as stored in the image
+     */
+    bool l2_hot_track;
+    bool l2_hot_changed;
+    unsigned long *l2_hot_used;
+    uint64_t l2_hot_used_size;
+    unsigned long *l2_hot_hint;
+    uint64_t l2_hot_hint_size;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -369,9 +427,23 @@ typedef struct BDRVQcow2State {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    /* Release of the clusters of deleted snapshots in the background */
+    bool background_snapshot_delete;
+    QEMUTimer *snapshot_release_timer;
+    QSIMPLEQ_HEAD(, Qcow2DeletedSnapshot) deleted_snapshots;
+    /* Next entry of the active L1 table whose copied flags need an update */
+    bool copied_flags_pending;
+    int copied_flags_index;
+
     uint32_t nb_bitmaps;
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
+    /* Image copies of persistent bitmaps, see qcow2-bitmap.c */
+    GHashTable *stored_bitmaps;
+    /* Background write of changed persistent bitmap clusters */
+    QEMUTimer *bitmap_flush_timer;
+    unsigned bitmap_flush_interval;
+    CoMutex bitmap_flush_lock; /* Taken before s->lock */
 
     int flags;
     int qcow_version;
@@ -873,6 +945,10 @@ void qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
 
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
+int qcow2_release_snapshot_l1_range(BlockDriverState *bs, uint64_t *l1_table,
+                                    int start, int end);
+int qcow2_update_copied_flags_l1_range(BlockDriverState *bs, int start,
+                                       int end);
 
 int coroutine_fn qcow2_flush_caches(BlockDriverState *bs);
 int coroutine_fn qcow2_write_caches(BlockDriverState *bs);
@@ -902,6 +978,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t max_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
+int coroutine_fn qcow2_co_warm_l2_cache(BlockDriverState *bs,
+                                        const unsigned long *filter,
+                                        uint64_t filter_size,
+                                        uint64_t *l1_index, int *slices_left);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
@@ -944,6 +1024,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
                             Error **errp);
 
 void qcow2_free_snapshots(BlockDriverState *bs);
+void qcow2_release_deleted_snapshots(BlockDriverState *bs, int max_entries);
 int qcow2_read_snapshots(BlockDriverState *bs, Error **errp);
 int qcow2_write_snapshots(BlockDriverState *bs);
 
@@ -966,6 +1047,8 @@ int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
 
+int qcow2_cache_get_size(Qcow2Cache *c);
+int qcow2_cache_get_free_entries(Qcow2Cache *c);
 void qcow2_cache_clean_unused(Qcow2Cache *c);
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
 
@@ -977,6 +1060,18 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-decompress-cache.c functions */
+Qcow2DecompressCache *qcow2_decompress_cache_get(BlockDriverState *bs,
+                                                 uint64_t size);
+void qcow2_decompress_cache_put(Qcow2DecompressCache *c);
+bool qcow2_decompress_cache_read(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset);
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset);
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c, uint64_t coffset,
+                                   void *data);
+
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                   void **refcount_table,
@@ -989,6 +1084,9 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp);
 int qcow2_truncate_bitmaps_check(BlockDriverState *bs, Error **errp);
 bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
                                           bool release_stored, Error **errp);
+int coroutine_fn qcow2_co_flush_persistent_dirty_bitmaps(BlockDriverState *bs,
+                                                         Error **errp);
+void qcow2_forget_stored_bitmaps(BlockDriverState *bs);
 int qcow2_reopen_bitmaps_ro(BlockDriverState *bs, Error **errp);
 bool qcow2_co_can_store_new_dirty_bitmap(BlockDriverState *bs,
                                          const char *name,
@@ -0,0 +1,651 @@
+/*
+ * Shared read cache filter driver
+ *
+ * The driver is meant to be inserted above the protocol node of a read-only
+ * image (typically a backing file shared by many VMs) and keeps the data read
+ * from it in a shared memory object. All QEMU processes on a host that open
+ * the same image through this filter with the same cache object serve each
+ * other's reads from memory, which turns boot storms from hundreds of VMs on
+ * a common base image into memory copies even with cache.direct=on.
+ *
+ * The cache object is a file mapped with MAP_SHARED; usually a file on tmpfs
+ * or a memfd passed in through an fdset. It is organized as a direct-mapped
+ * array of slots of one cache cluster each. Slots are protected by a
+ * sequence counter, so lookups never take a lock; writers claim a slot by
+ * making its sequence counter odd with a cmpxchg and skip slots that are
+ * claimed by somebody else.
+ *
+ * Images are identified by the device and inode number, size, modification
+ * and status change time of the file that the filter reads from, plus an
+ * optional generation number. The whole key is kept in every slot and
+ * compared on every hit, so hash collisions only cause misses and an image
+ * that is replaced or modified is never served from old entries. Any process
+ * that can write the cache object can change what other processes read, so
+ * the object must belong to the user that QEMU runs as and must not be
+ * writable for anybody else.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/seqlock.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC      0x51534843 /* "QSHC" */
+#define SHARED_CACHE_VERSION    2
+
+#define SHARED_CACHE_STATE_NEW          0
+#define SHARED_CACHE_STATE_INITIALIZING 1
+#define SHARED_CACHE_STATE_READY        2
+
+/* Upper limit for the size of a single read that populates the cache */
+#define SHARED_CACHE_MAX_FILL   (1 * MiB)
+
+/* Layout of the shared memory object; it is never shared between hosts */
+typedef struct SharedCacheHeader {
+    uint32_t state;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+} SharedCacheHeader;
+
+/* Identifies an image file; has no padding so that it can be memcmp()ed */
+typedef struct SharedCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t generation;
+} SharedCacheKey;
+
+typedef struct SharedCacheSlot {
+    QemuSeqLock lock;   /* odd while the slot is being written */
+    uint32_t len;       /* number of valid bytes, 0 if the slot is empty */
+    SharedCacheKey key;
+    uint64_t offset;
+} SharedCacheSlot;
+
+typedef struct BDRVSharedCacheState {
+    int fd;
+    void *map;
+    size_t map_size;
+
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_slots;
+    uint32_t cluster_size;
+
+    /* Identifies the image in the shared cache */
+    SharedCacheKey key;
+    uint64_t image_tag;     /* hash of key */
+    int64_t image_size;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH "path"
+#define SHARED_CACHE_OPT_SIZE "size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+#define SHARED_CACHE_OPT_GENERATION "generation"
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "path of the shared memory object holding the cache",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache if it needs to be created, "
+                "default 1G",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the cache, default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_GENERATION,
+            .type = QEMU_OPT_NUMBER,
+            .help = "part of the image identity, change it to stop using "
+                "data cached for earlier contents of the image",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*
+ * Sets up the header of a newly created cache object, or waits for another
+ * process to do so, and checks that an existing cache matches our
+ * configuration.
+ */
+static int shared_cache_init_header(BDRVSharedCacheState *s,
+                                    uint32_t cluster_size, Error **errp)
+{
+    SharedCacheHeader *hdr = s->map;
+    uint64_t nb_slots, data_offset;
+    int i;
+
+    if (qatomic_cmpxchg(&hdr->state, SHARED_CACHE_STATE_NEW,
+                        SHARED_CACHE_STATE_INITIALIZING) ==
+        SHARED_CACHE_STATE_NEW)
+    {
+        nb_slots = s->map_size <= qemu_real_host_page_size ? 0 :
+                   (s->map_size - qemu_real_host_page_size) /
+                   (cluster_size + sizeof(SharedCacheSlot));
+        data_offset = ROUND_UP(sizeof(*hdr) +
+                               nb_slots * sizeof(SharedCacheSlot),
+                               qemu_real_host_page_size);
+        while (nb_slots &&
+               data_offset + nb_slots * cluster_size > s->map_size) {
+            nb_slots--;
+        }
+        if (!nb_slots) {
+            qatomic_set(&hdr->state, SHARED_CACHE_STATE_NEW);
+            error_setg(errp, "Shared cache is too small for cluster size %"
+                       PRIu32, cluster_size);
+            return -EINVAL;
+        }
+
+        hdr->magic = SHARED_CACHE_MAGIC;
+        hdr->version = SHARED_CACHE_VERSION;
+        hdr->cluster_size = cluster_size;
+        hdr->nb_slots = nb_slots;
+        hdr->data_offset = data_offset;
+        qatomic_store_release(&hdr->state, SHARED_CACHE_STATE_READY);
+    }
+
+    /* Wait for up to a second if somebody else is creating the cache */
+    for (i = 0; i < 1000; i++) {
+        if (qatomic_load_acquire(&hdr->state) == SHARED_CACHE_STATE_READY) {
+            break;
+        }
+        g_usleep(1000);
+    }
+    if (i == 1000) {
+        error_setg(errp, "Timed out waiting for shared cache initialization");
+        return -ETIMEDOUT;
+    }
+
+    if (hdr->magic != SHARED_CACHE_MAGIC ||
+        hdr->version != SHARED_CACHE_VERSION)
+    {
+        error_setg(errp, "Shared cache object has an invalid header");
+        return -EINVAL;
+    }
+    if (hdr->cluster_size != cluster_size) {
+        error_setg(errp, "Shared cache was created with cluster size %" PRIu32
+                   ", but %" PRIu32 " was requested", hdr->cluster_size,
+                   cluster_size);
+        return -EINVAL;
+    }
+    if (hdr->data_offset + hdr->nb_slots * hdr->cluster_size > s->map_size ||
+        sizeof(*hdr) + hdr->nb_slots * sizeof(SharedCacheSlot) >
+        hdr->data_offset)
+    {
+        error_setg(errp, "Shared cache object has an invalid layout");
+        return -EINVAL;
+    }
+
+    s->cluster_size = cluster_size;
+    s->nb_slots = hdr->nb_slots;
+    s->slots = (SharedCacheSlot *)(hdr + 1);
+    s->data = (uint8_t *)s->map + hdr->data_offset;
+
+    return 0;
+}
+
+static int shared_cache_map(BDRVSharedCacheState *s, const char *path,
+                            uint64_t size, uint32_t cluster_size,
+                            Error **errp)
+{
+    struct stat st;
+    int ret;
+
+    s->fd = qemu_create(path, O_RDWR, 0600, errp);
+    if (s->fd < 0) {
+        return -errno;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat shared cache object");
+        return ret;
+    }
+
+    /* Whoever can write the object decides what the guest reads */
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        error_setg(errp, "Shared cache object must be owned by the current "
+                   "user and must not be writable for group or others");
+        return -EPERM;
+    }
+
+    if (st.st_size == 0) {
+        if (ftruncate(s->fd, size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno,
+                             "Could not resize shared cache object");
+            return ret;
+        }
+        st.st_size = size;
+    }
+
+    s->map_size = st.st_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        ret = -errno;
+        s->map = NULL;
+        error_setg_errno(errp, errno, "Could not map shared cache object");
+        return ret;
+    }
+
+    return shared_cache_init_header(s, cluster_size, errp);
+}
+
+static void shared_cache_unmap(BDRVSharedCacheState *s)
+{
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+}
+
+/*
+ * Computes the key that identifies the image file in the cache from its
+ * current state. Returns -ENOTSUP if the file cannot be identified.
+ */
+static int shared_cache_get_key(BlockDriverState *bs, uint64_t generation,
+                                SharedCacheKey *key)
+{
+    BlockDriverState *file_bs = bs->file->bs;
+    struct stat st;
+    int ret;
+
+    if (!file_bs->drv || !file_bs->drv->bdrv_fstat) {
+        return -ENOTSUP;
+    }
+    ret = file_bs->drv->bdrv_fstat(file_bs, &st);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return -ENOTSUP;
+    }
+
+    *key = (SharedCacheKey) {
+        .dev        = st.st_dev,
+        .ino        = st.st_ino,
+        .size       = st.st_size,
+        .mtime      = st.st_mtime,
+        .ctime      = st.st_ctime,
+        .generation = generation,
+    };
+    return 0;
+}
+
+static void shared_cache_set_key(BDRVSharedCacheState *s,
+                                 const SharedCacheKey *key)
+{
+    s->key = *key;
+    s->image_tag = key->dev ^ (key->ino << 16) ^ (key->size << 32) ^
+                   key->mtime ^ (key->ctime << 24) ^ key->generation;
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path;
+    uint64_t size, cluster_size;
+    uint64_t generation;
+    SharedCacheKey key;
+    int ret;
+
+    s->fd = -1;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter can only be used on "
+                   "read-only nodes");
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE, 1 * GiB);
+    cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                     64 * KiB);
+    generation = qemu_opt_get_number(opts, SHARED_CACHE_OPT_GENERATION, 0);
+
+    if (!path) {
+        error_setg(errp, "Parameter '" SHARED_CACHE_OPT_PATH "' is required");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (!is_power_of_2(cluster_size) || cluster_size < BDRV_SECTOR_SIZE ||
+        cluster_size > 2 * MiB ||
+        cluster_size < bs->file->bs->bl.request_alignment)
+    {
+        error_setg(errp, "Cluster size must be a power of two between the "
+                   "request alignment of the image file and 2M");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = shared_cache_get_key(bs, generation, &key);
+    if (ret == -ENOTSUP) {
+        error_setg(errp, "The shared-cache filter needs a regular file "
+                   "opened with the 'file' driver below it");
+        ret = -EINVAL;
+        goto out;
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not stat image file");
+        goto out;
+    }
+    shared_cache_set_key(s, &key);
+
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        ret = s->image_size;
+        error_setg_errno(errp, -ret, "Could not get image size");
+        goto out;
+    }
+
+    ret = shared_cache_map(s, path, size, cluster_size, errp);
+    if (ret < 0) {
+        shared_cache_unmap(s);
+        goto out;
+    }
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    shared_cache_unmap(bs->opaque);
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter can only be used on "
+                   "read-only nodes");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn
+shared_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    SharedCacheKey key;
+    int ret;
+
+    ret = shared_cache_get_key(bs, s->key.generation, &key);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not stat image file");
+        return;
+    }
+    shared_cache_set_key(s, &key);
+
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        error_setg_errno(errp, -s->image_size, "Could not get image size");
+    }
+}
+
+static SharedCacheSlot *shared_cache_slot(BDRVSharedCacheState *s,
+                                          uint64_t offset, uint8_t **data)
+{
+    uint64_t h = s->image_tag ^ (offset / s->cluster_size);
+    uint64_t index;
+
+    /* 64-bit finalizer of MurmurHash3 to spread neighbouring clusters */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    index = h % s->nb_slots;
+    *data = s->data + index * s->cluster_size;
+    return &s->slots[index];
+}
+
+/*
+ * Copies @bytes bytes starting at @offset_in_cluster from the cached cluster
+ * at @offset into @qiov. Returns false if the cluster is not cached; @qiov
+ * may have been modified anyway in this case.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t offset,
+                                uint32_t offset_in_cluster, uint32_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    unsigned seq;
+
+    slot = shared_cache_slot(s, offset, &data);
+    seq = seqlock_read_begin(&slot->lock);
+    if (seq != qatomic_read(&slot->lock.sequence) ||
+        memcmp(&slot->key, &s->key, sizeof(s->key)) ||
+        slot->offset != offset || slot->len < offset_in_cluster + bytes)
+    {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, data + offset_in_cluster, bytes);
+
+    return !seqlock_read_retry(&slot->lock, seq);
+}
+
+static void shared_cache_store(BDRVSharedCacheState *s, uint64_t offset,
+                               const uint8_t *buf, uint32_t len)
+{
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    unsigned seq;
+
+    slot = shared_cache_slot(s, offset, &data);
+    seq = qatomic_read(&slot->lock.sequence);
+    if ((seq & 1) ||
+        qatomic_cmpxchg(&slot->lock.sequence, seq, seq + 1) != seq)
+    {
+        /* Somebody else is writing this slot right now */
+        return;
+    }
+
+    slot->key = s->key;
+    slot->offset = offset;
+    slot->len = len;
+    memcpy(data, buf, len);
+
+    seqlock_write_end(&slot->lock);
+}
+
+/*
+ * Reads the clusters covering [@offset, @offset + @bytes) from the image,
+ * as far as SHARED_CACHE_MAX_FILL allows, stores them in the cache and
+ * copies the requested part into @qiov. Returns the number of bytes copied
+ * into @qiov or a negative errno value.
+ */
+static int64_t coroutine_fn
+shared_cache_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                  QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    int64_t end = MIN(QEMU_ALIGN_UP(offset + bytes, s->cluster_size),
+                      start + SHARED_CACHE_MAX_FILL);
+    SharedCacheKey key;
+    int64_t pos;
+    uint8_t *buf;
+    int ret;
+
+    end = MIN(end, QEMU_ALIGN_UP(s->image_size,
+                                 bs->file->bs->bl.request_alignment));
+    bytes = MIN(bytes, end - offset);
+
+    buf = qemu_try_blockalign(bs->file->bs, end - start);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /*
+     * If the file changed since the last fill, stop using the entries of its
+     * old contents. The data we just read may be from either version, so it
+     * is not stored.
+     */
+    ret = shared_cache_get_key(bs, s->key.generation, &key);
+    if (ret < 0) {
+        goto out;
+    }
+    if (memcmp(&key, &s->key, sizeof(key))) {
+        shared_cache_set_key(s, &key);
+    } else {
+        for (pos = start; pos < end; pos += s->cluster_size) {
+            uint32_t len = MIN(s->cluster_size, s->image_size - pos);
+
+            shared_cache_store(s, pos, buf + (pos - start), len);
+        }
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), bytes);
+    ret = bytes;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static coroutine_fn int shared_cache_co_preadv_part(
+        BlockDriverState *bs, int64_t offset, int64_t bytes,
+        QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    int64_t end = offset + bytes;
+    int64_t ret;
+
+    if (end > s->image_size) {
+        /* The generic block layer handles reads past EOF, don't cache them */
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    while (offset < end) {
+        int64_t cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+        uint32_t offset_in_cluster = offset - cluster;
+        uint32_t cur_bytes = MIN(end - offset,
+                                 s->cluster_size - offset_in_cluster);
+
+        if (shared_cache_lookup(s, cluster, offset_in_cluster, cur_bytes,
+                                qiov, qiov_offset))
+        {
+            trace_shared_cache_hit(bs, cluster);
+            ret = cur_bytes;
+        } else {
+            trace_shared_cache_miss(bs, cluster);
+            ret = shared_cache_fill(bs, offset, end - offset,
+                                    qiov, qiov_offset);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += ret;
+        qiov_offset += ret;
+    }
+
+    return 0;
+}
+
+static int64_t shared_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* The cached data must not change under our feet */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+BlockDriver bdrv_shared_cache_filter = {
+    .format_name = "shared-cache",
+    .instance_size = sizeof(BDRVSharedCacheState),
+
+    .bdrv_getlength = shared_cache_getlength,
+    .bdrv_open = shared_cache_open,
+    .bdrv_close = shared_cache_close,
+
+    .bdrv_reopen_prepare = shared_cache_reopen_prepare,
+    .bdrv_co_invalidate_cache = shared_cache_co_invalidate_cache,
+
+    .bdrv_co_preadv_part = shared_cache_co_preadv_part,
+
+    .bdrv_child_perm = shared_cache_child_perm,
+
+    .is_filter = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache_filter);
+}
+
+block_init(bdrv_shared_cache_init);
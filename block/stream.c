@@ -15,6 +15,7 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
+#include "block/aio_task.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qdict.h"
@@ -31,6 +32,8 @@ enum {
     STREAM_CHUNK = 512 * 1024, /* in bytes */
 };
 
+typedef struct StreamTask StreamTask;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     BlockBackend *blk;
@@ -41,8 +44,19 @@ typedef struct StreamBlockJob {
     BlockdevOnError on_error;
     char *backing_file_str;
     bool bs_read_only;
+    int max_workers;
+    int error;                      /* First error that was not retried */
+    QSIMPLEQ_HEAD(, StreamTask) retry_list;
 } StreamBlockJob;
 
+struct StreamTask {
+    AioTask task;
+    StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+    QSIMPLEQ_ENTRY(StreamTask) next;
+};
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t offset, uint64_t bytes)
 {
@@ -51,6 +65,77 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, bytes, NULL, BDRV_REQ_PREFETCH);
 }
 
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    int ret;
+
+    /*
+     * s->blk has no write permission, so ranges that read as zeroes are
+     * populated like any other range.  Copy-on-read writes them as zeroes.
+     */
+    ret = stream_populate(s->blk, t->offset, t->bytes);
+    if (ret < 0) {
+        BlockErrorAction action =
+            block_job_error_action(&s->common, s->on_error, true, -ret);
+        if (action == BLOCK_ERROR_ACTION_STOP) {
+            /* The task is freed on return, stream_run() resubmits a copy */
+            StreamTask *retry = g_new(StreamTask, 1);
+
+            *retry = *t;
+            QSIMPLEQ_INSERT_TAIL(&s->retry_list, retry, next);
+            return 0;
+        }
+        if (s->error == 0) {
+            s->error = ret;
+        }
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            return ret;
+        }
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+/*
+ * Find out how much of [@offset, @offset + @bytes) has the same status, and
+ * return it in *@pnum.  *@copy is set if the range has to be copied because
+ * it is allocated between the top image and the base.
+ */
+static int coroutine_fn stream_block_status(StreamBlockJob *s, int64_t offset,
+                                            int64_t bytes, int64_t *pnum,
+                                            bool *copy)
+{
+    BlockDriverState *unfiltered_bs = bdrv_skip_filters(s->target_bs);
+    BlockDriverState *cow_bs = bdrv_cow_bs(unfiltered_bs);
+    int ret;
+
+    *copy = false;
+
+    ret = bdrv_is_allocated(unfiltered_bs, offset, bytes, pnum);
+    if (ret != 0) {
+        /* Allocated in the top, no need to copy.  */
+        return ret;
+    }
+
+    /* Copy if allocated in the intermediate images.  Limit to the
+     * known-unallocated area [offset, offset + *pnum).  */
+    ret = bdrv_is_allocated_above(cow_bs, s->base_overlay, true,
+                                  offset, *pnum, pnum);
+    /* Finish early if end of backing file has been reached */
+    if (ret == 0 && *pnum == 0) {
+        *pnum = bytes;
+    }
+    if (ret <= 0) {
+        return ret;
+    }
+    *copy = true;
+    return 1;
+}
+
 static int stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -111,11 +196,14 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
     BlockDriverState *unfiltered_bs = bdrv_skip_filters(s->target_bs);
+    AioTaskPool *pool;
+    StreamTask *t;
     int64_t len;
     int64_t offset = 0;
     uint64_t delay_ns = 0;
-    int error = 0;
-    int64_t n = 0; /* bytes */
+    int64_t n = 0; /* bytes from offset with the same status */
+    bool copy = false;
+    int ret;
 
     if (unfiltered_bs == s->base_overlay) {
         /* Nothing to stream */
@@ -128,66 +216,91 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
     job_progress_set_remaining(&s->common.job, len);
 
-    for ( ; offset < len; offset += n) {
-        bool copy;
-        int ret;
+    pool = aio_task_pool_new(s->max_workers);
+    while (aio_task_pool_status(pool) == 0) {
+        /*
+         * Wait for a free worker before the pause point, so that no new
+         * request is started after a failed one has stopped the job.
+         */
+        aio_task_pool_wait_slot(pool);
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Requests that are still
+         * in flight are completed by the drain.
          */
         job_sleep_ns(&s->common.job, delay_ns);
         if (job_is_cancelled(&s->common.job)) {
             break;
         }
-
-        copy = false;
-
-        ret = bdrv_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).  */
-            ret = bdrv_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
-                                          s->base_overlay, true,
-                                          offset, n, &n);
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = len - offset;
+        delay_ns = 0;
+
+        t = QSIMPLEQ_FIRST(&s->retry_list);
+        if (t) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry_list, next);
+        } else if (offset < len) {
+            if (n == 0) {
+                /* Query as much as possible at once, copy in chunks */
+                ret = stream_block_status(s, offset, len - offset, &n, &copy);
+                trace_stream_one_iteration(s, offset, n, ret);
+                if (ret < 0) {
+                    BlockErrorAction action =
+                        block_job_error_action(&s->common, s->on_error, true,
+                                               -ret);
+                    if (action == BLOCK_ERROR_ACTION_STOP) {
+                        n = 0;
+                        continue;
+                    }
+                    if (s->error == 0) {
+                        s->error = ret;
+                    }
+                    if (action == BLOCK_ERROR_ACTION_REPORT) {
+                        break;
+                    }
+                    n = MIN(STREAM_CHUNK, len - offset);
+                    copy = false;
+                }
             }
 
-            copy = (ret > 0);
-        }
-        trace_stream_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = stream_populate(s->blk, offset, n);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
+            if (!copy) {
+                /* Publish progress */
+                job_progress_update(&s->common.job, n);
+                offset += n;
                 n = 0;
                 continue;
             }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
-            }
-        }
 
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
-        if (copy) {
-            delay_ns = block_job_ratelimit_get_delay(&s->common, n);
+            t = g_new(StreamTask, 1);
+            *t = (StreamTask) {
+                .task.func = stream_task_entry,
+                .s = s,
+                .offset = offset,
+                .bytes = MIN(n, STREAM_CHUNK),
+            };
+            offset += t->bytes;
+            n -= t->bytes;
+        } else if (!aio_task_pool_empty(pool)) {
+            /* Requests in flight may still fail and have to be retried */
+            aio_task_pool_wait_one(pool);
+            continue;
         } else {
-            delay_ns = 0;
+            break;
         }
+
+        delay_ns = block_job_ratelimit_get_delay(&s->common, t->bytes);
+        aio_task_pool_start_task(pool, &t->task);
+    }
+
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+
+    /* Drop the requests that were to be retried if the job was cancelled */
+    while ((t = QSIMPLEQ_FIRST(&s->retry_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry_list, next);
+        g_free(t);
     }
 
     /* Do not remove the backing file if an error was there but ignored. */
-    return error;
+    return s->error;
 }
 
 static const BlockJobDriver stream_job_driver = {
@@ -206,7 +319,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
                   BlockDriverState *bottom,
                   int creation_flags, int64_t speed,
-                  BlockdevOnError on_error,
+                  BlockdevOnError on_error, int max_workers,
                   const char *filter_node_name,
                   Error **errp)
 {
@@ -223,6 +336,11 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     assert(!(base && bottom));
     assert(!(backing_file_str && bottom));
 
+    if (max_workers < 1) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
     if (bottom) {
         /*
          * New simple interface. The code is written in terms of old interface
@@ -351,6 +469,8 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->bs_read_only = bs_read_only;
 
     s->on_error = on_error;
+    s->max_workers = max_workers;
+    QSIMPLEQ_INIT(&s->retry_list);
     trace_stream_start(bs, base, s);
     job_start(&s->common.job);
     return;
@@ -34,6 +34,10 @@
 #include "qapi/qapi-visit-block-core.h"
 #include "qom/object.h"
 #include "qom/object_interfaces.h"
+#include "trace.h"
+
+/* Lifetime of a ThrottleGroupBudget */
+#define THROTTLE_GROUP_BUDGET_NS (10 * SCALE_MS)
 
 static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
@@ -62,6 +66,14 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * To keep tg->lock out of the fast path, a member that takes the lock
+ * while the group is not throttling receives a ThrottleGroupBudget: a
+ * share of the I/O that the group could do right away, which is accounted
+ * in advance.  Until it runs out or expires, requests that fit in the
+ * budget only update the member's own fields.  The size of the shares is
+ * recomputed, and unused budget given back, whenever a member comes back
+ * for a new one, so they follow the group's load and membership.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,11 +82,14 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
+    unsigned nr_members;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
+    /* Incremented when budgets become void; also read atomically */
+    unsigned generation;
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
@@ -349,6 +364,95 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+/* Try to account an I/O request in the budget of a ThrottleGroupMember.
+ * This does not take tg->lock.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the request fit in the budget
+ */
+static bool throttle_group_use_budget(ThrottleGroupMember *tgm, int64_t bytes,
+                                      bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupBudget *budget = &tgm->budget[is_write];
+    double units = throttle_op_units(budget->op_size, bytes);
+
+    /* Requests must not overtake the throttled ones of the same member */
+    if (qatomic_read(&tgm->pending_reqs[is_write]) ||
+        budget->generation != qatomic_read(&tg->generation) ||
+        bytes > budget->bytes || units > budget->units ||
+        qemu_clock_get_ns(tg->clock_type) >= budget->expire_ns) {
+        return false;
+    }
+
+    budget->bytes -= bytes;
+    budget->units -= units;
+    return true;
+}
+
+/* Give back the unused part of the budget of a ThrottleGroupMember.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_return_budget(ThrottleGroupMember *tgm,
+                                         bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupBudget *budget = &tgm->budget[is_write];
+
+    /* A budget from before the last throttle_config() is not accounted */
+    if (budget->generation == tg->generation) {
+        throttle_account_budget(&tg->ts, is_write,
+                                -budget->bytes, -budget->units);
+    }
+    budget->bytes = 0;
+    budget->units = 0;
+}
+
+/* Give a ThrottleGroupMember a share of the I/O that the group can do
+ * without throttling, unless requests are being throttled.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_refill_budget(ThrottleGroupMember *tgm,
+                                         bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupBudget *budget = &tgm->budget[is_write];
+    double bytes, units;
+    int64_t now;
+
+    if (tg->any_timer_armed[is_write] || tgm->pending_reqs[is_write] ||
+        qatomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    /* Leave half of the headroom to members that have no budget yet */
+    now = qemu_clock_get_ns(tg->clock_type);
+    throttle_get_headroom(&tg->ts, is_write, now, &bytes, &units);
+    bytes /= 2 * tg->nr_members;
+    units /= 2 * tg->nr_members;
+    if (bytes < 1 || units < 1) {
+        return;
+    }
+
+    throttle_account_budget(&tg->ts, is_write, bytes, units);
+    budget->bytes = bytes;
+    budget->units = units;
+    budget->op_size = tg->ts.cfg.op_size;
+    budget->expire_ns = now + THROTTLE_GROUP_BUDGET_NS;
+    budget->generation = tg->generation;
+    trace_throttle_group_refill_budget(tgm, is_write, bytes, units);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -367,14 +471,24 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    if (throttle_group_use_budget(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* The budget is recomputed below, give back what is left of it */
+    throttle_group_return_budget(tgm, is_write);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
+        int64_t start_ns = qemu_clock_get_ns(tg->clock_type);
+        int64_t wait_ns;
+
         tgm->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
@@ -383,6 +497,11 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+
+        wait_ns = qemu_clock_get_ns(tg->clock_type) - start_ns;
+        tgm->wait_ns[is_write] += wait_ns;
+        trace_throttle_group_wait(tgm, is_write, bytes, wait_ns,
+                                  tgm->wait_ns[is_write]);
     }
 
     /* The I/O will be executed, so do the accounting */
@@ -391,6 +510,8 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    throttle_group_refill_budget(tgm, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -475,6 +596,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    qatomic_inc(&tg->generation);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -548,6 +670,8 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
+    memset(tgm->budget, 0, sizeof(tgm->budget));
+    memset(tgm->wait_ns, 0, sizeof(tgm->wait_ns));
 
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
@@ -558,6 +682,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -600,6 +725,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[i] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[i]));
             assert(!timer_pending(tgm->throttle_timers.timers[i]));
+            throttle_group_return_budget(tgm, i);
             if (tg->tokens[i] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -612,6 +738,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nr_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -900,6 +1027,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    qatomic_inc(&tg->generation);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
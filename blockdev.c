@@ -2445,6 +2445,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
                       bool has_filter_node_name, const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockDriverState *bs, *iter, *iter_end;
@@ -2460,6 +2461,11 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
         return;
     }
 
+    if (has_max_workers && (max_workers < 1 || max_workers > INT_MAX)) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
     if (has_base && has_bottom) {
         error_setg(errp, "'base' and 'bottom' cannot be specified "
                    "at the same time");
@@ -2558,7 +2564,8 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
 
     stream_start(has_job_id ? job_id : NULL, bs, base_bs, backing_file,
                  bottom_bs, job_flags, has_speed ? speed : 0, on_error,
-                 filter_node_name, &local_err);
+                 has_max_workers ? max_workers : 1, filter_node_name,
+                 &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto out;
@@ -2581,6 +2588,7 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                       bool has_filter_node_name, const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -2600,6 +2608,9 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
     if (!has_filter_node_name) {
         filter_node_name = NULL;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
     if (has_auto_finalize && !auto_finalize) {
         job_flags |= JOB_MANUAL_FINALIZE;
     }
@@ -2625,6 +2636,11 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
         return;
     }
 
+    if (max_workers < 1 || max_workers > INT_MAX) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
@@ -2747,7 +2763,8 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
             goto out;
         }
         commit_start(has_job_id ? job_id : NULL, bs, base_bs, top_bs, job_flags,
-                     speed, on_error, has_backing_file ? backing_file : NULL,
+                     speed, on_error, max_workers,
+                     has_backing_file ? backing_file : NULL,
                      filter_node_name, &local_err);
     }
     if (local_err != NULL) {
@@ -2803,6 +2820,9 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_max_chunk) {
             perf.max_chunk = backup->x_perf->max_chunk;
         }
+        if (backup->x_perf->has_staging_size) {
+            perf.staging_size = backup->x_perf->staging_size;
+        }
     }
 
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
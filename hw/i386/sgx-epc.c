@@ -18,6 +18,8 @@
 #include "qapi/visitor.h"
 #include "target/i386/cpu.h"
 #include "exec/address-spaces.h"
+#include "sysemu/kvm.h"
+#include "sysemu/tcg.h"
 
 static Property sgx_epc_properties[] = {
     DEFINE_PROP_UINT64(SGX_EPC_ADDR_PROP, SGXEPCDevice, addr, 0),
@@ -68,6 +70,20 @@ static void sgx_epc_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "'" SGX_EPC_MEMDEV_PROP "' property is not set");
         return;
     }
+    if (epc->hostmem->emulated && !tcg_enabled()) {
+        error_setg(errp, "emulated EPC is only supported with TCG");
+        return;
+    }
+    if (!epc->hostmem->emulated && tcg_enabled()) {
+        error_setg(errp, "TCG needs emulated EPC, use 'emulated=on'");
+        return;
+    }
+    if (sgx_epc->nr_sections &&
+        sgx_epc->sections[0]->hostmem->emulated != epc->hostmem->emulated) {
+        error_setg(errp, "can't mix emulated and host EPC sections");
+        return;
+    }
+
     hostmem = MEMORY_BACKEND(epc->hostmem);
     if (host_memory_backend_is_mapped(hostmem)) {
         path = object_get_canonical_path_component(OBJECT(hostmem));
@@ -36,3 +36,8 @@ bool sgx_epc_get_section(int section_nr, uint64_t *addr, uint64_t *size)
 {
     g_assert_not_reached();
 }
+
+bool sgx_epc_is_emulated(void)
+{
+    return false;
+}
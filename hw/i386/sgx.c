@@ -22,6 +22,7 @@
 #include "exec/address-spaces.h"
 #include "sysemu/hw_accel.h"
 #include "sysemu/reset.h"
+#include "sysemu/tcg.h"
 #include <sys/ioctl.h>
 #include "hw/acpi/aml-build.h"
 
@@ -156,8 +157,21 @@ SGXInfo *qmp_query_sgx_capabilities(Error **errp)
 {
     SGXInfo *info = NULL;
     uint32_t eax, ebx, ecx, edx;
+    int fd;
+
+    if (tcg_enabled()) {
+        /*
+         * TCG emulates SGX1 with launch control on any host.  EPC sections
+         * are limited only by guest memory, so there are none to report.
+         */
+        info = g_new0(SGXInfo, 1);
+        info->sgx = true;
+        info->sgx1 = true;
+        info->flc = true;
+        return info;
+    }
 
-    int fd = qemu_open_old("/dev/sgx_vepc", O_RDWR);
+    fd = qemu_open_old("/dev/sgx_vepc", O_RDWR);
     if (fd < 0) {
         error_setg(errp, "SGX is not enabled in KVM");
         return NULL;
@@ -224,7 +238,7 @@ SGXInfo *qmp_query_sgx(Error **errp)
 
     info->sgx = true;
     info->sgx1 = true;
-    info->sgx2 = true;
+    info->sgx2 = !sgx_epc_is_emulated();
     info->flc = true;
     info->sections = sgx_get_epc_sections_list();
 
@@ -276,6 +290,17 @@ bool sgx_epc_get_section(int section_nr, uint64_t *addr, uint64_t *size)
     return false;
 }
 
+/* Whether the EPC is plain memory that TCG emulates SGX with */
+bool sgx_epc_is_emulated(void)
+{
+    PCMachineState *pcms =
+        (PCMachineState *)object_dynamic_cast(qdev_get_machine(),
+                                              TYPE_PC_MACHINE);
+
+    return pcms && pcms->sgx_epc.nr_sections &&
+           pcms->sgx_epc.sections[0]->hostmem->emulated;
+}
+
 void pc_machine_init_sgx_epc(PCMachineState *pcms)
 {
     SGXEPCState *sgx_epc = &pcms->sgx_epc;
@@ -315,6 +340,11 @@ void pc_machine_init_sgx_epc(PCMachineState *pcms)
 
     memory_region_set_size(&sgx_epc->mr, sgx_epc->size);
 
-    /* register the reset callback for sgx epc */
-    qemu_register_reset(sgx_epc_reset, NULL);
+    /*
+     * register the reset callback for sgx epc; TCG resets the state of
+     * emulated EPC itself
+     */
+    if (!sgx_epc_is_emulated()) {
+        qemu_register_reset(sgx_epc_reset, NULL);
+    }
 }
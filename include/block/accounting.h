@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -78,6 +79,46 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/*
+ * Latencies are also always accounted in log-linear histograms, from which
+ * percentiles are computed: each power of two of nanoseconds is split into
+ * BLOCK_ACCT_LAT_SUB_BUCKETS buckets of the same width, so that the bucket
+ * of a latency is at most 1/BLOCK_ACCT_LAT_SUB_BUCKETS of its value wide.
+ * Latencies of 2^BLOCK_ACCT_LAT_MAX_BITS ns (about 68 seconds) or more are
+ * all accounted in the last bucket.
+ *
+ * There is one histogram for each class of request size and one for each
+ * class of queue depth, i.e. number of requests in flight on the owner of
+ * the statistics when the request was started.  The owner's own in-flight
+ * counter is used because devices do not finish every cookie they start
+ * (e.g. requests that are retried or canceled), so counting cookies would
+ * drift.  Class i covers the values up to
+ * block_acct_size_class_max[i] and block_acct_queue_depth_class_max[i]
+ * respectively; the last class has no upper bound.
+ *
+ * The buckets are only updated with atomic operations, so accounting does
+ * not need stats->lock.
+ */
+#define BLOCK_ACCT_LAT_SUB_BITS 3
+#define BLOCK_ACCT_LAT_SUB_BUCKETS (1 << BLOCK_ACCT_LAT_SUB_BITS)
+#define BLOCK_ACCT_LAT_MAX_BITS 36
+#define BLOCK_ACCT_LAT_BUCKETS \
+    ((BLOCK_ACCT_LAT_MAX_BITS - BLOCK_ACCT_LAT_SUB_BITS + 1) * \
+     BLOCK_ACCT_LAT_SUB_BUCKETS)
+
+#define BLOCK_ACCT_SIZE_CLASSES 5
+#define BLOCK_ACCT_QUEUE_DEPTH_CLASSES 5
+
+extern const uint64_t block_acct_size_class_max[BLOCK_ACCT_SIZE_CLASSES - 1];
+extern const unsigned
+    block_acct_queue_depth_class_max[BLOCK_ACCT_QUEUE_DEPTH_CLASSES - 1];
+
+typedef struct BlockAcctLatencyBuckets {
+    Stat64 by_size[BLOCK_ACCT_SIZE_CLASSES][BLOCK_ACCT_LAT_BUCKETS];
+    Stat64 by_queue_depth[BLOCK_ACCT_QUEUE_DEPTH_CLASSES]
+                         [BLOCK_ACCT_LAT_BUCKETS];
+} BlockAcctLatencyBuckets;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -91,15 +132,21 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+
+    /* Allocated on the first accounted request of each type */
+    BlockAcctLatencyBuckets *latency_buckets[BLOCK_MAX_IOTYPE];
+    /* Requests in flight on the owner, NULL if unknown */
+    const unsigned int *in_flight;
 };
 
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
     enum BlockAcctType type;
+    unsigned queue_depth;
 } BlockAcctCookie;
 
-void block_acct_init(BlockAcctStats *stats);
+void block_acct_init(BlockAcctStats *stats, const unsigned int *in_flight);
 void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
                      bool account_failed);
 void block_acct_cleanup(BlockAcctStats *stats);
@@ -119,5 +166,9 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+int block_acct_latency_bucket(uint64_t latency_ns);
+uint64_t block_acct_latency_bucket_max(int bucket);
+uint64_t block_acct_latency_percentile(const uint64_t *buckets, uint64_t count,
+                                       double fraction);
 
 #endif
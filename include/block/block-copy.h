@@ -32,6 +32,15 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress);
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
 
+/*
+ * Allow up to @size bytes of staged data for block_copy_staged(), which is
+ * read from source but not yet written to target. Zero disables staging.
+ * @bs is kept in flight while staged data is written, so that draining it
+ * waits for the writes.
+ */
+void block_copy_set_staging(BlockCopyState *s, BlockDriverState *bs,
+                            uint64_t size);
+
 void block_copy_state_free(BlockCopyState *s);
 
 int64_t block_copy_reset_unallocated(BlockCopyState *s,
@@ -40,6 +49,18 @@ int64_t block_copy_reset_unallocated(BlockCopyState *s,
 int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
                             bool ignore_ratelimit);
 
+/*
+ * Like block_copy() with @ignore_ratelimit, but return as soon as the dirty
+ * clusters in the range have been read into the staging area. Their data is
+ * written to target in the background; if the staging area is full, this
+ * waits for space first.
+ *
+ * Errors of the background writes can't be reported to the caller. Once one
+ * happens, all following block_copy() and block_copy_async() calls fail.
+ */
+int coroutine_fn block_copy_staged(BlockCopyState *s, int64_t offset,
+                                   int64_t bytes);
+
 /*
  * Run block-copy in a coroutine, create corresponding BlockCopyCallState
  * object and return pointer to it. Never returns NULL.
@@ -93,4 +114,7 @@ BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+/* Return the request statistics of @s. The caller must free the result. */
+BlockCopyStats *block_copy_get_stats(BlockCopyState *s);
+
 #endif /* BLOCK_COPY_H */
@@ -435,6 +435,11 @@ struct BlockDriver {
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     bool has_variable_length;
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
+    /*
+     * Returns the stat() data of the local file that the node accesses.
+     * Only implemented by protocol drivers that work on a local file.
+     */
+    int (*bdrv_fstat)(BlockDriverState *bs, struct stat *st);
     BlockMeasureInfo *(*bdrv_measure)(QemuOpts *opts, BlockDriverState *in_bs,
                                       Error **errp);
 
@@ -1182,6 +1187,7 @@ int is_windows_drive(const char *filename);
  *                  See @BlockJobCreateFlags
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @on_error: The action to take upon error.
+ * @max_workers: The maximum number of regions that are copied in parallel.
  * @filter_node_name: The node name that should be assigned to the filter
  *                    driver that the stream job inserts into the graph above
  *                    @bs. NULL means that a node name should be autogenerated.
@@ -1198,7 +1204,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
                   BlockDriverState *bottom,
                   int creation_flags, int64_t speed,
-                  BlockdevOnError on_error,
+                  BlockdevOnError on_error, int max_workers,
                   const char *filter_node_name,
                   Error **errp);
 
@@ -1213,6 +1219,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  *                  See @BlockJobCreateFlags
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @on_error: The action to take upon error.
+ * @max_workers: The maximum number of regions that are copied in parallel.
  * @backing_file_str: String to use as the backing file in @top's overlay
  * @filter_node_name: The node name that should be assigned to the filter
  * driver that the commit job inserts into the graph above @top. NULL means
@@ -1223,7 +1230,8 @@ void stream_start(const char *job_id, BlockDriverState *bs,
 void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top,
                   int creation_flags, int64_t speed,
-                  BlockdevOnError on_error, const char *backing_file_str,
+                  BlockdevOnError on_error, int max_workers,
+                  const char *backing_file_str,
                   const char *filter_node_name, Error **errp);
 /**
  * commit_active_start:
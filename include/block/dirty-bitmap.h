@@ -81,6 +81,9 @@ void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, const BdrvDirtyBitmap *src,
                              HBitmap **backup, Error **errp);
 void bdrv_dirty_bitmap_skip_store(BdrvDirtyBitmap *bitmap, bool skip);
 bool bdrv_dirty_bitmap_get(BdrvDirtyBitmap *bitmap, int64_t offset);
+void bdrv_dirty_bitmap_create_meta(BdrvDirtyBitmap *bitmap,
+                                   uint64_t chunk_size);
+void bdrv_dirty_bitmap_release_meta(BdrvDirtyBitmap *bitmap);
 
 /* Functions that require manual locking.  */
 void bdrv_dirty_bitmap_lock(BdrvDirtyBitmap *bitmap);
@@ -93,6 +96,10 @@ void bdrv_reset_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap,
 int64_t bdrv_dirty_iter_next(BdrvDirtyBitmapIter *iter);
 void bdrv_set_dirty_iter(BdrvDirtyBitmapIter *hbi, int64_t offset);
 int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap);
+int64_t bdrv_dirty_bitmap_next_changed(BdrvDirtyBitmap *bitmap,
+                                       int64_t offset, int64_t bytes);
+void bdrv_dirty_bitmap_reset_changed(BdrvDirtyBitmap *bitmap,
+                                     int64_t offset, int64_t bytes);
 void bdrv_dirty_bitmap_truncate(BlockDriverState *bs, int64_t bytes);
 bool bdrv_dirty_bitmap_readonly(const BdrvDirtyBitmap *bitmap);
 bool bdrv_has_readonly_bitmaps(BlockDriverState *bs);
@@ -29,6 +29,18 @@
 #include "block/block_int.h"
 #include "qom/object.h"
 
+/* A budget of I/O that a ThrottleGroupMember can use without taking the
+ * ThrottleGroup lock.  It has already been accounted in the group's
+ * ThrottleState when it was handed out, and expires after a short time.
+ */
+typedef struct ThrottleGroupBudget {
+    double   bytes;
+    double   units;
+    uint64_t op_size;       /* copy of the group's cfg.op_size */
+    int64_t  expire_ns;
+    unsigned generation;    /* the budget is void if the group's changed */
+} ThrottleGroupBudget;
+
 /* The ThrottleGroupMember structure indicates membership in a ThrottleGroup
  * and holds related data.
  */
@@ -49,6 +61,12 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Only used by requests, i.e. in aio_context, and (with the
+     * ThrottleGroup lock held) by throttle_group_unregister_tgm().
+     */
+    ThrottleGroupBudget budget[2];
+    int64_t      wait_ns[2];    /* total time that requests were throttled */
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -29,6 +29,12 @@
 
 #define XTS_BLOCK_SIZE 16
 
+/*
+ * Encrypts or decrypts @length bytes, which may be any multiple of
+ * XTS_BLOCK_SIZE, block by block in ECB mode. @dst and @src may be the
+ * same buffer. The blocks are independent, so implementations are free to
+ * process several of them at once.
+ */
 typedef void xts_cipher_func(const void *ctx,
                              size_t length,
                              uint8_t *dst,
@@ -23,6 +23,9 @@ typedef struct HostMemoryBackendEpc HostMemoryBackendEpc;
 
 struct HostMemoryBackendEpc {
     HostMemoryBackend parent_obj;
+
+    /* Plain memory for TCG instead of host EPC from /dev/sgx_vepc */
+    bool emulated;
 };
 
 #endif
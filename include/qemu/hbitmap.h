@@ -272,6 +272,19 @@ void hbitmap_deserialize_finish(HBitmap *hb);
  */
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
 
+/**
+ * hbitmap_set_meta:
+ * @hb: HBitmap to operate on.
+ * @meta: HBitmap that tracks changes to @hb, or NULL.
+ *
+ * Attach @meta to @hb, so that every change to @hb sets the changed range
+ * in @meta, which is indexed like @hb.  Changes that cannot be located
+ * cheaply (e.g. merges into a fresh bitmap) set all of @meta.  Pass NULL
+ * to detach the current meta bitmap.  The caller keeps ownership of
+ * @meta and must detach it before freeing @hb.
+ */
+void hbitmap_set_meta(HBitmap *hb, HBitmap *meta);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
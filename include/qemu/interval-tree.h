@@ -0,0 +1,134 @@
+/*
+ * Interval tree of non-overlapping ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An AVL tree of disjoint, inclusive ranges [start, last].  Nodes are
+ * embedded in the structures they describe, like QLIST/QTAILQ entries.
+ *
+ * Insertion, removal and lookups are O(log n).  Every node also tracks the
+ * largest hole between the ranges of its subtree, so that free space can be
+ * found quickly with interval_tree_find_gap(); as the tree only stores the
+ * ranges in use, freed ranges are merged with adjacent free space for free.
+ *
+ * Updates must be serialized by the caller.  interval_tree_find_rcu() may
+ * run concurrently with updates provided that removed nodes are freed
+ * with RCU; see its documentation.
+ */
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;              /* Inclusive */
+
+    /* Private, maintained by the tree */
+    IntervalTreeNode *parent;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    uint64_t subtree_first;
+    uint64_t subtree_last;
+    uint64_t max_gap;           /* Largest hole between ranges of the subtree */
+    int height;
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+/**
+ * interval_tree_insert:
+ *
+ * @root: the tree
+ * @node: the node to insert, with @start and @last filled in
+ *
+ * Returns: true on success, false if the range of @node overlaps with a
+ * node of the tree, in which case @node is not inserted.
+ */
+bool interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_remove:
+ *
+ * @root: the tree
+ * @node: a node of the tree
+ *
+ * Remove @node from the tree.  If the tree is accessed with
+ * interval_tree_find_rcu(), @node must not be freed before an RCU grace
+ * period has elapsed.
+ */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ *
+ * @root: the tree
+ * @start: first address of the range to look up
+ * @last: last address of the range to look up (inclusive)
+ *
+ * Returns: the node with the lowest range that overlaps with
+ * [@start, @last], or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root, uint64_t start,
+                                     uint64_t last);
+
+/**
+ * interval_tree_find_rcu:
+ *
+ * Like interval_tree_find(), except that it returns any of the nodes that
+ * overlap with [@start, @last] and that it may run concurrently with
+ * updates of the tree.  It must be called within an RCU read-side critical
+ * section.
+ *
+ * A lookup that races with an update may miss nodes, or return NULL even if
+ * there is a match, but always terminates.  Callers typically detect such
+ * races with a QemuSeqLock whose write side covers the updates.
+ */
+IntervalTreeNode *interval_tree_find_rcu(IntervalTreeRoot *root,
+                                         uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_first:
+ *
+ * Returns: the node with the lowest range, or NULL if the tree is empty.
+ */
+IntervalTreeNode *interval_tree_first(IntervalTreeRoot *root);
+
+/**
+ * interval_tree_last:
+ *
+ * Returns: the node with the highest range, or NULL if the tree is empty.
+ */
+IntervalTreeNode *interval_tree_last(IntervalTreeRoot *root);
+
+/**
+ * interval_tree_next:
+ *
+ * Returns: the node that follows @node in address order, or NULL if
+ * @node has the highest range.
+ */
+IntervalTreeNode *interval_tree_next(IntervalTreeNode *node);
+
+/**
+ * interval_tree_find_gap:
+ *
+ * @root: the tree
+ * @size: size of the free range to look for, must not be zero
+ * @lo: lowest address of the free range
+ * @hi: highest address of the free range (inclusive)
+ * @start: returns the start of the free range
+ *
+ * Look for the lowest range of @size addresses within [@lo, @hi] that
+ * does not overlap with any node of the tree.
+ *
+ * Returns: true if a free range was found, false otherwise.
+ */
+bool interval_tree_find_gap(IntervalTreeRoot *root, uint64_t size,
+                            uint64_t lo, uint64_t hi, uint64_t *start);
+
+#endif
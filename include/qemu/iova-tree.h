@@ -1,5 +1,5 @@
 /*
- * An very simplified iova tree implementation based on GTree.
+ * An very simplified iova tree implementation based on an interval tree.
  *
  * Copyright 2018 Red Hat, Inc.
  *
@@ -13,10 +13,9 @@
 
 /*
  * Currently the iova tree will only allow to keep ranges
- * information, and no extra user data is allowed for each element.  A
- * benefit is that we can merge adjacent ranges internally within the
- * tree.  It can save a lot of memory when the ranges are splitted but
- * mostly continuous.
+ * information, and no extra user data is allowed for each element.
+ * Lookups, insertions and removals are O(log n) in the number of
+ * ranges, and so is finding free IOVA space in most cases.
  *
  * Note that current implementation does not provide any thread
  * protections.  Callers of the iova tree should be responsible
@@ -29,6 +28,7 @@
 #define  IOVA_OK           (0)
 #define  IOVA_ERR_INVALID  (-1) /* Invalid parameters */
 #define  IOVA_ERR_OVERLAP  (-2) /* IOVA range overlapped */
+#define  IOVA_ERR_NOMEM    (-3) /* Cannot allocate */
 
 typedef struct IOVATree IOVATree;
 typedef struct DMAMap {
@@ -61,6 +61,23 @@ IOVATree *iova_tree_new(void);
  */
 int iova_tree_insert(IOVATree *tree, const DMAMap *map);
 
+/**
+ * iova_tree_alloc_map:
+ *
+ * @tree: the iova tree to allocate from
+ * @map: the new map (as translated addr & size) to allocate in the iova region
+ * @iova_begin: the minimum address of the allocation
+ * @iova_last: the last address (inclusive) of the allocation
+ *
+ * Allocate the lowest free iova range of @map->size within [@iova_begin,
+ * @iova_last] and insert @map there.  On success, @map->iova is updated.
+ *
+ * Return: IOVA_OK if succeeded, IOVA_ERR_NOMEM if there is no free range
+ * that is big enough, or IOVA_ERR_INVALID for invalid parameters.
+ */
+int iova_tree_alloc_map(IOVATree *tree, DMAMap *map, hwaddr iova_begin,
+                        hwaddr iova_last);
+
 /**
  * iova_tree_remove:
  *
@@ -114,6 +114,8 @@ void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta);
 
 int64_t throttle_compute_wait(LeakyBucket *bkt);
 
+double throttle_headroom(LeakyBucket *bkt);
+
 /* init/destroy cycle */
 void throttle_init(ThrottleState *ts);
 
@@ -152,6 +154,15 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              bool is_write);
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+double throttle_op_units(uint64_t op_size, uint64_t size);
+
+void throttle_account_budget(ThrottleState *ts, bool is_write,
+                             double size, double units);
+
+void throttle_get_headroom(ThrottleState *ts, bool is_write, int64_t now,
+                           double *size, double *units);
+
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
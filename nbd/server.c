@@ -76,10 +76,45 @@ static int system_errno_to_nbd_errno(int err)
 
 typedef struct NBDRequestData NBDRequestData;
 
+/*
+ * Payload buffers of up to NBD_POOL_BUF_SIZE bytes are taken from per-export
+ * pools instead of being allocated and freed for every request.  Backup-style
+ * clients issue a steady stream of reads and writes of similar size, so once
+ * the pools have grown to the number of requests in flight, request handling
+ * no longer needs to touch the allocator at all.
+ *
+ * There is one pool for each power of two between NBD_POOL_MIN_BUF_SIZE and
+ * NBD_POOL_BUF_SIZE, so that small requests don't pin large buffers.  Every
+ * NBD_POOL_TRIM_INTERVAL_MS, the buffers that have stayed unused for the
+ * whole interval are freed.
+ */
+#define NBD_POOL_MIN_BUF_SHIFT 12
+#define NBD_POOL_MAX_BUF_SHIFT 20
+#define NBD_POOL_MIN_BUF_SIZE (1 << NBD_POOL_MIN_BUF_SHIFT)
+#define NBD_POOL_BUF_SIZE (1 << NBD_POOL_MAX_BUF_SHIFT)
+#define NBD_POOL_NR_CLASSES \
+    (NBD_POOL_MAX_BUF_SHIFT - NBD_POOL_MIN_BUF_SHIFT + 1)
+#define NBD_POOL_MAX_FREE 64
+#define NBD_POOL_TRIM_INTERVAL_MS 10000
+
+typedef struct NBDBuffer {
+    QSLIST_ENTRY(NBDBuffer) next;
+    uint8_t *data;
+    int size_class;
+} NBDBuffer;
+
+typedef struct NBDBufferPool {
+    QSLIST_HEAD(, NBDBuffer) free_bufs;
+    unsigned nb_free;
+    /* Lowest nb_free since the last trim */
+    unsigned min_free;
+} NBDBufferPool;
+
 struct NBDRequestData {
     QSIMPLEQ_ENTRY(NBDRequestData) entry;
     NBDClient *client;
     uint8_t *data;
+    NBDBuffer *buf; /* pool buffer backing @data, NULL if not pooled */
     bool complete;
 };
 
@@ -99,6 +134,10 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* Unused payload buffers, by size class */
+    NBDBufferPool pools[NBD_POOL_NR_CLASSES];
+    QEMUTimer *pool_trim_timer;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -1512,11 +1551,117 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
     return req;
 }
 
+/*
+ * Return a payload buffer of at least @len bytes for @req in req->data, or
+ * -ENOMEM if none could be allocated.
+ */
+static int nbd_request_alloc_data(NBDRequestData *req, uint32_t len)
+{
+    NBDExport *exp = req->client->exp;
+    NBDBufferPool *pool;
+    NBDBuffer *buf;
+    int size_class;
+
+    assert(!req->data);
+
+    if (len > NBD_POOL_BUF_SIZE) {
+        req->data = blk_try_blockalign(exp->common.blk, len);
+        return req->data ? 0 : -ENOMEM;
+    }
+
+    size_class = len <= NBD_POOL_MIN_BUF_SIZE ? 0 :
+        ctz32(pow2ceil(len)) - NBD_POOL_MIN_BUF_SHIFT;
+    pool = &exp->pools[size_class];
+
+    buf = QSLIST_FIRST(&pool->free_bufs);
+    trace_nbd_buffer_pool_get(exp, len, size_class, buf != NULL);
+    if (buf) {
+        QSLIST_REMOVE_HEAD(&pool->free_bufs, next);
+        pool->nb_free--;
+        pool->min_free = MIN(pool->min_free, pool->nb_free);
+    } else {
+        uint8_t *data = blk_try_blockalign(exp->common.blk,
+                                           NBD_POOL_MIN_BUF_SIZE << size_class);
+        if (!data) {
+            return -ENOMEM;
+        }
+        buf = g_new0(NBDBuffer, 1);
+        buf->data = data;
+        buf->size_class = size_class;
+    }
+
+    req->buf = buf;
+    req->data = buf->data;
+    return 0;
+}
+
+static void nbd_buffer_free(NBDBuffer *buf)
+{
+    qemu_vfree(buf->data);
+    g_free(buf);
+}
+
+static void nbd_buffer_pool_schedule_trim(NBDExport *exp)
+{
+    if (exp->pool_trim_timer && !timer_pending(exp->pool_trim_timer)) {
+        timer_mod(exp->pool_trim_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  NBD_POOL_TRIM_INTERVAL_MS);
+    }
+}
+
+/* Free @n unused buffers of @pool */
+static void nbd_buffer_pool_shrink(NBDBufferPool *pool, unsigned n)
+{
+    NBDBuffer *buf;
+
+    while (n-- && (buf = QSLIST_FIRST(&pool->free_bufs))) {
+        QSLIST_REMOVE_HEAD(&pool->free_bufs, next);
+        pool->nb_free--;
+        nbd_buffer_free(buf);
+    }
+    pool->min_free = pool->nb_free;
+}
+
+static void nbd_buffer_pool_trim(void *opaque)
+{
+    NBDExport *exp = opaque;
+    bool idle = true;
+    int i;
+
+    for (i = 0; i < NBD_POOL_NR_CLASSES; i++) {
+        NBDBufferPool *pool = &exp->pools[i];
+
+        if (pool->min_free) {
+            trace_nbd_buffer_pool_trim(exp, i, pool->min_free);
+            nbd_buffer_pool_shrink(pool, pool->min_free);
+        }
+        /* Start a new interval: all buffers that are free now count as idle */
+        pool->min_free = pool->nb_free;
+        idle &= pool->nb_free == 0;
+    }
+
+    if (!idle) {
+        nbd_buffer_pool_schedule_trim(exp);
+    }
+}
+
 static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+
+    if (req->buf) {
+        NBDBufferPool *pool = &exp->pools[req->buf->size_class];
 
-    if (req->data) {
+        if (pool->nb_free < NBD_POOL_MAX_FREE) {
+            QSLIST_INSERT_HEAD(&pool->free_bufs, req->buf, next);
+            pool->nb_free++;
+            nbd_buffer_pool_schedule_trim(exp);
+        } else {
+            nbd_buffer_free(req->buf);
+        }
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1540,6 +1685,9 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     trace_nbd_blk_aio_attached(exp->name, ctx);
 
     exp->common.ctx = ctx;
+    exp->pool_trim_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                         nbd_buffer_pool_trim, exp);
+    nbd_buffer_pool_schedule_trim(exp);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
         qio_channel_attach_aio_context(client->ioc, ctx);
@@ -1561,6 +1709,8 @@ static void blk_aio_detach(void *opaque)
         qio_channel_detach_aio_context(client->ioc);
     }
 
+    timer_free(exp->pool_trim_timer);
+    exp->pool_trim_timer = NULL;
     exp->common.ctx = NULL;
 }
 
@@ -1689,6 +1839,9 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     QTAILQ_INIT(&exp->clients);
+    for (i = 0; i < NBD_POOL_NR_CLASSES; i++) {
+        QSLIST_INIT(&exp->pools[i].free_bufs);
+    }
     exp->name = g_strdup(arg->name);
     exp->description = g_strdup(arg->description);
     exp->nbdflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
@@ -1762,6 +1915,8 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     blk_set_disable_request_queuing(blk, true);
 
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
+    exp->pool_trim_timer = aio_timer_new(exp->common.ctx, QEMU_CLOCK_REALTIME,
+                                         SCALE_MS, nbd_buffer_pool_trim, exp);
 
     blk_set_dev_ops(blk, &nbd_block_ops, exp);
 
@@ -1829,6 +1984,12 @@ static void nbd_export_delete(BlockExport *blk_exp)
     g_free(exp->description);
     exp->description = NULL;
 
+    timer_free(exp->pool_trim_timer);
+    exp->pool_trim_timer = NULL;
+    for (i = 0; i < NBD_POOL_NR_CLASSES; i++) {
+        nbd_buffer_pool_shrink(&exp->pools[i], UINT_MAX);
+    }
+
     if (exp->common.blk) {
         if (exp->eject_notifier_blk) {
             notifier_remove(&exp->eject_notifier);
@@ -2315,11 +2476,10 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
         }
 
         if (request->type != NBD_CMD_CACHE) {
-            req->data = blk_try_blockalign(client->exp->common.blk,
-                                           request->len);
-            if (req->data == NULL) {
+            ret = nbd_request_alloc_data(req, request->len);
+            if (ret < 0) {
                 error_setg(errp, "No memory");
-                return -ENOMEM;
+                return ret;
             }
         }
     }
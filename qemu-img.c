@@ -33,6 +33,7 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -47,6 +48,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "block/accounting.h"
 #include "crypto/init.h"
 #include "trace/control.h"
 #include "qemu/throttle.h"
@@ -83,6 +85,9 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_RANDOM = 278,
+    OPTION_RWMIXREAD = 279,
+    OPTION_RATE = 280,
 };
 
 typedef enum OutputFormat {
@@ -198,7 +203,7 @@ static void QEMU_NORETURN help(void)
            "Parameters to convert subcommand:\n"
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
-           "       process (defaults to 8)\n"
+           "       process (by default, this is tuned automatically)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
@@ -1319,6 +1324,202 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+/*
+ * Number of coroutines that compare chunks of the images concurrently.
+ * Block status queries are serialized and cached for whole extents, so the
+ * coroutines mostly overlap reads.
+ */
+#define COMPARE_COROUTINES 8
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1, *blk2;
+    const char *filename1, *filename2;
+    int64_t total_size1, total_size2;
+    int64_t total_size;             /* Compared range, the smaller size */
+    uint64_t progress_base;
+    bool strict;
+    bool quiet;
+
+    CoMutex lock;                   /* Serializes block status queries */
+    int64_t offset;                 /* Next offset to compare */
+    int status1, status2;           /* Cached block status of each image */
+    int64_t status_end1, status_end2;
+
+    /*
+     * The first difference or error by offset.  Chunks are handed out in
+     * order, so once all coroutines are done it is the one that a serial
+     * comparison would have found.
+     */
+    int64_t fail_offset;
+    int ret;
+    bool fail_is_error;
+    char *fail_msg;
+
+    int running_coroutines;
+} ImgCompareState;
+
+static void GCC_FMT_ATTR(5, 6)
+compare_fail(ImgCompareState *s, int64_t offset, int ret, bool is_error,
+             const char *fmt, ...)
+{
+    va_list ap;
+
+    if (offset >= s->fail_offset) {
+        return;
+    }
+
+    g_free(s->fail_msg);
+    va_start(ap, fmt);
+    s->fail_msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    s->fail_offset = offset;
+    s->ret = ret;
+    s->fail_is_error = is_error;
+}
+
+/*
+ * Returns the next chunk that needs to be read in *@offset and *@bytes,
+ * and whether it is allocated in each image.  Ranges that read as zeroes
+ * in both images or are unallocated in both are skipped in one go.
+ *
+ * Returns false if there is nothing left to compare.
+ */
+static bool coroutine_fn compare_next_chunk(ImgCompareState *s,
+                                            int64_t *offset, int64_t *bytes,
+                                            bool *allocated1, bool *allocated2)
+{
+    int64_t chunk, pnum;
+    int ret;
+
+    while (s->offset < MIN(s->total_size, s->fail_offset)) {
+        if (s->offset >= s->status_end1) {
+            ret = bdrv_block_status_above(blk_bs(s->blk1), NULL, s->offset,
+                                          s->total_size1 - s->offset, &pnum,
+                                          NULL, NULL);
+            if (ret < 0) {
+                compare_fail(s, s->offset, 3, true,
+                             "Sector allocation test failed for %s",
+                             s->filename1);
+                return false;
+            }
+            s->status1 = ret;
+            s->status_end1 = s->offset + pnum;
+        }
+        if (s->offset >= s->status_end2) {
+            ret = bdrv_block_status_above(blk_bs(s->blk2), NULL, s->offset,
+                                          s->total_size2 - s->offset, &pnum,
+                                          NULL, NULL);
+            if (ret < 0) {
+                compare_fail(s, s->offset, 3, true,
+                             "Sector allocation test failed for %s",
+                             s->filename2);
+                return false;
+            }
+            s->status2 = ret;
+            s->status_end2 = s->offset + pnum;
+        }
+
+        chunk = MIN(s->status_end1, s->status_end2) - s->offset;
+        assert(chunk > 0);
+
+        if (s->strict && s->status1 != s->status2) {
+            compare_fail(s, s->offset, 1, false,
+                         "Strict mode: Offset %" PRId64
+                         " block status mismatch!\n", s->offset);
+            return false;
+        }
+
+        *allocated1 = s->status1 & BDRV_BLOCK_ALLOCATED;
+        *allocated2 = s->status2 & BDRV_BLOCK_ALLOCATED;
+        if (((s->status1 & BDRV_BLOCK_ZERO) &&
+             (s->status2 & BDRV_BLOCK_ZERO)) ||
+            (!*allocated1 && !*allocated2)) {
+            /* nothing to do */
+            s->offset += chunk;
+            qemu_progress_print(((float) chunk / s->progress_base) * 100,
+                                100);
+            continue;
+        }
+
+        *offset = s->offset;
+        *bytes = MIN(chunk, IO_BUF_SIZE);
+        s->offset += *bytes;
+        return true;
+    }
+
+    return false;
+}
+
+static void coroutine_fn compare_co_do(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    uint8_t *buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+    int64_t offset, chunk, pnum, idx;
+    bool allocated1, allocated2;
+    int ret;
+
+    s->running_coroutines++;
+
+    for (;;) {
+        qemu_co_mutex_lock(&s->lock);
+        if (!compare_next_chunk(s, &offset, &chunk,
+                                &allocated1, &allocated2)) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (allocated1 == allocated2) {
+            ret = blk_co_pread(s->blk1, offset, chunk, buf1, 0);
+            if (ret < 0) {
+                compare_fail(s, offset, 4, true, "Error while reading offset "
+                             "%" PRId64 " of %s: %s",
+                             offset, s->filename1, strerror(-ret));
+                continue;
+            }
+            ret = blk_co_pread(s->blk2, offset, chunk, buf2, 0);
+            if (ret < 0) {
+                compare_fail(s, offset, 4, true, "Error while reading offset "
+                             "%" PRId64 " of %s: %s",
+                             offset, s->filename2, strerror(-ret));
+                continue;
+            }
+            /* Only look for the first difference if there is one */
+            if (memcmp(buf1, buf2, chunk)) {
+                ret = compare_buffers(buf1, buf2, chunk, &pnum);
+                compare_fail(s, offset, 1, false,
+                             "Content mismatch at offset %" PRId64 "!\n",
+                             offset + (ret ? 0 : pnum));
+                continue;
+            }
+        } else {
+            BlockBackend *blk = allocated1 ? s->blk1 : s->blk2;
+            const char *filename = allocated1 ? s->filename1 : s->filename2;
+
+            ret = blk_co_pread(blk, offset, chunk, buf1, 0);
+            if (ret < 0) {
+                compare_fail(s, offset, 4, true, "Error while reading offset "
+                             "%" PRId64 " of %s: %s",
+                             offset, filename, strerror(-ret));
+                continue;
+            }
+            idx = find_nonzero(buf1, chunk);
+            if (idx >= 0) {
+                compare_fail(s, offset, 1, false,
+                             "Content mismatch at offset %" PRId64 "!\n",
+                             offset + idx);
+                continue;
+            }
+        }
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1330,19 +1531,17 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf1 = NULL;
+    ImgCompareState s;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
     int64_t total_size;
-    int64_t offset = 0;
+    int64_t offset;
     int64_t chunk;
-    int c;
+    int c, i;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
@@ -1449,11 +1648,8 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
 
     buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1479,87 +1675,38 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+    s = (ImgCompareState) {
+        .blk1 = blk1,
+        .blk2 = blk2,
+        .filename1 = filename1,
+        .filename2 = filename2,
+        .total_size1 = total_size1,
+        .total_size2 = total_size2,
+        .total_size = total_size,
+        .progress_base = progress_base,
+        .strict = strict,
+        .quiet = quiet,
+        .fail_offset = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < COMPARE_COROUTINES; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do, &s));
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    if (s.fail_msg) {
+        if (s.fail_is_error) {
+            error_report("%s", s.fail_msg);
         } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
+            qprintf(quiet, "%s", s.fail_msg);
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        g_free(s.fail_msg);
+        ret = s.ret;
+        goto out;
     }
+    offset = total_size;
 
     if (total_size1 != total_size2) {
         BlockBackend *blk_over;
@@ -1603,7 +1750,6 @@ static int img_compare(int argc, char **argv)
 
 out:
     qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1636,6 +1782,34 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+/*
+ * Copy offloading needs no buffer, so it can work on much larger chunks
+ * than buffered copying. With reflink-capable file systems, a whole extent
+ * is usually shared in a single request.
+ */
+#define MAX_COPY_RANGE_SECTORS ((1 * GiB) >> BDRV_SECTOR_BITS)
+
+/*
+ * Without -m, convert tunes the number of requests in flight (and, for
+ * high-latency sources, the request size) by itself, see convert_adapt().
+ */
+#define CONVERT_ADAPT_START_COROUTINES 8
+#define CONVERT_ADAPT_WINDOW_NS (200 * SCALE_MS)
+#define CONVERT_ADAPT_TOLERANCE 0.05
+#define CONVERT_ADAPT_HIGH_LATENCY_NS (10 * SCALE_MS)
+
+/*
+ * Number of block status extents that convert remembers ahead of the copy.
+ * The window is filled during the allocation scan and refilled with the
+ * following extents whenever the copy has consumed it.
+ */
+#define CONVERT_STATUS_CACHE_SIZE 256
+
+typedef struct ConvertStatusExtent {
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ConvertStatusExtent;
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1670,6 +1844,30 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* Adaptive parallelism, see convert_adapt() */
+    bool adaptive;
+    int active_coroutines;
+    int adapt_direction;
+    size_t max_buf_sectors;
+    int64_t adapt_window_start;
+    uint64_t adapt_window_bytes;
+    uint64_t adapt_window_reqs;
+    uint64_t adapt_window_latency;
+    double adapt_last_throughput;
+    CoQueue adapt_queue;
+
+    /*
+     * Block status of the source as determined ahead of the copy, so that
+     * the copy doesn't have to wait for it again. This is a ring buffer of
+     * CONVERT_STATUS_CACHE_SIZE extents; @status_cache_end is the end of the
+     * last extent that was added.
+     */
+    ConvertStatusExtent *status_cache;
+    int status_cache_head;
+    int status_cache_len;
+    int64_t status_cache_end;
+    bool status_cache_ready;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1684,20 +1882,23 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
-static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+/*
+ * Returns the maximum number of sectors starting at @sector_num that can
+ * have the same block status. If @post_backing_zero is non-NULL, it is set
+ * to whether they are past the end of the target's backing file.
+ */
+static int convert_status_limit(ImgConvertState *s, int64_t sector_num,
+                                bool *post_backing_zero)
 {
-    int64_t src_cur_offset;
-    int ret, n, src_cur;
-    bool post_backing_zero = false;
-
-    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    int n;
+    bool past_backing = false;
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->target_backing_sectors >= 0) {
         if (sector_num >= s->target_backing_sectors) {
-            post_backing_zero = true;
+            past_backing = true;
         } else if (sector_num + n > s->target_backing_sectors) {
             /* Split requests around target_backing_sectors (because
              * starting from there, zeros are handled differently) */
@@ -1705,74 +1906,202 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
-        uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
-        int64_t count;
-        int tail;
-        BlockDriverState *src_bs = blk_bs(s->src[src_cur]);
-        BlockDriverState *base;
-
-        if (s->target_has_backing) {
-            base = bdrv_cow_bs(bdrv_skip_filters(src_bs));
-        } else {
-            base = NULL;
-        }
+    if (post_backing_zero) {
+        *post_backing_zero = past_backing;
+    }
+    return n;
+}
 
-        do {
-            count = n * BDRV_SECTOR_SIZE;
+/*
+ * Query the block status of the source at @sector_num and store it in
+ * s->status and s->sector_next_status.
+ */
+static int convert_block_status(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int ret, n, src_cur;
+    bool post_backing_zero;
+    uint64_t offset;
+    int64_t count;
+    int tail;
+    BlockDriverState *src_bs;
+    BlockDriverState *base;
 
-            ret = bdrv_block_status_above(src_bs, base, offset, count, &count,
-                                          NULL, NULL);
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    n = convert_status_limit(s, sector_num, &post_backing_zero);
 
-            if (ret < 0) {
-                if (s->salvage) {
-                    if (n == 1) {
-                        if (!s->quiet) {
-                            warn_report("error while reading block status at "
-                                        "offset %" PRIu64 ": %s", offset,
-                                        strerror(-ret));
-                        }
-                        /* Just try to read the data, then */
-                        ret = BDRV_BLOCK_DATA;
-                        count = BDRV_SECTOR_SIZE;
-                    } else {
-                        /* Retry on a shorter range */
-                        n = DIV_ROUND_UP(n, 4);
+    offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
+    src_bs = blk_bs(s->src[src_cur]);
+    if (s->target_has_backing) {
+        base = bdrv_cow_bs(bdrv_skip_filters(src_bs));
+    } else {
+        base = NULL;
+    }
+
+    do {
+        count = n * BDRV_SECTOR_SIZE;
+
+        ret = bdrv_block_status_above(src_bs, base, offset, count, &count,
+                                      NULL, NULL);
+
+        if (ret < 0) {
+            if (s->salvage) {
+                if (n == 1) {
+                    if (!s->quiet) {
+                        warn_report("error while reading block status at "
+                                    "offset %" PRIu64 ": %s", offset,
+                                    strerror(-ret));
                     }
+                    /* Just try to read the data, then */
+                    ret = BDRV_BLOCK_DATA;
+                    count = BDRV_SECTOR_SIZE;
                 } else {
-                    error_report("error while reading block status at offset "
-                                 "%" PRIu64 ": %s", offset, strerror(-ret));
-                    return ret;
+                    /* Retry on a shorter range */
+                    n = DIV_ROUND_UP(n, 4);
                 }
+            } else {
+                error_report("error while reading block status at offset "
+                             "%" PRIu64 ": %s", offset, strerror(-ret));
+                return ret;
             }
-        } while (ret < 0);
+        }
+    } while (ret < 0);
 
-        n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
+    n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
 
-        /*
-         * Avoid that s->sector_next_status becomes unaligned to the source
-         * request alignment and/or cluster size to avoid unnecessary read
-         * cycles.
-         */
-        tail = (sector_num - src_cur_offset + n) % s->src_alignment[src_cur];
-        if (n > tail) {
-            n -= tail;
+    /*
+     * Avoid that s->sector_next_status becomes unaligned to the source
+     * request alignment and/or cluster size to avoid unnecessary read
+     * cycles.
+     */
+    tail = (sector_num - src_cur_offset + n) % s->src_alignment[src_cur];
+    if (n > tail) {
+        n -= tail;
+    }
+
+    if (ret & BDRV_BLOCK_ZERO) {
+        s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
+    } else if (ret & BDRV_BLOCK_DATA) {
+        s->status = BLK_DATA;
+    } else {
+        s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+    }
+
+    s->sector_next_status = sector_num + n;
+    return 0;
+}
+
+/*
+ * Remember the block status that was just determined for @sector_num if it
+ * continues the extents in the cache and there is room for it.
+ */
+static void convert_cache_status(ImgConvertState *s, int64_t sector_num)
+{
+    ConvertStatusExtent *e;
+
+    if (!s->status_cache || sector_num != s->status_cache_end ||
+        s->status_cache_len == CONVERT_STATUS_CACHE_SIZE)
+    {
+        return;
+    }
+
+    e = &s->status_cache[(s->status_cache_head + s->status_cache_len) %
+                         CONVERT_STATUS_CACHE_SIZE];
+    *e = (ConvertStatusExtent) {
+        .start  = sector_num,
+        .end    = s->sector_next_status,
+        .status = s->status,
+    };
+    s->status_cache_len++;
+    s->status_cache_end = s->sector_next_status;
+}
+
+/* Query the extents following the cached ones until the cache is full */
+static int convert_fill_status_cache(ImgConvertState *s)
+{
+    int ret;
+
+    while (s->status_cache_len < CONVERT_STATUS_CACHE_SIZE &&
+           s->status_cache_end < s->total_sectors)
+    {
+        ret = convert_block_status(s, s->status_cache_end);
+        if (ret < 0) {
+            return ret;
         }
+        convert_cache_status(s, s->status_cache_end);
+    }
+    return 0;
+}
 
-        if (ret & BDRV_BLOCK_ZERO) {
-            s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
-        } else if (ret & BDRV_BLOCK_DATA) {
-            s->status = BLK_DATA;
-        } else {
-            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+/*
+ * Look up the block status for @sector_num in the cache, refilling it if the
+ * copy has used up all cached extents. Must be called with increasing
+ * @sector_num.
+ *
+ * Returns 1 and sets s->status and s->sector_next_status if the status was
+ * found, 0 if it wasn't and a negative errno on error.
+ */
+static int convert_get_cached_status(ImgConvertState *s, int64_t sector_num)
+{
+    ConvertStatusExtent *e;
+    int ret;
+
+    if (!s->status_cache || !s->status_cache_ready) {
+        return 0;
+    }
+
+    /* Drop the extents that the copy has passed */
+    while (s->status_cache_len &&
+           s->status_cache[s->status_cache_head].end <= sector_num)
+    {
+        s->status_cache_head = (s->status_cache_head + 1) %
+                               CONVERT_STATUS_CACHE_SIZE;
+        s->status_cache_len--;
+    }
+
+    if (!s->status_cache_len) {
+        s->status_cache_end = sector_num;
+        ret = convert_fill_status_cache(s);
+        if (ret < 0) {
+            return ret;
         }
+        if (!s->status_cache_len) {
+            return 0;
+        }
+    }
 
-        s->sector_next_status = sector_num + n;
+    e = &s->status_cache[s->status_cache_head];
+    if (e->start > sector_num) {
+        return 0;
+    }
+
+    s->status = e->status;
+    s->sector_next_status = e->end;
+    return 1;
+}
+
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int ret, n;
+
+    n = convert_status_limit(s, sector_num, NULL);
+
+    if (s->sector_next_status <= sector_num) {
+        ret = convert_get_cached_status(s, sector_num);
+        if (ret == 0) {
+            ret = convert_block_status(s, sector_num);
+            if (ret == 0) {
+                convert_cache_status(s, sector_num);
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
     if (s->status == BLK_DATA) {
-        n = MIN(n, s->buf_sectors);
+        n = MIN(n, s->copy_range ? MAX_COPY_RANGE_SECTORS : s->buf_sectors);
     }
 
     /* We need to write complete clusters for compressed images, so if an
@@ -1908,8 +2237,58 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Returns true if a copy offloading failure with @ret means that offloading
+ * doesn't work for this source and target, so that the data must be copied
+ * through the buffer instead. Other errors (e.g. -EIO or -ENOSPC) are real
+ * I/O errors and fail the conversion.
+ */
+static bool convert_copy_range_unsupported(int ret)
+{
+    return ret == -ENOTSUP || ret == -EXDEV || ret == -EINVAL;
+}
+
+/* Copy through @buf, which has room for @buf_sectors sectors */
+static int coroutine_fn convert_co_copy_buffered(ImgConvertState *s,
+                                                 int64_t sector_num,
+                                                 int nb_sectors, uint8_t *buf,
+                                                 int buf_sectors)
+{
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, buf_sectors);
+
+        ret = convert_co_read(s, sector_num, n, buf);
+        if (ret < 0) {
+            error_report("error while reading at byte %lld: %s",
+                         sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
+            return ret;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, BLK_DATA);
+        if (ret < 0) {
+            error_report("error while writing at byte %lld: %s",
+                         sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
+/*
+ * Copy @nb_sectors with copy offloading, falling back to buffered copying
+ * through @buf for the parts where offloading fails. Offloading is disabled
+ * for the rest of the conversion only if it isn't supported at all.
+ *
+ * Errors are reported here.
+ */
 static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector_num,
-                                              int nb_sectors)
+                                              int nb_sectors, uint8_t *buf,
+                                              int buf_sectors)
 {
     int n, ret;
 
@@ -1926,11 +2305,26 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 
         n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
 
-        ret = blk_co_copy_range(blk, offset, s->target,
-                                sector_num << BDRV_SECTOR_BITS,
-                                n << BDRV_SECTOR_BITS, 0, 0);
+        ret = -ENOTSUP;
+        if (s->copy_range) {
+            ret = blk_co_copy_range(blk, offset, s->target,
+                                    sector_num << BDRV_SECTOR_BITS,
+                                    n << BDRV_SECTOR_BITS, 0, 0);
+            if (ret < 0 && !convert_copy_range_unsupported(ret)) {
+                error_report("error while copying at byte %lld: %s",
+                             sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
+                return ret;
+            }
+            if (ret < 0) {
+                s->copy_range = false;
+            }
+        }
         if (ret < 0) {
-            return ret;
+            ret = convert_co_copy_buffered(s, sector_num, n, buf,
+                                           buf_sectors);
+            if (ret < 0) {
+                return ret;
+            }
         }
 
         sector_num += n;
@@ -1939,10 +2333,73 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Account a finished request of @bytes that took @latency_ns and, once per
+ * CONVERT_ADAPT_WINDOW_NS, adjust the number of active coroutines.
+ *
+ * This is a simple hill climber: As long as the throughput of a window is
+ * significantly better than that of the previous one, the last step is
+ * repeated; if it got worse, the direction is reversed. When the maximum
+ * number of coroutines is reached and requests still take long, the
+ * request size is increased instead.
+ */
+static void convert_adapt(ImgConvertState *s, uint64_t bytes,
+                          int64_t latency_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->adapt_window_start;
+    double throughput, last = s->adapt_last_throughput;
+    uint64_t avg_latency;
+    int new_active;
+
+    s->adapt_window_bytes += bytes;
+    s->adapt_window_reqs++;
+    s->adapt_window_latency += latency_ns;
+
+    if (elapsed < CONVERT_ADAPT_WINDOW_NS) {
+        return;
+    }
+
+    throughput = (double)s->adapt_window_bytes * NANOSECONDS_PER_SECOND /
+                 elapsed;
+    avg_latency = s->adapt_window_latency / s->adapt_window_reqs;
+
+    s->adapt_last_throughput = throughput;
+    s->adapt_window_start = now;
+    s->adapt_window_bytes = 0;
+    s->adapt_window_reqs = 0;
+    s->adapt_window_latency = 0;
+
+    if (throughput < last * (1.0 - CONVERT_ADAPT_TOLERANCE)) {
+        /* The last step made things worse, go back */
+        s->adapt_direction = -s->adapt_direction;
+    } else if (throughput < last * (1.0 + CONVERT_ADAPT_TOLERANCE)) {
+        /* No significant change, stay where we are */
+        return;
+    }
+
+    new_active = MAX(1, MIN(s->active_coroutines + s->adapt_direction,
+                            s->num_coroutines));
+    if (new_active == s->active_coroutines) {
+        if (s->adapt_direction > 0 &&
+            avg_latency > CONVERT_ADAPT_HIGH_LATENCY_NS &&
+            s->buf_sectors * 2 <= s->max_buf_sectors)
+        {
+            /* Buffers are reallocated by the coroutines when they need it */
+            s->buf_sectors *= 2;
+        }
+        return;
+    }
+
+    s->active_coroutines = new_active;
+    qemu_co_queue_restart_all(&s->adapt_queue);
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    int buf_sectors;
     int ret, i;
     int index = -1;
 
@@ -1955,14 +2412,21 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
     assert(index >= 0);
 
     s->running_coroutines++;
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    buf_sectors = s->buf_sectors;
+    buf = blk_blockalign(s->target, buf_sectors * BDRV_SECTOR_SIZE);
 
     while (1) {
         int n;
-        int64_t sector_num;
+        int64_t sector_num, start_ns, io_ns;
         enum ImgConvertBlockStatus status;
         bool copy_range;
 
+        /* Wait while this coroutine is not needed */
+        while (index >= s->active_coroutines && s->ret == -EINPROGRESS &&
+               s->sector_num < s->total_sectors) {
+            qemu_co_queue_wait(&s->adapt_queue, NULL);
+        }
+
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
             qemu_co_mutex_unlock(&s->lock);
@@ -1991,8 +2455,28 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
-retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        /*
+         * Large chunks can only have been created for copy offloading, so
+         * keep using convert_co_copy_range() for them even if offloading has
+         * been disabled in the meantime; it splits up the fallback path.
+         */
+        copy_range = status == BLK_DATA &&
+                     (s->copy_range || n > s->buf_sectors);
+        if (!copy_range && n > buf_sectors &&
+            (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)))
+        {
+            /* convert_adapt() has increased the request size */
+            qemu_vfree(buf);
+            buf_sectors = s->buf_sectors;
+            buf = blk_blockalign(s->target, buf_sectors * BDRV_SECTOR_SIZE);
+        }
+
+        /*
+         * Only the time spent in I/O is accounted for convert_adapt(), not
+         * the time waiting for earlier requests to be written in order, or
+         * more coroutines would look like higher latency.
+         */
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -2004,6 +2488,7 @@ retry:
             status = BLK_DATA;
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
+        io_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
 
         if (s->wr_in_order) {
             /* keep writes in order */
@@ -2014,21 +2499,29 @@ retry:
             s->wait_sector_num[index] = -1;
         }
 
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
-                ret = convert_co_copy_range(s, sector_num, n);
-                if (ret) {
-                    s->copy_range = false;
-                    goto retry;
+                ret = convert_co_copy_range(s, sector_num, n, buf,
+                                            buf_sectors);
+                if (ret < 0) {
+                    s->ret = ret;
                 }
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
+                if (ret < 0) {
+                    error_report("error while writing at byte %lld: %s",
+                                 sector_num * BDRV_SECTOR_SIZE,
+                                 strerror(-ret));
+                    s->ret = ret;
+                }
             }
-            if (ret < 0) {
-                error_report("error while writing at byte %lld: %s",
-                             sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
-            }
+        }
+
+        io_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+        if (s->adaptive && status == BLK_DATA) {
+            convert_adapt(s, n * BDRV_SECTOR_SIZE, io_ns);
         }
 
         if (s->wr_in_order) {
@@ -2052,6 +2545,8 @@ retry:
     qemu_vfree(buf);
     s->co[index] = NULL;
     s->running_coroutines--;
+    /* Let the coroutines that are waiting for work know that there is none */
+    qemu_co_queue_restart_all(&s->adapt_queue);
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
         /* the convert job finished successfully */
         s->ret = 0;
@@ -2079,10 +2574,20 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    /*
+     * In salvaging mode, block status errors must be retried (and reported)
+     * while copying, so don't remember the results in that case.
+     */
+    if (!s->salvage) {
+        s->status_cache = g_new(ConvertStatusExtent,
+                                CONVERT_STATUS_CACHE_SIZE);
+    }
+
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            return n;
+            ret = n;
+            goto out;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -2093,8 +2598,27 @@ static int convert_do_copy(ImgConvertState *s)
 
     /* Do the copy */
     s->sector_next_status = 0;
+    s->status_cache_ready = true;
     s->ret = -EINPROGRESS;
 
+    /*
+     * Unless -m was given, start with CONVERT_ADAPT_START_COROUTINES active
+     * coroutines and let convert_adapt() find the best number. Compressed
+     * output must be written one cluster at a time, so the request size
+     * is only adapted for uncompressed output.
+     */
+    s->active_coroutines = s->num_coroutines;
+    if (s->adaptive) {
+        s->num_coroutines = MAX_COROUTINES;
+        s->active_coroutines = CONVERT_ADAPT_START_COROUTINES;
+        s->adapt_direction = 1;
+        s->max_buf_sectors = s->compressed ? s->buf_sectors
+                                           : MAX(s->buf_sectors,
+                                                 MAX_BUF_SECTORS);
+        s->adapt_window_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    qemu_co_queue_init(&s->adapt_queue);
+
     qemu_co_mutex_init(&s->lock);
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
@@ -2106,15 +2630,16 @@ static int convert_do_copy(ImgConvertState *s)
         main_loop_wait(false);
     }
 
+    ret = s->ret;
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
-        if (ret < 0) {
-            return ret;
-        }
     }
 
-    return s->ret;
+out:
+    g_free(s->status_cache);
+    s->status_cache = NULL;
+    return ret < 0 ? ret : 0;
 }
 
 /* Check that bitmaps can be copied, or output an error */
@@ -2223,7 +2748,8 @@ static int img_convert(int argc, char **argv)
         .copy_range         = false,
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
-        .num_coroutines     = 8,
+        .num_coroutines     = CONVERT_ADAPT_START_COROUTINES,
+        .adaptive           = true,
     };
 
     for(;;) {
@@ -2332,6 +2858,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            s.adaptive = false;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -3147,6 +3674,66 @@ static inline bool entry_mergeable(const MapEntry *curr, const MapEntry *next)
     return true;
 }
 
+/* Merges @next into @curr, or prints @curr and continues with @next */
+static int map_add_entry(OutputFormat output_format, MapEntry *curr,
+                         MapEntry *next)
+{
+    int ret;
+
+    if (entry_mergeable(curr, next)) {
+        curr->length += next->length;
+        return 0;
+    }
+
+    if (curr->length > 0) {
+        ret = dump_map_entry(output_format, curr, next);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    *curr = *next;
+    return 0;
+}
+
+/*
+ * img_map() queries the block status of up to MAP_COROUTINES slices of the
+ * image concurrently, which hides the latency of remote images.
+ */
+#define MAP_COROUTINES 8
+#define MAP_SLICE_SIZE (1 * GiB)
+
+typedef struct ImgMapSlice {
+    BlockDriverState *bs;
+    int64_t start;
+    int64_t end;
+    int64_t length;                 /* End of the mapped range */
+    GArray *entries;                /* MapEntry from @start to at least @end */
+    int *running_coroutines;
+} ImgMapSlice;
+
+static void coroutine_fn map_co_slice(void *opaque)
+{
+    ImgMapSlice *slice = opaque;
+    int64_t offset = slice->start;
+    MapEntry e;
+
+    /*
+     * Entries are not limited to the slice, so that they start at the
+     * same offsets as those of a serial walk.  Errors are left for the
+     * serial walk to report.
+     */
+    while (offset < slice->end) {
+        if (get_block_status(slice->bs, offset, slice->length - offset,
+                             &e) < 0) {
+            break;
+        }
+        g_array_append_val(slice->entries, e);
+        offset += e.length;
+    }
+
+    (*slice->running_coroutines)--;
+}
+
 static int img_map(int argc, char **argv)
 {
     int c;
@@ -3156,11 +3743,15 @@ static int img_map(int argc, char **argv)
     const char *filename, *fmt, *output;
     int64_t length;
     MapEntry curr = { .length = 0 }, next;
+    ImgMapSlice slices[MAP_COROUTINES];
+    int nb_slices, running_coroutines;
+    int64_t offset, slice_start;
     int ret = 0;
     bool image_opts = false;
     bool force_share = false;
     int64_t start_offset = 0;
     int64_t max_length = -1;
+    int i;
 
     fmt = NULL;
     output = NULL;
@@ -3257,28 +3848,78 @@ static int img_map(int argc, char **argv)
     }
 
     curr.start = start_offset;
-    while (curr.start + curr.length < length) {
-        int64_t offset = curr.start + curr.length;
-        int64_t n = length - offset;
+    offset = start_offset;
+    slice_start = start_offset;
+    while (offset < length) {
+        /* Query the next slices concurrently */
+        slice_start = MAX(slice_start, offset);
+        running_coroutines = 0;
+        for (nb_slices = 0;
+             nb_slices < MAP_COROUTINES && slice_start < length;
+             nb_slices++)
+        {
+            ImgMapSlice *slice = &slices[nb_slices];
 
-        ret = get_block_status(bs, offset, n, &next);
-        if (ret < 0) {
-            error_report("Could not read file metadata: %s", strerror(-ret));
-            goto out;
-        }
+            *slice = (ImgMapSlice) {
+                .bs = bs,
+                .start = slice_start,
+                .end = MIN(slice_start + MAP_SLICE_SIZE, length),
+                .length = length,
+                .entries = g_array_new(false, false, sizeof(MapEntry)),
+                .running_coroutines = &running_coroutines,
+            };
+            slice_start = slice->end;
 
-        if (entry_mergeable(&curr, &next)) {
-            curr.length += next.length;
-            continue;
+            running_coroutines++;
+            qemu_coroutine_enter(qemu_coroutine_create(map_co_slice, slice));
+        }
+        while (running_coroutines) {
+            main_loop_wait(false);
         }
 
-        if (curr.length > 0) {
-            ret = dump_map_entry(output_format, &curr, &next);
-            if (ret < 0) {
-                goto out;
+        /*
+         * Walk the entries in order.  Where the walk gets out of step with
+         * the entries of a slice, i.e. when the previous entry ends in the
+         * middle of one, query serially until they meet again.
+         */
+        ret = 0;
+        for (i = 0; i < nb_slices && ret >= 0; i++) {
+            ImgMapSlice *slice = &slices[i];
+            guint j = 0;
+
+            while (offset < slice->end) {
+                while (j < slice->entries->len &&
+                       g_array_index(slice->entries, MapEntry, j).start <
+                       offset) {
+                    j++;
+                }
+                if (j < slice->entries->len &&
+                    g_array_index(slice->entries, MapEntry, j).start ==
+                    offset) {
+                    next = g_array_index(slice->entries, MapEntry, j++);
+                } else {
+                    ret = get_block_status(bs, offset, length - offset, &next);
+                    if (ret < 0) {
+                        error_report("Could not read file metadata: %s",
+                                     strerror(-ret));
+                        break;
+                    }
+                }
+
+                offset += next.length;
+                ret = map_add_entry(output_format, &curr, &next);
+                if (ret < 0) {
+                    break;
+                }
             }
         }
-        curr = next;
+
+        for (i = 0; i < nb_slices; i++) {
+            g_array_free(slices[i].entries, true);
+        }
+        if (ret < 0) {
+            goto out;
+        }
     }
 
     ret = dump_map_entry(output_format, &curr, NULL);
@@ -4248,7 +4889,26 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    int64_t start_ns;
+    bool write;
+} BenchRequest;
+
+/* Statistics of the requests of one direction */
+typedef struct BenchStats {
+    uint64_t nr_ops;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t lat_buckets[BLOCK_ACCT_LAT_BUCKETS];
+} BenchStats;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
     bool write;
@@ -4258,13 +4918,96 @@ typedef struct BenchData {
     int n;
     int flush_interval;
     bool drain_on_flush;
+    bool random;
+    int rwmixread;              /* Percentage of reads in a write test */
+    int64_t rate_ns;            /* Interval between requests, 0 if unlimited */
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    int *free_reqs;
+    int nr_free_reqs;
+    GRand *rand;
+    QEMUTimer *rate_timer;
 
     int in_flight;
     bool in_flush;
+    bool draining;
     uint64_t offset;
-} BenchData;
+    int64_t next_ns;            /* When the next request is due */
+    BenchStats stats[2];        /* Indexed by BenchRequest.write */
+};
+
+static void bench_request_cb(void *opaque, int ret);
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset, nr_blocks;
+
+    if (b->random) {
+        nr_blocks = MAX(b->image_size / b->bufsize, 1);
+        offset = ((uint64_t)g_rand_int(b->rand) << 32) | g_rand_int(b->rand);
+        return (offset % nr_blocks) * b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
+static void bench_submit(BenchData *b)
+{
+    BlockAIOCB *acb;
+
+    if (b->in_flush || b->draining) {
+        return;
+    }
+
+    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        BenchRequest *req;
+        int64_t offset;
+
+        if (b->rate_ns && b->next_ns > now) {
+            timer_mod(b->rate_timer, b->next_ns);
+            break;
+        }
+
+        req = &b->reqs[b->free_reqs[--b->nr_free_reqs]];
+        if (b->rate_ns) {
+            /* Latency includes the time a late request had to wait */
+            req->start_ns = b->next_ns;
+            b->next_ns += b->rate_ns;
+        } else {
+            req->start_ns = now;
+        }
+        req->write = b->write &&
+                     (!b->rwmixread ||
+                      g_rand_int_range(b->rand, 0, 100) >= b->rwmixread);
+
+        /* blk_aio_* might look for completed I/Os and kick bench_cb
+         * again, so make sure this operation is counted by in_flight
+         * and b->offset is ready for the next submission.
+         */
+        b->in_flight++;
+        offset = bench_next_offset(b);
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_request_cb, req);
+        } else {
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_request_cb, req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void bench_rate_timer_cb(void *opaque)
+{
+    bench_submit(opaque);
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4288,6 +5031,7 @@ static void bench_cb(void *opaque, int ret)
         /* Just finished a flush with drained queue: Start next requests */
         assert(b->in_flight == 0);
         b->in_flush = false;
+        b->draining = false;
     } else if (b->in_flight > 0) {
         int remaining = b->n - b->in_flight;
 
@@ -4313,30 +5057,128 @@ static void bench_cb(void *opaque, int ret)
                 }
             }
             if (b->drain_on_flush) {
+                b->draining = true;
                 return;
             }
         }
     }
 
-    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
-        /* blk_aio_* might look for completed I/Os and kick bench_cb
-         * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
-         */
-        b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
-        } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
-        }
-        if (!acb) {
-            error_report("Failed to issue request");
-            exit(EXIT_FAILURE);
-        }
+    bench_submit(b);
+}
+
+static void bench_request_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    BenchStats *stats = &b->stats[req->write];
+    int64_t latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                         req->start_ns;
+
+    latency_ns = MAX(latency_ns, 0);
+    if (ret >= 0) {
+        stats->min_ns = stats->nr_ops ? MIN(stats->min_ns, latency_ns)
+                                      : latency_ns;
+        stats->max_ns = MAX(stats->max_ns, latency_ns);
+        stats->nr_ops++;
+        stats->bytes += b->bufsize;
+        stats->total_ns += latency_ns;
+        stats->lat_buckets[block_acct_latency_bucket(latency_ns)]++;
+    }
+
+    b->free_reqs[b->nr_free_reqs++] = req - b->reqs;
+    bench_cb(b, ret);
+}
+
+static const double bench_lat_fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *const bench_lat_names[] = { "p50", "p90", "p99", "p99.9" };
+
+/* Per-second rate of @n, 0 for runs too short to be measured */
+static double bench_rate(uint64_t n, double secs)
+{
+    return secs > 0 ? n / secs : 0;
+}
+
+static void bench_latency_percentiles(const BenchStats *stats, uint64_t *lat)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(bench_lat_fractions); i++) {
+        lat[i] = stats->nr_ops ?
+                 block_acct_latency_percentile(stats->lat_buckets,
+                                               stats->nr_ops,
+                                               bench_lat_fractions[i]) :
+                 0;
+    }
+}
+
+static double bench_mean_ns(const BenchStats *stats)
+{
+    return stats->nr_ops ? (double)stats->total_ns / stats->nr_ops : 0;
+}
+
+static QDict *bench_stats_to_qdict(const BenchStats *stats, double secs)
+{
+    uint64_t lat[ARRAY_SIZE(bench_lat_fractions)];
+    QDict *dict = qdict_new();
+    QDict *latency = qdict_new();
+    int i;
+
+    bench_latency_percentiles(stats, lat);
+
+    qdict_put(dict, "requests", qnum_from_uint(stats->nr_ops));
+    qdict_put(dict, "bytes", qnum_from_uint(stats->bytes));
+    qdict_put(dict, "iops", qnum_from_double(bench_rate(stats->nr_ops, secs)));
+    qdict_put(dict, "bytes-per-second",
+              qnum_from_double(bench_rate(stats->bytes, secs)));
+
+    qdict_put(latency, "min", qnum_from_uint(stats->min_ns));
+    qdict_put(latency, "mean", qnum_from_double(bench_mean_ns(stats)));
+    qdict_put(latency, "max", qnum_from_uint(stats->max_ns));
+    for (i = 0; i < ARRAY_SIZE(bench_lat_fractions); i++) {
+        qdict_put(latency, bench_lat_names[i], qnum_from_uint(lat[i]));
+    }
+    qdict_put(dict, "latency-ns", latency);
+
+    return dict;
+}
+
+static void dump_json_bench_stats(const BenchStats *stats, double secs)
+{
+    GString *str;
+    QDict *dict = qdict_new();
+
+    qdict_put(dict, "seconds", qnum_from_double(secs));
+    qdict_put(dict, "read", bench_stats_to_qdict(&stats[false], secs));
+    qdict_put(dict, "write", bench_stats_to_qdict(&stats[true], secs));
+
+    str = qobject_to_json_pretty(QOBJECT(dict), true);
+    printf("%s\n", str->str);
+    qobject_unref(dict);
+    g_string_free(str, true);
+}
+
+static void dump_human_bench_stats(const char *name, const BenchStats *stats,
+                                   double secs)
+{
+    uint64_t lat[ARRAY_SIZE(bench_lat_fractions)];
+    int i;
+
+    if (!stats->nr_ops) {
+        return;
     }
+
+    bench_latency_percentiles(stats, lat);
+
+    printf("%s: %" PRIu64 " requests, %.1f IOPS, %.2f MiB/s\n",
+           name, stats->nr_ops, bench_rate(stats->nr_ops, secs),
+           bench_rate(stats->bytes, secs) / MiB);
+    printf("  latency (us): min %.1f, avg %.1f, max %.1f",
+           stats->min_ns / 1000.0, bench_mean_ns(stats) / 1000,
+           stats->max_ns / 1000.0);
+    for (i = 0; i < ARRAY_SIZE(bench_lat_fractions); i++) {
+        printf(", %s %.1f", bench_lat_names[i], lat[i] / 1000.0);
+    }
+    printf("\n");
 }
 
 static int img_bench(int argc, char **argv)
@@ -4354,12 +5196,18 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    bool is_random = false;
+    int rwmixread = 0;
+    int64_t rate = 0;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *output = NULL;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    double secs;
     int i;
     bool force_share = false;
     size_t buf_size;
@@ -4372,6 +5220,10 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"rwmixread", required_argument, 0, OPTION_RWMIXREAD},
+            {"rate", required_argument, 0, OPTION_RATE},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4505,6 +5357,35 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_RANDOM:
+            is_random = true;
+            break;
+        case OPTION_RWMIXREAD:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            rwmixread = res;
+            break;
+        }
+        case OPTION_RATE:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res == 0 ||
+                res > NANOSECONDS_PER_SECOND) {
+                error_report("Invalid rate specified");
+                return 1;
+            }
+            rate = res;
+            break;
+        }
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -4513,11 +5394,27 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        ret = -1;
+        goto out;
+    }
+
     if (!is_write && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
     }
+    if (!is_write && rwmixread) {
+        error_report("--rwmixread is only available in write tests");
+        ret = -1;
+        goto out;
+    }
+
     if (flush_interval && flush_interval < depth) {
         error_report("Flush interval can't be smaller than depth");
         ret = -1;
@@ -4548,13 +5445,30 @@ static int img_bench(int argc, char **argv)
         .write          = is_write,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
+        .random         = is_random,
+        .rwmixread      = rwmixread,
+        .rate_ns        = rate ? NANOSECONDS_PER_SECOND / rate : 0,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (output_format == OFORMAT_HUMAN) {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel ",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq);
+        if (is_random) {
+            printf("(random offsets)\n");
+        } else {
+            printf("(starting at offset %" PRId64 ", step size %d)\n",
+                   data.offset, data.step);
+        }
+        if (rwmixread) {
+            printf("Reading instead of writing in %d%% of the requests\n",
+                   rwmixread);
+        }
+        if (rate) {
+            printf("Sending %" PRId64 " requests per second\n", rate);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
     }
 
     buf_size = data.nrreq * data.bufsize;
@@ -4563,14 +5477,24 @@ static int img_bench(int argc, char **argv)
 
     blk_register_buf(blk, data.buf, buf_size);
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
+    data.reqs = g_new0(BenchRequest, data.nrreq);
+    data.free_reqs = g_new(int, data.nrreq);
     for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov,
                        data.buf + i * data.bufsize, data.bufsize);
+        data.free_reqs[i] = data.nrreq - 1 - i;
     }
+    data.nr_free_reqs = data.nrreq;
+
+    /* A fixed seed makes random runs comparable */
+    data.rand = g_rand_new_with_seed(0);
+    data.rate_timer = timer_new_ns(QEMU_CLOCK_REALTIME, bench_rate_timer_cb,
+                                   &data);
 
     gettimeofday(&t1, NULL);
+    data.next_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bench_cb(&data, 0);
 
     while (data.n > 0) {
@@ -4578,11 +5502,30 @@ static int img_bench(int argc, char **argv)
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    secs = (t2.tv_sec - t1.tv_sec) +
+           ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    if (output_format == OFORMAT_JSON) {
+        dump_json_bench_stats(data.stats, secs);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", secs);
+        dump_human_bench_stats("read", &data.stats[false], secs);
+        dump_human_bench_stats("write", &data.stats[true], secs);
+    }
 
 out:
+    if (data.rate_timer) {
+        timer_free(data.rate_timer);
+    }
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    if (data.reqs) {
+        for (i = 0; i < data.nrreq; i++) {
+            qemu_iovec_destroy(&data.reqs[i].qiov);
+        }
+    }
+    g_free(data.reqs);
+    g_free(data.free_reqs);
     if (data.buf) {
         blk_unregister_buf(blk, data.buf);
     }
@@ -640,14 +640,14 @@ void x86_cpu_vendor_words2str(char *dst, uint32_t vendor1,
           CPUID_7_0_EBX_BMI1 | CPUID_7_0_EBX_BMI2 | CPUID_7_0_EBX_ADX | \
           CPUID_7_0_EBX_PCOMMIT | CPUID_7_0_EBX_CLFLUSHOPT |            \
           CPUID_7_0_EBX_CLWB | CPUID_7_0_EBX_MPX | CPUID_7_0_EBX_FSGSBASE | \
-          CPUID_7_0_EBX_ERMS)
+          CPUID_7_0_EBX_ERMS | CPUID_7_0_EBX_SGX)
           /* missing:
           CPUID_7_0_EBX_HLE, CPUID_7_0_EBX_AVX2,
           CPUID_7_0_EBX_INVPCID, CPUID_7_0_EBX_RTM,
           CPUID_7_0_EBX_RDSEED */
 #define TCG_7_0_ECX_FEATURES (CPUID_7_0_ECX_PKU | \
           /* CPUID_7_0_ECX_OSPKE is dynamic */ \
-          CPUID_7_0_ECX_LA57 | CPUID_7_0_ECX_PKS)
+          CPUID_7_0_ECX_LA57 | CPUID_7_0_ECX_PKS | CPUID_7_0_ECX_SGX_LC)
 #define TCG_7_0_EDX_FEATURES 0
 #define TCG_7_1_EAX_FEATURES 0
 #define TCG_APM_FEATURES 0
@@ -656,9 +656,10 @@ void x86_cpu_vendor_words2str(char *dst, uint32_t vendor1,
           /* missing:
           CPUID_XSAVE_XSAVEC, CPUID_XSAVE_XSAVES */
 #define TCG_14_0_ECX_FEATURES 0
-#define TCG_SGX_12_0_EAX_FEATURES 0
+#define TCG_SGX_12_0_EAX_FEATURES CPUID_12_0_EAX_SGX1
 #define TCG_SGX_12_0_EBX_FEATURES 0
-#define TCG_SGX_12_1_EAX_FEATURES 0
+#define TCG_SGX_12_1_EAX_FEATURES (CPUID_12_1_EAX_DEBUG | \
+          CPUID_12_1_EAX_MODE64)
 
 FeatureWordInfo feature_word_info[FEATURE_WORDS] = {
     [FEAT_1_EDX] = {
@@ -5190,6 +5191,21 @@ uint32_t cpu_x86_virtual_addr_width(CPUX86State *env)
     }
 }
 
+/*
+ * SGX needs support from hardware with KVM.  TCG emulates it, but only if
+ * the machine has an EPC that is plain memory.
+ */
+static bool x86_sgx_supported(CPUState *cs, int reg, uint32_t mask)
+{
+#ifndef CONFIG_USER_ONLY
+    if (tcg_enabled()) {
+        return sgx_epc_is_emulated();
+    }
+#endif
+    return kvm_enabled() &&
+           (kvm_arch_get_supported_cpuid(cs->kvm_state, 0x7, 0, reg) & mask);
+}
+
 void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
                    uint32_t *eax, uint32_t *ebx,
                    uint32_t *ecx, uint32_t *edx)
@@ -5339,21 +5355,19 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
             *edx = env->features[FEAT_7_0_EDX]; /* Feature flags */
 
             /*
-             * SGX cannot be emulated in software.  If hardware does not
-             * support enabling SGX and/or SGX flexible launch control,
-             * then we need to update the VM's CPUID values accordingly.
+             * If hardware does not support enabling SGX and/or SGX flexible
+             * launch control, or there is no EPC for TCG to emulate SGX
+             * with, then we need to update the VM's CPUID values
+             * accordingly.
              */
             if ((*ebx & CPUID_7_0_EBX_SGX) &&
-                (!kvm_enabled() ||
-                 !(kvm_arch_get_supported_cpuid(cs->kvm_state, 0x7, 0, R_EBX) &
-                    CPUID_7_0_EBX_SGX))) {
+                !x86_sgx_supported(cs, R_EBX, CPUID_7_0_EBX_SGX)) {
                 *ebx &= ~CPUID_7_0_EBX_SGX;
             }
 
             if ((*ecx & CPUID_7_0_ECX_SGX_LC) &&
-                (!(*ebx & CPUID_7_0_EBX_SGX) || !kvm_enabled() ||
-                 !(kvm_arch_get_supported_cpuid(cs->kvm_state, 0x7, 0, R_ECX) &
-                    CPUID_7_0_ECX_SGX_LC))) {
+                (!(*ebx & CPUID_7_0_EBX_SGX) ||
+                 !x86_sgx_supported(cs, R_ECX, CPUID_7_0_ECX_SGX_LC))) {
                 *ecx &= ~CPUID_7_0_ECX_SGX_LC;
             }
         } else if (count == 1) {
@@ -5493,7 +5507,7 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
     }
     case 0x12:
 #ifndef CONFIG_USER_ONLY
-        if (!kvm_enabled() ||
+        if (!x86_sgx_supported(cs, R_EBX, CPUID_7_0_EBX_SGX) ||
             !(env->features[FEAT_7_0_EBX] & CPUID_7_0_EBX_SGX)) {
             *eax = *ebx = *ecx = *edx = 0;
             break;
@@ -5512,7 +5526,11 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
                 *eax = *ebx = *ecx = *edx = 0;
                 break;
             }
-            host_cpuid(index, 2, eax, ebx, ecx, edx);
+            if (kvm_enabled()) {
+                host_cpuid(index, 2, eax, ebx, ecx, edx);
+            } else {
+                *ecx = 0;
+            }
             *eax = (uint32_t)(epc_addr & 0xfffff000) | 0x1;
             *ebx = (uint32_t)(epc_addr >> 32);
             *ecx = (uint32_t)(epc_size & 0xfffff000) | (*ecx & 0xf);
@@ -5520,6 +5538,27 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
             break;
         }
 
+        /*
+         * TCG emulates SGX1 for enclaves of up to 2^31 bytes outside of
+         * 64-bit mode and 2^36 bytes in 64-bit mode.  XFRM may contain any
+         * state component that the CPU enumerates.
+         */
+        if (tcg_enabled()) {
+            if (count == 0) {
+                *eax = env->features[FEAT_SGX_12_0_EAX];
+                *ebx = env->features[FEAT_SGX_12_0_EBX];
+                *ecx = 0;
+                *edx = (36 << 8) | 31;
+            } else {
+                *eax = env->features[FEAT_SGX_12_1_EAX];
+                *ebx = 0;
+                *ecx = env->features[FEAT_XSAVE_COMP_LO] |
+                       XSTATE_FP_MASK | XSTATE_SSE_MASK;
+                *edx = env->features[FEAT_XSAVE_COMP_HI];
+            }
+            break;
+        }
+
         /*
          * SGX sub-leafs CPUID.0x12.{0x0,0x1} are heavily dependent on hardware
          * and KVM, i.e. QEMU cannot emulate features to override what KVM
@@ -318,6 +318,7 @@ typedef enum X86Seg {
 #define PG_ERROR_RSVD_MASK 0x08
 #define PG_ERROR_I_D_MASK  0x10
 #define PG_ERROR_PK_MASK   0x20
+#define PG_ERROR_SGX_MASK  0x8000
 
 #define PG_MODE_PAE      (1 << 0)
 #define PG_MODE_LMA      (1 << 1)
@@ -856,6 +857,13 @@ typedef uint64_t FeatureWordArray[FEATURE_WORDS];
 /* AVX512 BFloat16 Instruction */
 #define CPUID_7_1_EAX_AVX512_BF16       (1U << 5)
 
+/* SGX1 leaf functions */
+#define CPUID_12_0_EAX_SGX1             (1U << 0)
+/* SGX enclaves may be launched in debug mode */
+#define CPUID_12_1_EAX_DEBUG            (1U << 1)
+/* SGX enclaves may run in 64-bit mode */
+#define CPUID_12_1_EAX_MODE64           (1U << 2)
+
 /* Packets which contain IP payload have LIP values */
 #define CPUID_14_0_ECX_LIP              (1U << 31)
 
@@ -1183,6 +1191,20 @@ typedef struct SegmentCache {
     uint32_t flags;
 } SegmentCache;
 
+/* State of a logical processor in enclave mode, see tcg/sysemu/sgx_helper.c */
+typedef struct X86SGXState {
+    struct SGXEnclave *encl;    /* NULL outside of enclave mode */
+    target_ulong tcs;           /* linear address of the TCS in use */
+    hwaddr tcs_paddr;
+    hwaddr gprsgx_paddr;        /* where an AEX saves the register state */
+    hwaddr xsave_paddr;         /* ... and the XSAVE state components */
+    target_ulong aep;           /* asynchronous exit pointer */
+    target_ulong ursp;          /* RSP and RBP outside of the enclave */
+    target_ulong urbp;
+    SegmentCache fs;            /* FS and GS outside of the enclave */
+    SegmentCache gs;
+} X86SGXState;
+
 #define MMREG_UNION(n, bits)        \
     union n {                       \
         uint8_t  _b_##n[(bits)/8];  \
@@ -1606,6 +1628,9 @@ typedef struct CPUX86State {
     uint8_t v_tpr;
     uint32_t int_ctl;
 
+    /* SGX enclave mode, only used when TCG emulates SGX */
+    X86SGXState sgx;
+
     /* KVM states, automatically cleared on reset */
     uint8_t nmi_injected;
     uint8_t nmi_pending;
@@ -2002,8 +2027,14 @@ void host_cpuid(uint32_t function, uint32_t count,
 void x86_cpu_set_a20(X86CPU *cpu, int a20_state);
 
 #ifndef CONFIG_USER_ONLY
+/* TCG maps EPC accesses from outside of their enclave to an abort page */
+#define X86_ASIDX_SGX_ABORT 2
+
 static inline int x86_asidx_from_attrs(CPUState *cs, MemTxAttrs attrs)
 {
+    if (attrs.target_tlb_bit0) {
+        return X86_ASIDX_SGX_ABORT;
+    }
     return !!attrs.secure;
 }
 
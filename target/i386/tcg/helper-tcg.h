@@ -51,6 +51,9 @@ void x86_cpu_record_sigsegv(CPUState *cs, vaddr addr,
 bool x86_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
                       MMUAccessType access_type, int mmu_idx,
                       bool probe, uintptr_t retaddr);
+hwaddr x86_cpu_get_physical_address(CPUX86State *env, vaddr addr,
+                                    MMUAccessType access_type, int mmu_idx,
+                                    uintptr_t retaddr);
 #endif
 
 void breakpoint_handler(CPUState *cs);
@@ -93,6 +96,18 @@ void QEMU_NORETURN cpu_vmexit(CPUX86State *nenv, uint32_t exit_code,
 void do_vmexit(CPUX86State *env);
 #endif
 
+/* sysemu/sgx_helper.c */
+#ifndef CONFIG_USER_ONLY
+extern bool x86_sgx_active;
+int x86_sgx_check_access(CPUX86State *env, vaddr addr, hwaddr paddr,
+                         int is_write1, int mmu_idx, int *prot,
+                         MemTxAttrs *attrs);
+void x86_sgx_aex(CPUX86State *env, int intno, int is_int,
+                 target_ulong next_eip);
+MemoryRegion *x86_sgx_abort_region(void);
+void x86_sgx_machine_done(void);
+#endif
+
 /* seg_helper.c */
 void do_interrupt_x86_hardirq(CPUX86State *env, int intno, int is_hw);
 void do_interrupt_all(X86CPU *cpu, int intno, int is_int,
@@ -1067,6 +1067,13 @@ void do_interrupt_all(X86CPU *cpu, int intno, int is_int,
             count++;
         }
     }
+#if !defined(CONFIG_USER_ONLY)
+    if (env->sgx.encl) {
+        /* Leave the enclave first, the handler returns to the AEP */
+        x86_sgx_aex(env, intno, is_int, next_eip);
+        next_eip = env->eip;
+    }
+#endif
     if (env->cr[0] & CR0_PE_MASK) {
 #if !defined(CONFIG_USER_ONLY)
         if (env->hflags & HF_GUEST_MASK) {
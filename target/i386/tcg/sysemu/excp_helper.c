@@ -382,20 +382,34 @@ hwaddr get_hphys(CPUState *cs, hwaddr gphys, MMUAccessType access_type,
     cpu_vmexit(env, SVM_EXIT_NPF, exit_info_1, env->retaddr);
 }
 
-/* return value:
- * -1 = cannot handle fault
- * 0  = nothing more to do
- * 1  = generate PF fault
+static void page_fault(CPUState *cs, vaddr addr, int error_code)
+{
+    CPUX86State *env = &X86_CPU(cs)->env;
+
+    if (env->intercept_exceptions & (1 << EXCP0E_PAGE)) {
+        /* cr2 is not modified in case of exceptions */
+        x86_stq_phys(cs,
+                 env->vm_vmcb + offsetof(struct vmcb, control.exit_info_2),
+                 addr);
+    } else {
+        env->cr[2] = addr;
+    }
+    env->error_code = error_code;
+    cs->exception_index = EXCP0E_PAGE;
+}
+
+/*
+ * Translates the linear address @addr.  On a fault, sets up the exception
+ * to be raised in cs->exception_index and env->error_code and returns false.
  */
-static int handle_mmu_fault(CPUState *cs, vaddr addr, int size,
-                            int is_write1, int mmu_idx)
+static bool get_physical_address(CPUState *cs, vaddr addr, int is_write1,
+                                 int mmu_idx, hwaddr *paddr, int *prot,
+                                 int *page_size)
 {
     X86CPU *cpu = X86_CPU(cs);
     CPUX86State *env = &cpu->env;
     int error_code = PG_ERROR_OK;
-    int pg_mode, prot, page_size;
-    hwaddr paddr;
-    hwaddr vaddr;
+    int pg_mode;
 
 #if defined(DEBUG_MMU)
     printf("MMU fault: addr=%" VADDR_PRIx " w=%d mmu=%d eip=" TARGET_FMT_lx "\n",
@@ -403,15 +417,15 @@ static int handle_mmu_fault(CPUState *cs, vaddr addr, int size,
 #endif
 
     if (!(env->cr[0] & CR0_PG_MASK)) {
-        paddr = addr;
+        *paddr = addr;
 #ifdef TARGET_X86_64
         if (!(env->hflags & HF_LMA_MASK)) {
             /* Without long mode we can only address 32bits in real mode */
-            paddr = (uint32_t)paddr;
+            *paddr = (uint32_t)*paddr;
         }
 #endif
-        prot = PAGE_READ | PAGE_WRITE | PAGE_EXEC;
-        page_size = 4096;
+        *prot = PAGE_READ | PAGE_WRITE | PAGE_EXEC;
+        *page_size = 4096;
     } else {
         pg_mode = get_pg_mode(env);
         if (pg_mode & PG_MODE_LMA) {
@@ -422,38 +436,87 @@ static int handle_mmu_fault(CPUState *cs, vaddr addr, int size,
             if (sext != 0 && sext != -1) {
                 env->error_code = 0;
                 cs->exception_index = EXCP0D_GPF;
-                return 1;
+                return false;
             }
         }
 
         error_code = mmu_translate(cs, addr, get_hphys, env->cr[3], is_write1,
                                    mmu_idx, pg_mode,
-                                   &paddr, &page_size, &prot);
+                                   paddr, page_size, prot);
     }
 
-    if (error_code == PG_ERROR_OK) {
-        /* Even if 4MB pages, we map only one 4KB page in the cache to
-           avoid filling it too fast */
-        vaddr = addr & TARGET_PAGE_MASK;
-        paddr &= TARGET_PAGE_MASK;
+    if (error_code != PG_ERROR_OK) {
+        page_fault(cs, addr, error_code);
+        return false;
+    }
+    return true;
+}
 
-        assert(prot & (1 << is_write1));
-        tlb_set_page_with_attrs(cs, vaddr, paddr, cpu_get_mem_attrs(env),
-                                prot, mmu_idx, page_size);
-        return 0;
-    } else {
-        if (env->intercept_exceptions & (1 << EXCP0E_PAGE)) {
-            /* cr2 is not modified in case of exceptions */
-            x86_stq_phys(cs,
-                     env->vm_vmcb + offsetof(struct vmcb, control.exit_info_2),
-                     addr);
-        } else {
-            env->cr[2] = addr;
-        }
-        env->error_code = error_code;
-        cs->exception_index = EXCP0E_PAGE;
+/* return value:
+ * -1 = cannot handle fault
+ * 0  = nothing more to do
+ * 1  = generate PF fault
+ */
+static int handle_mmu_fault(CPUState *cs, vaddr addr, int size,
+                            int is_write1, int mmu_idx)
+{
+    X86CPU *cpu = X86_CPU(cs);
+    CPUX86State *env = &cpu->env;
+    MemTxAttrs attrs = cpu_get_mem_attrs(env);
+    int prot, page_size;
+    int error_code;
+    hwaddr paddr;
+    hwaddr vaddr;
+
+    if (!get_physical_address(cs, addr, is_write1, mmu_idx,
+                              &paddr, &prot, &page_size)) {
         return 1;
     }
+
+    if (unlikely(x86_sgx_active)) {
+        error_code = x86_sgx_check_access(env, addr, paddr, is_write1, mmu_idx,
+                                          &prot, &attrs);
+        if (error_code < 0) {
+            env->error_code = 0;
+            cs->exception_index = EXCP0D_GPF;
+            return 1;
+        } else if (error_code) {
+            page_fault(cs, addr, error_code);
+            return 1;
+        }
+    }
+
+    /* Even if 4MB pages, we map only one 4KB page in the cache to
+       avoid filling it too fast */
+    vaddr = addr & TARGET_PAGE_MASK;
+    paddr &= TARGET_PAGE_MASK;
+
+    assert(prot & (1 << is_write1));
+    tlb_set_page_with_attrs(cs, vaddr, paddr, attrs, prot, mmu_idx, page_size);
+    return 0;
+}
+
+/*
+ * Translates the linear address @addr like a guest access with @mmu_idx
+ * would, raising the resulting exception on a fault.  Unlike a TLB fill,
+ * this does not apply SGX access control, so that ENCLS can get at EPC
+ * pages.
+ */
+hwaddr x86_cpu_get_physical_address(CPUX86State *env, vaddr addr,
+                                    MMUAccessType access_type, int mmu_idx,
+                                    uintptr_t retaddr)
+{
+    CPUState *cs = env_cpu(env);
+    int prot, page_size;
+    hwaddr paddr;
+
+    env->retaddr = retaddr;
+    if (!get_physical_address(cs, addr, access_type, mmu_idx,
+                              &paddr, &prot, &page_size)) {
+        raise_exception_err_ra(env, cs->exception_index,
+                               env->error_code, retaddr);
+    }
+    return paddr;
 }
 
 bool x86_cpu_tlb_fill(CPUState *cs, vaddr addr, int size,
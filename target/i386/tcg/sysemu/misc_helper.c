@@ -282,6 +282,23 @@ void helper_wrmsr(CPUX86State *env)
     case MSR_IA32_MISC_ENABLE:
         env->msr_ia32_misc_enable = val;
         break;
+    case MSR_IA32_FEATURE_CONTROL:
+        if (env->msr_ia32_feature_control & FEATURE_CONTROL_LOCKED) {
+            goto error;
+        }
+        env->msr_ia32_feature_control = val;
+        break;
+    case MSR_IA32_SGXLEPUBKEYHASH0 ... MSR_IA32_SGXLEPUBKEYHASH3:
+        /* Only writable if firmware has unlocked launch control */
+        if (!(env->features[FEAT_7_0_ECX] & CPUID_7_0_ECX_SGX_LC) ||
+            (env->msr_ia32_feature_control &
+             (FEATURE_CONTROL_LOCKED | FEATURE_CONTROL_SGX_LC)) !=
+            (FEATURE_CONTROL_LOCKED | FEATURE_CONTROL_SGX_LC)) {
+            goto error;
+        }
+        env->msr_ia32_sgxlepubkeyhash[(uint32_t)env->regs[R_ECX] -
+                                      MSR_IA32_SGXLEPUBKEYHASH0] = val;
+        break;
     case MSR_IA32_BNDCFGS:
         /* FIXME: #GP if reserved bits are set.  */
         /* FIXME: Extend highest implemented bit of linear address.  */
@@ -443,6 +460,13 @@ void helper_rdmsr(CPUX86State *env)
     case MSR_IA32_MISC_ENABLE:
         val = env->msr_ia32_misc_enable;
         break;
+    case MSR_IA32_FEATURE_CONTROL:
+        val = env->msr_ia32_feature_control;
+        break;
+    case MSR_IA32_SGXLEPUBKEYHASH0 ... MSR_IA32_SGXLEPUBKEYHASH3:
+        val = env->msr_ia32_sgxlepubkeyhash[(uint32_t)env->regs[R_ECX] -
+                                            MSR_IA32_SGXLEPUBKEYHASH0];
+        break;
     case MSR_IA32_BNDCFGS:
         val = env->msr_bndcfgs;
         break;
@@ -0,0 +1,1647 @@
+/*
+ *  x86 SGX helpers - sysemu code
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * TCG emulates the SGX1 leaf functions of ENCLS and ENCLU on top of an EPC
+ * that is plain guest memory (memory-backend-epc with emulated=on).  The
+ * EPCM lives in QEMU and access control is enforced when filling the TLB:
+ *
+ * - In enclave mode, linear addresses inside ELRANGE must map to a valid,
+ *   unblocked regular page of the current enclave that was added at that
+ *   very linear address.  The EPCM permissions further restrict those of
+ *   the page tables.  Anything else raises a #PF with the SGX bit set.
+ * - All other accesses to the EPC go to an abort page: reads return all
+ *   ones and writes are dropped.
+ *
+ * TLB entries thus depend on the enclave mode and are flushed whenever a
+ * logical processor enters or leaves an enclave.  EPCM changes that revoke
+ * access flush the page from the TLBs of all CPUs synchronously, so the
+ * EBLOCK/ETRACK protocol is satisfied as soon as ETRACK returns.
+ *
+ * ENCLS and ENCLU do everything that can fault (reading operands and
+ * translating addresses) before taking sgx.lock; under the lock, memory
+ * is only accessed by physical address.
+ *
+ * Limitations: pages evicted with EWB are integrity protected and bound to
+ * their version, but not encrypted; the RSA signature of SIGSTRUCT is not
+ * verified and launch tokens are not supported (launch control only);
+ * EREPORT, EGETKEY and SGX2 are not implemented.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/guest-random.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "cpu.h"
+#include "exec/address-spaces.h"
+#include "exec/exec-all.h"
+#include "exec/helper-proto.h"
+#include "exec/cpu_ldst.h"
+#include "hw/i386/sgx-epc.h"
+#include "migration/blocker.h"
+#include "sysemu/reset.h"
+#include "tcg/helper-tcg.h"
+#include "tcg/tcg-cpu.h"
+
+#define SGX_PAGE_SIZE           4096
+
+/* ENCLS leaf functions */
+enum {
+    SGX_ECREATE = 0x0,
+    SGX_EADD = 0x1,
+    SGX_EINIT = 0x2,
+    SGX_EREMOVE = 0x3,
+    SGX_EEXTEND = 0x6,
+    SGX_ELDB = 0x7,
+    SGX_ELDU = 0x8,
+    SGX_EBLOCK = 0x9,
+    SGX_EPA = 0xa,
+    SGX_EWB = 0xb,
+    SGX_ETRACK = 0xc,
+};
+
+/* ENCLU leaf functions */
+enum {
+    SGX_EENTER = 0x2,
+    SGX_ERESUME = 0x3,
+    SGX_EEXIT = 0x4,
+};
+
+/* ENCLS error codes, returned in EAX */
+enum {
+    SGX_SUCCESS = 0,
+    SGX_INVALID_SIG_STRUCT = 1,
+    SGX_INVALID_ATTRIBUTE = 2,
+    SGX_BLKSTATE = 3,
+    SGX_INVALID_MEASUREMENT = 4,
+    SGX_NOTBLOCKABLE = 5,
+    SGX_PG_INVLD = 6,
+    SGX_MAC_COMPARE_FAIL = 9,
+    SGX_PAGE_NOT_BLOCKED = 10,
+    SGX_NOT_TRACKED = 11,
+    SGX_VA_SLOT_OCCUPIED = 12,
+    SGX_CHILD_PRESENT = 13,
+    SGX_ENCLAVE_ACT = 14,
+    SGX_INVALID_EINITTOKEN = 16,
+    SGX_PG_IS_SECS = 18,
+};
+
+/*
+ * Exceptions detected under sgx.lock; they are raised by sgx_check_fault()
+ * once the lock has been dropped.
+ */
+#define SGX_FAULT_GP            (-1)
+#define SGX_FAULT_PF            (-2)
+
+/* EPC page types */
+enum {
+    SGX_PT_SECS = 0,
+    SGX_PT_TCS = 1,
+    SGX_PT_REG = 2,
+    SGX_PT_VA = 3,
+};
+
+/* SECINFO */
+#define SGX_SECINFO_R           (1ULL << 0)
+#define SGX_SECINFO_W           (1ULL << 1)
+#define SGX_SECINFO_X           (1ULL << 2)
+#define SGX_SECINFO_PT_SHIFT    8
+#define SGX_SECINFO_PT_MASK     (0xffULL << SGX_SECINFO_PT_SHIFT)
+#define SGX_SECINFO_SIZE        64
+
+/* PAGEINFO */
+#define SGX_PAGEINFO_LINADDR    0
+#define SGX_PAGEINFO_SRCPGE     8
+#define SGX_PAGEINFO_SECINFO    16  /* PCMD for EWB, ELDB and ELDU */
+#define SGX_PAGEINFO_SECS       24
+#define SGX_PAGEINFO_SIZE       32
+
+/* PCMD */
+#define SGX_PCMD_ENCLAVEID      64
+#define SGX_PCMD_MAC            112
+#define SGX_PCMD_MAC_SIZE       16
+#define SGX_PCMD_SIZE           128
+
+/* SECS */
+#define SGX_SECS_SIZE           0
+#define SGX_SECS_BASEADDR       8
+#define SGX_SECS_SSAFRAMESIZE   16
+#define SGX_SECS_MISCSELECT     20
+#define SGX_SECS_EID            24  /* reserved, QEMU keeps the EID there */
+#define SGX_SECS_ATTRIBUTES     48
+#define SGX_SECS_XFRM           56
+#define SGX_SECS_MRENCLAVE      64
+#define SGX_SECS_MRSIGNER       128
+#define SGX_SECS_ISVPRODID      256
+#define SGX_SECS_ISVSVN         258
+
+#define SGX_ATTR_INIT           (1ULL << 0)
+#define SGX_ATTR_MODE64BIT      (1ULL << 2)
+
+/* TCS */
+#define SGX_TCS_OSSA            16
+#define SGX_TCS_CSSA            24
+#define SGX_TCS_NSSA            28
+#define SGX_TCS_OENTRY          32
+#define SGX_TCS_OFSBASE         48
+#define SGX_TCS_OGSBASE         56
+
+/* GPRSGX, at the end of each SSA frame; RAX to R15 come first */
+#define SGX_GPRSGX_RFLAGS       128
+#define SGX_GPRSGX_RIP          136
+#define SGX_GPRSGX_URSP         144
+#define SGX_GPRSGX_URBP         152
+#define SGX_GPRSGX_EXITINFO     160
+#define SGX_GPRSGX_FSBASE       168
+#define SGX_GPRSGX_GSBASE       176
+#define SGX_GPRSGX_SIZE         184
+
+#define SGX_EXITINFO_VALID      (1U << 31)
+#define SGX_EXITINFO_HW_EXC     (3 << 8)
+#define SGX_EXITINFO_SW_EXC     (6 << 8)
+
+/* SIGSTRUCT */
+#define SGX_SIGSTRUCT_HEADER        0
+#define SGX_SIGSTRUCT_HEADER2       24
+#define SGX_SIGSTRUCT_MODULUS       128
+#define SGX_SIGSTRUCT_MODULUS_SIZE  384
+#define SGX_SIGSTRUCT_MISCSELECT    900
+#define SGX_SIGSTRUCT_MISCMASK      904
+#define SGX_SIGSTRUCT_ATTRIBUTES    928
+#define SGX_SIGSTRUCT_ATTRIBUTEMASK 944
+#define SGX_SIGSTRUCT_ENCLAVEHASH   960
+#define SGX_SIGSTRUCT_ISVPRODID     1024
+#define SGX_SIGSTRUCT_ISVSVN        1026
+#define SGX_SIGSTRUCT_SIZE          1808
+
+#define SGX_EINITTOKEN_VALID        (1U << 0)
+
+#define SGX_HASH_SIZE               32
+
+static const uint8_t sgx_sigstruct_header[16] = {
+    0x06, 0x00, 0x00, 0x00, 0xe1, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const uint8_t sgx_sigstruct_header2[16] = {
+    0x01, 0x01, 0x00, 0x00, 0x60, 0x00, 0x00, 0x00,
+    0x60, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+};
+
+typedef struct SGXEnclave {
+    uint64_t eid;
+    hwaddr secs;                /* EPC page of the SECS, 0 while evicted */
+    uint64_t base;
+    uint64_t size;
+    uint64_t ssa_frame_size;    /* in bytes */
+    uint64_t attributes;
+    uint64_t xfrm;
+    uint32_t xsave_size;        /* of the XSAVE area at the start of SSA frames */
+    uint32_t miscselect;
+    bool initialized;
+    GChecksum *measurement;     /* MRENCLAVE in the making, until EINIT */
+    uint64_t nr_pages;          /* resident pages, not counting the SECS */
+    unsigned nr_threads;        /* logical processors inside the enclave */
+    uint64_t epoch;             /* incremented by ETRACK */
+} SGXEnclave;
+
+typedef struct SGXEPCMEntry {
+    SGXEnclave *encl;           /* NULL for VA pages */
+    target_ulong lin_addr;
+    uint64_t epoch;             /* enclave epoch when the page was blocked */
+    uint8_t type;
+    uint8_t prot;               /* PAGE_READ, PAGE_WRITE and PAGE_EXEC */
+    bool valid;
+    bool blocked;
+    bool busy;                  /* TCS in use by a logical processor */
+} SGXEPCMEntry;
+
+static struct {
+    QemuMutex lock;
+    hwaddr base;
+    hwaddr size;
+    SGXEPCMEntry *epcm;
+    GHashTable *enclaves;       /* enclave ID => SGXEnclave */
+    uint64_t next_eid;
+    uint64_t next_version;      /* for pages evicted with EWB */
+    uint8_t key[32];            /* MAC key for pages evicted with EWB */
+    Error *migration_blocker;
+} sgx;
+
+bool x86_sgx_active;
+
+static const uint8_t sgx_zero_page[SGX_PAGE_SIZE];
+
+/* Returns the EPCM entry of the EPC page at @paddr, NULL outside the EPC */
+static SGXEPCMEntry *sgx_epcm(hwaddr paddr)
+{
+    if (paddr - sgx.base >= sgx.size) {
+        return NULL;
+    }
+    return &sgx.epcm[(paddr - sgx.base) / SGX_PAGE_SIZE];
+}
+
+static void sgx_enclave_free(gpointer data)
+{
+    SGXEnclave *encl = data;
+
+    if (encl->measurement) {
+        g_checksum_free(encl->measurement);
+    }
+    g_free(encl);
+}
+
+static int sgx_secinfo_type(uint64_t flags)
+{
+    return (flags & SGX_SECINFO_PT_MASK) >> SGX_SECINFO_PT_SHIFT;
+}
+
+static int sgx_secinfo_prot(uint64_t flags)
+{
+    return (flags & SGX_SECINFO_R ? PAGE_READ : 0) |
+           (flags & SGX_SECINFO_W ? PAGE_WRITE : 0) |
+           (flags & SGX_SECINFO_X ? PAGE_EXEC : 0);
+}
+
+static uint64_t sgx_prot_secinfo(int prot)
+{
+    return (prot & PAGE_READ ? SGX_SECINFO_R : 0) |
+           (prot & PAGE_WRITE ? SGX_SECINFO_W : 0) |
+           (prot & PAGE_EXEC ? SGX_SECINFO_X : 0);
+}
+
+static bool sgx_enabled(CPUX86State *env)
+{
+    uint64_t mask = FEATURE_CONTROL_LOCKED | FEATURE_CONTROL_SGX;
+
+    return x86_sgx_active &&
+           (env->features[FEAT_7_0_EBX] & CPUID_7_0_EBX_SGX) &&
+           (env->msr_ia32_feature_control & mask) == mask;
+}
+
+/*
+ * Adds a 64 byte block made of @tag and @len bytes of @data to the
+ * measurement of @encl.
+ */
+static void sgx_measure(SGXEnclave *encl, const char *tag,
+                        const void *data, size_t len)
+{
+    uint8_t block[64] = { 0 };
+
+    assert(strlen(tag) <= 8 && len <= sizeof(block) - 8);
+    memcpy(block, tag, strlen(tag));
+    memcpy(block + 8, data, len);
+    g_checksum_update(encl->measurement, block, sizeof(block));
+}
+
+static void sgx_sha256(uint8_t *digest, const void *data, size_t len)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    gsize digest_len = SGX_HASH_SIZE;
+
+    g_checksum_update(checksum, data, len);
+    g_checksum_get_digest(checksum, digest, &digest_len);
+    g_checksum_free(checksum);
+}
+
+/*
+ * Computes the MAC of a page evicted with EWB.  It covers the page content,
+ * the PCMD up to the MAC, the linear address and the version that is kept
+ * in the VA slot, so that pages can neither be modified nor replayed.
+ */
+static void sgx_page_mac(uint8_t *mac, const uint8_t *page,
+                         const uint8_t *pcmd, uint64_t lin_addr,
+                         uint64_t version)
+{
+    GHmac *hmac = g_hmac_new(G_CHECKSUM_SHA256, sgx.key, sizeof(sgx.key));
+    uint8_t digest[SGX_HASH_SIZE];
+    gsize digest_len = sizeof(digest);
+    uint8_t meta[16];
+
+    stq_le_p(meta, lin_addr);
+    stq_le_p(meta + 8, version);
+    g_hmac_update(hmac, page, SGX_PAGE_SIZE);
+    g_hmac_update(hmac, pcmd, SGX_PCMD_MAC);
+    g_hmac_update(hmac, meta, sizeof(meta));
+    g_hmac_get_digest(hmac, digest, &digest_len);
+    g_hmac_unref(hmac);
+
+    memcpy(mac, digest, SGX_PCMD_MAC_SIZE);
+}
+
+static void sgx_flush_page(CPUX86State *env, SGXEPCMEntry *e)
+{
+    tlb_flush_page_all_cpus_synced(env_cpu(env), e->lin_addr);
+}
+
+/*
+ * Operands
+ */
+
+/* Returns the linear address for the effective address in @reg */
+static target_ulong sgx_operand(CPUX86State *env, int reg)
+{
+    if (env->hflags & HF_CS64_MASK) {
+        return env->regs[reg];
+    }
+    return (uint32_t)(env->segs[R_DS].base + env->regs[reg]);
+}
+
+static void sgx_check_align(CPUX86State *env, target_ulong addr,
+                            target_ulong align, uintptr_t ra)
+{
+    if (addr & (align - 1)) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+}
+
+/* Translates the address of an operand that is not in the EPC */
+static hwaddr sgx_translate(CPUX86State *env, target_ulong addr,
+                            MMUAccessType access_type, uintptr_t ra)
+{
+    hwaddr paddr = x86_cpu_get_physical_address(env, addr, access_type,
+                                                cpu_mmu_index(env, false),
+                                                ra);
+
+    if (sgx_epcm(paddr)) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    return paddr;
+}
+
+/* Reads an operand that is not in the EPC and does not cross pages */
+static void sgx_read(CPUX86State *env, target_ulong addr, void *buf,
+                     size_t len, uintptr_t ra)
+{
+    cpu_physical_memory_read(sgx_translate(env, addr, MMU_DATA_LOAD, ra),
+                             buf, len);
+}
+
+/* Translates the address of an operand that must be in the EPC */
+static hwaddr sgx_translate_epc(CPUX86State *env, target_ulong addr,
+                                target_ulong align, uintptr_t ra)
+{
+    hwaddr paddr;
+
+    sgx_check_align(env, addr, align, ra);
+    paddr = x86_cpu_get_physical_address(env, addr, MMU_DATA_STORE,
+                                         cpu_mmu_index(env, false), ra);
+    if (!sgx_epcm(paddr)) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    return paddr;
+}
+
+static void QEMU_NORETURN sgx_raise_pf(CPUX86State *env, target_ulong addr,
+                                       uintptr_t ra)
+{
+    env->cr[2] = addr;
+    raise_exception_err_ra(env, EXCP0E_PAGE,
+                           PG_ERROR_SGX_MASK | PG_ERROR_P_MASK, ra);
+}
+
+static void sgx_check_fault(CPUX86State *env, int ret, target_ulong addr,
+                            uintptr_t ra)
+{
+    if (ret == SGX_FAULT_GP) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    } else if (ret == SGX_FAULT_PF) {
+        sgx_raise_pf(env, addr, ra);
+    }
+}
+
+/* Reads the PAGEINFO at RBX, whose LINADDR and SECS fields are optional */
+static void sgx_read_pageinfo(CPUX86State *env, target_ulong *lin_addr,
+                              target_ulong *srcpge, target_ulong *secinfo,
+                              target_ulong *secs, uintptr_t ra)
+{
+    target_ulong pageinfo = sgx_operand(env, R_EBX);
+    uint64_t linaddr_val, secs_val;
+
+    sgx_check_align(env, pageinfo, SGX_PAGEINFO_SIZE, ra);
+    linaddr_val = cpu_ldq_data_ra(env, pageinfo + SGX_PAGEINFO_LINADDR, ra);
+    *srcpge = cpu_ldq_data_ra(env, pageinfo + SGX_PAGEINFO_SRCPGE, ra);
+    *secinfo = cpu_ldq_data_ra(env, pageinfo + SGX_PAGEINFO_SECINFO, ra);
+    secs_val = cpu_ldq_data_ra(env, pageinfo + SGX_PAGEINFO_SECS, ra);
+
+    if (lin_addr) {
+        *lin_addr = linaddr_val;
+    } else if (linaddr_val) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    if (secs) {
+        *secs = secs_val;
+    } else if (secs_val) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+}
+
+static bool sgx_secinfo_valid(const uint8_t *secinfo)
+{
+    uint64_t flags = ldq_le_p(secinfo);
+
+    if (flags & ~(SGX_SECINFO_R | SGX_SECINFO_W | SGX_SECINFO_X |
+                  SGX_SECINFO_PT_MASK)) {
+        return false;
+    }
+    if ((flags & SGX_SECINFO_W) && !(flags & SGX_SECINFO_R)) {
+        return false;
+    }
+    return buffer_is_zero(secinfo + 8, SGX_SECINFO_SIZE - 8);
+}
+
+/*
+ * Size of the XSAVE area that holds the state components in @xfrm, in the
+ * standard format, at the start of each SSA frame
+ */
+static uint32_t sgx_xsave_size(uint64_t xfrm)
+{
+    uint32_t size = 0;
+    int i;
+
+    for (i = 0; i < XSAVE_STATE_AREA_COUNT; i++) {
+        const ExtSaveArea *esa = &x86_ext_save_areas[i];
+
+        if ((xfrm >> i) & 1) {
+            size = MAX(size, esa->offset + esa->size);
+        }
+    }
+    return size;
+}
+
+static bool sgx_secs_valid(CPUX86State *env, const uint8_t *secs)
+{
+    uint64_t size = ldq_le_p(secs + SGX_SECS_SIZE);
+    uint64_t base = ldq_le_p(secs + SGX_SECS_BASEADDR);
+    uint64_t attributes = ldq_le_p(secs + SGX_SECS_ATTRIBUTES);
+    uint64_t xfrm = ldq_le_p(secs + SGX_SECS_XFRM);
+    bool mode64 = attributes & SGX_ATTR_MODE64BIT;
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t allowed_attrs, allowed_xfrm;
+    int max_size_bits;
+
+    cpu_x86_cpuid(env, 0x12, 0, &eax, &ebx, &ecx, &edx);
+    if (ldl_le_p(secs + SGX_SECS_MISCSELECT) & ~ebx) {
+        return false;
+    }
+    max_size_bits = mode64 ? (edx >> 8) & 0xff : edx & 0xff;
+
+    cpu_x86_cpuid(env, 0x12, 1, &eax, &ebx, &ecx, &edx);
+    allowed_attrs = ((uint64_t)ebx << 32) | eax;
+    allowed_xfrm = ((uint64_t)edx << 32) | ecx;
+
+    if (size < 2 * SGX_PAGE_SIZE || !is_power_of_2(size) ||
+        size > (1ULL << max_size_bits) || (base & (size - 1))) {
+        return false;
+    }
+    if ((uint64_t)ldl_le_p(secs + SGX_SECS_SSAFRAMESIZE) * SGX_PAGE_SIZE <
+        sgx_xsave_size(xfrm) + SGX_GPRSGX_SIZE) {
+        return false;
+    }
+    if ((attributes & (~allowed_attrs | SGX_ATTR_INIT)) ||
+        mode64 != !!(env->hflags & HF_LMA_MASK)) {
+        return false;
+    }
+    if ((xfrm & 3) != 3 || (xfrm & ~allowed_xfrm)) {
+        return false;
+    }
+    return buffer_is_zero(secs + SGX_SECS_EID,
+                          SGX_SECS_ATTRIBUTES - SGX_SECS_EID);
+}
+
+static bool sgx_tcs_valid(const uint8_t *tcs)
+{
+    return !ldl_le_p(tcs + SGX_TCS_CSSA) &&
+           !(ldq_le_p(tcs + SGX_TCS_OSSA) & (SGX_PAGE_SIZE - 1)) &&
+           !(ldq_le_p(tcs + SGX_TCS_OFSBASE) & (SGX_PAGE_SIZE - 1)) &&
+           !(ldq_le_p(tcs + SGX_TCS_OGSBASE) & (SGX_PAGE_SIZE - 1));
+}
+
+/* Returns the enclave of the SECS at @secs, NULL if it is not a SECS */
+static SGXEnclave *sgx_secs_enclave(hwaddr secs)
+{
+    SGXEPCMEntry *e = sgx_epcm(secs);
+
+    if (!e || !e->valid || e->type != SGX_PT_SECS) {
+        return NULL;
+    }
+    return e->encl;
+}
+
+/*
+ * ENCLS leaf functions
+ */
+
+static int sgx_ecreate_locked(hwaddr epc, uint8_t *secs)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+    SGXEnclave *encl;
+    uint8_t data[12];
+
+    if (e->valid) {
+        return SGX_FAULT_PF;
+    }
+
+    encl = g_new0(SGXEnclave, 1);
+    encl->eid = ++sgx.next_eid;
+    encl->secs = epc;
+    encl->base = ldq_le_p(secs + SGX_SECS_BASEADDR);
+    encl->size = ldq_le_p(secs + SGX_SECS_SIZE);
+    encl->ssa_frame_size =
+        (uint64_t)ldl_le_p(secs + SGX_SECS_SSAFRAMESIZE) * SGX_PAGE_SIZE;
+    encl->attributes = ldq_le_p(secs + SGX_SECS_ATTRIBUTES);
+    encl->xfrm = ldq_le_p(secs + SGX_SECS_XFRM);
+    encl->xsave_size = sgx_xsave_size(encl->xfrm);
+    encl->miscselect = ldl_le_p(secs + SGX_SECS_MISCSELECT);
+    encl->measurement = g_checksum_new(G_CHECKSUM_SHA256);
+    g_hash_table_insert(sgx.enclaves, &encl->eid, encl);
+
+    memcpy(data, secs + SGX_SECS_SSAFRAMESIZE, 4);
+    memcpy(data + 4, secs + SGX_SECS_SIZE, 8);
+    sgx_measure(encl, "ECREATE", data, sizeof(data));
+
+    stq_le_p(secs + SGX_SECS_EID, encl->eid);
+    cpu_physical_memory_write(epc, secs, SGX_PAGE_SIZE);
+    *e = (SGXEPCMEntry) {
+        .encl = encl,
+        .type = SGX_PT_SECS,
+        .valid = true,
+    };
+
+    return SGX_SUCCESS;
+}
+
+static void sgx_ecreate(CPUX86State *env, uintptr_t ra)
+{
+    target_ulong epc_addr = sgx_operand(env, R_ECX);
+    target_ulong srcpge, secinfo_addr;
+    uint8_t secinfo[SGX_SECINFO_SIZE];
+    g_autofree uint8_t *secs = g_malloc(SGX_PAGE_SIZE);
+    hwaddr epc;
+    int ret;
+
+    sgx_read_pageinfo(env, NULL, &srcpge, &secinfo_addr, NULL, ra);
+    sgx_check_align(env, srcpge, SGX_PAGE_SIZE, ra);
+    sgx_check_align(env, secinfo_addr, SGX_SECINFO_SIZE, ra);
+    sgx_read(env, secinfo_addr, secinfo, sizeof(secinfo), ra);
+    sgx_read(env, srcpge, secs, SGX_PAGE_SIZE, ra);
+    epc = sgx_translate_epc(env, epc_addr, SGX_PAGE_SIZE, ra);
+
+    if (!sgx_secinfo_valid(secinfo) ||
+        sgx_secinfo_type(ldq_le_p(secinfo)) != SGX_PT_SECS ||
+        !sgx_secs_valid(env, secs)) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+
+    qemu_mutex_lock(&sgx.lock);
+    ret = sgx_ecreate_locked(epc, secs);
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_check_fault(env, ret, epc_addr, ra);
+}
+
+static int sgx_eadd_locked(hwaddr epc, hwaddr secs, target_ulong lin_addr,
+                           const uint8_t *secinfo, const uint8_t *page)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+    SGXEnclave *encl = sgx_secs_enclave(secs);
+    uint64_t flags = ldq_le_p(secinfo);
+    int type = sgx_secinfo_type(flags);
+    uint8_t data[56];
+
+    if (!encl || encl->initialized ||
+        lin_addr - encl->base >= encl->size) {
+        return SGX_FAULT_GP;
+    }
+    if (e->valid) {
+        return SGX_FAULT_PF;
+    }
+
+    stq_le_p(data, lin_addr - encl->base);
+    memcpy(data + 8, secinfo, 48);
+    sgx_measure(encl, "EADD", data, sizeof(data));
+
+    cpu_physical_memory_write(epc, page, SGX_PAGE_SIZE);
+    *e = (SGXEPCMEntry) {
+        .encl = encl,
+        .lin_addr = lin_addr,
+        .type = type,
+        .prot = type == SGX_PT_REG ? sgx_secinfo_prot(flags) : 0,
+        .valid = true,
+    };
+    encl->nr_pages++;
+
+    return SGX_SUCCESS;
+}
+
+static void sgx_eadd(CPUX86State *env, uintptr_t ra)
+{
+    target_ulong epc_addr = sgx_operand(env, R_ECX);
+    target_ulong lin_addr, srcpge, secinfo_addr, secs_addr;
+    uint8_t secinfo[SGX_SECINFO_SIZE];
+    g_autofree uint8_t *page = g_malloc(SGX_PAGE_SIZE);
+    hwaddr epc, secs;
+    uint64_t flags;
+    int ret;
+
+    sgx_read_pageinfo(env, &lin_addr, &srcpge, &secinfo_addr, &secs_addr, ra);
+    sgx_check_align(env, lin_addr, SGX_PAGE_SIZE, ra);
+    sgx_check_align(env, srcpge, SGX_PAGE_SIZE, ra);
+    sgx_check_align(env, secinfo_addr, SGX_SECINFO_SIZE, ra);
+    sgx_read(env, secinfo_addr, secinfo, sizeof(secinfo), ra);
+    sgx_read(env, srcpge, page, SGX_PAGE_SIZE, ra);
+    secs = sgx_translate_epc(env, secs_addr, SGX_PAGE_SIZE, ra);
+    epc = sgx_translate_epc(env, epc_addr, SGX_PAGE_SIZE, ra);
+
+    flags = ldq_le_p(secinfo);
+    if (!sgx_secinfo_valid(secinfo)) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    switch (sgx_secinfo_type(flags)) {
+    case SGX_PT_REG:
+        break;
+    case SGX_PT_TCS:
+        if ((flags & (SGX_SECINFO_R | SGX_SECINFO_W | SGX_SECINFO_X)) ||
+            !sgx_tcs_valid(page)) {
+            raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+        }
+        break;
+    default:
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+
+    qemu_mutex_lock(&sgx.lock);
+    ret = sgx_eadd_locked(epc, secs, lin_addr, secinfo, page);
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_check_fault(env, ret, epc_addr, ra);
+}
+
+static int sgx_eextend_locked(hwaddr secs, hwaddr chunk)
+{
+    SGXEnclave *encl = sgx_secs_enclave(secs);
+    SGXEPCMEntry *e = sgx_epcm(chunk);
+    uint8_t buf[256];
+    uint8_t data[8];
+
+    if (!encl || encl->initialized || !e->valid || e->encl != encl ||
+        (e->type != SGX_PT_REG && e->type != SGX_PT_TCS)) {
+        return SGX_FAULT_GP;
+    }
+
+    stq_le_p(data, e->lin_addr + (chunk & (SGX_PAGE_SIZE - 1)) - encl->base);
+    sgx_measure(encl, "EEXTEND", data, sizeof(data));
+    cpu_physical_memory_read(chunk, buf, sizeof(buf));
+    g_checksum_update(encl->measurement, buf, sizeof(buf));
+
+    return SGX_SUCCESS;
+}
+
+static void sgx_eextend(CPUX86State *env, uintptr_t ra)
+{
+    hwaddr secs = sgx_translate_epc(env, sgx_operand(env, R_EBX),
+                                    SGX_PAGE_SIZE, ra);
+    hwaddr chunk = sgx_translate_epc(env, sgx_operand(env, R_ECX), 256, ra);
+    int ret;
+
+    qemu_mutex_lock(&sgx.lock);
+    ret = sgx_eextend_locked(secs, chunk);
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_check_fault(env, ret, 0, ra);
+}
+
+static int sgx_einit_locked(CPUX86State *env, hwaddr secs,
+                            const uint8_t *sigstruct, bool token_valid)
+{
+    SGXEnclave *encl = sgx_secs_enclave(secs);
+    uint8_t mrenclave[SGX_HASH_SIZE], mrsigner[SGX_HASH_SIZE];
+    uint8_t lepubkeyhash[SGX_HASH_SIZE];
+    gsize digest_len = SGX_HASH_SIZE;
+    uint32_t miscmask;
+    uint64_t attrmask, xfrmmask;
+    GChecksum *checksum;
+    int i;
+
+    if (!encl || encl->initialized) {
+        return SGX_FAULT_GP;
+    }
+
+    if (memcmp(sigstruct + SGX_SIGSTRUCT_HEADER, sgx_sigstruct_header,
+               sizeof(sgx_sigstruct_header)) ||
+        memcmp(sigstruct + SGX_SIGSTRUCT_HEADER2, sgx_sigstruct_header2,
+               sizeof(sgx_sigstruct_header2))) {
+        return SGX_INVALID_SIG_STRUCT;
+    }
+
+    miscmask = ldl_le_p(sigstruct + SGX_SIGSTRUCT_MISCMASK);
+    attrmask = ldq_le_p(sigstruct + SGX_SIGSTRUCT_ATTRIBUTEMASK);
+    xfrmmask = ldq_le_p(sigstruct + SGX_SIGSTRUCT_ATTRIBUTEMASK + 8);
+    if ((encl->miscselect & miscmask) !=
+        (ldl_le_p(sigstruct + SGX_SIGSTRUCT_MISCSELECT) & miscmask) ||
+        (encl->attributes & attrmask) !=
+        (ldq_le_p(sigstruct + SGX_SIGSTRUCT_ATTRIBUTES) & attrmask) ||
+        (encl->xfrm & xfrmmask) !=
+        (ldq_le_p(sigstruct + SGX_SIGSTRUCT_ATTRIBUTES + 8) & xfrmmask)) {
+        return SGX_INVALID_ATTRIBUTE;
+    }
+
+    checksum = g_checksum_copy(encl->measurement);
+    g_checksum_get_digest(checksum, mrenclave, &digest_len);
+    g_checksum_free(checksum);
+    if (memcmp(mrenclave, sigstruct + SGX_SIGSTRUCT_ENCLAVEHASH,
+               SGX_HASH_SIZE)) {
+        return SGX_INVALID_MEASUREMENT;
+    }
+
+    /* Only launch control is supported, which needs no token */
+    sgx_sha256(mrsigner, sigstruct + SGX_SIGSTRUCT_MODULUS,
+               SGX_SIGSTRUCT_MODULUS_SIZE);
+    for (i = 0; i < 4; i++) {
+        stq_le_p(lepubkeyhash + i * 8, env->msr_ia32_sgxlepubkeyhash[i]);
+    }
+    if (token_valid || memcmp(mrsigner, lepubkeyhash, SGX_HASH_SIZE)) {
+        return SGX_INVALID_EINITTOKEN;
+    }
+
+    encl->initialized = true;
+    encl->attributes |= SGX_ATTR_INIT;
+    g_checksum_free(encl->measurement);
+    encl->measurement = NULL;
+
+    stq_le_phys(&address_space_memory, secs + SGX_SECS_ATTRIBUTES,
+                encl->attributes);
+    cpu_physical_memory_write(secs + SGX_SECS_MRENCLAVE, mrenclave,
+                              SGX_HASH_SIZE);
+    cpu_physical_memory_write(secs + SGX_SECS_MRSIGNER, mrsigner,
+                              SGX_HASH_SIZE);
+    cpu_physical_memory_write(secs + SGX_SECS_ISVPRODID,
+                              sigstruct + SGX_SIGSTRUCT_ISVPRODID, 4);
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_einit(CPUX86State *env, uintptr_t ra)
+{
+    target_ulong sigstruct_addr = sgx_operand(env, R_EBX);
+    target_ulong token_addr = sgx_operand(env, R_EDX);
+    g_autofree uint8_t *sigstruct = g_malloc(SGX_SIGSTRUCT_SIZE);
+    hwaddr secs;
+    bool token_valid;
+    int ret;
+
+    sgx_check_align(env, sigstruct_addr, SGX_PAGE_SIZE, ra);
+    sgx_check_align(env, token_addr, 512, ra);
+    sgx_read(env, sigstruct_addr, sigstruct, SGX_SIGSTRUCT_SIZE, ra);
+    token_valid = cpu_ldl_data_ra(env, token_addr, ra) & SGX_EINITTOKEN_VALID;
+    secs = sgx_translate_epc(env, sgx_operand(env, R_ECX), SGX_PAGE_SIZE, ra);
+
+    qemu_mutex_lock(&sgx.lock);
+    ret = sgx_einit_locked(env, secs, sigstruct, token_valid);
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_check_fault(env, ret, 0, ra);
+    return ret;
+}
+
+static int sgx_eremove_locked(CPUX86State *env, hwaddr epc)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+
+    if (!e->valid) {
+        return SGX_SUCCESS;
+    }
+
+    switch (e->type) {
+    case SGX_PT_SECS:
+        if (e->encl->nr_pages) {
+            return SGX_CHILD_PRESENT;
+        }
+        g_hash_table_remove(sgx.enclaves, &e->encl->eid);
+        break;
+    case SGX_PT_TCS:
+    case SGX_PT_REG:
+        if (e->encl->nr_threads) {
+            return SGX_ENCLAVE_ACT;
+        }
+        e->encl->nr_pages--;
+        sgx_flush_page(env, e);
+        break;
+    }
+    memset(e, 0, sizeof(*e));
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_epa_locked(hwaddr epc)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+
+    if (e->valid) {
+        return SGX_FAULT_PF;
+    }
+
+    cpu_physical_memory_write(epc, sgx_zero_page, SGX_PAGE_SIZE);
+    *e = (SGXEPCMEntry) {
+        .type = SGX_PT_VA,
+        .valid = true,
+    };
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_eblock_locked(CPUX86State *env, hwaddr epc)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+
+    if (!e->valid) {
+        return SGX_PG_INVLD;
+    }
+    if (e->type == SGX_PT_SECS) {
+        return SGX_PG_IS_SECS;
+    }
+    if (e->type == SGX_PT_VA) {
+        return SGX_NOTBLOCKABLE;
+    }
+    if (e->blocked) {
+        return SGX_BLKSTATE;
+    }
+
+    e->blocked = true;
+    e->epoch = e->encl->epoch;
+    sgx_flush_page(env, e);
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_etrack_locked(hwaddr secs)
+{
+    SGXEnclave *encl = sgx_secs_enclave(secs);
+
+    if (!encl) {
+        return SGX_FAULT_PF;
+    }
+
+    /*
+     * Blocked pages were flushed from all TLBs by EBLOCK, so tracking is
+     * complete right away.
+     */
+    encl->epoch++;
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_ewb_locked(CPUX86State *env, hwaddr epc, hwaddr va_slot,
+                          uint8_t *page, uint8_t *pcmd)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+    SGXEPCMEntry *va = sgx_epcm(va_slot);
+    uint64_t version;
+
+    if (!e->valid || !va->valid || va->type != SGX_PT_VA || va == e) {
+        return SGX_FAULT_PF;
+    }
+
+    switch (e->type) {
+    case SGX_PT_SECS:
+        if (e->encl->nr_pages) {
+            return SGX_CHILD_PRESENT;
+        }
+        break;
+    case SGX_PT_TCS:
+    case SGX_PT_REG:
+        if (!e->blocked) {
+            return SGX_PAGE_NOT_BLOCKED;
+        }
+        if (e->epoch == e->encl->epoch || e->busy) {
+            return SGX_NOT_TRACKED;
+        }
+        break;
+    }
+    if (ldq_le_phys(&address_space_memory, va_slot)) {
+        return SGX_VA_SLOT_OCCUPIED;
+    }
+
+    version = ++sgx.next_version;
+    memset(pcmd, 0, SGX_PCMD_SIZE);
+    stq_le_p(pcmd, ((uint64_t)e->type << SGX_SECINFO_PT_SHIFT) |
+                   sgx_prot_secinfo(e->prot));
+    stq_le_p(pcmd + SGX_PCMD_ENCLAVEID, e->encl ? e->encl->eid : 0);
+    cpu_physical_memory_read(epc, page, SGX_PAGE_SIZE);
+    sgx_page_mac(pcmd + SGX_PCMD_MAC, page, pcmd, e->lin_addr, version);
+    stq_le_phys(&address_space_memory, va_slot, version);
+
+    if (e->type == SGX_PT_SECS) {
+        e->encl->secs = 0;
+    } else if (e->encl) {
+        e->encl->nr_pages--;
+    }
+    memset(e, 0, sizeof(*e));
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_ewb(CPUX86State *env, uintptr_t ra)
+{
+    target_ulong epc_addr = sgx_operand(env, R_ECX);
+    target_ulong srcpge, pcmd_addr;
+    g_autofree uint8_t *page = g_malloc(SGX_PAGE_SIZE);
+    uint8_t pcmd[SGX_PCMD_SIZE];
+    hwaddr epc, va_slot, srcpge_paddr, pcmd_paddr;
+    int ret;
+
+    sgx_read_pageinfo(env, NULL, &srcpge, &pcmd_addr, NULL, ra);
+    sgx_check_align(env, srcpge, SGX_PAGE_SIZE, ra);
+    sgx_check_align(env, pcmd_addr, SGX_PCMD_SIZE, ra);
+    srcpge_paddr = sgx_translate(env, srcpge, MMU_DATA_STORE, ra);
+    pcmd_paddr = sgx_translate(env, pcmd_addr, MMU_DATA_STORE, ra);
+    epc = sgx_translate_epc(env, epc_addr, SGX_PAGE_SIZE, ra);
+    va_slot = sgx_translate_epc(env, sgx_operand(env, R_EDX), 8, ra);
+
+    qemu_mutex_lock(&sgx.lock);
+    ret = sgx_ewb_locked(env, epc, va_slot, page, pcmd);
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_check_fault(env, ret, epc_addr, ra);
+    if (ret == SGX_SUCCESS) {
+        cpu_physical_memory_write(srcpge_paddr, page, SGX_PAGE_SIZE);
+        cpu_physical_memory_write(pcmd_paddr, pcmd, SGX_PCMD_SIZE);
+    }
+    return ret;
+}
+
+static int sgx_eldu_locked(hwaddr epc, hwaddr va_slot, hwaddr secs,
+                           target_ulong lin_addr, const uint8_t *page,
+                           const uint8_t *pcmd, bool blocked)
+{
+    SGXEPCMEntry *e = sgx_epcm(epc);
+    SGXEPCMEntry *va = sgx_epcm(va_slot);
+    uint64_t flags = ldq_le_p(pcmd);
+    uint64_t eid = ldq_le_p(pcmd + SGX_PCMD_ENCLAVEID);
+    int type = sgx_secinfo_type(flags);
+    SGXEnclave *encl = NULL;
+    uint8_t mac[SGX_PCMD_MAC_SIZE];
+    uint64_t version;
+
+    if (e->valid || !va->valid || va->type != SGX_PT_VA || va == e) {
+        return SGX_FAULT_PF;
+    }
+
+    switch (type) {
+    case SGX_PT_SECS:
+        encl = g_hash_table_lookup(sgx.enclaves, &eid);
+        if (!encl || encl->secs) {
+            return SGX_MAC_COMPARE_FAIL;
+        }
+        break;
+    case SGX_PT_TCS:
+    case SGX_PT_REG:
+        encl = sgx_secs_enclave(secs);
+        if (!encl) {
+            return SGX_FAULT_GP;
+        }
+        if (encl->eid != eid) {
+            return SGX_MAC_COMPARE_FAIL;
+        }
+        break;
+    }
+
+    version = ldq_le_phys(&address_space_memory, va_slot);
+    sgx_page_mac(mac, page, pcmd, lin_addr, version);
+    if (!version || memcmp(mac, pcmd + SGX_PCMD_MAC, sizeof(mac))) {
+        return SGX_MAC_COMPARE_FAIL;
+    }
+
+    cpu_physical_memory_write(epc, page, SGX_PAGE_SIZE);
+    stq_le_phys(&address_space_memory, va_slot, 0);
+    *e = (SGXEPCMEntry) {
+        .encl = encl,
+        .lin_addr = lin_addr,
+        .epoch = encl ? encl->epoch : 0,
+        .type = type,
+        .prot = sgx_secinfo_prot(flags),
+        .valid = true,
+        .blocked = blocked && type != SGX_PT_SECS && type != SGX_PT_VA,
+    };
+    if (type == SGX_PT_SECS) {
+        encl->secs = epc;
+    } else if (encl) {
+        encl->nr_pages++;
+    }
+
+    return SGX_SUCCESS;
+}
+
+static int sgx_eldu(CPUX86State *env, bool blocked, uintptr_t ra)
+{
+    target_ulong epc_addr = sgx_operand(env, R_ECX);
+    target_ulong lin_addr, srcpge, pcmd_addr, secs_addr;
+    g_autofree uint8_t *page = g_malloc(SGX_PAGE_SIZE);
+    uint8_t pcmd[SGX_PCMD_SIZE];
+    hwaddr epc, va_slot, secs = 0;
+    int type, ret;
+
+    sgx_read_pageinfo(env, &lin_addr, &srcpge, &pcmd_addr, &secs_addr, ra);
+    sgx_check_align(env, srcpge, SGX_PAGE_SIZE, ra);
+    sgx_check_align(env, pcmd_addr, SGX_PCMD_SIZE, ra);
+    sgx_read(env, pcmd_addr, pcmd, sizeof(pcmd), ra);
+    sgx_read(env, srcpge, page, SGX_PAGE_SIZE, ra);
+
+    type = sgx_secinfo_type(ldq_le_p(pcmd));
+    switch (type) {
+    case SGX_PT_TCS:
+    case SGX_PT_REG:
+        secs = sgx_translate_epc(env, secs_addr, SGX_PAGE_SIZE, ra);
+        break;
+    case SGX_PT_SECS:
+    case SGX_PT_VA:
+        break;
+    default:
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    epc = sgx_translate_epc(env, epc_addr, SGX_PAGE_SIZE, ra);
+    va_slot = sgx_translate_epc(env, sgx_operand(env, R_EDX), 8, ra);
+
+    qemu_mutex_lock(&sgx.lock);
+    ret = sgx_eldu_locked(epc, va_slot, secs, lin_addr, page, pcmd, blocked);
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_check_fault(env, ret, epc_addr, ra);
+    return ret;
+}
+
+void helper_encls(CPUX86State *env)
+{
+    uintptr_t ra = GETPC();
+    uint32_t eflags = cpu_cc_compute_all(env, CC_OP);
+    hwaddr epc;
+    int ret = -1;
+
+    if (!sgx_enabled(env)) {
+        raise_exception_ra(env, EXCP06_ILLOP, ra);
+    }
+
+    switch ((uint32_t)env->regs[R_EAX]) {
+    case SGX_ECREATE:
+        sgx_ecreate(env, ra);
+        break;
+    case SGX_EADD:
+        sgx_eadd(env, ra);
+        break;
+    case SGX_EINIT:
+        ret = sgx_einit(env, ra);
+        break;
+    case SGX_EREMOVE:
+        epc = sgx_translate_epc(env, sgx_operand(env, R_ECX),
+                                SGX_PAGE_SIZE, ra);
+        qemu_mutex_lock(&sgx.lock);
+        ret = sgx_eremove_locked(env, epc);
+        qemu_mutex_unlock(&sgx.lock);
+        break;
+    case SGX_EEXTEND:
+        sgx_eextend(env, ra);
+        break;
+    case SGX_ELDB:
+    case SGX_ELDU:
+        ret = sgx_eldu(env, env->regs[R_EAX] == SGX_ELDB, ra);
+        break;
+    case SGX_EBLOCK:
+        epc = sgx_translate_epc(env, sgx_operand(env, R_ECX),
+                                SGX_PAGE_SIZE, ra);
+        qemu_mutex_lock(&sgx.lock);
+        ret = sgx_eblock_locked(env, epc);
+        qemu_mutex_unlock(&sgx.lock);
+        break;
+    case SGX_EPA:
+        if (env->regs[R_EBX] != SGX_PT_VA) {
+            raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+        }
+        epc = sgx_translate_epc(env, sgx_operand(env, R_ECX),
+                                SGX_PAGE_SIZE, ra);
+        qemu_mutex_lock(&sgx.lock);
+        ret = sgx_epa_locked(epc);
+        qemu_mutex_unlock(&sgx.lock);
+        sgx_check_fault(env, ret, sgx_operand(env, R_ECX), ra);
+        ret = -1;
+        break;
+    case SGX_EWB:
+        ret = sgx_ewb(env, ra);
+        break;
+    case SGX_ETRACK:
+        epc = sgx_translate_epc(env, sgx_operand(env, R_ECX),
+                                SGX_PAGE_SIZE, ra);
+        qemu_mutex_lock(&sgx.lock);
+        ret = sgx_etrack_locked(epc);
+        qemu_mutex_unlock(&sgx.lock);
+        sgx_check_fault(env, ret, sgx_operand(env, R_ECX), ra);
+        break;
+    default:
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+
+    /* Leaf functions with an error code report it in EAX and ZF */
+    if (ret >= 0) {
+        env->regs[R_EAX] = ret;
+        eflags &= ~(CC_O | CC_S | CC_Z | CC_A | CC_P | CC_C);
+        if (ret != SGX_SUCCESS) {
+            eflags |= CC_Z;
+        }
+    }
+    CC_SRC = eflags;
+}
+
+/*
+ * ENCLU leaf functions
+ */
+
+/*
+ * The XSAVE area of an SSA frame fits into its first page; the page is
+ * checked and translated by EENTER and ERESUME like the GPRSGX page.
+ */
+QEMU_BUILD_BUG_ON(sizeof(X86XSaveArea) > SGX_PAGE_SIZE);
+
+/* Saves the state components in @xfrm like XSAVE would */
+static void sgx_xsave(CPUX86State *env, uint64_t xfrm, X86XSaveArea *area)
+{
+    int i;
+
+    update_mxcsr_from_sse_status(env);
+    x86_cpu_xsave_all_areas(env_archcpu(env), area, sizeof(*area));
+    for (i = XSTATE_YMM_BIT; i < XSAVE_STATE_AREA_COUNT; i++) {
+        const ExtSaveArea *esa = &x86_ext_save_areas[i];
+
+        if (!((xfrm >> i) & 1) && esa->size) {
+            memset((uint8_t *)area + esa->offset, 0, esa->size);
+        }
+    }
+    area->header.xstate_bv &= xfrm;
+    area->legacy.mxcsr_mask = 0x0000ffff;
+}
+
+/*
+ * Loads the state components in @xfrm from @area like XRSTOR would; the
+ * other components are left alone.
+ */
+static void sgx_xrstor(CPUX86State *env, uint64_t xfrm,
+                       const X86XSaveArea *area)
+{
+    X86XSaveArea cur;
+    int i;
+
+    sgx_xsave(env, ~0ULL, &cur);
+    /* XFRM always includes x87 and SSE, which share the legacy area */
+    cur.legacy = area->legacy;
+    cur.legacy.mxcsr &= 0x0000ffff;
+    for (i = XSTATE_YMM_BIT; i < XSAVE_STATE_AREA_COUNT; i++) {
+        const ExtSaveArea *esa = &x86_ext_save_areas[i];
+
+        if (((xfrm >> i) & 1) && esa->size) {
+            memcpy((uint8_t *)&cur + esa->offset,
+                   (const uint8_t *)area + esa->offset, esa->size);
+        }
+    }
+    cur.header.xstate_bv = (cur.header.xstate_bv & ~xfrm) |
+                           (area->header.xstate_bv & xfrm);
+    x86_cpu_xrstor_all_areas(env_archcpu(env), &cur, sizeof(cur));
+    cpu_set_mxcsr(env, env->mxcsr);
+    cpu_set_fpuc(env, env->fpuc);
+}
+
+/* Puts the state components in @xfrm into their initial configuration */
+static void sgx_xinit(CPUX86State *env, uint64_t xfrm)
+{
+    X86XSaveArea init = {
+        .legacy.fcw = 0x037f,
+        .legacy.mxcsr = 0x1f80,
+    };
+
+    sgx_xrstor(env, xfrm, &init);
+}
+
+/* Whether the SSA frame page at @addr, which maps to @e, can be used */
+static bool sgx_ssa_page_usable(SGXEPCMEntry *e, SGXEnclave *encl,
+                                target_ulong addr)
+{
+    return e && e->valid && e->type == SGX_PT_REG && e->encl == encl &&
+           !e->blocked && e->lin_addr == (addr & TARGET_PAGE_MASK) &&
+           (e->prot & (PAGE_READ | PAGE_WRITE)) == (PAGE_READ | PAGE_WRITE);
+}
+
+/* Restores the state from before the enclave was entered */
+static void sgx_leave(CPUX86State *env)
+{
+    env->segs[R_FS] = env->sgx.fs;
+    env->segs[R_GS] = env->sgx.gs;
+    memset(&env->sgx, 0, sizeof(env->sgx));
+    tlb_flush(env_cpu(env));
+}
+
+static bool sgx_tcs_usable(SGXEPCMEntry *e, target_ulong tcs, uint64_t eid)
+{
+    return e->valid && e->type == SGX_PT_TCS && e->lin_addr == tcs &&
+           !e->blocked && !e->busy && e->encl->initialized &&
+           e->encl->eid == eid;
+}
+
+static void sgx_enter(CPUX86State *env, bool resume, target_ulong next_eip,
+                      uintptr_t ra)
+{
+    target_ulong tcs = sgx_operand(env, R_EBX);
+    target_ulong aep = env->regs[R_ECX];
+    uint8_t gprs[SGX_GPRSGX_SIZE];
+    X86XSaveArea xsave;
+    SGXEPCMEntry *e;
+    SGXEnclave *encl;
+    hwaddr tcs_paddr, gprsgx, xsave_paddr;
+    target_ulong gprsgx_addr, xsave_addr;
+    uint64_t eid, base, xfrm, oentry, ofsbase, ogsbase;
+    uint32_t cssa, nssa, frame;
+    bool mode64;
+    int i;
+
+    if (env->sgx.encl) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    sgx_check_align(env, tcs, SGX_PAGE_SIZE, ra);
+    tcs_paddr = x86_cpu_get_physical_address(env, tcs, MMU_DATA_LOAD,
+                                             cpu_mmu_index(env, false), ra);
+
+    /* Find the SSA frame, it has to be translated without the lock */
+    qemu_mutex_lock(&sgx.lock);
+    e = sgx_epcm(tcs_paddr);
+    if (!e || !e->valid || e->type != SGX_PT_TCS || e->lin_addr != tcs) {
+        qemu_mutex_unlock(&sgx.lock);
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    encl = e->encl;
+    eid = encl->eid;
+    cssa = ldl_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_CSSA);
+    nssa = ldl_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_NSSA);
+    frame = resume ? cssa - 1 : cssa;
+    xsave_addr = encl->base +
+                 ldq_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_OSSA) +
+                 (uint64_t)frame * encl->ssa_frame_size;
+    gprsgx_addr = xsave_addr + encl->ssa_frame_size - SGX_GPRSGX_SIZE;
+    qemu_mutex_unlock(&sgx.lock);
+
+    if (resume ? cssa == 0 : cssa >= nssa) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    xsave_paddr = x86_cpu_get_physical_address(env, xsave_addr,
+                                               MMU_DATA_STORE,
+                                               cpu_mmu_index(env, false), ra);
+    gprsgx = x86_cpu_get_physical_address(env, gprsgx_addr, MMU_DATA_STORE,
+                                          cpu_mmu_index(env, false), ra);
+
+    qemu_mutex_lock(&sgx.lock);
+    if (!sgx_tcs_usable(e, tcs, eid) ||
+        ldl_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_CSSA) != cssa) {
+        qemu_mutex_unlock(&sgx.lock);
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    mode64 = encl->attributes & SGX_ATTR_MODE64BIT;
+    if (mode64 != !!(env->hflags & HF_CS64_MASK)) {
+        qemu_mutex_unlock(&sgx.lock);
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+    if (!sgx_ssa_page_usable(sgx_epcm(xsave_paddr), encl, xsave_addr)) {
+        qemu_mutex_unlock(&sgx.lock);
+        sgx_raise_pf(env, xsave_addr, ra);
+    }
+    if (!sgx_ssa_page_usable(sgx_epcm(gprsgx), encl, gprsgx_addr)) {
+        qemu_mutex_unlock(&sgx.lock);
+        sgx_raise_pf(env, gprsgx_addr, ra);
+    }
+
+    base = encl->base;
+    xfrm = encl->xfrm;
+    oentry = ldq_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_OENTRY);
+    ofsbase = ldq_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_OFSBASE);
+    ogsbase = ldq_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_OGSBASE);
+    if (resume) {
+        cpu_physical_memory_read(gprsgx, gprs, sizeof(gprs));
+        memset(&xsave, 0, sizeof(xsave));
+        cpu_physical_memory_read(xsave_paddr, &xsave, encl->xsave_size);
+        stl_le_phys(&address_space_memory, tcs_paddr + SGX_TCS_CSSA, frame);
+    }
+    stq_le_phys(&address_space_memory, gprsgx + SGX_GPRSGX_URSP,
+                env->regs[R_ESP]);
+    stq_le_phys(&address_space_memory, gprsgx + SGX_GPRSGX_URBP,
+                env->regs[R_EBP]);
+    e->busy = true;
+    encl->nr_threads++;
+    qemu_mutex_unlock(&sgx.lock);
+
+    env->sgx = (X86SGXState) {
+        .encl = encl,
+        .tcs = tcs,
+        .tcs_paddr = tcs_paddr,
+        .gprsgx_paddr = gprsgx,
+        .xsave_paddr = xsave_paddr,
+        .aep = aep,
+        .ursp = env->regs[R_ESP],
+        .urbp = env->regs[R_EBP],
+        .fs = env->segs[R_FS],
+        .gs = env->segs[R_GS],
+    };
+    tlb_flush(env_cpu(env));
+
+    if (!resume) {
+        env->regs[R_EAX] = cssa;
+        env->regs[R_ECX] = env->segs[R_CS].base + next_eip;
+        env->eip = base + oentry - env->segs[R_CS].base;
+        env->segs[R_FS].base = base + ofsbase;
+        env->segs[R_GS].base = base + ogsbase;
+        return;
+    }
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->regs[i] = ldq_le_p(gprs + i * 8);
+    }
+    env->eip = ldq_le_p(gprs + SGX_GPRSGX_RIP);
+    env->segs[R_FS].base = ldq_le_p(gprs + SGX_GPRSGX_FSBASE);
+    env->segs[R_GS].base = ldq_le_p(gprs + SGX_GPRSGX_GSBASE);
+    cpu_load_eflags(env, ldq_le_p(gprs + SGX_GPRSGX_RFLAGS),
+                    TF_MASK | AC_MASK | ID_MASK);
+    sgx_xrstor(env, xfrm, &xsave);
+}
+
+static void sgx_eexit(CPUX86State *env, target_ulong next_eip, uintptr_t ra)
+{
+    SGXEnclave *encl = env->sgx.encl;
+
+    if (!encl) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+
+    qemu_mutex_lock(&sgx.lock);
+    sgx_epcm(env->sgx.tcs_paddr)->busy = false;
+    encl->nr_threads--;
+    qemu_mutex_unlock(&sgx.lock);
+
+    env->regs[R_ECX] = env->segs[R_CS].base + next_eip;
+    env->eip = env->regs[R_EBX] - env->segs[R_CS].base;
+    sgx_leave(env);
+}
+
+void helper_enclu(CPUX86State *env, int next_eip_addend)
+{
+    uintptr_t ra = GETPC();
+    target_ulong next_eip = env->eip + next_eip_addend;
+    uint32_t eflags = cpu_cc_compute_all(env, CC_OP);
+
+    if (!sgx_enabled(env)) {
+        raise_exception_ra(env, EXCP06_ILLOP, ra);
+    }
+
+    switch ((uint32_t)env->regs[R_EAX]) {
+    case SGX_EENTER:
+        sgx_enter(env, false, next_eip, ra);
+        CC_SRC = eflags;
+        break;
+    case SGX_ERESUME:
+        /* Loads RFLAGS from the SSA frame */
+        sgx_enter(env, true, next_eip, ra);
+        break;
+    case SGX_EEXIT:
+        sgx_eexit(env, next_eip, ra);
+        CC_SRC = eflags;
+        break;
+    default:
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, ra);
+    }
+}
+
+/*
+ * Asynchronous enclave exit: called when an exception or interrupt is
+ * delivered in enclave mode.  Saves the enclave state, including the
+ * XSAVE state components in XFRM, to the current SSA frame and leaves the
+ * enclave with a synthetic state that makes the handler return to the AEP
+ * and does not reveal any enclave register.
+ */
+void x86_sgx_aex(CPUX86State *env, int intno, int is_int,
+                 target_ulong next_eip)
+{
+    SGXEnclave *encl = env->sgx.encl;
+    uint8_t gprs[SGX_GPRSGX_SIZE] = { 0 };
+    X86XSaveArea xsave;
+    hwaddr gprsgx = env->sgx.gprsgx_paddr;
+    hwaddr xsave_paddr = env->sgx.xsave_paddr;
+    hwaddr cssa_paddr = env->sgx.tcs_paddr + SGX_TCS_CSSA;
+    uint32_t exitinfo = 0;
+    SGXEPCMEntry *g, *x;
+    int i;
+
+    sgx_xsave(env, encl->xfrm, &xsave);
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        stq_le_p(gprs + i * 8, env->regs[i]);
+    }
+    stq_le_p(gprs + SGX_GPRSGX_RFLAGS, cpu_compute_eflags(env));
+    stq_le_p(gprs + SGX_GPRSGX_RIP, is_int ? next_eip : env->eip);
+    stq_le_p(gprs + SGX_GPRSGX_URSP, env->sgx.ursp);
+    stq_le_p(gprs + SGX_GPRSGX_URBP, env->sgx.urbp);
+    stq_le_p(gprs + SGX_GPRSGX_FSBASE, env->segs[R_FS].base);
+    stq_le_p(gprs + SGX_GPRSGX_GSBASE, env->segs[R_GS].base);
+
+    switch (intno) {
+    case EXCP00_DIVZ:
+    case EXCP01_DB:
+    case EXCP05_BOUND:
+    case EXCP06_ILLOP:
+    case EXCP10_COPR:
+    case EXCP11_ALGN:
+    case 19:                /* #XM */
+        exitinfo = SGX_EXITINFO_VALID | SGX_EXITINFO_HW_EXC | intno;
+        break;
+    case EXCP03_INT3:
+    case EXCP04_INTO:
+        if (is_int) {
+            exitinfo = SGX_EXITINFO_VALID | SGX_EXITINFO_SW_EXC | intno;
+        }
+        break;
+    }
+    stl_le_p(gprs + SGX_GPRSGX_EXITINFO, exitinfo);
+
+    qemu_mutex_lock(&sgx.lock);
+    /* The SSA frame is lost if it was evicted behind our back */
+    g = sgx_epcm(gprsgx);
+    x = sgx_epcm(xsave_paddr);
+    if (g->valid && g->encl == encl && !g->blocked &&
+        x->valid && x->encl == encl && !x->blocked) {
+        cpu_physical_memory_write(xsave_paddr, &xsave, encl->xsave_size);
+        cpu_physical_memory_write(gprsgx, gprs, sizeof(gprs));
+        stl_le_phys(&address_space_memory, cssa_paddr,
+                    ldl_le_phys(&address_space_memory, cssa_paddr) + 1);
+    }
+    sgx_epcm(env->sgx.tcs_paddr)->busy = false;
+    encl->nr_threads--;
+    qemu_mutex_unlock(&sgx.lock);
+
+    sgx_xinit(env, encl->xfrm);
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->regs[i] = 0;
+    }
+    env->regs[R_EAX] = SGX_ERESUME;
+    env->regs[R_EBX] = env->sgx.tcs;
+    env->regs[R_ECX] = env->sgx.aep;
+    env->regs[R_ESP] = env->sgx.ursp;
+    env->regs[R_EBP] = env->sgx.urbp;
+    env->eip = env->sgx.aep - env->segs[R_CS].base;
+    cpu_load_eflags(env, 0, TF_MASK | AC_MASK);
+    if (intno == EXCP0E_PAGE) {
+        env->cr[2] &= TARGET_PAGE_MASK;
+    }
+    sgx_leave(env);
+}
+
+/*
+ * Memory access control
+ */
+
+/*
+ * Called when filling the TLB for @addr, which maps to @paddr.  Returns
+ * the error code of a #PF to raise, -1 if a #GP(0) must be raised, or 0
+ * after restricting @prot to the EPCM permissions and redirecting EPC
+ * accesses from outside of the enclave to the abort page.
+ */
+int x86_sgx_check_access(CPUX86State *env, vaddr addr, hwaddr paddr,
+                         int is_write1, int mmu_idx, int *prot,
+                         MemTxAttrs *attrs)
+{
+    SGXEnclave *encl = env->sgx.encl;
+    SGXEPCMEntry *e = sgx_epcm(paddr);
+    int epcm_prot = 0;
+    int error_code;
+
+    if (!encl || addr - encl->base >= encl->size) {
+        if (encl) {
+            /*
+             * Enclave code must not run outside ELRANGE.  Keep data
+             * accesses from creating TLB entries that allow it.
+             */
+            if (is_write1 == MMU_INST_FETCH) {
+                return -1;
+            }
+            *prot &= ~PAGE_EXEC;
+        }
+        if (e) {
+            attrs->target_tlb_bit0 = 1;
+        }
+        return 0;
+    }
+
+    if (e) {
+        qemu_mutex_lock(&sgx.lock);
+        if (e->valid && e->type == SGX_PT_REG && e->encl == encl &&
+            !e->blocked && e->lin_addr == (addr & TARGET_PAGE_MASK)) {
+            epcm_prot = e->prot;
+        }
+        qemu_mutex_unlock(&sgx.lock);
+    }
+
+    *prot &= epcm_prot;
+    if (*prot & (1 << is_write1)) {
+        return 0;
+    }
+
+    error_code = PG_ERROR_SGX_MASK | PG_ERROR_P_MASK;
+    if (is_write1 == MMU_DATA_STORE) {
+        error_code |= PG_ERROR_W_MASK;
+    } else if (is_write1 == MMU_INST_FETCH) {
+        error_code |= PG_ERROR_I_D_MASK;
+    }
+    if (mmu_idx == MMU_USER_IDX) {
+        error_code |= PG_ERROR_U_MASK;
+    }
+    return error_code;
+}
+
+static uint64_t sgx_abort_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return UINT64_MAX;
+}
+
+static void sgx_abort_write(void *opaque, hwaddr addr, uint64_t val,
+                            unsigned size)
+{
+}
+
+static const MemoryRegionOps sgx_abort_ops = {
+    .read = sgx_abort_read,
+    .write = sgx_abort_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+    },
+    .impl = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+    },
+};
+
+/* Root of the address space that EPC accesses from outside go to */
+MemoryRegion *x86_sgx_abort_region(void)
+{
+    static MemoryRegion *mr;
+
+    if (!mr) {
+        mr = g_new(MemoryRegion, 1);
+        memory_region_init_io(mr, NULL, &sgx_abort_ops, NULL,
+                              "sgx-abort-page", UINT64_MAX);
+    }
+    return mr;
+}
+
+static void sgx_reset(void *opaque)
+{
+    qemu_mutex_lock(&sgx.lock);
+    g_hash_table_remove_all(sgx.enclaves);
+    memset(sgx.epcm, 0, sizeof(*sgx.epcm) * (sgx.size / SGX_PAGE_SIZE));
+    qemu_mutex_unlock(&sgx.lock);
+}
+
+void x86_sgx_machine_done(void)
+{
+    uint64_t addr, size, end = 0;
+    int i;
+
+    if (x86_sgx_active || !sgx_epc_is_emulated()) {
+        return;
+    }
+
+    sgx.base = UINT64_MAX;
+    for (i = 0; !sgx_epc_get_section(i, &addr, &size); i++) {
+        sgx.base = MIN(sgx.base, addr);
+        end = MAX(end, addr + size);
+    }
+    sgx.size = end - sgx.base;
+    sgx.epcm = g_new0(SGXEPCMEntry, sgx.size / SGX_PAGE_SIZE);
+    sgx.enclaves = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                         sgx_enclave_free);
+    qemu_mutex_init(&sgx.lock);
+    qemu_guest_getrandom_nofail(sgx.key, sizeof(sgx.key));
+    qemu_register_reset(sgx_reset, NULL);
+
+    error_setg(&sgx.migration_blocker,
+               "SGX EPC emulation does not support migration");
+    migrate_add_blocker(sgx.migration_blocker, &error_fatal);
+
+    x86_sgx_active = true;
+}
@@ -33,6 +33,8 @@ static void tcg_cpu_machine_done(Notifier *n, void *unused)
     MemoryRegion *smram =
         (MemoryRegion *) object_resolve_path("/machine/smram", NULL);
 
+    x86_sgx_machine_done();
+
     if (smram) {
         cpu->smram = g_new(MemoryRegion, 1);
         memory_region_init_alias(cpu->smram, OBJECT(cpu), "smram",
@@ -72,9 +74,11 @@ bool tcg_cpu_realizefn(CPUState *cs, Error **errp)
     memory_region_add_subregion_overlap(cpu->cpu_as_root, 0, cpu->cpu_as_mem, 0);
     memory_region_set_enabled(cpu->cpu_as_mem, true);
 
-    cs->num_ases = 2;
+    cs->num_ases = 3;
     cpu_address_space_init(cs, 0, "cpu-memory", cs->memory);
     cpu_address_space_init(cs, 1, "cpu-smm", cpu->cpu_as_root);
+    cpu_address_space_init(cs, X86_ASIDX_SGX_ABORT, "cpu-sgx-abort",
+                           x86_sgx_abort_region());
 
     /* ... SMRAM with higher priority, linked from /machine/smram.  */
     cpu->machine_done.notify = tcg_cpu_machine_done;
@@ -193,6 +193,7 @@ typedef struct DisasContext {
 
 #ifdef CONFIG_USER_ONLY
 STUB_HELPER(clgi, TCGv_env env)
+STUB_HELPER(encls, TCGv_env env)
 STUB_HELPER(flush_page, TCGv_env env, TCGv addr)
 STUB_HELPER(hlt, TCGv_env env, TCGv_i32 pc_ofs)
 STUB_HELPER(inb, TCGv ret, TCGv_env env, TCGv_i32 port)
@@ -7494,6 +7495,38 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             gen_eob(s);
             break;
 
+        case 0xcf: /* encls */
+            if (!(s->cpuid_7_0_ebx_features & CPUID_7_0_EBX_SGX)
+                || !PE(s) || VM86(s) || CPL(s) != 0) {
+                goto illegal_op;
+            }
+            gen_update_cc_op(s);
+            gen_jmp_im(s, pc_start - s->cs_base);
+            gen_helper_encls(cpu_env);
+            set_cc_op(s, CC_OP_EFLAGS);
+            /* End TB because EPC pages may have been unmapped.  */
+            gen_jmp_im(s, s->pc - s->cs_base);
+            gen_eob(s);
+            break;
+
+        case 0xd7: /* enclu */
+            if (!(s->cpuid_7_0_ebx_features & CPUID_7_0_EBX_SGX)
+                || !PE(s) || VM86(s) || CPL(s) != 3) {
+                goto illegal_op;
+            }
+#ifdef CONFIG_USER_ONLY
+            /* there is no EPC to create enclaves in */
+            goto illegal_op;
+#else
+            gen_update_cc_op(s);
+            gen_jmp_im(s, pc_start - s->cs_base);
+            gen_helper_enclu(cpu_env, tcg_const_i32(s->pc - pc_start));
+            set_cc_op(s, CC_OP_EFLAGS);
+            /* the helper sets EIP, possibly to enter or leave an enclave */
+            gen_eob(s);
+            break;
+#endif
+
         CASE_MODRM_MEM_OP(1): /* sidt */
             gen_svm_check_intercept(s, SVM_EXIT_IDTR_READ);
             gen_lea_modrm(env, s, modrm);
@@ -14,6 +14,10 @@
 #include "qemu/units.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
+#ifdef CONFIG_QEMU_PRIVATE_XTS
+#include "crypto/aes.h"
+#include "crypto/xts.h"
+#endif
 
 static void test_cipher_speed(size_t chunk_size,
                               QCryptoCipherMode mode,
@@ -164,6 +168,98 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+#ifdef CONFIG_QEMU_PRIVATE_XTS
+/*
+ * The generic XTS code used by backends without XTS support of their own,
+ * here on top of the builtin AES implementation
+ */
+struct BenchXTSAES {
+    AES_KEY enc;
+    AES_KEY dec;
+};
+
+static void bench_xts_aes_encrypt(const void *ctx, size_t length,
+                                  uint8_t *dst, const uint8_t *src)
+{
+    const struct BenchXTSAES *aesctx = ctx;
+
+    for (; length > 0; length -= AES_BLOCK_SIZE) {
+        AES_encrypt(src, dst, &aesctx->enc);
+        src += AES_BLOCK_SIZE;
+        dst += AES_BLOCK_SIZE;
+    }
+}
+
+static void bench_xts_aes_decrypt(const void *ctx, size_t length,
+                                  uint8_t *dst, const uint8_t *src)
+{
+    const struct BenchXTSAES *aesctx = ctx;
+
+    for (; length > 0; length -= AES_BLOCK_SIZE) {
+        AES_decrypt(src, dst, &aesctx->dec);
+        src += AES_BLOCK_SIZE;
+        dst += AES_BLOCK_SIZE;
+    }
+}
+
+static void test_xts_generic_speed(size_t chunk_size, int keybits)
+{
+    struct BenchXTSAES data, tweak;
+    uint8_t key[64], iv[XTS_BLOCK_SIZE];
+    uint8_t *plaintext, *ciphertext;
+    const size_t total = 512 * MiB;
+    size_t remain;
+
+    memset(key, g_test_rand_int(), sizeof(key));
+    memset(iv, g_test_rand_int(), sizeof(iv));
+    AES_set_encrypt_key(key, keybits, &data.enc);
+    AES_set_decrypt_key(key, keybits, &data.dec);
+    AES_set_encrypt_key(key + keybits / 8, keybits, &tweak.enc);
+    AES_set_decrypt_key(key + keybits / 8, keybits, &tweak.dec);
+
+    ciphertext = g_new0(uint8_t, chunk_size);
+    plaintext = g_new0(uint8_t, chunk_size);
+    memset(plaintext, g_test_rand_int(), chunk_size);
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= chunk_size) {
+        xts_encrypt(&data, &tweak, bench_xts_aes_encrypt,
+                    bench_xts_aes_decrypt, iv, chunk_size,
+                    ciphertext, plaintext);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("enc(generic-xts-aes-%d) chunk %zu bytes %.2f MB/sec ",
+                   keybits, chunk_size,
+                   (double)total / MiB / g_test_timer_last());
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= chunk_size) {
+        xts_decrypt(&data, &tweak, bench_xts_aes_encrypt,
+                    bench_xts_aes_decrypt, iv, chunk_size,
+                    plaintext, ciphertext);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("dec(generic-xts-aes-%d) chunk %zu bytes %.2f MB/sec ",
+                   keybits, chunk_size,
+                   (double)total / MiB / g_test_timer_last());
+
+    g_free(plaintext);
+    g_free(ciphertext);
+}
+
+static void test_cipher_speed_generic_xts_aes_128(const void *opaque)
+{
+    test_xts_generic_speed((size_t)opaque, 128);
+}
+
+static void test_cipher_speed_generic_xts_aes_256(const void *opaque)
+{
+    test_xts_generic_speed((size_t)opaque, 256);
+}
+#endif
+
 
 int main(int argc, char **argv)
 {
@@ -204,5 +300,18 @@ int main(int argc, char **argv)
     ADD_TESTS(16384);
     ADD_TESTS(65536);
 
+    /* The request sizes LUKS and encrypted qcow2 images see */
+    ADD_TEST(xts, aes, 128, 1048576);
+    ADD_TEST(xts, aes, 256, 1048576);
+
+#ifdef CONFIG_QEMU_PRIVATE_XTS
+    ADD_TEST(generic_xts, aes, 128, 512);
+    ADD_TEST(generic_xts, aes, 256, 512);
+    ADD_TEST(generic_xts, aes, 128, 4096);
+    ADD_TEST(generic_xts, aes, 256, 4096);
+    ADD_TEST(generic_xts, aes, 128, 65536);
+    ADD_TEST(generic_xts, aes, 256, 65536);
+#endif
+
     return g_test_run();
 }
@@ -0,0 +1,157 @@
+/*
+ * Hierarchical bitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* A 64 TiB disk tracked at 64 KiB granularity */
+#define BITMAP_SIZE (64 * TiB)
+#define BITMAP_GRANULARITY 16
+
+/* Bitmap range covered by 8 MiB of serialized data */
+#define SERIALIZE_CHUNK ((UINT64_C(8) * MiB * 8) << BITMAP_GRANULARITY)
+
+typedef struct HBitmapBenchOpts {
+    const char *name;
+    /* Set one bit out of every @stride, a power of two */
+    uint64_t stride;
+} HBitmapBenchOpts;
+
+static HBitmap *bench_bitmap_new(const HBitmapBenchOpts *opts)
+{
+    HBitmap *hb = hbitmap_alloc(BITMAP_SIZE, BITMAP_GRANULARITY);
+    uint64_t size = hbitmap_serialization_size(hb, 0, SERIALIZE_CHUNK);
+    uint8_t *buf = g_malloc0(size);
+    uint64_t bit, offset;
+
+    /* Setting the bits one by one would take longer than the benchmark */
+    for (bit = 0; bit < size * 8; bit += opts->stride) {
+        buf[bit / 8] |= 1 << (bit % 8);
+    }
+    for (offset = 0; offset < BITMAP_SIZE; offset += SERIALIZE_CHUNK) {
+        hbitmap_deserialize_part(hb, buf, offset, SERIALIZE_CHUNK, false);
+    }
+    hbitmap_deserialize_finish(hb);
+
+    g_free(buf);
+    return hb;
+}
+
+static void bench_report(const char *op, const HBitmapBenchOpts *opts,
+                         uint64_t bytes)
+{
+    double secs = g_test_timer_last();
+
+    g_test_message("%s(%s): %.3f ms, %.2f MB/sec of bitmap", op, opts->name,
+                   secs * 1000, bytes / secs / MiB);
+}
+
+static uint64_t bench_bitmap_bytes(void)
+{
+    return (BITMAP_SIZE >> BITMAP_GRANULARITY) / 8;
+}
+
+static void test_next_dirty_area(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = bench_bitmap_new(opts);
+    int64_t offset, count;
+    uint64_t areas = 0;
+
+    g_test_timer_start();
+    for (offset = 0;
+         hbitmap_next_dirty_area(hb, offset, BITMAP_SIZE, INT64_MAX,
+                                 &offset, &count);
+         offset += count)
+    {
+        areas++;
+    }
+    g_test_timer_elapsed();
+
+    g_assert_cmpuint(areas, >, 0);
+    bench_report("next_dirty_area", opts, bench_bitmap_bytes());
+    hbitmap_free(hb);
+}
+
+static void test_merge(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *src = bench_bitmap_new(opts);
+    HBitmap *dst = hbitmap_alloc(BITMAP_SIZE, BITMAP_GRANULARITY);
+
+    g_test_timer_start();
+    g_assert(hbitmap_merge(dst, src, dst));
+    g_test_timer_elapsed();
+
+    g_assert_cmpuint(hbitmap_count(dst), ==, hbitmap_count(src));
+    bench_report("merge", opts, bench_bitmap_bytes());
+    hbitmap_free(dst);
+    hbitmap_free(src);
+}
+
+static void test_serialize(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = bench_bitmap_new(opts);
+    HBitmap *copy = hbitmap_alloc(BITMAP_SIZE, BITMAP_GRANULARITY);
+    uint64_t size = hbitmap_serialization_size(hb, 0, SERIALIZE_CHUNK);
+    uint8_t *buf = g_malloc(size);
+    uint64_t offset;
+
+    g_test_timer_start();
+    for (offset = 0; offset < BITMAP_SIZE; offset += SERIALIZE_CHUNK) {
+        hbitmap_serialize_part(hb, buf, offset, SERIALIZE_CHUNK);
+    }
+    g_test_timer_elapsed();
+    bench_report("serialize", opts, bench_bitmap_bytes());
+
+    g_test_timer_start();
+    for (offset = 0; offset < BITMAP_SIZE; offset += SERIALIZE_CHUNK) {
+        hbitmap_serialize_part(hb, buf, offset, SERIALIZE_CHUNK);
+        hbitmap_deserialize_part(copy, buf, offset, SERIALIZE_CHUNK, false);
+    }
+    hbitmap_deserialize_finish(copy);
+    g_test_timer_elapsed();
+    bench_report("serialize+deserialize", opts, bench_bitmap_bytes());
+
+    g_assert_cmpuint(hbitmap_count(copy), ==, hbitmap_count(hb));
+    g_free(buf);
+    hbitmap_free(copy);
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    static const HBitmapBenchOpts opts[] = {
+        { .name = "full", .stride = 1 },
+        { .name = "every-64th", .stride = 64 },
+        { .name = "every-4096th", .stride = 4096 },
+    };
+    char *name;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        name = g_strdup_printf("/hbitmap/benchmark/next-dirty-area/%s",
+                               opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_next_dirty_area);
+        g_free(name);
+
+        name = g_strdup_printf("/hbitmap/benchmark/merge/%s", opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_merge);
+        g_free(name);
+
+        name = g_strdup_printf("/hbitmap/benchmark/serialize/%s",
+                               opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_serialize);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,129 @@
+/*
+ * IOVA tree speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/iova-tree.h"
+
+/* One 64 KiB mapping per buffer, with a hole of the same size in between */
+#define MAP_SIZE (64 * KiB)
+#define IOVA_LAST (UINT64_C(1) << 48)
+
+static void bench_report(const char *op, int nr_maps, uint64_t ops)
+{
+    double secs = g_test_timer_last();
+
+    g_test_message("%s(%d mappings): %.3f ms, %.2f Mops/sec", op, nr_maps,
+                   secs * 1000, ops / secs / 1000000);
+}
+
+static IOVATree *bench_tree_new(int nr_maps)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap map = { .size = MAP_SIZE - 1, .perm = IOMMU_RW };
+    int i;
+
+    for (i = 0; i < nr_maps; i++) {
+        map.iova = (uint64_t)i * 2 * MAP_SIZE;
+        map.translated_addr = map.iova;
+        g_assert_cmpint(iova_tree_insert(tree, &map), ==, IOVA_OK);
+    }
+    return tree;
+}
+
+static void test_insert(const void *opaque)
+{
+    int nr_maps = GPOINTER_TO_INT(opaque);
+    IOVATree *tree;
+
+    g_test_timer_start();
+    tree = bench_tree_new(nr_maps);
+    g_test_timer_elapsed();
+
+    bench_report("insert", nr_maps, nr_maps);
+    iova_tree_destroy(tree);
+}
+
+static void test_find(const void *opaque)
+{
+    int nr_maps = GPOINTER_TO_INT(opaque);
+    IOVATree *tree = bench_tree_new(nr_maps);
+    uint64_t i, ops = 4 * 1000 * 1000;
+    uint64_t found = 0;
+
+    g_test_timer_start();
+    for (i = 0; i < ops; i++) {
+        hwaddr iova = (i * 7919 % nr_maps) * 2 * MAP_SIZE + i % MAP_SIZE;
+
+        found += iova_tree_find_address(tree, iova) != NULL;
+    }
+    g_test_timer_elapsed();
+
+    g_assert_cmpuint(found, ==, ops);
+    bench_report("find", nr_maps, ops);
+    iova_tree_destroy(tree);
+}
+
+/*
+ * Unmap random mappings and allocate new ones in their place, like a
+ * device that maps and unmaps buffers of different lifetime.
+ */
+static void test_alloc_churn(const void *opaque)
+{
+    int nr_maps = GPOINTER_TO_INT(opaque);
+    IOVATree *tree = bench_tree_new(nr_maps);
+    DMAMap map = { .size = MAP_SIZE - 1, .perm = IOMMU_RW };
+    hwaddr *iovas = g_new(hwaddr, nr_maps);
+    uint64_t i, ops = 1000 * 1000;
+
+    for (i = 0; i < nr_maps; i++) {
+        iovas[i] = i * 2 * MAP_SIZE;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < ops; i++) {
+        int victim = i * 7919 % nr_maps;
+
+        map.iova = iovas[victim];
+        iova_tree_remove(tree, &map);
+        g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0, IOVA_LAST),
+                        ==, IOVA_OK);
+        iovas[victim] = map.iova;
+    }
+    g_test_timer_elapsed();
+
+    bench_report("alloc+remove", nr_maps, ops);
+    g_free(iovas);
+    iova_tree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    static const int nr_maps[] = { 64, 4096, 262144 };
+    char *name;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(nr_maps); i++) {
+        name = g_strdup_printf("/iova-tree/benchmark/insert/%d", nr_maps[i]);
+        g_test_add_data_func(name, GINT_TO_POINTER(nr_maps[i]), test_insert);
+        g_free(name);
+
+        name = g_strdup_printf("/iova-tree/benchmark/find/%d", nr_maps[i]);
+        g_test_add_data_func(name, GINT_TO_POINTER(nr_maps[i]), test_find);
+        g_free(name);
+
+        name = g_strdup_printf("/iova-tree/benchmark/alloc-churn/%d",
+                               nr_maps[i]);
+        g_test_add_data_func(name, GINT_TO_POINTER(nr_maps[i]),
+                             test_alloc_churn);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
@@ -296,6 +296,97 @@ static const QCryptoXTSTestData test_data[] = {
           0xed, 0xbf, 0x9d, 0xac, 0xe4, 0x5d, 0x6f, 0x6a,
           0x73, 0x06, 0xe6, 0x4b, 0xe5, 0xdd, 0x82 },
     },
+
+    /*
+     * 32 byte key, 301 byte PTX: ciphertext stealing after more full
+     * blocks than are processed in one batch; generated with OpenSSL
+     */
+    {
+        "/crypto/xts/cts-key-32-ptx-301",
+        32,
+        { 0xff, 0xfe, 0xfd, 0xfc, 0xfb, 0xfa, 0xf9, 0xf8,
+          0xf7, 0xf6, 0xf5, 0xf4, 0xf3, 0xf2, 0xf1, 0xf0 },
+        { 0xbf, 0xbe, 0xbd, 0xbc, 0xbb, 0xba, 0xb9, 0xb8,
+          0xb7, 0xb6, 0xb5, 0xb4, 0xb3, 0xb2, 0xb1, 0xb0 },
+        0x123456789aLL,
+        301,
+        { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+          0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+          0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+          0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+          0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+          0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+          0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+          0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+          0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+          0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+          0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+          0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+          0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+          0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+          0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+          0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+          0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+          0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+          0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+          0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+          0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+          0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+          0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7,
+          0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+          0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+          0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+          0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
+          0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+          0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+          0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+          0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+          0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+          0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+          0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+          0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+          0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+          0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+          0x28, 0x29, 0x2a, 0x2b, 0x2c },
+        { 0xed, 0xbf, 0x9d, 0xac, 0xe4, 0x5d, 0x6f, 0x6a,
+          0x73, 0x06, 0xe6, 0x4b, 0xe5, 0xdd, 0x82, 0x4b,
+          0x25, 0x38, 0xf5, 0x72, 0x4f, 0xcf, 0x24, 0x24,
+          0x9a, 0xc1, 0x11, 0xab, 0x45, 0xad, 0x39, 0x23,
+          0x3a, 0xd6, 0x18, 0x3c, 0x66, 0xfa, 0x54, 0x8a,
+          0x3c, 0xdf, 0x3e, 0x36, 0xd2, 0xb2, 0x1c, 0xcd,
+          0xc6, 0xbc, 0x65, 0x7c, 0xb3, 0xae, 0xb8, 0x7b,
+          0xa2, 0xc5, 0xf5, 0x8f, 0xfa, 0xfa, 0xcd, 0x76,
+          0xd0, 0xa0, 0x98, 0xb6, 0x87, 0xc0, 0xb6, 0x53,
+          0x6d, 0x56, 0x0c, 0xa0, 0x07, 0x05, 0x1b, 0x0b,
+          0x44, 0x9b, 0xad, 0x44, 0x22, 0x5a, 0x2b, 0x98,
+          0x84, 0xa1, 0x69, 0x56, 0x66, 0xc5, 0x65, 0x6e,
+          0xc9, 0xe3, 0x03, 0xec, 0xe2, 0x9d, 0x65, 0xdc,
+          0xad, 0x21, 0x16, 0x99, 0x50, 0xfe, 0x3a, 0x7d,
+          0x50, 0x17, 0x70, 0xaa, 0x1b, 0x4a, 0x5e, 0x51,
+          0x2a, 0xf2, 0x10, 0xc8, 0x27, 0x6f, 0x26, 0x5b,
+          0x9b, 0x9b, 0x1b, 0x6f, 0x23, 0x92, 0xbe, 0xdf,
+          0xc1, 0x10, 0xfd, 0x7d, 0xba, 0x65, 0x8c, 0x0e,
+          0x36, 0x2d, 0x81, 0x88, 0x68, 0x21, 0x3c, 0x96,
+          0x9e, 0x52, 0x28, 0xe9, 0xbc, 0xeb, 0xc4, 0xf2,
+          0x9b, 0x7b, 0xc0, 0x0f, 0xeb, 0x28, 0x61, 0x8e,
+          0x3b, 0x47, 0x89, 0x88, 0xa9, 0x9d, 0xe8, 0x77,
+          0xd1, 0x05, 0x31, 0x64, 0xca, 0xad, 0x0d, 0x58,
+          0xb3, 0xca, 0xa3, 0x3c, 0xcd, 0xe2, 0xda, 0x62,
+          0xb6, 0x95, 0x4f, 0xb2, 0x23, 0x9e, 0x98, 0x25,
+          0xf2, 0xb3, 0x73, 0x9a, 0x61, 0x86, 0x4a, 0x86,
+          0x58, 0xa4, 0x97, 0x12, 0xdb, 0x60, 0x32, 0x09,
+          0x69, 0x12, 0x48, 0xf4, 0x0d, 0x8d, 0x95, 0xc3,
+          0xa4, 0xac, 0x66, 0xa6, 0x6d, 0xe3, 0x85, 0xab,
+          0x72, 0xf7, 0x69, 0x59, 0xe8, 0x53, 0xe5, 0x89,
+          0xd2, 0x1c, 0x79, 0x73, 0x17, 0xec, 0x76, 0x6d,
+          0x9c, 0x0c, 0xc0, 0x06, 0xc6, 0x52, 0xa2, 0xd2,
+          0x47, 0x29, 0x1b, 0xd1, 0x22, 0xee, 0x93, 0x5c,
+          0x16, 0x5c, 0xf3, 0xda, 0x1d, 0x6e, 0x9d, 0x60,
+          0x5e, 0x04, 0x32, 0x9d, 0x9c, 0x9f, 0xa5, 0x04,
+          0xd5, 0x4e, 0x94, 0x87, 0x15, 0xfb, 0x82, 0x8d,
+          0x0f, 0x62, 0x9f, 0xa5, 0xfc, 0xed, 0x0e, 0xa0,
+          0x3f, 0xf9, 0x11, 0xe7, 0xed },
+    },
 };
 
 #define STORE64L(x, y)                                                  \
@@ -322,7 +413,11 @@ static void test_xts_aes_encrypt(const void *ctx,
 {
     const struct TestAES *aesctx = ctx;
 
-    AES_encrypt(src, dst, &aesctx->enc);
+    for (; length > 0; length -= AES_BLOCK_SIZE) {
+        AES_encrypt(src, dst, &aesctx->enc);
+        src += AES_BLOCK_SIZE;
+        dst += AES_BLOCK_SIZE;
+    }
 }
 
 
@@ -333,7 +428,11 @@ static void test_xts_aes_decrypt(const void *ctx,
 {
     const struct TestAES *aesctx = ctx;
 
-    AES_decrypt(src, dst, &aesctx->dec);
+    for (; length > 0; length -= AES_BLOCK_SIZE) {
+        AES_decrypt(src, dst, &aesctx->dec);
+        src += AES_BLOCK_SIZE;
+        dst += AES_BLOCK_SIZE;
+    }
 }
 
 
@@ -793,6 +793,46 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void test_hbitmap_meta(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *meta = hbitmap_alloc(L3, 12);
+    HBitmap *src = hbitmap_alloc(L3, 0);
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_set_meta(data->hb, meta);
+
+    /* Only actual changes are recorded, in chunks of 4096 bits */
+    hbitmap_set(data->hb, 5000, 10);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, 4096);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 8192, L3 - 8192), ==, -1);
+    hbitmap_reset_all(meta);
+    hbitmap_set(data->hb, 5000, 10);
+    g_assert_cmpint(hbitmap_count(meta), ==, 0);
+
+    hbitmap_reset(data->hb, 5000, 1);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, 4096);
+    hbitmap_reset_all(meta);
+
+    /* Merges only record the words that gained bits */
+    hbitmap_set(src, L2, 1);
+    hbitmap_set(src, 5001, 1);
+    hbitmap_merge(data->hb, src, data->hb);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, L2 & ~4095ULL);
+    g_assert_cmpint(hbitmap_next_dirty(meta, (L2 | 4095) + 1, L3), ==, -1);
+    hbitmap_reset_all(meta);
+
+    /* Deserialization and clearing are recorded as well */
+    hbitmap_deserialize_zeroes(data->hb, L2, L1, true);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, L2 & ~4095ULL);
+    hbitmap_reset_all(meta);
+    hbitmap_reset_all(data->hb);
+    g_assert_cmpint(hbitmap_count(meta), ==, L3);
+
+    hbitmap_set_meta(data->hb, NULL);
+    hbitmap_free(src);
+    hbitmap_free(meta);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -1094,6 +1134,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/serialize/zeroes",
                      test_hbitmap_serialize_zeroes);
 
+    hbitmap_test_add("/hbitmap/meta", test_hbitmap_meta);
+
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
 
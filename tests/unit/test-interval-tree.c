@@ -0,0 +1,227 @@
+/*
+ * Interval tree unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+#include "qemu/iova-tree.h"
+
+/* Random ranges of at most MAX_LEN addresses in [0, SPACE) */
+#define NR_NODES 2000
+#define SPACE 50000
+#define MAX_LEN 40
+#define ITERATIONS 50000
+
+typedef struct TestState {
+    IntervalTreeRoot root;
+    IntervalTreeNode nodes[NR_NODES];
+    bool inserted[NR_NODES];
+    /* Brute-force model of the tree */
+    bool used[SPACE];
+} TestState;
+
+/* Check the AVL property and ordering; returns the height of @node */
+static int check_subtree(IntervalTreeNode *node, IntervalTreeNode *parent)
+{
+    int hl, hr;
+
+    if (!node) {
+        return 0;
+    }
+    g_assert(node->parent == parent);
+    hl = check_subtree(node->left, node);
+    hr = check_subtree(node->right, node);
+    g_assert_cmpint(abs(hl - hr), <=, 1);
+    g_assert_cmpint(node->height, ==, MAX(hl, hr) + 1);
+    if (node->left) {
+        g_assert_cmpuint(node->left->subtree_last, <, node->start);
+    }
+    if (node->right) {
+        g_assert_cmpuint(node->right->subtree_first, >, node->last);
+    }
+    return node->height;
+}
+
+static void model_set(TestState *s, IntervalTreeNode *node, bool used)
+{
+    uint64_t addr;
+
+    for (addr = node->start; addr <= node->last; addr++) {
+        s->used[addr] = used;
+    }
+}
+
+static bool model_find_gap(TestState *s, uint64_t size, uint64_t lo,
+                           uint64_t hi, uint64_t *start)
+{
+    uint64_t addr, len = 0;
+
+    for (addr = lo; addr <= hi && addr < SPACE; addr++) {
+        len = s->used[addr] ? 0 : len + 1;
+        if (len == size) {
+            *start = addr - size + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_random_ops(TestState *s, int i)
+{
+    IntervalTreeNode *node = &s->nodes[i];
+    uint64_t addr, start, last, size, lo, hi, gap1, gap2;
+    bool free, found;
+
+    if (s->inserted[i]) {
+        interval_tree_remove(&s->root, node);
+        model_set(s, node, false);
+        s->inserted[i] = false;
+    } else {
+        node->start = g_test_rand_int_range(0, SPACE - MAX_LEN);
+        node->last = node->start + g_test_rand_int_range(0, MAX_LEN);
+        free = true;
+        for (addr = node->start; addr <= node->last; addr++) {
+            free = free && !s->used[addr];
+        }
+        g_assert(interval_tree_insert(&s->root, node) == free);
+        if (free) {
+            model_set(s, node, true);
+            s->inserted[i] = true;
+        }
+    }
+
+    /* interval_tree_find() returns the lowest overlapping range */
+    start = g_test_rand_int_range(0, SPACE);
+    last = MIN(start + g_test_rand_int_range(0, MAX_LEN), SPACE - 1);
+    node = interval_tree_find(&s->root, start, last);
+    for (addr = start; addr <= last && !s->used[addr]; addr++) {
+        /* nothing */
+    }
+    if (addr <= last) {
+        g_assert(node);
+        g_assert_cmpuint(node->start, <=, addr);
+        g_assert_cmpuint(node->last, >=, addr);
+    } else {
+        g_assert(!node);
+    }
+
+    node = interval_tree_find_rcu(&s->root, start, start);
+    g_assert(!!node == s->used[start]);
+
+    /* interval_tree_find_gap() returns the lowest free range */
+    size = g_test_rand_int_range(1, MAX_LEN);
+    lo = g_test_rand_int_range(0, SPACE);
+    hi = MIN(lo + g_test_rand_int_range(0, 3000), SPACE - 1);
+    found = interval_tree_find_gap(&s->root, size, lo, hi, &gap1);
+    g_assert(found == model_find_gap(s, size, lo, hi, &gap2));
+    if (found) {
+        g_assert_cmpuint(gap1, ==, gap2);
+    }
+}
+
+static void test_interval_tree_random(void)
+{
+    TestState *s = g_new0(TestState, 1);
+    IntervalTreeNode *node;
+    uint64_t prev = 0;
+    int i, count = 0, expected = 0;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        test_random_ops(s, g_test_rand_int_range(0, NR_NODES));
+        if (i % 100 == 0) {
+            check_subtree(s->root.root, NULL);
+        }
+    }
+
+    for (node = interval_tree_first(&s->root); node;
+         node = interval_tree_next(node)) {
+        if (count++) {
+            g_assert_cmpuint(node->start, >, prev);
+        }
+        prev = node->last;
+    }
+    for (i = 0; i < NR_NODES; i++) {
+        expected += s->inserted[i];
+    }
+    g_assert_cmpint(count, ==, expected);
+    g_assert(interval_tree_last(&s->root) == NULL ||
+             interval_tree_last(&s->root)->last == prev);
+    g_free(s);
+}
+
+static void test_interval_tree_gap_limits(void)
+{
+    IntervalTreeRoot root = { 0 };
+    IntervalTreeNode a = { .start = 0, .last = 0xfff };
+    IntervalTreeNode b = { .start = UINT64_MAX - 0xfff, .last = UINT64_MAX };
+    uint64_t start;
+
+    g_assert(interval_tree_find_gap(&root, 1, 0, UINT64_MAX, &start));
+    g_assert_cmpuint(start, ==, 0);
+
+    g_assert(interval_tree_insert(&root, &a));
+    g_assert(interval_tree_insert(&root, &b));
+    g_assert(!interval_tree_insert(&root, &a));
+
+    g_assert(interval_tree_find_gap(&root, 0x1000, 0, UINT64_MAX, &start));
+    g_assert_cmpuint(start, ==, 0x1000);
+    g_assert(!interval_tree_find_gap(&root, 0x1000, 0, 0x1fff - 1, &start));
+    g_assert(interval_tree_find_gap(&root, 0x1000, UINT64_MAX - 0x1fff,
+                                    UINT64_MAX, &start));
+    g_assert_cmpuint(start, ==, UINT64_MAX - 0x1fff);
+
+    interval_tree_remove(&root, &a);
+    g_assert(interval_tree_find_gap(&root, 0x2000, 0, UINT64_MAX, &start));
+    g_assert_cmpuint(start, ==, 0);
+}
+
+static void test_iova_tree_alloc(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap map = { .size = 0xfff, .perm = IOMMU_RW };
+    DMAMap *found;
+    int i;
+
+    /* Allocations are first-fit and freed ranges are reused */
+    for (i = 0; i < 4; i++) {
+        map.translated_addr = i * 0x10000;
+        g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0xffff),
+                        ==, IOVA_OK);
+        g_assert_cmpuint(map.iova, ==, 0x1000 + i * 0x1000);
+    }
+
+    map.iova = 0x2000;
+    iova_tree_remove(tree, &map);
+    g_assert(iova_tree_find(tree, &map) == NULL);
+
+    map.translated_addr = 0x100000;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0xffff),
+                    ==, IOVA_OK);
+    g_assert_cmpuint(map.iova, ==, 0x2000);
+
+    found = (DMAMap *)iova_tree_find_address(tree, 0x2800);
+    g_assert(found);
+    g_assert_cmpuint(found->translated_addr, ==, 0x100000);
+
+    map.size = 0xdfff;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0xffff),
+                    ==, IOVA_ERR_NOMEM);
+    map.size = 0xafff;
+    g_assert_cmpint(iova_tree_alloc_map(tree, &map, 0x1000, 0xffff),
+                    ==, IOVA_OK);
+    g_assert_cmpuint(map.iova, ==, 0x5000);
+
+    iova_tree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    g_test_add_func("/interval-tree/gap-limits", test_interval_tree_gap_limits);
+    g_test_add_func("/iova-tree/alloc", test_iova_tree_alloc);
+    return g_test_run();
+}
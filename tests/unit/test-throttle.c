@@ -143,6 +143,66 @@ static void test_compute_wait(void)
     }
 }
 
+static void test_headroom(void)
+{
+    double size, units;
+
+    throttle_config_init(&cfg);
+    bkt = cfg.buckets[THROTTLE_BPS_TOTAL];
+
+    /* no operation limit set */
+    bkt.avg = 0;
+    bkt.level = 1.5;
+    g_assert(double_cmp(throttle_headroom(&bkt), THROTTLE_VALUE_MAX));
+
+    /* without bursts the bucket holds bkt.avg / 10 */
+    bkt.avg = 150;
+    bkt.level = 9;
+    g_assert(double_cmp(throttle_headroom(&bkt), 6));
+    bkt.level = 15;
+    g_assert(double_cmp(throttle_headroom(&bkt), 0));
+    g_assert(!throttle_compute_wait(&bkt));
+    bkt.level = 15.5;
+    g_assert(double_cmp(throttle_headroom(&bkt), 0));
+    g_assert(throttle_compute_wait(&bkt));
+
+    /* with bursts, the burst bucket limits the headroom */
+    bkt.avg = 10;
+    bkt.max = 200;
+    bkt.burst_length = 2;
+    bkt.level = 100;
+    bkt.burst_level = 5;
+    g_assert(double_cmp(throttle_headroom(&bkt), 15));
+
+    /* a budget is accounted like I/O and can be given back */
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 100;
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    throttle_get_headroom(&ts, true, ts.previous_leak, &size, &units);
+    g_assert(double_cmp(size, 100));
+    g_assert(double_cmp(units, 10));
+    throttle_get_headroom(&ts, false, ts.previous_leak, &size, &units);
+    g_assert(double_cmp(size, 100));
+    g_assert(double_cmp(units, THROTTLE_VALUE_MAX));
+
+    throttle_account_budget(&ts, true, 60, 4);
+    throttle_get_headroom(&ts, true, ts.previous_leak, &size, &units);
+    g_assert(double_cmp(size, 40));
+    g_assert(double_cmp(units, 6));
+
+    throttle_account_budget(&ts, true, -100, -4);
+    throttle_get_headroom(&ts, true, ts.previous_leak, &size, &units);
+    g_assert(double_cmp(size, 100));
+    g_assert(double_cmp(units, 10));
+
+    g_assert(double_cmp(throttle_op_units(0, 4096), 1));
+    g_assert(double_cmp(throttle_op_units(8192, 4096), 1));
+    g_assert(double_cmp(throttle_op_units(1024, 4096), 4));
+}
+
 /* functions to test ThrottleState initialization/destroy methods */
 static void read_timer_cb(void *opaque)
 {
@@ -751,6 +811,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
     g_test_add_func("/throttle/compute_wait",       test_compute_wait);
+    g_test_add_func("/throttle/headroom",           test_headroom);
     g_test_add_func("/throttle/init",               test_init);
     g_test_add_func("/throttle/destroy",            test_destroy);
     g_test_add_func("/throttle/have_timer",         test_have_timer);
@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/cutils.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -217,6 +218,35 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
     return MAX(start, first_dirty_off);
 }
 
+/*
+ * Return the index of the first word in [@pos, @sz) of @words that is not
+ * all ones, or @sz if there is none.
+ */
+static size_t hb_find_not_full_word(const unsigned long *words,
+                                    size_t pos, size_t sz)
+{
+    /*
+     * Check groups of words at once.  The reduction has no branches, so it
+     * can be vectorized; only a mismatching group is looked at word by word.
+     */
+    while (pos + 8 <= sz) {
+        unsigned long and = words[pos] & words[pos + 1] &
+                            words[pos + 2] & words[pos + 3] &
+                            words[pos + 4] & words[pos + 5] &
+                            words[pos + 6] & words[pos + 7];
+        if (and != (unsigned long)-1) {
+            break;
+        }
+        pos += 8;
+    }
+
+    while (pos < sz && words[pos] == (unsigned long)-1) {
+        pos++;
+    }
+
+    return pos;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
@@ -245,10 +275,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_not_full_word(last_lev, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
@@ -375,9 +402,49 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+/*
+ * Count all set bits in the last level.  Unlike hb_count_between() this
+ * doesn't go through the upper levels, which is faster unless the bitmap is
+ * very sparse.
+ */
+static uint64_t hb_count_all(const HBitmap *hb)
+{
+    const unsigned long *words = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t n = hb->size >> BITS_PER_LEVEL;
+    unsigned tail = hb->size & (BITS_PER_LONG - 1);
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    uint64_t i;
+
+    /* Independent accumulators let the popcounts run in parallel */
+    for (i = 0; i + 4 <= n; i += 4) {
+        c0 += ctpopl(words[i]);
+        c1 += ctpopl(words[i + 1]);
+        c2 += ctpopl(words[i + 2]);
+        c3 += ctpopl(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        c0 += ctpopl(words[i]);
+    }
+    if (tail) {
+        /* Ignore bits beyond the end of the bitmap */
+        c0 += ctpopl(words[n] & ((1UL << tail) - 1));
+    }
+
+    return c0 + c1 + c2 + c3;
+}
+
+/* Mark [@start, @start + @count) as changed in the meta bitmap */
+static void hb_meta_set(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    if (hb->meta && start < hb->meta->orig_size) {
+        hbitmap_set(hb->meta, start, MIN(count, hb->meta->orig_size - start));
+    }
+}
+
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
+
 static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t last)
 {
     unsigned long mask;
@@ -561,6 +628,7 @@ void hbitmap_reset_all(HBitmap *hb)
 
     hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
     hb->count = 0;
+    hb_meta_set(hb, 0, hb->orig_size);
 }
 
 bool hbitmap_is_serializable(const HBitmap *hb)
@@ -649,6 +717,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     serialization_chunk(hb, start, count, &cur, &el_count);
     end = cur + el_count;
 
+#ifdef HOST_WORDS_BIGENDIAN
     while (cur != end) {
         unsigned long el =
             (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
@@ -657,6 +726,10 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
         buf += sizeof(el);
         cur++;
     }
+#else
+    /* The serialized format is the in-memory one on little endian hosts */
+    memcpy(buf, cur, (end - cur) * sizeof(unsigned long));
+#endif
 }
 
 void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
@@ -672,6 +745,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     serialization_chunk(hb, start, count, &cur, &el_count);
     end = cur + el_count;
 
+#ifdef HOST_WORDS_BIGENDIAN
     while (cur != end) {
         memcpy(cur, buf, sizeof(*cur));
 
@@ -684,6 +758,10 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
         buf += sizeof(unsigned long);
         cur++;
     }
+#else
+    memcpy(cur, buf, (end - cur) * sizeof(unsigned long));
+#endif
+    hb_meta_set(hb, start, count);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -701,6 +779,7 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
     serialization_chunk(hb, start, count, &first, &el_count);
 
     memset(first, 0, el_count * sizeof(unsigned long));
+    hb_meta_set(hb, start, count);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -718,6 +797,7 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
     serialization_chunk(hb, start, count, &first, &el_count);
 
     memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_meta_set(hb, start, count);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -725,7 +805,7 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
-    int64_t i, size, prev_size;
+    int64_t i, j, n, size, prev_size;
     int lev;
 
     /* restore levels starting from penultimate to zero level, assuming
@@ -734,18 +814,36 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
         prev_size = size;
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
-        for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
-                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
-                    1UL << (i & (BITS_PER_LONG - 1));
+        for (i = 0; i < size; i++) {
+            const unsigned long *lower =
+                bitmap->levels[lev + 1] + (i << BITS_PER_LEVEL);
+            unsigned long word = 0;
+
+            n = MIN(prev_size - (i << BITS_PER_LEVEL), BITS_PER_LONG);
+
+            /*
+             * Each word summarizes BITS_PER_LONG words of the lower level;
+             * buffer_is_zero() skips all-zero groups of sparse bitmaps
+             * quickly with the host's vector instructions.
+             */
+            if (n > 0 && !buffer_is_zero(lower, n * sizeof(unsigned long))) {
+                for (j = 0; j < n; j++) {
+                    word |= (unsigned long)(lower[j] != 0) << j;
+                }
             }
+            bitmap->levels[lev][i] = word;
         }
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_count_all(bitmap);
+}
+
+void hbitmap_set_meta(HBitmap *hb, HBitmap *meta)
+{
+    assert(!meta || !hb->meta);
+    hb->meta = meta;
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -864,6 +962,49 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/**
+ * hbitmap_dense_merge: performs dst = dst | src
+ * requires equal granularities.
+ * Only the words that are set in src are visited in the last level.
+ */
+static void hbitmap_dense_merge(HBitmap *dst, const HBitmap *src)
+{
+    unsigned long *last = dst->levels[HBITMAP_LEVELS - 1];
+    HBitmapIter hbi;
+    unsigned long cur;
+    size_t pos;
+    uint64_t j;
+    int i;
+
+    assert(dst->size == src->size);
+
+    if (!src->count) {
+        return;
+    }
+
+    hbitmap_iter_init(&hbi, src, 0);
+    while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+        if (cur & ~last[pos]) {
+            dst->count += ctpopl(cur & ~last[pos]);
+            hb_meta_set(dst, ((uint64_t)pos << BITS_PER_LEVEL) <<
+                        dst->granularity,
+                        (uint64_t)BITS_PER_LONG << dst->granularity);
+        }
+        last[pos] |= cur;
+    }
+
+    /*
+     * A word of the result is non-zero iff it is in either bitmap, so the
+     * upper levels are just merged as well.  They are BITS_PER_LONG times
+     * smaller than the last level.
+     */
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        for (j = 0; j < dst->sizes[i]; j++) {
+            dst->levels[i][j] |= src->levels[i][j];
+        }
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -875,7 +1016,6 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -905,19 +1045,25 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* The merge visits the set words of the source bitmap and the upper
+     * levels, so it is O(size / BITS_PER_LONG) plus the number of non-zero
+     * words, as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
-        }
+    if (result == b) {
+        hbitmap_dense_merge(result, a);
+        return true;
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    if (result != a) {
+        for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+            memcpy(result->levels[i], a->levels[i],
+                   a->sizes[i] * sizeof(unsigned long));
+        }
+        result->count = a->count;
+        hb_meta_set(result, 0, result->orig_size);
+    }
+    hbitmap_dense_merge(result, b);
 
     return true;
 }
@@ -0,0 +1,335 @@
+/*
+ * Interval tree of non-overlapping ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/interval-tree.h"
+
+/*
+ * An AVL tree is at most 1.44 * log2(n) high, so no lookup in a consistent
+ * tree takes more steps than this.  Lockless lookups give up after that
+ * many steps, which can only happen while racing with an update.
+ */
+#define INTERVAL_TREE_MAX_DEPTH 128
+
+static int node_height(IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+/* Recompute the height and the augmented data of @node from its children */
+static void node_update(IntervalTreeNode *node)
+{
+    IntervalTreeNode *left = node->left, *right = node->right;
+    uint64_t max_gap = 0;
+
+    node->height = MAX(node_height(left), node_height(right)) + 1;
+    node->subtree_first = left ? left->subtree_first : node->start;
+    node->subtree_last = right ? right->subtree_last : node->last;
+
+    if (left) {
+        max_gap = MAX(left->max_gap, node->start - left->subtree_last - 1);
+    }
+    if (right) {
+        max_gap = MAX(max_gap, right->max_gap);
+        max_gap = MAX(max_gap, right->subtree_first - node->last - 1);
+    }
+    node->max_gap = max_gap;
+}
+
+/*
+ * Child pointers are published with qatomic_rcu_set() for the benefit of
+ * interval_tree_find_rcu(); parent pointers are only used by updates.
+ */
+static void replace_child(IntervalTreeRoot *root, IntervalTreeNode *parent,
+                          IntervalTreeNode *old, IntervalTreeNode *new)
+{
+    if (!parent) {
+        qatomic_rcu_set(&root->root, new);
+    } else if (parent->left == old) {
+        qatomic_rcu_set(&parent->left, new);
+    } else {
+        qatomic_rcu_set(&parent->right, new);
+    }
+}
+
+/*
+ * The rotations unlink the moving edge before adding the new ones, so that
+ * concurrent lookups never see a cycle.
+ */
+static IntervalTreeNode *rotate_left(IntervalTreeRoot *root,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *right = node->right;
+
+    qatomic_rcu_set(&node->right, right->left);
+    if (right->left) {
+        right->left->parent = node;
+    }
+    right->parent = node->parent;
+    replace_child(root, node->parent, node, right);
+    qatomic_rcu_set(&right->left, node);
+    node->parent = right;
+
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeRoot *root,
+                                      IntervalTreeNode *node)
+{
+    IntervalTreeNode *left = node->left;
+
+    qatomic_rcu_set(&node->left, left->right);
+    if (left->right) {
+        left->right->parent = node;
+    }
+    left->parent = node->parent;
+    replace_child(root, node->parent, node, left);
+    qatomic_rcu_set(&left->right, node);
+    node->parent = left;
+
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+/*
+ * Restore the AVL property and the augmented data from @node up to the
+ * root.  The walk does not stop early because the augmented data of all
+ * ancestors may have changed.
+ */
+static void rebalance(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    while (node) {
+        int balance = node_height(node->left) - node_height(node->right);
+
+        if (balance > 1) {
+            if (node_height(node->left->left) <
+                node_height(node->left->right)) {
+                rotate_left(root, node->left);
+            }
+            node = rotate_right(root, node);
+        } else if (balance < -1) {
+            if (node_height(node->right->right) <
+                node_height(node->right->left)) {
+                rotate_right(root, node->right);
+            }
+            node = rotate_left(root, node);
+        } else {
+            node_update(node);
+        }
+        node = node->parent;
+    }
+}
+
+bool interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    IntervalTreeNode *parent = NULL;
+    IntervalTreeNode **link = &root->root;
+
+    assert(node->start <= node->last);
+
+    while (*link) {
+        parent = *link;
+        if (node->last < parent->start) {
+            link = &parent->left;
+        } else if (node->start > parent->last) {
+            link = &parent->right;
+        } else {
+            return false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node_update(node);
+    qatomic_rcu_set(link, node);
+
+    rebalance(root, parent);
+    return true;
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    IntervalTreeNode *parent, *child;
+
+    if (node->left && node->right) {
+        /* Put the successor of @node in its place */
+        IntervalTreeNode *succ = node->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        if (succ->parent != node) {
+            parent = succ->parent;
+            child = succ->right;
+            qatomic_rcu_set(&parent->left, child);
+            if (child) {
+                child->parent = parent;
+            }
+            qatomic_rcu_set(&succ->right, node->right);
+            node->right->parent = succ;
+        } else {
+            parent = succ;
+        }
+
+        qatomic_rcu_set(&succ->left, node->left);
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        replace_child(root, node->parent, node, succ);
+    } else {
+        parent = node->parent;
+        child = node->left ? node->left : node->right;
+        if (child) {
+            child->parent = parent;
+        }
+        replace_child(root, parent, node, child);
+    }
+
+    rebalance(root, parent);
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root, uint64_t start,
+                                     uint64_t last)
+{
+    IntervalTreeNode *node = root->root;
+    IntervalTreeNode *found = NULL;
+
+    while (node) {
+        if (node->last < start) {
+            node = node->right;
+        } else {
+            /* Lower ranges can only be on the left */
+            if (node->start <= last) {
+                found = node;
+            }
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+IntervalTreeNode *interval_tree_find_rcu(IntervalTreeRoot *root,
+                                         uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = qatomic_rcu_read(&root->root);
+    int depth;
+
+    for (depth = 0; node && depth < INTERVAL_TREE_MAX_DEPTH; depth++) {
+        if (node->last < start) {
+            node = qatomic_rcu_read(&node->right);
+        } else if (node->start > last) {
+            node = qatomic_rcu_read(&node->left);
+        } else {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+IntervalTreeNode *interval_tree_first(IntervalTreeRoot *root)
+{
+    IntervalTreeNode *node = root->root;
+
+    while (node && node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+IntervalTreeNode *interval_tree_last(IntervalTreeRoot *root)
+{
+    IntervalTreeNode *node = root->root;
+
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
+IntervalTreeNode *interval_tree_next(IntervalTreeNode *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/* Try to fit @size addresses in the part of [gap_start, gap_last] in [lo, hi] */
+static bool try_gap(uint64_t gap_start, uint64_t gap_last, uint64_t size,
+                    uint64_t lo, uint64_t hi, uint64_t *start)
+{
+    uint64_t s = MAX(gap_start, lo);
+    uint64_t e = MIN(gap_last, hi);
+
+    if (gap_start > gap_last || s > e || e - s < size - 1) {
+        return false;
+    }
+    *start = s;
+    return true;
+}
+
+/* Look for a free range between the ranges of the subtree of @node */
+static bool find_gap_in(IntervalTreeNode *node, uint64_t size,
+                        uint64_t lo, uint64_t hi, uint64_t *start)
+{
+    if (!node || node->max_gap < size ||
+        node->subtree_last < lo || node->subtree_first > hi) {
+        return false;
+    }
+
+    if (find_gap_in(node->left, size, lo, hi, start)) {
+        return true;
+    }
+    if (node->left &&
+        try_gap(node->left->subtree_last + 1, node->start - 1,
+                size, lo, hi, start)) {
+        return true;
+    }
+    if (node->right &&
+        try_gap(node->last + 1, node->right->subtree_first - 1,
+                size, lo, hi, start)) {
+        return true;
+    }
+    return find_gap_in(node->right, size, lo, hi, start);
+}
+
+bool interval_tree_find_gap(IntervalTreeRoot *root, uint64_t size,
+                            uint64_t lo, uint64_t hi, uint64_t *start)
+{
+    IntervalTreeNode *node = root->root;
+
+    assert(size > 0);
+    if (lo > hi) {
+        return false;
+    }
+    if (!node) {
+        return try_gap(lo, hi, size, lo, hi, start);
+    }
+
+    if (node->subtree_first > 0 &&
+        try_gap(0, node->subtree_first - 1, size, lo, hi, start)) {
+        return true;
+    }
+    if (find_gap_in(node, size, lo, hi, start)) {
+        return true;
+    }
+    return node->subtree_last < UINT64_MAX &&
+           try_gap(node->subtree_last + 1, UINT64_MAX, size, lo, hi, start);
+}
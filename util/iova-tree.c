@@ -1,5 +1,5 @@
 /*
- * IOVA tree implementation based on GTree.
+ * IOVA tree implementation based on an interval tree.
  *
  * Copyright 2018 Red Hat, Inc.
  *
@@ -10,41 +10,30 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
 #include "qemu/iova-tree.h"
 
+typedef struct IOVATreeNode {
+    IntervalTreeNode node;
+    DMAMap map;
+} IOVATreeNode;
+
 struct IOVATree {
-    GTree *tree;
+    IntervalTreeRoot root;
 };
 
-static int iova_tree_compare(gconstpointer a, gconstpointer b, gpointer data)
-{
-    const DMAMap *m1 = a, *m2 = b;
-
-    if (m1->iova > m2->iova + m2->size) {
-        return 1;
-    }
-
-    if (m1->iova + m1->size < m2->iova) {
-        return -1;
-    }
-
-    /* Overlapped */
-    return 0;
-}
-
 IOVATree *iova_tree_new(void)
 {
-    IOVATree *iova_tree = g_new0(IOVATree, 1);
-
-    /* We don't have values actually, no need to free */
-    iova_tree->tree = g_tree_new_full(iova_tree_compare, NULL, g_free, NULL);
-
-    return iova_tree;
+    return g_new0(IOVATree, 1);
 }
 
 const DMAMap *iova_tree_find(const IOVATree *tree, const DMAMap *map)
 {
-    return g_tree_lookup(tree->tree, map);
+    IntervalTreeNode *node;
+
+    node = interval_tree_find((IntervalTreeRoot *)&tree->root, map->iova,
+                              map->iova + map->size);
+    return node ? &container_of(node, IOVATreeNode, node)->map : NULL;
 }
 
 const DMAMap *iova_tree_find_address(const IOVATree *tree, hwaddr iova)
@@ -54,54 +43,67 @@ const DMAMap *iova_tree_find_address(const IOVATree *tree, hwaddr iova)
     return iova_tree_find(tree, &map);
 }
 
-static inline void iova_tree_insert_internal(GTree *gtree, DMAMap *range)
-{
-    /* Key and value are sharing the same range data */
-    g_tree_insert(gtree, range, range);
-}
-
 int iova_tree_insert(IOVATree *tree, const DMAMap *map)
 {
-    DMAMap *new;
+    IOVATreeNode *new;
 
     if (map->iova + map->size < map->iova || map->perm == IOMMU_NONE) {
         return IOVA_ERR_INVALID;
     }
 
+    new = g_new0(IOVATreeNode, 1);
+    new->node.start = map->iova;
+    new->node.last = map->iova + map->size;
+    memcpy(&new->map, map, sizeof(new->map));
+
     /* We don't allow to insert range that overlaps with existings */
-    if (iova_tree_find(tree, map)) {
+    if (!interval_tree_insert(&tree->root, &new->node)) {
+        g_free(new);
         return IOVA_ERR_OVERLAP;
     }
 
-    new = g_new0(DMAMap, 1);
-    memcpy(new, map, sizeof(*new));
-    iova_tree_insert_internal(tree->tree, new);
-
     return IOVA_OK;
 }
 
-static gboolean iova_tree_traverse(gpointer key, gpointer value,
-                                gpointer data)
+int iova_tree_alloc_map(IOVATree *tree, DMAMap *map, hwaddr iova_begin,
+                        hwaddr iova_last)
 {
-    iova_tree_iterator iterator = data;
-    DMAMap *map = key;
+    uint64_t iova;
+
+    if (iova_begin > iova_last || map->size > iova_last - iova_begin ||
+        map->size == HWADDR_MAX || map->perm == IOMMU_NONE) {
+        return IOVA_ERR_INVALID;
+    }
 
-    g_assert(key == value);
+    if (!interval_tree_find_gap(&tree->root, map->size + 1, iova_begin,
+                                iova_last, &iova)) {
+        return IOVA_ERR_NOMEM;
+    }
 
-    return iterator(map);
+    map->iova = iova;
+    return iova_tree_insert(tree, map);
 }
 
 void iova_tree_foreach(IOVATree *tree, iova_tree_iterator iterator)
 {
-    g_tree_foreach(tree->tree, iova_tree_traverse, iterator);
+    IntervalTreeNode *node;
+
+    for (node = interval_tree_first(&tree->root); node;
+         node = interval_tree_next(node)) {
+        if (iterator(&container_of(node, IOVATreeNode, node)->map)) {
+            break;
+        }
+    }
 }
 
 int iova_tree_remove(IOVATree *tree, const DMAMap *map)
 {
-    const DMAMap *overlap;
+    IntervalTreeNode *node;
 
-    while ((overlap = iova_tree_find(tree, map))) {
-        g_tree_remove(tree->tree, overlap);
+    while ((node = interval_tree_find(&tree->root, map->iova,
+                                      map->iova + map->size))) {
+        interval_tree_remove(&tree->root, node);
+        g_free(container_of(node, IOVATreeNode, node));
     }
 
     return IOVA_OK;
@@ -109,6 +111,11 @@ int iova_tree_remove(IOVATree *tree, const DMAMap *map)
 
 void iova_tree_destroy(IOVATree *tree)
 {
-    g_tree_destroy(tree->tree);
+    IntervalTreeNode *node;
+
+    while ((node = tree->root.root)) {
+        interval_tree_remove(&tree->root, node);
+        g_free(container_of(node, IOVATreeNode, node));
+    }
     g_free(tree);
 }
@@ -87,6 +87,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute the sizes of the main and burst buckets
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +125,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -134,6 +146,29 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
     return 0;
 }
 
+/* This function computes how many units can be accounted to a leaky bucket
+ * before throttle_compute_wait() starts to return a non-zero wait
+ *
+ * @bkt: the leaky bucket we operate on
+ * @ret: the number of units, or THROTTLE_VALUE_MAX if @bkt has no limit
+ */
+double throttle_headroom(LeakyBucket *bkt)
+{
+    double bucket_size, burst_bucket_size, headroom;
+
+    if (!bkt->avg) {
+        return THROTTLE_VALUE_MAX;
+    }
+
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+    headroom = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        headroom = MIN(headroom, burst_bucket_size - bkt->burst_level);
+    }
+
+    return MAX(headroom, 0);
+}
+
 /* This function compute the time that must be waited while this IO
  *
  * @is_write:   true if the current IO is a write, false if it's a read
@@ -444,6 +479,39 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+/* compute the number of operations that an I/O request counts as
+ *
+ * @op_size: the size of an operation in bytes, or 0
+ * @size:    the size of the I/O request
+ * @ret:     the number of operations
+ */
+double throttle_op_units(uint64_t op_size, uint64_t size)
+{
+    /* if op_size is defined and smaller than size we compute unit count */
+    if (op_size && size > op_size) {
+        return (double) size / op_size;
+    }
+    return 1.0;
+}
+
+static void throttle_bucket_add(LeakyBucket *bkt, double units)
+{
+    bkt->level = MAX(bkt->level + units, 0);
+    if (bkt->burst_length > 1) {
+        bkt->burst_level = MAX(bkt->burst_level + units, 0);
+    }
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -451,36 +519,54 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
-    double units = 1.0;
+    throttle_account_budget(ts, is_write, size,
+                            throttle_op_units(ts->cfg.op_size, size));
+}
+
+/* account an amount of I/O that is not (yet) tied to a request, such as
+ * a budget that is handed out in advance.  Negative values give back
+ * I/O that was accounted but not used.
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the number of bytes
+ * @units:    the number of operations
+ */
+void throttle_account_budget(ThrottleState *ts, bool is_write,
+                             double size, double units)
+{
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
+    for (i = 0; i < 2; i++) {
+        throttle_bucket_add(&ts->cfg.buckets[bucket_types_size[is_write][i]],
+                            size);
+        throttle_bucket_add(&ts->cfg.buckets[bucket_types_units[is_write][i]],
+                            units);
     }
+}
+
+/* compute how much I/O can be done right now without being throttled
+ *
+ * @is_write: the type of operation (read/write)
+ * @now:      the current clock timestamp
+ * @size:     the number of bytes, or THROTTLE_VALUE_MAX if unlimited
+ * @units:    the number of operations, or THROTTLE_VALUE_MAX if unlimited
+ */
+void throttle_get_headroom(ThrottleState *ts, bool is_write, int64_t now,
+                           double *size, double *units)
+{
+    unsigned i;
+
+    /* leak proportionally to the time elapsed */
+    throttle_do_leak(ts, now);
 
+    *size = *units = THROTTLE_VALUE_MAX;
     for (i = 0; i < 2; i++) {
         LeakyBucket *bkt;
 
         bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
-        bkt->level += size;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
-        }
-
+        *size = MIN(*size, throttle_headroom(bkt));
         bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
-        bkt->level += units;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
-        }
+        *units = MIN(*units, throttle_headroom(bkt));
     }
 }
 
@@ -22,11 +22,12 @@
 #include "standard-headers/linux/pci_regs.h"
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
+#include "qemu/interval-tree.h"
 #include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "qemu/seqlock.h"
 #include "trace.h"
 
-#define QEMU_VFIO_DEBUG 0
-
 #define QEMU_VFIO_IOVA_MIN 0x10000ULL
 /* XXX: Once VFIO exposes the iova bit width in the IOMMU capability interface,
  * we can use a runtime limit; alternatively it's also possible to do platform
@@ -39,6 +40,10 @@ typedef struct {
     void *host;
     size_t size;
     uint64_t iova;
+
+    IntervalTreeNode host_node;     /* in QEMUVFIOState.mappings */
+    IntervalTreeNode iova_node;     /* in QEMUVFIOState.fixed_iovas */
+    struct rcu_head rcu;
 } IOVAMapping;
 
 struct IOVARange {
@@ -84,8 +89,9 @@ struct QEMUVFIOState {
      * - Addresses lower than QEMU_VFIO_IOVA_MIN are reserved as invalid;
      *
      * - Fixed mappings of HVAs are assigned "low" IOVAs in the range of
-     *   [QEMU_VFIO_IOVA_MIN, low_water_mark).  Once allocated they will not be
-     *   reclaimed - low_water_mark never shrinks;
+     *   [QEMU_VFIO_IOVA_MIN, low_water_mark).  The lowest free IOVA range
+     *   is used, so the IOVAs of unmapped fixed mappings are reused;
+     *   low_water_mark is the end of the highest fixed mapping;
      *
      * - IOVAs in range [low_water_mark, high_water_mark) are free;
      *
@@ -96,8 +102,15 @@ struct QEMUVFIOState {
      **/
     uint64_t low_water_mark;
     uint64_t high_water_mark;
-    IOVAMapping *mappings;
-    int nr_mappings;
+    IntervalTreeRoot fixed_iovas;
+
+    /*
+     * Host address ranges of the fixed mappings.  Updated with @lock and
+     * @seqlock held, so that lookups of existing mappings need no lock.
+     * Mappings are freed with RCU.
+     */
+    QemuSeqLock seqlock;
+    IntervalTreeRoot mappings;
 };
 
 /**
@@ -488,6 +501,7 @@ static void qemu_vfio_ram_block_removed(RAMBlockNotifier *n, void *host,
 static void qemu_vfio_open_common(QEMUVFIOState *s)
 {
     qemu_mutex_init(&s->lock);
+    seqlock_init(&s->seqlock);
     s->ram_notifier.ram_block_added = qemu_vfio_ram_block_added;
     s->ram_notifier.ram_block_removed = qemu_vfio_ram_block_removed;
     s->low_water_mark = QEMU_VFIO_IOVA_MIN;
@@ -526,86 +540,92 @@ QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
 
 static void qemu_vfio_dump_mappings(QEMUVFIOState *s)
 {
-    for (int i = 0; i < s->nr_mappings; ++i) {
-        trace_qemu_vfio_dump_mapping(s->mappings[i].host,
-                                     s->mappings[i].iova,
-                                     s->mappings[i].size);
+    IntervalTreeNode *node;
+
+    for (node = interval_tree_first(&s->mappings); node;
+         node = interval_tree_next(node)) {
+        IOVAMapping *m = container_of(node, IOVAMapping, host_node);
+
+        trace_qemu_vfio_dump_mapping(m->host, m->iova, m->size);
     }
 }
 
 /**
- * Find the mapping entry that contains [host, host + size) and set @index to
- * the position. If no entry contains it, @index is the position _after_ which
- * to insert the new mapping. IOW, it is the index of the largest element that
- * is smaller than @host, or -1 if no entry is.
+ * Find the fixed mapping that contains @host.  Called with @lock held.
  */
-static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
-                                           int *index)
+static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host)
 {
-    IOVAMapping *p = s->mappings;
-    IOVAMapping *q = p ? p + s->nr_mappings - 1 : NULL;
-    IOVAMapping *mid;
+    IntervalTreeNode *node;
+
     trace_qemu_vfio_find_mapping(s, host);
-    if (!p) {
-        *index = -1;
-        return NULL;
-    }
-    while (true) {
-        mid = p + (q - p) / 2;
-        if (mid == p) {
-            break;
-        }
-        if (mid->host > host) {
-            q = mid;
-        } else if (mid->host < host) {
-            p = mid;
-        } else {
-            break;
+    node = interval_tree_find(&s->mappings, (uintptr_t)host, (uintptr_t)host);
+    return node ? container_of(node, IOVAMapping, host_node) : NULL;
+}
+
+static bool qemu_vfio_mapping_covers(IOVAMapping *m, void *host, size_t size)
+{
+    return (uint8_t *)host + size <= (uint8_t *)m->host + m->size;
+}
+
+/**
+ * Look up the IOVA of [host, host + size) in the fixed mappings without
+ * taking @lock.
+ */
+static bool qemu_vfio_find_iova_lockless(QEMUVFIOState *s, void *host,
+                                         size_t size, uint64_t *iova)
+{
+    IntervalTreeNode *node;
+    bool found;
+    unsigned seq;
+
+    RCU_READ_LOCK_GUARD();
+    do {
+        seq = seqlock_read_begin(&s->seqlock);
+        node = interval_tree_find_rcu(&s->mappings, (uintptr_t)host,
+                                      (uintptr_t)host);
+        found = false;
+        if (node) {
+            IOVAMapping *m = container_of(node, IOVAMapping, host_node);
+
+            found = qemu_vfio_mapping_covers(m, host, size);
+            *iova = m->iova + ((uint8_t *)host - (uint8_t *)m->host);
         }
-    }
-    if (mid->host > host) {
-        mid--;
-    } else if (mid < &s->mappings[s->nr_mappings - 1]
-               && (mid + 1)->host <= host) {
-        mid++;
-    }
-    *index = mid - &s->mappings[0];
-    if (mid >= &s->mappings[0] &&
-        mid->host <= host && mid->host + mid->size > host) {
-        assert(mid < &s->mappings[s->nr_mappings]);
-        return mid;
-    }
-    /* At this point *index + 1 is the right position to insert the new
-     * mapping.*/
-    return NULL;
+    } while (seqlock_read_retry(&s->seqlock, seq));
+
+    return found;
 }
 
 /**
- * Allocate IOVA and create a new mapping record and insert it in @s.
+ * Create a new mapping record and insert it in @s.
  */
-static IOVAMapping *qemu_vfio_add_mapping(QEMUVFIOState *s,
-                                          void *host, size_t size,
-                                          int index, uint64_t iova)
+static void qemu_vfio_add_mapping(QEMUVFIOState *s, void *host, size_t size,
+                                  uint64_t iova)
 {
-    int shift;
-    IOVAMapping m = {.host = host, .size = size, .iova = iova};
-    IOVAMapping *insert;
+    IOVAMapping *m = g_new0(IOVAMapping, 1);
 
     assert(QEMU_IS_ALIGNED(size, qemu_real_host_page_size));
-    assert(QEMU_IS_ALIGNED(s->low_water_mark, qemu_real_host_page_size));
+    assert(QEMU_IS_ALIGNED(iova, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(s->high_water_mark, qemu_real_host_page_size));
-    trace_qemu_vfio_new_mapping(s, host, size, index, iova);
-
-    assert(index >= 0);
-    s->nr_mappings++;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-    insert = &s->mappings[index];
-    shift = s->nr_mappings - index - 1;
-    if (shift) {
-        memmove(insert + 1, insert, shift * sizeof(s->mappings[0]));
-    }
-    *insert = m;
-    return insert;
+    trace_qemu_vfio_new_mapping(s, host, size, iova);
+
+    m->host = host;
+    m->size = size;
+    m->iova = iova;
+    m->host_node.start = (uintptr_t)host;
+    m->host_node.last = (uintptr_t)host + size - 1;
+    m->iova_node.start = iova;
+    m->iova_node.last = iova + size - 1;
+
+    /* The caller checked that neither range is in use */
+    seqlock_write_begin(&s->seqlock);
+    if (!interval_tree_insert(&s->mappings, &m->host_node)) {
+        abort();
+    }
+    seqlock_write_end(&s->seqlock);
+    if (!interval_tree_insert(&s->fixed_iovas, &m->iova_node)) {
+        abort();
+    }
+    s->low_water_mark = MAX(s->low_water_mark, iova + size);
 }
 
 /* Do the DMA mapping with VFIO. */
@@ -634,7 +654,7 @@ static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
 static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
                                    Error **errp)
 {
-    int index;
+    IntervalTreeNode *last;
     struct vfio_iommu_type1_dma_unmap unmap = {
         .argsz = sizeof(unmap),
         .flags = 0,
@@ -642,39 +662,21 @@ static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
         .size = mapping->size,
     };
 
-    index = mapping - s->mappings;
     assert(mapping->size > 0);
     assert(QEMU_IS_ALIGNED(mapping->size, qemu_real_host_page_size));
-    assert(index >= 0 && index < s->nr_mappings);
     if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
         error_setg_errno(errp, errno, "VFIO_UNMAP_DMA failed");
     }
-    memmove(mapping, &s->mappings[index + 1],
-            sizeof(s->mappings[0]) * (s->nr_mappings - index - 1));
-    s->nr_mappings--;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-}
 
-/* Check if the mapping list is (ascending) ordered. */
-static bool qemu_vfio_verify_mappings(QEMUVFIOState *s)
-{
-    int i;
-    if (QEMU_VFIO_DEBUG) {
-        for (i = 0; i < s->nr_mappings - 1; ++i) {
-            if (!(s->mappings[i].host < s->mappings[i + 1].host)) {
-                error_report("item %d not sorted!", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-            if (!(s->mappings[i].host + s->mappings[i].size <=
-                  s->mappings[i + 1].host)) {
-                error_report("item %d overlap with next!", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-        }
-    }
-    return true;
+    seqlock_write_begin(&s->seqlock);
+    interval_tree_remove(&s->mappings, &mapping->host_node);
+    seqlock_write_end(&s->seqlock);
+
+    interval_tree_remove(&s->fixed_iovas, &mapping->iova_node);
+    last = interval_tree_last(&s->fixed_iovas);
+    s->low_water_mark = last ? last->last + 1 : QEMU_VFIO_IOVA_MIN;
+
+    g_free_rcu(mapping, rcu);
 }
 
 static bool qemu_vfio_find_fixed_iova(QEMUVFIOState *s, size_t size,
@@ -683,16 +685,12 @@ static bool qemu_vfio_find_fixed_iova(QEMUVFIOState *s, size_t size,
     int i;
 
     for (i = 0; i < s->nb_iova_ranges; i++) {
-        if (s->usable_iova_ranges[i].end < s->low_water_mark) {
-            continue;
-        }
-        s->low_water_mark =
-            MAX(s->low_water_mark, s->usable_iova_ranges[i].start);
+        uint64_t start = MAX(s->usable_iova_ranges[i].start,
+                             QEMU_VFIO_IOVA_MIN);
+        uint64_t last = MIN(s->usable_iova_ranges[i].end,
+                            s->high_water_mark - 1);
 
-        if (s->usable_iova_ranges[i].end - s->low_water_mark + 1 >= size ||
-            s->usable_iova_ranges[i].end - s->low_water_mark + 1 == 0) {
-            *iova = s->low_water_mark;
-            s->low_water_mark += size;
+        if (interval_tree_find_gap(&s->fixed_iovas, size, start, last, iova)) {
             return true;
         }
     }
@@ -740,54 +738,77 @@ static bool qemu_vfio_water_mark_reached(QEMUVFIOState *s, size_t size,
     return false;
 }
 
+static int qemu_vfio_dma_map_locked(QEMUVFIOState *s, void *host,
+                                    size_t size, bool temporary,
+                                    uint64_t *iova, Error **errp)
+{
+    IOVAMapping *mapping;
+    int ret;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    mapping = qemu_vfio_find_mapping(s, host);
+    if (mapping && qemu_vfio_mapping_covers(mapping, host, size)) {
+        *iova = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
+        return 0;
+    }
+
+    if (!temporary) {
+        if (interval_tree_find(&s->mappings, (uintptr_t)host,
+                               (uintptr_t)host + size - 1)) {
+            error_setg(errp, "%p-%p overlaps with an existing mapping",
+                       host, (uint8_t *)host + size);
+            return -EINVAL;
+        }
+        if (!qemu_vfio_find_fixed_iova(s, size, iova, errp)) {
+            return -ENOMEM;
+        }
+        ret = qemu_vfio_do_mapping(s, host, size, *iova, errp);
+        if (ret < 0) {
+            return ret;
+        }
+        qemu_vfio_add_mapping(s, host, size, *iova);
+        qemu_vfio_dump_mappings(s);
+    } else {
+        if (qemu_vfio_water_mark_reached(s, size, errp)) {
+            return -ENOMEM;
+        }
+        if (!qemu_vfio_find_temp_iova(s, size, iova, errp)) {
+            return -ENOMEM;
+        }
+        ret = qemu_vfio_do_mapping(s, host, size, *iova, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 /* Map [host, host + size) area into a contiguous IOVA address space, and store
  * the result in @iova if not NULL. The caller need to make sure the area is
  * aligned to page size, and mustn't overlap with existing mapping areas (split
  * mapping status within this area is not allowed).
+ *
+ * Areas that are mapped already are looked up without taking a lock.  An
+ * area that is only partly covered by a fixed mapping can still be mapped
+ * temporarily.
  */
 int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
                       bool temporary, uint64_t *iova, Error **errp)
 {
-    int index;
-    IOVAMapping *mapping;
     uint64_t iova0;
+    int ret;
 
     assert(QEMU_PTR_IS_ALIGNED(host, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(size, qemu_real_host_page_size));
     trace_qemu_vfio_dma_map(s, host, size, temporary, iova);
-    QEMU_LOCK_GUARD(&s->lock);
-    mapping = qemu_vfio_find_mapping(s, host, &index);
-    if (mapping) {
-        iova0 = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
-    } else {
-        int ret;
 
-        if (qemu_vfio_water_mark_reached(s, size, errp)) {
-            return -ENOMEM;
-        }
-        if (!temporary) {
-            if (!qemu_vfio_find_fixed_iova(s, size, &iova0, errp)) {
-                return -ENOMEM;
-            }
-
-            mapping = qemu_vfio_add_mapping(s, host, size, index + 1, iova0);
-            assert(qemu_vfio_verify_mappings(s));
-            ret = qemu_vfio_do_mapping(s, host, size, iova0, errp);
-            if (ret < 0) {
-                qemu_vfio_undo_mapping(s, mapping, NULL);
-                return ret;
-            }
-            qemu_vfio_dump_mappings(s);
-        } else {
-            if (!qemu_vfio_find_temp_iova(s, size, &iova0, errp)) {
-                return -ENOMEM;
-            }
-            ret = qemu_vfio_do_mapping(s, host, size, iova0, errp);
-            if (ret < 0) {
-                return ret;
-            }
+    if (!qemu_vfio_find_iova_lockless(s, host, size, &iova0)) {
+        ret = qemu_vfio_dma_map_locked(s, host, size, temporary, &iova0, errp);
+        if (ret < 0) {
+            return ret;
         }
     }
+
     trace_qemu_vfio_dma_mapped(s, host, iova0, size);
     if (iova) {
         *iova = iova0;
@@ -818,7 +839,6 @@ int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
  * qemu_vfio_dma_map(). */
 void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 {
-    int index = 0;
     IOVAMapping *m;
 
     if (!host) {
@@ -827,7 +847,7 @@ void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 
     trace_qemu_vfio_dma_unmap(s, host);
     QEMU_LOCK_GUARD(&s->lock);
-    m = qemu_vfio_find_mapping(s, host, &index);
+    m = qemu_vfio_find_mapping(s, host);
     if (!m) {
         return;
     }
@@ -842,13 +862,14 @@ static void qemu_vfio_reset(QEMUVFIOState *s)
 /* Close and free the VFIO resources. */
 void qemu_vfio_close(QEMUVFIOState *s)
 {
-    int i;
+    IntervalTreeNode *node;
 
     if (!s) {
         return;
     }
-    for (i = 0; i < s->nr_mappings; ++i) {
-        qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
+    while ((node = interval_tree_first(&s->mappings))) {
+        qemu_vfio_undo_mapping(s, container_of(node, IOVAMapping, host_node),
+                               NULL);
     }
     ram_block_notifier_remove(&s->ram_notifier);
     g_free(s->usable_iova_ranges);